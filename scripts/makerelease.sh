@@ -1,6 +1,6 @@
 #!/bin/bash
 
-VERSION=1.3.2
+VERSION=1.4.0
 
 if [ ! -f technical.txt ]
 then
@@ -247,6 +247,7 @@ IW_IMPL(struct iw_context*) iw_create_context(struct iw_init_params *params)
 
 	ctx->max_malloc = IW_DEFAULT_MAX_MALLOC;
 	ctx->max_width = ctx->max_height = IW_DEFAULT_MAX_DIMENSION;
+	ctx->max_threads = 1;
 	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_H]);
 	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_V]);
 	ctx->input_w = -1;
@@ -277,6 +278,7 @@ IW_IMPL(void) iw_destroy_context(struct iw_context *ctx)
 		iw_free(ctx, ctx->req.options);
 	}
 	if(ctx->img1.pixels) iw_free(ctx,ctx->img1.pixels);
+	if(ctx->img1_palette) iw_free(ctx,ctx->img1_palette);
 	if(ctx->img2.pixels) iw_free(ctx,ctx->img2.pixels);
 	if(ctx->error_msg) iw_free(ctx,ctx->error_msg);
 	if(ctx->optctx.tmp_pixels) iw_free(ctx,ctx->optctx.tmp_pixels);
@@ -284,10 +286,89 @@ IW_IMPL(void) iw_destroy_context(struct iw_context *ctx)
 	if(ctx->input_color_corr_table) iw_free(ctx,ctx->input_color_corr_table);
 	if(ctx->output_rev_color_corr_table) iw_free(ctx,ctx->output_rev_color_corr_table);
 	if(ctx->nearest_color_table) iw_free(ctx,ctx->nearest_color_table);
+	if(ctx->output_rev_index) iw_free(ctx,ctx->output_rev_index);
+	if(ctx->nearest_color_index) iw_free(ctx,ctx->nearest_color_index);
 	if(ctx->prng) iwpvt_prng_destroy(ctx,ctx->prng);
+	for(i=0; i<IW_RRCTX_CACHE_SIZE; i++) {
+		if(ctx->rrctx_cache[i]) iwpvt_resize_rows_done(ctx->rrctx_cache[i]);
+	}
 	iw_free(ctx,ctx);
 }
 
+IW_IMPL(void) iw_reset_context(struct iw_context *ctx)
+{
+	int i;
+	iw_byte *img2_pixels;
+	struct iw_resize_settings *rs;
+
+	if(!ctx) return;
+
+	// Free the things that belong to the previous image.
+	if(ctx->img1.pixels) iw_free(ctx,ctx->img1.pixels);
+	if(ctx->img1_palette) iw_free(ctx,ctx->img1_palette);
+	ctx->img1_palette = NULL;
+	if(ctx->error_msg) iw_free(ctx,ctx->error_msg);
+	if(ctx->optctx.tmp_pixels) iw_free(ctx,ctx->optctx.tmp_pixels);
+	if(ctx->optctx.palette) iw_free(ctx,ctx->optctx.palette);
+	// The indexes are cheap to make, and depend on more than just the tables.
+	if(ctx->output_rev_index) iw_free(ctx,ctx->output_rev_index);
+	if(ctx->nearest_color_index) iw_free(ctx,ctx->nearest_color_index);
+	ctx->output_rev_index = NULL;
+	ctx->nearest_color_index = NULL;
+	ctx->error_msg = NULL;
+	ctx->error_flag = 0;
+	ctx->use_count = 0;
+
+	iw_zeromem(&ctx->img1,sizeof(struct iw_image));
+	ctx->img1_true_valid = 0;
+	iw_zeromem(&ctx->optctx,sizeof(struct iw_opt_ctx));
+	iw_zeromem(ctx->img1_ci,sizeof(ctx->img1_ci));
+	iw_zeromem(ctx->intermed_ci,sizeof(ctx->intermed_ci));
+	iw_zeromem(ctx->img2_ci,sizeof(ctx->img2_ci));
+
+	// Keep the output pixel buffer, to reuse if it's big enough.
+	img2_pixels = ctx->img2.pixels;
+	iw_zeromem(&ctx->img2,sizeof(struct iw_image));
+	ctx->img2.pixels = img2_pixels;
+
+	iw_make_srgb_csdescr_2(&ctx->img1cs);
+	ctx->img1_bkgd_label_set = 0;
+	ctx->input_maxcolorcode_int = 0;
+	ctx->input_maxcolorcode = 0.0;
+	ctx->support_reduced_input_bitdepths = 0;
+	ctx->get_raw_samples_fn = NULL;
+	ctx->disable_output_lookup_tables = 0;
+	ctx->reduced_output_maxcolor_flag = 0;
+	ctx->uses_errdiffdither = 0;
+
+	ctx->apply_bkgd = 0;
+	ctx->apply_bkgd_strategy = 0;
+	ctx->bkgd_checkerboard = 0;
+	ctx->bkgd_color_source = IW_BKGD_COLOR_SOURCE_NONE;
+
+	// These settings normally depend on the size of the input image.
+	ctx->canvas_width = 0;
+	ctx->canvas_height = 0;
+	ctx->req.out_true_valid = 0;
+	ctx->input_start_x = 0;
+	ctx->input_start_y = 0;
+	ctx->input_w = -1;
+	ctx->input_h = -1;
+
+	for(i=0;i<2;i++) {
+		rs = &ctx->resize_settings[i];
+		if(rs->auto_family) {
+			rs->family = IW_RESIZETYPE_AUTO;
+			rs->auto_family = 0;
+		}
+		rs->use_offset = 0;
+		rs->disable_rrctx_cache = 0;
+		rs->out_true_size = 0.0;
+		rs->in_true_size = 0.0;
+		rs->in_true_start = 0.0;
+	}
+}
+
 IW_IMPL(void) iw_get_output_image(struct iw_context *ctx, struct iw_image *img)
 {
 	int k;
@@ -363,6 +444,32 @@ IW_IMPL(void) iw_set_output_image_size(struct iw_context *ctx, double w, double
 	ctx->req.out_true_valid = 1;
 }
 
+IW_IMPL(void) iw_set_input_true_size(struct iw_context *ctx, double w, double h)
+{
+	// Each dimension must be within one pixel of the pixel count.
+	if(w<=(double)(ctx->img1.width-1) || w>(double)ctx->img1.width) return;
+	if(h<=(double)(ctx->img1.height-1) || h>(double)ctx->img1.height) return;
+	ctx->img1_true_width = w;
+	ctx->img1_true_height = h;
+	ctx->img1_true_valid = 1;
+}
+
+IW_IMPL(void) iw_get_input_true_size(struct iw_context *ctx, double *pw, double *ph)
+{
+	if(ctx->img1_region_valid) {
+		*pw = (double)ctx->img1_full_width;
+		*ph = (double)ctx->img1_full_height;
+	}
+	else if(ctx->img1_true_valid) {
+		*pw = ctx->img1_true_width;
+		*ph = ctx->img1_true_height;
+	}
+	else {
+		*pw = (double)ctx->img1.width;
+		*ph = (double)ctx->img1.height;
+	}
+}
+
 IW_IMPL(void) iw_set_input_crop(struct iw_context *ctx, int x, int y, int w, int h)
 {
 	ctx->input_start_x = x;
@@ -371,6 +478,45 @@ IW_IMPL(void) iw_set_input_crop(struct iw_context *ctx, int x, int y, int w, int
 	ctx->input_h = h;
 }
 
+// Clamp a crop rectangle to an image of the given size. A negative width or
+// height means "to the right or bottom edge".
+void iwpvt_clamp_crop(int full_w, int full_h, int *px, int *py, int *pw, int *ph)
+{
+	if(*px<0) *px=0;
+	if(*py<0) *py=0;
+	if(*px>full_w-1) *px=full_w-1;
+	if(*py>full_h-1) *py=full_h-1;
+	if(*pw<0) *pw = full_w - *px;
+	if(*ph<0) *ph = full_h - *py;
+	if(*pw<1) *pw = 1;
+	if(*ph<1) *ph = 1;
+	if(*pw>full_w-*px) *pw = full_w - *px;
+	if(*ph>full_h-*py) *ph = full_h - *py;
+}
+
+IW_IMPL(int) iw_get_input_region(struct iw_context *ctx, int full_w, int full_h,
+	int *px, int *py, int *pw, int *ph)
+{
+	*px = ctx->input_start_x;
+	*py = ctx->input_start_y;
+	*pw = ctx->input_w;
+	*ph = ctx->input_h;
+	if(full_w<1 || full_h<1) return 0;
+	iwpvt_clamp_crop(full_w,full_h,px,py,pw,ph);
+	if(*pw==full_w && *ph==full_h) return 0;
+	return 1;
+}
+
+IW_IMPL(void) iw_set_input_region(struct iw_context *ctx, int x, int y,
+	int full_w, int full_h)
+{
+	ctx->img1_region_valid = 1;
+	ctx->img1_region_x = x;
+	ctx->img1_region_y = y;
+	ctx->img1_full_width = full_w;
+	ctx->img1_full_height = full_h;
+}
+
 IW_IMPL(void) iw_set_output_profile(struct iw_context *ctx, unsigned int n)
 {
 	ctx->output_profile = n;
@@ -641,6 +787,39 @@ IW_IMPL(void) iw_set_warning_fn(struct iw_context *ctx, iw_warningfn_type warnfn
 IW_IMPL(void) iw_set_input_image(struct iw_context *ctx, const struct iw_image *img)
 {
 	ctx->img1 = *img; // struct copy
+	ctx->img1_true_valid = 0;
+	ctx->img1_region_valid = 0;
+	if(ctx->img1_palette) {
+		iw_free(ctx,ctx->img1_palette);
+		ctx->img1_palette = NULL;
+	}
+}
+
+IW_IMPL(void) iw_set_input_palette(struct iw_context *ctx, const struct iw_palette *pal)
+{
+	int i;
+	int n;
+
+	if(!ctx->img1_palette) {
+		ctx->img1_palette = (struct iw_palette*)iw_malloc(ctx,sizeof(struct iw_palette));
+		if(!ctx->img1_palette) return;
+	}
+
+	n = pal->num_entries;
+	if(n<0) n=0;
+	if(n>256) n=256;
+	for(i=0;i<n;i++) {
+		ctx->img1_palette->entry[i] = pal->entry[i]; // struct copy
+	}
+	// Pixels can use any index that fits in 8 bits, so fill in the rest
+	// of the palette.
+	for(i=n;i<256;i++) {
+		ctx->img1_palette->entry[i].r = 0;
+		ctx->img1_palette->entry[i].g = 0;
+		ctx->img1_palette->entry[i].b = 0;
+		ctx->img1_palette->entry[i].a = 255;
+	}
+	ctx->img1_palette->num_entries = 256;
 }
 
 IW_IMPL(void) iw_set_resize_alg(struct iw_context *ctx, int dimension, int family,
@@ -677,10 +856,29 @@ IW_IMPL(void) iw_reorient_image(struct iw_context *ctx, unsigned int x)
 		tmpd = ctx->img1.density_x;
 		ctx->img1.density_x = ctx->img1.density_y;
 		ctx->img1.density_y = tmpd;
+
+		tmpd = ctx->img1_true_width;
+		ctx->img1_true_width = ctx->img1_true_height;
+		ctx->img1_true_height = tmpd;
+
+		tmpi = ctx->img1_region_x;
+		ctx->img1_region_x = ctx->img1_region_y;
+		ctx->img1_region_y = tmpi;
+		tmpi = ctx->img1_full_width;
+		ctx->img1_full_width = ctx->img1_full_height;
+		ctx->img1_full_height = tmpi;
 	}
 
 	// Do horizontal and vertical mirroring.
 	ctx->img1.orient_transform ^= (x&0x03);
+
+	// The region of the full image that img1 contains moves with the image.
+	if(x&0x01) {
+		ctx->img1_region_x = ctx->img1_full_width - ctx->img1_region_x - ctx->img1.width;
+	}
+	if(x&0x02) {
+		ctx->img1_region_y = ctx->img1_full_height - ctx->img1_region_y - ctx->img1.height;
+	}
 }
 
 IW_IMPL(int) iw_get_sample_size(void)
@@ -859,6 +1057,26 @@ IW_IMPL(void) iw_set_value(struct iw_context *ctx, int code, int n)
 	case IW_VAL_NEGATE_TARGET:
 		ctx->req.negate_target = n;
 		break;
+	case IW_VAL_MAX_THREADS:
+		if(n<1) n=1;
+		if(n>IW_MAX_THREADS) n=IW_MAX_THREADS;
+		ctx->max_threads = n;
+		break;
+	case IW_VAL_NO_SIMD:
+		ctx->no_simd = n;
+		break;
+	case IW_VAL_RESIZE_ORDER:
+		ctx->resize_order_req = n;
+		break;
+	case IW_VAL_NO_STREAMING:
+		ctx->no_streaming = n;
+		break;
+	case IW_VAL_DECODE_WIDTH_HINT:
+		ctx->decode_width_hint = (n>0) ? n : 0;
+		break;
+	case IW_VAL_DECODE_HEIGHT_HINT:
+		ctx->decode_height_hint = (n>0) ? n : 0;
+		break;
 	}
 }
 
@@ -898,11 +1116,13 @@ IW_IMPL(int) iw_get_value(struct iw_context *ctx, int code)
 		ret = ctx->img1.native_grayscale;
 		break;
 	case IW_VAL_INPUT_WIDTH:
-		if(ctx->img1.width<1) ret=1;
+		if(ctx->img1_region_valid) ret = ctx->img1_full_width;
+		else if(ctx->img1.width<1) ret=1;
 		else ret = ctx->img1.width;
 		break;
 	case IW_VAL_INPUT_HEIGHT:
-		if(ctx->img1.height<1) ret=1;
+		if(ctx->img1_region_valid) ret = ctx->img1_full_height;
+		else if(ctx->img1.height<1) ret=1;
 		else ret = ctx->img1.height;
 		break;
 	case IW_VAL_INPUT_IMAGE_TYPE:
@@ -956,6 +1176,27 @@ IW_IMPL(int) iw_get_value(struct iw_context *ctx, int code)
 	case IW_VAL_NEGATE_TARGET:
 		ret = ctx->req.negate_target;
 		break;
+	case IW_VAL_MAX_THREADS:
+		ret = ctx->max_threads;
+		break;
+	case IW_VAL_NO_SIMD:
+		ret = ctx->no_simd;
+		break;
+	case IW_VAL_RESIZE_ORDER:
+		ret = ctx->resize_order_req;
+		break;
+	case IW_VAL_RESIZE_ORDER_USED:
+		ret = ctx->resize_order;
+		break;
+	case IW_VAL_NO_STREAMING:
+		ret = ctx->no_streaming;
+		break;
+	case IW_VAL_DECODE_WIDTH_HINT:
+		ret = ctx->decode_width_hint;
+		break;
+	case IW_VAL_DECODE_HEIGHT_HINT:
+		ret = ctx->decode_height_hint;
+		break;
 	}
 
 	return ret;
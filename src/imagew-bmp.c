@@ -18,6 +18,15 @@
 #define IWBMP_BI_JPEG      4
 #define IWBMP_BI_PNG       5
 
+// Layouts of 16- and 32-bit pixels that have specialized conversion
+// functions. Bytes are listed in file order (e.g. BGRA = blue first);
+// 565 and 555 are the bit counts of red, green, and blue.
+#define IWBMP_LAYOUT_GENERIC  0
+#define IWBMP_LAYOUT_BGRA8888 1
+#define IWBMP_LAYOUT_BGRX8888 2
+#define IWBMP_LAYOUT_RGB565   3
+#define IWBMP_LAYOUT_RGB555   4
+
 #define IWBMPCS_CALIBRATED_RGB    0
 #define IWBMPCS_DEVICE_RGB        1 // (Unconfirmed)
 #define IWBMPCS_DEVICE_CMYK       2 // (Unconfirmed)
@@ -58,6 +67,10 @@ struct iwbmprcontext {
 	int bf_high_bit[4];
 	int bf_low_bit[4];
 	int bf_bits_count[4]; // number of bits in each channel
+	int row_layout; // IWBMP_LAYOUT_*
+
+	// The position of the part of the image we read, in file row order.
+	int rgn_x, rgn_y;
 
 	struct iw_csdescr csdescr;
 };
@@ -82,6 +95,10 @@ static int iwbmp_skip_bytes(struct iwbmprcontext *rctx, size_t n)
 	size_t still_to_read;
 	size_t num_to_read;
 
+	if(rctx->iodescr->seek_fn) {
+		return (*rctx->iodescr->seek_fn)(rctx->ctx,rctx->iodescr,(iw_int64)n,SEEK_CUR);
+	}
+
 	still_to_read = n;
 	while(still_to_read>0) {
 		num_to_read = still_to_read;
@@ -551,6 +568,77 @@ static int iwbmp_read_palette(struct iwbmprcontext *rctx)
 	return 1;
 }
 
+// Decide whether the bitfields masks describe one of the common pixel
+// layouts that have a specialized conversion function.
+static int bmpr_find_row_layout(struct iwbmprcontext *rctx)
+{
+	if(rctx->img->bit_depth!=8) return IWBMP_LAYOUT_GENERIC;
+
+	if(rctx->bitcount==32 && rctx->bf_mask[0]==0x00ff0000 &&
+		rctx->bf_mask[1]==0x0000ff00 && rctx->bf_mask[2]==0x000000ff)
+	{
+		if(!rctx->has_alpha_channel) return IWBMP_LAYOUT_BGRX8888;
+		if(rctx->bf_mask[3]==0xff000000U) return IWBMP_LAYOUT_BGRA8888;
+	}
+	else if(rctx->bitcount==16 && !rctx->has_alpha_channel && rctx->bf_mask[2]==0x001f) {
+		if(rctx->bf_mask[0]==0xf800 && rctx->bf_mask[1]==0x07e0) return IWBMP_LAYOUT_RGB565;
+		if(rctx->bf_mask[0]==0x7c00 && rctx->bf_mask[1]==0x03e0) return IWBMP_LAYOUT_RGB555;
+	}
+	return IWBMP_LAYOUT_GENERIC;
+}
+
+static void bmpr_convert_row_bgra8888(struct iwbmprcontext *rctx, const iw_byte *src, size_t row)
+{
+	int i;
+	iw_byte *dst;
+
+	dst = &rctx->img->pixels[row*rctx->img->bpr];
+	for(i=0;i<rctx->img->width;i++) {
+		dst[i*4+0] = src[i*4+2];
+		dst[i*4+1] = src[i*4+1];
+		dst[i*4+2] = src[i*4+0];
+		dst[i*4+3] = src[i*4+3];
+	}
+}
+
+static void bmpr_convert_row_bgrx8888(struct iwbmprcontext *rctx, const iw_byte *src, size_t row)
+{
+	int i;
+	iw_byte *dst;
+
+	dst = &rctx->img->pixels[row*rctx->img->bpr];
+	for(i=0;i<rctx->img->width;i++) {
+		dst[i*3+0] = src[i*4+2];
+		dst[i*3+1] = src[i*4+1];
+		dst[i*3+2] = src[i*4+0];
+	}
+}
+
+// Handles both 5-6-5 and 5-5-5. The samples are not scaled; the image's
+// max color codes tell the rest of IW how to interpret them.
+static void bmpr_convert_row_rgb565_555(struct iwbmprcontext *rctx, const iw_byte *src, size_t row)
+{
+	int i;
+	unsigned int x;
+	unsigned int r_shift, g_mask;
+	iw_byte *dst;
+
+	if(rctx->row_layout==IWBMP_LAYOUT_RGB565) {
+		r_shift = 11; g_mask = 0x3f;
+	}
+	else {
+		r_shift = 10; g_mask = 0x1f;
+	}
+
+	dst = &rctx->img->pixels[row*rctx->img->bpr];
+	for(i=0;i<rctx->img->width;i++) {
+		x = ((unsigned int)src[i*2+0]) | ((unsigned int)src[i*2+1])<<8;
+		dst[i*3+0] = (iw_byte)((x>>r_shift)&0x1f);
+		dst[i*3+1] = (iw_byte)((x>>5)&g_mask);
+		dst[i*3+2] = (iw_byte)(x&0x1f);
+	}
+}
+
 static void bmpr_convert_row_32_16(struct iwbmprcontext *rctx, const iw_byte *src, size_t row)
 {
 	int i,k;
@@ -559,7 +647,7 @@ static void bmpr_convert_row_32_16(struct iwbmprcontext *rctx, const iw_byte *sr
 
 	numchannels = rctx->has_alpha_channel ? 4 : 3;
 
-	for(i=0;i<rctx->width;i++) {
+	for(i=0;i<rctx->img->width;i++) {
 		if(rctx->bitcount==32) {
 			x = ((unsigned int)src[i*4+0]) | ((unsigned int)src[i*4+1])<<8 |
 				((unsigned int)src[i*4+2])<<16 | ((unsigned int)src[i*4+3])<<24;
@@ -586,7 +674,7 @@ static void bmpr_convert_row_32_16(struct iwbmprcontext *rctx, const iw_byte *sr
 static void bmpr_convert_row_24(struct iwbmprcontext *rctx,const iw_byte *src, size_t row)
 {
 	int i;
-	for(i=0;i<rctx->width;i++) {
+	for(i=0;i<rctx->img->width;i++) {
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = src[i*3+2];
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = src[i*3+1];
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 2] = src[i*3+0];
@@ -596,7 +684,7 @@ static void bmpr_convert_row_24(struct iwbmprcontext *rctx,const iw_byte *src, s
 static void bmpr_convert_row_8(struct iwbmprcontext *rctx,const iw_byte *src, size_t row)
 {
 	int i;
-	for(i=0;i<rctx->width;i++) {
+	for(i=0;i<rctx->img->width;i++) {
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[src[i]].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[src[i]].g;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 2] = rctx->palette.entry[src[i]].b;
@@ -608,7 +696,7 @@ static void bmpr_convert_row_4(struct iwbmprcontext *rctx,const iw_byte *src, si
 	int i;
 	int pal_index;
 
-	for(i=0;i<rctx->width;i++) {
+	for(i=0;i<rctx->img->width;i++) {
 		pal_index = (i&0x1) ? src[i/2]&0x0f : src[i/2]>>4;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[pal_index].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[pal_index].g;
@@ -621,7 +709,7 @@ static void bmpr_convert_row_2(struct iwbmprcontext *rctx,const iw_byte *src, si
 	int i;
 	int pal_index;
 
-	for(i=0;i<rctx->width;i++) {
+	for(i=0;i<rctx->img->width;i++) {
 		pal_index = (src[i/4]>>(2*(3-i%4)))&0x03;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[pal_index].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[pal_index].g;
@@ -634,7 +722,7 @@ static void bmpr_convert_row_1(struct iwbmprcontext *rctx,const iw_byte *src, si
 	int i;
 	int pal_index;
 
-	for(i=0;i<rctx->width;i++) {
+	for(i=0;i<rctx->img->width;i++) {
 		pal_index = (src[i/8] & (1<<(7-i%8))) ? 1 : 0;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 0] = rctx->palette.entry[pal_index].r;
 		rctx->img->pixels[row*rctx->img->bpr + i*3 + 1] = rctx->palette.entry[pal_index].g;
@@ -645,20 +733,37 @@ static void bmpr_convert_row_1(struct iwbmprcontext *rctx,const iw_byte *src, si
 static int bmpr_read_uncompressed(struct iwbmprcontext *rctx)
 {
 	iw_byte *rowbuf = NULL;
+	const iw_byte *src;
 	size_t bmp_bpr;
 	int j;
+	int x, y, w, h;
 	int retval = 0;
 
+	// If only part of the image is needed, read only the rows it covers.
+	if(iw_get_input_region(rctx->ctx,rctx->width,rctx->height,&x,&y,&w,&h)) {
+		if(rctx->bitcount<8) {
+			// Start on a byte boundary, so that the pixels can be found
+			// without shifting.
+			w += x%8;
+			x -= x%8;
+		}
+		rctx->rgn_x = x;
+		// Bottom-up images will be flipped later, so count from the bottom.
+		rctx->rgn_y = rctx->topdown ? y : rctx->height - y - h;
+		rctx->img->width = w;
+		rctx->img->height = h;
+	}
+
 	if(rctx->has_alpha_channel) {
 		rctx->img->imgtype = IW_IMGTYPE_RGBA;
 		
 		rctx->img->bit_depth = rctx->need_16bit ? 16 : 8;
-		rctx->img->bpr = iw_calc_bytesperrow(rctx->width,4*rctx->img->bit_depth);
+		rctx->img->bpr = iw_calc_bytesperrow(rctx->img->width,4*rctx->img->bit_depth);
 	}
 	else {
 		rctx->img->imgtype = IW_IMGTYPE_RGB;
 		rctx->img->bit_depth = rctx->need_16bit ? 16 : 8;
-		rctx->img->bpr = iw_calc_bytesperrow(rctx->width,3*rctx->img->bit_depth);
+		rctx->img->bpr = iw_calc_bytesperrow(rctx->img->width,3*rctx->img->bit_depth);
 	}
 
 	bmp_bpr = iwbmp_calc_bpr(rctx->bitcount,rctx->width);
@@ -667,6 +772,16 @@ static int bmpr_read_uncompressed(struct iwbmprcontext *rctx)
 	if(!rctx->img->pixels) goto done;
 
 	rowbuf = iw_malloc(rctx->ctx,bmp_bpr);
+	if(!rowbuf) goto done;
+
+	if(rctx->bitcount==32 || rctx->bitcount==16) {
+		rctx->row_layout = bmpr_find_row_layout(rctx);
+	}
+
+	if(rctx->rgn_y>0) {
+		if(!iwbmp_skip_bytes(rctx,bmp_bpr*rctx->rgn_y)) goto done;
+	}
+	src = &rowbuf[(size_t)rctx->rgn_x*rctx->bitcount/8];
 
 	for(j=0;j<rctx->img->height;j++) {
 		// Read a row of the BMP file.
@@ -676,22 +791,35 @@ static int bmpr_read_uncompressed(struct iwbmprcontext *rctx)
 		switch(rctx->bitcount) {
 		case 32:
 		case 16:
-			bmpr_convert_row_32_16(rctx,rowbuf,j);
+			switch(rctx->row_layout) {
+			case IWBMP_LAYOUT_BGRA8888:
+				bmpr_convert_row_bgra8888(rctx,src,j);
+				break;
+			case IWBMP_LAYOUT_BGRX8888:
+				bmpr_convert_row_bgrx8888(rctx,src,j);
+				break;
+			case IWBMP_LAYOUT_RGB565:
+			case IWBMP_LAYOUT_RGB555:
+				bmpr_convert_row_rgb565_555(rctx,src,j);
+				break;
+			default:
+				bmpr_convert_row_32_16(rctx,src,j);
+			}
 			break;
 		case 24:
-			bmpr_convert_row_24(rctx,rowbuf,j);
+			bmpr_convert_row_24(rctx,src,j);
 			break;
 		case 8:
-			bmpr_convert_row_8(rctx,rowbuf,j);
+			bmpr_convert_row_8(rctx,src,j);
 			break;
 		case 4:
-			bmpr_convert_row_4(rctx,rowbuf,j);
+			bmpr_convert_row_4(rctx,src,j);
 			break;
 		case 2:
-			bmpr_convert_row_2(rctx,rowbuf,j);
+			bmpr_convert_row_2(rctx,src,j);
 			break;
 		case 1:
-			bmpr_convert_row_1(rctx,rowbuf,j);
+			bmpr_convert_row_1(rctx,src,j);
 			break;
 		}
 	}
@@ -983,6 +1111,9 @@ IW_IMPL(int) iw_read_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	if(!iwbmp_read_bits(&rctx)) goto done;
 
 	iw_set_input_image(ctx, &img);
+	if(img.width!=rctx.width || img.height!=rctx.height) {
+		iw_set_input_region(ctx,rctx.rgn_x,rctx.rgn_y,rctx.width,rctx.height);
+	}
 
 	iwbmpr_misc_config(ctx, &rctx);
 
@@ -1017,6 +1148,7 @@ struct iwbmpwcontext {
 	int bf_amt_to_shift[4]; // For 16-bit images
 	unsigned int bf_mask[4];
 	unsigned int maxcolor[4]; // R, G, B -- For 16-bit images.
+	int row_layout; // IWBMP_LAYOUT_*
 	struct iw_csdescr csdescr;
 	int no_cslabel;
 };
@@ -1058,6 +1190,56 @@ static void bmpw_convert_row_8(const iw_byte *srcrow, iw_byte *dstrow, int width
 	memcpy(dstrow,srcrow,width);
 }
 
+// Decide whether the image can be written by one of the specialized
+// conversion functions. Call after iwbmp_calc_bitfields_masks().
+static int bmpw_find_row_layout(struct iwbmpwcontext *wctx)
+{
+	if(wctx->img->bit_depth!=8) return IWBMP_LAYOUT_GENERIC;
+
+	if(wctx->img->imgtype==IW_IMGTYPE_RGBA && wctx->bitcount==32 &&
+		wctx->bf_mask[0]==0x00ff0000 && wctx->bf_mask[1]==0x0000ff00 &&
+		wctx->bf_mask[2]==0x000000ff && wctx->bf_mask[3]==0xff000000U)
+	{
+		return IWBMP_LAYOUT_BGRA8888;
+	}
+	if(wctx->img->imgtype==IW_IMGTYPE_RGB && wctx->bitcount==16 &&
+		wctx->bf_mask[2]==0x001f)
+	{
+		if(wctx->bf_mask[0]==0xf800 && wctx->bf_mask[1]==0x07e0) return IWBMP_LAYOUT_RGB565;
+		if(wctx->bf_mask[0]==0x7c00 && wctx->bf_mask[1]==0x03e0) return IWBMP_LAYOUT_RGB555;
+	}
+	return IWBMP_LAYOUT_GENERIC;
+}
+
+static void bmpw_convert_row_bgra8888(const iw_byte *srcrow, iw_byte *dstrow, int width)
+{
+	int i;
+
+	for(i=0;i<width;i++) {
+		dstrow[i*4+0] = srcrow[i*4+2];
+		dstrow[i*4+1] = srcrow[i*4+1];
+		dstrow[i*4+2] = srcrow[i*4+0];
+		dstrow[i*4+3] = srcrow[i*4+3];
+	}
+}
+
+static void bmpw_convert_row_rgb565_555(struct iwbmpwcontext *wctx, const iw_byte *srcrow,
+	iw_byte *dstrow, int width)
+{
+	int i;
+	unsigned int v;
+	unsigned int r_shift;
+
+	r_shift = (wctx->row_layout==IWBMP_LAYOUT_RGB565) ? 11 : 10;
+
+	for(i=0;i<width;i++) {
+		v = (((unsigned int)srcrow[i*3+0])<<r_shift) |
+			(((unsigned int)srcrow[i*3+1])<<5) | (unsigned int)srcrow[i*3+2];
+		dstrow[i*2+0] = (iw_byte)(v&0xff);
+		dstrow[i*2+1] = (iw_byte)(v>>8);
+	}
+}
+
 static void bmpw_convert_row_16_32(struct iwbmpwcontext *wctx, const iw_byte *srcrow,
 	iw_byte *dstrow, int width)
 {
@@ -1066,6 +1248,16 @@ static void bmpw_convert_row_16_32(struct iwbmpwcontext *wctx, const iw_byte *sr
 	int num_src_samples;
 	unsigned int src_sample[4];
 
+	switch(wctx->row_layout) {
+	case IWBMP_LAYOUT_BGRA8888:
+		bmpw_convert_row_bgra8888(srcrow,dstrow,width);
+		return;
+	case IWBMP_LAYOUT_RGB565:
+	case IWBMP_LAYOUT_RGB555:
+		bmpw_convert_row_rgb565_555(wctx,srcrow,dstrow,width);
+		return;
+	}
+
 	for(k=0;k<4;k++) src_sample[k]=0;
 
 	num_src_samples = iw_imgtype_num_channels(wctx->img->imgtype);
@@ -2059,6 +2251,7 @@ static int setup_16_32bit(struct iwbmpwcontext *wctx,
 	if(has_alpha) wctx->maxcolor[3] = mcc_a;
 
 	if(!iwbmp_calc_bitfields_masks(wctx,has_alpha?4:3)) return 0;
+	wctx->row_layout = bmpw_find_row_layout(wctx);
 
 	if(mcc_r==31 && mcc_g==31 && mcc_b==31 && !has_alpha) {
 		// For the default 5-5-5, set the 'compression' to BI_RGB
@@ -33,6 +33,14 @@
 #include <io.h> // for _setmode
 #endif
 
+#if IW_SUPPORT_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifndef IW_NO_LOCALE
 #include <locale.h>
 #include <langinfo.h>
@@ -95,7 +103,8 @@ struct params_struct {
 	int nowarn;
 	int noinfo;
 	int src_width, src_height;
-	int adjusted_src_width, adjusted_src_height;
+	double src_true_width, src_true_height;
+	double adjusted_src_width, adjusted_src_height;
 	int dst_width_req, dst_height_req;
 	int rel_width_flag, rel_height_flag;
 	int noresize_flag;
@@ -141,6 +150,11 @@ struct params_struct {
 	struct iw_color bkgd;
 	struct iw_color bkgd2;
 	int page_to_read;
+	int max_threads;
+	int no_simd;
+	int no_streaming;
+	int fast_decode;
+	int resize_order;
 	int bmp_version;
 	int bmp_trns;
 	int interlace;
@@ -192,6 +206,10 @@ struct params_struct {
 	size_t input_initial_bytes_stored;
 	size_t input_initial_bytes_consumed;
 
+	// If the input file is memory-mapped
+	void *input_map;
+	size_t input_map_size;
+
 #define IWCMD_MAX_OPTIONS 32
 	struct iw_option_struct options[IWCMD_MAX_OPTIONS];
 	int options_count;
@@ -494,6 +512,54 @@ static int my_readfn(struct iw_context *ctx, struct iw_iodescr *iodescr, void *b
 	return 1;
 }
 
+// Try to memory-map the input file, and have readdescr read from the mapping.
+// Returns 0 if that's not possible, in which case the file should be read
+// normally.
+static int iwcmd_map_input_file(struct params_struct *p, struct iw_iodescr *readdescr)
+{
+#if IW_SUPPORT_MMAP
+	int fd;
+	int flags;
+	struct stat st;
+	void *m;
+
+	fd = open(p->input_uri.filename, O_RDONLY);
+	if(fd<0) return 0;
+	if(fstat(fd,&st)!=0 || !S_ISREG(st.st_mode) || st.st_size<1 ||
+		(iw_int64)st.st_size != (iw_int64)(size_t)st.st_size)
+	{
+		close(fd);
+		return 0;
+	}
+	flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	// We're going to read the whole file, so avoid taking a page fault for
+	// each page.
+	flags |= MAP_POPULATE;
+#endif
+	m = mmap(NULL,(size_t)st.st_size,PROT_READ,flags,fd,0);
+	close(fd);
+	if(m==MAP_FAILED) return 0;
+
+	p->input_map = m;
+	p->input_map_size = (size_t)st.st_size;
+	iw_set_iodescr_mem(readdescr,m,p->input_map_size);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+static void iwcmd_unmap_input_file(struct params_struct *p)
+{
+#if IW_SUPPORT_MMAP
+	if(!p->input_map) return;
+	munmap(p->input_map,p->input_map_size);
+	p->input_map = NULL;
+	p->input_map_size = 0;
+#endif
+}
+
 static int my_getfilesizefn(struct iw_context *ctx, struct iw_iodescr *iodescr, iw_int64 *pfilesize)
 {
 	int ret;
@@ -776,10 +842,10 @@ done:
 #endif // IW_WINDOWS
 /////////////////////////////////////////////////
 
-static int iwcmd_calc_rel_size(double rel, int d)
+static int iwcmd_calc_rel_size(double rel, double d)
 {
 	int n;
-	n = (int)(0.5 + rel * (double)d);
+	n = (int)(0.5 + rel * d);
 	if(n<1) n=1;
 	return n;
 }
@@ -800,6 +866,31 @@ static void my_freefn(void *userdata, void *mem)
 	free(mem);
 }
 
+// Tell the decoder the size of the image we'll make, so that it can decode a
+// smaller image if that's much faster. Only done in the simple cases where
+// that size doesn't depend on the exact size of the input image.
+static void iwcmd_set_decode_hints(struct params_struct *p, struct iw_context *ctx)
+{
+	int hint_w, hint_h;
+
+	if(p->noresize_flag || p->use_crop || p->imagesize_set) return;
+	if(p->rel_width_flag || p->rel_height_flag) return;
+	if(p->translate_set && p->translate_src_flag) return;
+
+	hint_w = (p->dst_width_req>0) ? p->dst_width_req : 0;
+	hint_h = (p->dst_height_req>0) ? p->dst_height_req : 0;
+
+	// The hints apply to the image before we reorient it.
+	if(p->reorient & 0x4) {
+		iw_set_value(ctx,IW_VAL_DECODE_WIDTH_HINT,hint_h);
+		iw_set_value(ctx,IW_VAL_DECODE_HEIGHT_HINT,hint_w);
+	}
+	else {
+		iw_set_value(ctx,IW_VAL_DECODE_WIDTH_HINT,hint_w);
+		iw_set_value(ctx,IW_VAL_DECODE_HEIGHT_HINT,hint_h);
+	}
+}
+
 static void figure_out_size_and_density(struct params_struct *p, struct iw_context *ctx)
 {
 	int fit_flag = 0;
@@ -841,17 +932,17 @@ static void figure_out_size_and_density(struct params_struct *p, struct iw_conte
 	// Set adjusted_* variables, which will be different from the original ones
 	// of there are nonsquare pixels. For certain operations, we'll pretend that
 	// the adjusted settings are the real setting.
-	p->adjusted_src_width = p->src_width;
-	p->adjusted_src_height = p->src_height;
+	p->adjusted_src_width = p->src_true_width;
+	p->adjusted_src_height = p->src_true_height;
 	adjusted_dens_x = xdens;
 	adjusted_dens_y = ydens;
 	if(nonsquare_pixels_flag && fit_flag) {
 		if(xdens > ydens) {
-			p->adjusted_src_height = (int)(0.5+ (xdens/ydens) * (double)p->adjusted_src_height);
+			p->adjusted_src_height = (double)(int)(0.5+ (xdens/ydens) * p->adjusted_src_height);
 			adjusted_dens_y = xdens;
 		}
 		else {
-			p->adjusted_src_width = (int)(0.5+ (ydens/xdens) * (double)p->adjusted_src_width);
+			p->adjusted_src_width = (double)(int)(0.5+ (ydens/xdens) * p->adjusted_src_width);
 			adjusted_dens_x = ydens;
 		}
 	}
@@ -875,8 +966,8 @@ static void figure_out_size_and_density(struct params_struct *p, struct iw_conte
 		// Neither -width nor -height specified. Keep image the same size.
 		// (But if the pixels were not square, pretend the image was a different
 		// size, and had square pixels.)
-		p->dst_width=p->adjusted_src_width;
-		p->dst_height=p->adjusted_src_height;
+		p->dst_width=(int)p->adjusted_src_width;
+		p->dst_height=(int)p->adjusted_src_height;
 	}
 	else if(p->dst_height == -1) {
 		// -width given but not -height. Fit to width.
@@ -1135,10 +1226,18 @@ static int iwcmd_run(struct params_struct *p)
 		}
 	}
 	if(p->page_to_read>0) iw_set_value(ctx,IW_VAL_PAGE_TO_READ,p->page_to_read);
+	if(p->max_threads>0) iw_set_value(ctx,IW_VAL_MAX_THREADS,p->max_threads);
+	if(p->no_simd) iw_set_value(ctx,IW_VAL_NO_SIMD,1);
+	if(p->no_streaming) iw_set_value(ctx,IW_VAL_NO_STREAMING,1);
+	if(p->fast_decode) iwcmd_set_decode_hints(p,ctx);
+	if(p->resize_order) iw_set_value(ctx,IW_VAL_RESIZE_ORDER,p->resize_order);
 	if(p->include_screen>=0) iw_set_value(ctx,IW_VAL_INCLUDE_SCREEN,p->include_screen);
 	if(p->negate) iw_set_value(ctx,IW_VAL_NEGATE_TARGET,1);
 
-	if(p->input_uri.scheme==IWCMD_SCHEME_FILE) {
+	if(p->input_uri.scheme==IWCMD_SCHEME_FILE && iwcmd_map_input_file(p,&readdescr)) {
+		;
+	}
+	else if(p->input_uri.scheme==IWCMD_SCHEME_FILE) {
 		readdescr.read_fn = my_readfn;
 		readdescr.getfilesize_fn = my_getfilesizefn;
 		readdescr.fp = (void*)iwcmd_fopen(p->input_uri.filename, "rb", errmsg, sizeof(errmsg));
@@ -1172,7 +1271,13 @@ static int iwcmd_run(struct params_struct *p)
 		switch(p->input_uri.scheme) {
 		case IWCMD_SCHEME_FILE:
 		case IWCMD_SCHEME_STDIN:
-			p->infmt=detect_fmt_of_file(p,(FILE*)readdescr.fp);
+			if(readdescr.mem) {
+				p->infmt=iw_detect_fmt_of_file(readdescr.mem,
+					(readdescr.mem_size<12) ? readdescr.mem_size : 12);
+			}
+			else {
+				p->infmt=detect_fmt_of_file(p,(FILE*)readdescr.fp);
+			}
 			break;
 		case IWCMD_SCHEME_CLIPBOARD:
 			p->infmt=IW_FORMAT_BMP;
@@ -1188,12 +1293,21 @@ static int iwcmd_run(struct params_struct *p)
 		iw_set_value(ctx,IW_VAL_BMP_NO_FILEHEADER,1);
 	}
 
+	if(p->use_crop && !p->reorient) {
+		// Tell the decoder about the crop, so that it may be able to skip
+		// decoding the parts of the image we won't use. (The crop will be
+		// set again after we know the image size.)
+		iw_set_input_crop(ctx,p->crop_x,p->crop_y,p->crop_w,p->crop_h);
+	}
+
 	if(!iw_read_file_by_fmt(ctx,&readdescr,p->infmt)) goto done;
 
-	if(p->input_uri.scheme==IWCMD_SCHEME_FILE) {
+	if(p->input_uri.scheme==IWCMD_SCHEME_FILE && readdescr.fp) {
 		fclose((FILE*)readdescr.fp);
 	}
 	readdescr.fp=NULL;
+	// The image has been copied to IW's own memory.
+	iwcmd_unmap_input_file(p);
 
 	if(p->reorient) {
 		iw_reorient_image(ctx,p->reorient);
@@ -1304,6 +1418,7 @@ static int iwcmd_run(struct params_struct *p)
 
 	p->src_width=iw_get_value(ctx,IW_VAL_INPUT_WIDTH);
 	p->src_height=iw_get_value(ctx,IW_VAL_INPUT_HEIGHT);
+	iw_get_input_true_size(ctx,&p->src_true_width,&p->src_true_height);
 
 	// If we're cropping, adjust the src_width and height accordingly.
 	if(p->use_crop) {
@@ -1318,6 +1433,8 @@ static int iwcmd_run(struct params_struct *p)
 
 		p->src_width = p->crop_w;
 		p->src_height = p->crop_h;
+		p->src_true_width = (double)p->crop_w;
+		p->src_true_height = (double)p->crop_h;
 	}
 
 	figure_out_size_and_density(p,ctx);
@@ -1452,6 +1569,7 @@ done:
 	iwcmd_close_clipboard_r(p,ctx);
 #endif
 	if(readdescr.fp) fclose((FILE*)readdescr.fp);
+	iwcmd_unmap_input_file(p);
 	if(writedescr.fp) fclose((FILE*)writedescr.fp);
 
 	if(ctx) {
@@ -1929,6 +2047,15 @@ static int iwcmd_decode_edge_policy(struct params_struct *p, const char *s)
 	return -1;
 }
 
+static int iwcmd_decode_resize_order(struct params_struct *p, const char *s)
+{
+	if(s[0]=='a') return IW_RESIZE_ORDER_AUTO;
+	else if(s[0]=='v') return IW_RESIZE_ORDER_V_FIRST;
+	else if(s[0]=='h') return IW_RESIZE_ORDER_H_FIRST;
+	iwcmd_error(p,"Unknown resize order\n");
+	return -1;
+}
+
 static int iwcmd_option_gsf(struct params_struct *p, const char *s)
 {
 	int namelen;
@@ -2073,7 +2200,7 @@ enum iwcmd_param_types {
  PT_WEBPQUALITY, PT_ZIPCMPRLEVEL, PT_INTERLACE, PT_COLORTYPE, PT_NEGATE,
  PT_RANDSEED, PT_INFMT, PT_OUTFMT, PT_EDGE_POLICY, PT_EDGE_POLICY_X,
  PT_EDGE_POLICY_Y, PT_GRAYSCALEFORMULA,
- PT_DENSITY_POLICY, PT_PAGETOREAD, PT_INCLUDESCREEN, PT_NOINCLUDESCREEN,
+ PT_DENSITY_POLICY, PT_PAGETOREAD, PT_THREADS, PT_NOSIMD, PT_NOSTREAMING, PT_FASTDECODE, PT_RESIZEORDER, PT_INCLUDESCREEN, PT_NOINCLUDESCREEN,
  PT_BESTFIT, PT_NOBESTFIT, PT_NORESIZE, PT_GRAYSCALE, PT_CONDGRAYSCALE, PT_NOGAMMA,
  PT_INTCLAMP, PT_NOCSLABEL, PT_NOOPT, PT_USEBKGDLABEL, PT_BKGDLABEL, PT_NOBKGDLABEL,
  PT_MSGSTOSTDOUT, PT_MSGSTOSTDERR,
@@ -2151,6 +2278,8 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"compress",PT_COMPRESS,1},
 		{"colortype",PT_COLORTYPE,1},
 		{"page",PT_PAGETOREAD,1},
+		{"threads",PT_THREADS,1},
+		{"resizeorder",PT_RESIZEORDER,1},
 		{"jpegquality",PT_JPEGQUALITY,1},
 		{"jpegsampling",PT_JPEGSAMPLING,1},
 		{"webpquality",PT_WEBPQUALITY,1},
@@ -2177,6 +2306,9 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"condgrayscale",PT_CONDGRAYSCALE,0},
 		{"nogamma",PT_NOGAMMA,0},
 		{"intclamp",PT_INTCLAMP,0},
+		{"nosimd",PT_NOSIMD,0},
+		{"nostreaming",PT_NOSTREAMING,0},
+		{"fastdecode",PT_FASTDECODE,0},
 		{"nocslabel",PT_NOCSLABEL,0},
 		{"usebkgdlabel",PT_USEBKGDLABEL,0},
 		{"nobkgdlabel",PT_NOBKGDLABEL,0},
@@ -2236,6 +2368,15 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 	case PT_INTCLAMP:
 		p->intclamp=1;
 		break;
+	case PT_NOSIMD:
+		p->no_simd=1;
+		break;
+	case PT_NOSTREAMING:
+		p->no_streaming=1;
+		break;
+	case PT_FASTDECODE:
+		p->fast_decode=1;
+		break;
 	case PT_NOCSLABEL:
 		p->no_cslabel=1;
 		break;
@@ -2619,6 +2760,13 @@ static int process_option_arg(struct params_struct *p, struct parsestate_struct
 	case PT_PAGETOREAD:
 		p->page_to_read = iw_parse_int(v);
 		break;
+	case PT_THREADS:
+		p->max_threads = iw_parse_int(v);
+		break;
+	case PT_RESIZEORDER:
+		p->resize_order = iwcmd_decode_resize_order(p,v);
+		if(p->resize_order<0) return 0;
+		break;
 	case PT_JPEGQUALITY:
 		add_opt(p, "jpeg:quality", v);
 		break;
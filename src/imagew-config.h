@@ -53,6 +53,18 @@
 #define IW_SUPPORT_WEBP 0
 #endif
 
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+#define IW_SUPPORT_THREADS 1
+#else
+#define IW_SUPPORT_THREADS 0
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define IW_SUPPORT_MMAP 1
+#else
+#define IW_SUPPORT_MMAP 0
+#endif
+
 #else
 // Not using autoconf
 
@@ -74,9 +86,32 @@
 #ifndef IW_SUPPORT_WEBP
 #define IW_SUPPORT_WEBP 1
 #endif
+// Uses Windows threads if IW_WINDOWS is defined, otherwise POSIX threads.
+#ifndef IW_SUPPORT_THREADS
+#define IW_SUPPORT_THREADS 1
+#endif
+// Used by the command-line utility to read input files. Not supported on
+// Windows.
+#ifndef IW_SUPPORT_MMAP
+#ifdef IW_WINDOWS
+#define IW_SUPPORT_MMAP 0
+#else
+#define IW_SUPPORT_MMAP 1
+#endif
+#endif
 
 #endif
 
+// SIMD-optimized resampling, with run-time CPU detection. Currently only
+// available when using a GCC-compatible compiler on x86 processors.
+#ifndef IW_SUPPORT_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IW_SUPPORT_SIMD 1
+#else
+#define IW_SUPPORT_SIMD 0
+#endif
+#endif
+
 #ifndef IW_WEBP_SUPPORT_TRANSPARENCY
 #define IW_WEBP_SUPPORT_TRANSPARENCY 1
 #endif
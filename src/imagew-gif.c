@@ -14,8 +14,13 @@
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
 
+// The approximate number of decoded palette indices to collect before
+// converting them to colors.
+#define IWGIF_IDXBUF_SIZE 65536
+
 struct iwgifrcontext {
 	struct iw_iodescr *iodescr;
+	struct iw_bufreader br;
 	struct iw_context *ctx;
 	struct iw_image *img;
 
@@ -30,7 +35,7 @@ struct iwgifrcontext {
 	int screen_initialized;
 	int pages_seen;
 	int interlaced;
-	int bytes_per_pixel;
+	int bytes_per_pixel; // 1 if the image is stored as palette indices
 	int has_transparency;
 	int has_bg_color;
 	int bg_color_index;
@@ -41,6 +46,13 @@ struct iwgifrcontext {
 
 	iw_byte **row_pointers;
 
+	// Decoded palette indices, waiting to be converted to colors.
+	// The first index is for pixel number idxbuf_start, which is always at the
+	// start of a row, except after the final flush.
+	iw_byte *idxbuf;
+	size_t idxbuf_alloc; // Size of idxbuf, in pixels
+	size_t idxbuf_start;
+
 	struct iw_palette colortable;
 
 	// A buffer used when reading the GIF file.
@@ -51,15 +63,7 @@ struct iwgifrcontext {
 static int iwgif_read(struct iwgifrcontext *rctx,
 		iw_byte *buf, size_t buflen)
 {
-	int ret;
-	size_t bytesread = 0;
-
-	ret = (*rctx->iodescr->read_fn)(rctx->ctx,rctx->iodescr,
-		buf,buflen,&bytesread);
-	if(!ret || bytesread!=buflen) {
-		return 0;
-	}
-	return 1;
+	return iw_bufreader_read(&rctx->br,buf,buflen);
 }
 
 static int iwgif_read_file_header(struct iwgifrcontext *rctx)
@@ -136,8 +140,8 @@ static int iwgif_skip_subblocks(struct iwgifrcontext *rctx)
 		// A size of 0 marks the end of the subblocks.
 		if(subblock_size==0) return 1;
 
-		// Read the subblock's data
-		if(!iwgif_read(rctx,rctx->rbuf,(size_t)subblock_size)) return 0;
+		// Skip the subblock's data
+		if(!iw_bufreader_skip(&rctx->br,(size_t)subblock_size)) return 0;
 	}
 }
 
@@ -195,55 +199,97 @@ done:
 	return retval;
 }
 
-// Set the (rctx->pixels_set + offset)th pixel in the logical image to the
-// color represented by palette entry #coloridx.
-static void iwgif_record_pixel(struct iwgifrcontext *rctx, unsigned int coloridx,
-		int offset)
+// Convert some decoded palette indices to colors, and store them in the image.
+// 'row' is the row number in the local image, and npixels is the number of
+// pixels to convert, starting at the left edge of the local image.
+static void iwgif_expand_row(struct iwgifrcontext *rctx, const iw_byte *idx,
+		size_t row, int npixels)
 {
-	struct iw_image *img;
-	unsigned int r,g,b,a;
-	size_t pixnum;
-	size_t xi,yi; // position in image coordinates
-	size_t xs,ys; // position in screen coordinates
+	const struct iw_rgba8color *entry;
+	unsigned int num_entries;
+	unsigned int coloridx;
 	iw_byte *ptr;
+	int i;
 
-	img = rctx->img;
-
-	// Figure out which pixel to set.
-
-	pixnum = rctx->pixels_set + offset;
-	xi = pixnum%rctx->image_width;
-	yi = pixnum/rctx->image_width;
-	xs = rctx->image_left + xi;
-	ys = rctx->image_top + yi;
-
-	// Make sure the coordinate is within the image, and on the screen.
-	if(yi>=(size_t)rctx->image_height) return;
-	if(xs>=(size_t)rctx->screen_width) return;
-	if(ys>=(size_t)rctx->screen_height) return;
+	if(row>=(size_t)rctx->image_height) return;
 
-	// Because of how we de-interlace, it's not obvious whether the Y coordinate
+	// Because of how we de-interlace, it's not obvious whether the row
 	// is on the screen. The easiest way is to check if the row pointer is NULL.
-	if(rctx->row_pointers[yi]==NULL) return;
-
-	// Figure out what color to set the pixel to.
-
-	if(coloridx<(unsigned int)rctx->colortable.num_entries) {
-		r=rctx->colortable.entry[coloridx].r;
-		g=rctx->colortable.entry[coloridx].g;
-		b=rctx->colortable.entry[coloridx].b;
-		a=rctx->colortable.entry[coloridx].a;
+	ptr = rctx->row_pointers[row];
+	if(!ptr) return;
+
+	// Don't write past the right edge of the screen.
+	if(rctx->image_left >= rctx->screen_width) return;
+	if(npixels > rctx->screen_width - rctx->image_left)
+		npixels = rctx->screen_width - rctx->image_left;
+
+	if(rctx->bytes_per_pixel==1) {
+		// Palette image. Illegal palette indices are handled by the palette
+		// that we give to IW. See iwgif_make_palette().
+		memcpy(ptr,idx,(size_t)npixels);
+		return;
+	}
+
+	entry = rctx->colortable.entry;
+	num_entries = (unsigned int)rctx->colortable.num_entries;
+
+	if(rctx->bytes_per_pixel==4) {
+		for(i=0;i<npixels;i++) {
+			coloridx = (unsigned int)idx[i];
+			if(coloridx<num_entries) { // Skip illegal palette indices
+				ptr[4*i+0]=entry[coloridx].r;
+				ptr[4*i+1]=entry[coloridx].g;
+				ptr[4*i+2]=entry[coloridx].b;
+				ptr[4*i+3]=entry[coloridx].a;
+			}
+		}
 	}
 	else {
-		return; // Illegal palette index
+		for(i=0;i<npixels;i++) {
+			coloridx = (unsigned int)idx[i];
+			if(coloridx<num_entries) {
+				ptr[3*i+0]=entry[coloridx].r;
+				ptr[3*i+1]=entry[coloridx].g;
+				ptr[3*i+2]=entry[coloridx].b;
+			}
+		}
 	}
+}
 
-	// Set the pixel.
+// Convert the complete rows in the index buffer to colors, and remove them
+// from the buffer. If 'final' is set, also convert any partial row at the end.
+static void iwgif_flush_idxbuf(struct iwgifrcontext *rctx, int final)
+{
+	size_t npixels;
+	size_t nrows;
+	size_t firstrow;
+	size_t j;
+	size_t w;
+
+	w = (size_t)rctx->image_width;
+	npixels = rctx->pixels_set;
+	if(npixels > rctx->total_npixels) npixels = rctx->total_npixels;
+	npixels -= rctx->idxbuf_start;
+	nrows = npixels/w;
+	firstrow = rctx->idxbuf_start/w;
+
+	for(j=0;j<nrows;j++) {
+		iwgif_expand_row(rctx,&rctx->idxbuf[j*w],firstrow+j,rctx->image_width);
+	}
+
+	if(final) {
+		if(npixels>nrows*w) {
+			iwgif_expand_row(rctx,&rctx->idxbuf[nrows*w],firstrow+nrows,
+				(int)(npixels-nrows*w));
+		}
+		rctx->idxbuf_start += npixels;
+		return;
+	}
 
-	ptr = &rctx->row_pointers[yi][rctx->bytes_per_pixel*xi];
-	ptr[0]=r; ptr[1]=g; ptr[2]=b;
-	if(img->imgtype==IW_IMGTYPE_RGBA) {
-		ptr[3]=a;
+	// Move the partial row to the start of the buffer.
+	if(nrows>0) {
+		memmove(rctx->idxbuf,&rctx->idxbuf[nrows*w],npixels-nrows*w);
+		rctx->idxbuf_start += nrows*w;
 	}
 }
 
@@ -302,22 +348,44 @@ static void lzw_clear(struct lzwdeccontext *d)
 	d->oldcode=0;
 }
 
-// Decode an LZW code to one or more pixels, and record it in the image.
+// Decode an LZW code to one or more palette indices, and record them in the
+// index buffer.
 static void lzw_emit_code(struct iwgifrcontext *rctx, struct lzwdeccontext *d,
 		unsigned int first_code)
 {
 	unsigned int code;
+	size_t length;
+	size_t n;
+	iw_byte *ptr;
+
 	code = first_code;
+	length = (size_t)d->ct[code].length;
 
-	// An LZW code may decode to more than one pixel. Note that the pixels for
-	// an LZW code are decoded in reverse order (right to left).
+	if(rctx->pixels_set < rctx->total_npixels) {
+		// Ignore any pixels past the end of the image.
+		n = rctx->total_npixels - rctx->pixels_set;
+		if(n>length) n=length;
 
-	while(1) {
-		iwgif_record_pixel(rctx, (unsigned int)d->ct[code].lastchar, (int)(d->ct[code].length-1));
-		if(d->ct[code].length<=1) break;
-		// The codes are structured as a "forest" (multiple trees).
-		// Go to the parent code, which will have a length 1 less than this one.
-		code = (unsigned int)d->ct[code].parent;
+		// Make sure the string will fit in the buffer. This always makes room,
+		// because the buffer is at least one row larger than the longest string.
+		if(rctx->pixels_set - rctx->idxbuf_start + n > rctx->idxbuf_alloc) {
+			iwgif_flush_idxbuf(rctx,0);
+		}
+
+		// The codes are structured as a "forest" (multiple trees). Each parent
+		// code has a length 1 less than its child, so the pixels for a code are
+		// found in reverse order (right to left). Write them straight to their
+		// final positions, skipping any that were past the end of the image.
+		while(length>n) {
+			code = (unsigned int)d->ct[code].parent;
+			length--;
+		}
+		ptr = &rctx->idxbuf[rctx->pixels_set - rctx->idxbuf_start + n];
+		while(n>0) {
+			*(--ptr) = d->ct[code].lastchar;
+			code = (unsigned int)d->ct[code].parent;
+			n--;
+		}
 	}
 
 	// Track the total number of pixels decoded in this image.
@@ -426,36 +494,33 @@ static int lzw_process_code(struct iwgifrcontext *rctx, struct lzwdeccontext *d,
 // Any unfinished business is recorded, to be continued the next time
 // this function is called.
 static int lzw_process_bytes(struct iwgifrcontext *rctx, struct lzwdeccontext *d,
-	iw_byte *data, size_t data_size)
+	const iw_byte *data, size_t data_size)
 {
 	size_t i;
-	int b;
-	int retval=0;
+	unsigned int codesize;
+	unsigned int code;
 
 	for(i=0;i<data_size;i++) {
-		// Look at the bits one at a time.
-		for(b=0;b<8;b++) {
-			if(d->eoi_flag) { // Stop if we've seen an EOI (end of image) code.
-				retval=1;
-				goto done;
-			}
-
-			if(data[i]&(1<<b))
-				d->pending_code |= 1<<d->bits_in_pending_code;
-			d->bits_in_pending_code++;
+		if(d->eoi_flag) { // Stop if we've seen an EOI (end of image) code.
+			return 1;
+		}
 
-			// When we get enough bits to form a complete LZW code, process it.
-			if(d->bits_in_pending_code >= d->current_codesize) {
-				if(!lzw_process_code(rctx,d,d->pending_code)) goto done;
-				d->pending_code=0;
-				d->bits_in_pending_code=0;
-			}
+		// Append the byte's bits to the pending bits. Codes are packed
+		// starting with the least-significant bit.
+		d->pending_code |= ((unsigned int)data[i])<<d->bits_in_pending_code;
+		d->bits_in_pending_code += 8;
+
+		// Process all the complete LZW codes we have. Processing a code can
+		// change the code size, so check it each time.
+		while(!d->eoi_flag && d->bits_in_pending_code >= d->current_codesize) {
+			codesize = d->current_codesize;
+			code = d->pending_code & ((1U<<codesize)-1);
+			d->pending_code >>= codesize;
+			d->bits_in_pending_code -= codesize;
+			if(!lzw_process_code(rctx,d,code)) return 0;
 		}
 	}
-	retval=1;
-
-done:
-	return retval;
+	return 1;
 }
 
 ////////////////////////////////////////////////////////
@@ -498,13 +563,15 @@ static int iwgif_init_screen(struct iwgifrcontext *rctx)
 	}
 
 	// Allocate IW image
-	if(rctx->has_transparency || bg_visible) {
-		rctx->bytes_per_pixel=4;
-		img->imgtype = IW_IMGTYPE_RGBA;
+	if(!bg_visible) {
+		// Every pixel comes from the GIF image, so we can store the palette
+		// indices, and let IW read the colors from the palette.
+		rctx->bytes_per_pixel=1;
+		img->imgtype = IW_IMGTYPE_PALETTE;
 	}
 	else {
-		rctx->bytes_per_pixel=3;
-		img->imgtype = IW_IMGTYPE_RGB;
+		rctx->bytes_per_pixel=4;
+		img->imgtype = IW_IMGTYPE_RGBA;
 	}
 	img->bit_depth = 8;
 	img->bpr = rctx->bytes_per_pixel * img->width;
@@ -513,7 +580,11 @@ static int iwgif_init_screen(struct iwgifrcontext *rctx)
 	if(!img->pixels) goto done;
 
 	// Start by clearing the screen to black, or transparent black.
-	iw_zeromem(img->pixels,img->bpr*img->height);
+	// (Palette images don't need this. Every pixel will be set, unless the
+	// image is truncated, and then iwgif_convert_to_rgb() handles it.)
+	if(rctx->bytes_per_pixel>1) {
+		iw_zeromem(img->pixels,img->bpr*img->height);
+	}
 
 	retval=1;
 done:
@@ -609,13 +680,100 @@ done:
 	return retval;
 }
 
+// Make the palette to give to IW: the color table, padded to 256 entries.
+// The padding entries (used by illegal palette indices) are the same color
+// that the screen is initialized to.
+static void iwgif_make_palette(struct iwgifrcontext *rctx, struct iw_palette *pal)
+{
+	int i;
+
+	for(i=0;i<256;i++) {
+		if(i<rctx->colortable.num_entries) {
+			pal->entry[i] = rctx->colortable.entry[i];
+		}
+		else {
+			pal->entry[i].r = pal->entry[i].g = pal->entry[i].b = 0;
+			pal->entry[i].a = rctx->has_transparency ? 0 : 255;
+		}
+	}
+	pal->num_entries = 256;
+}
+
+// If the image ended early, the pixels that weren't decoded should be
+// black (or transparent black), which may not be in the palette. In that case,
+// convert the image from palette indices to colors.
+static int iwgif_convert_to_rgb(struct iwgifrcontext *rctx)
+{
+	struct iw_image *img;
+	struct iw_palette pal;
+	iw_byte *newpixels;
+	size_t newbpr;
+	int nc;
+	int row;
+	int i, k;
+	int y;
+	size_t npixels;
+	size_t rowstart;
+	int rowsize;
+	const iw_byte *src;
+	iw_byte *dst;
+	const struct iw_rgba8color *c;
+
+	img = rctx->img;
+	nc = rctx->has_transparency ? 4 : 3;
+	iwgif_make_palette(rctx,&pal);
+
+	newbpr = (size_t)nc * img->width;
+	newpixels = (iw_byte*)iw_malloc_large(rctx->ctx, newbpr, img->height);
+	if(!newpixels) return 0;
+	iw_zeromem(newpixels,newbpr*img->height);
+
+	npixels = rctx->pixels_set;
+	if(npixels > rctx->total_npixels) npixels = rctx->total_npixels;
+
+	// The image is positioned at (0,0), but may extend past the right edge of
+	// the screen.
+	rowsize = rctx->image_width;
+	if(rowsize > rctx->screen_width) rowsize = rctx->screen_width;
+
+	// Only the first npixels pixels, in the order they were decoded, are valid.
+	for(row=0;row<rctx->image_height;row++) {
+		rowstart = (size_t)row * (size_t)rctx->image_width;
+		if(rowstart >= npixels) break;
+		if(!rctx->row_pointers[row]) continue;
+
+		y = (int)((rctx->row_pointers[row] - img->pixels)/img->bpr);
+		src = rctx->row_pointers[row];
+		dst = &newpixels[y*newbpr];
+		for(i=0;i<rowsize && rowstart+(size_t)i<npixels;i++) {
+			c = &pal.entry[src[i]];
+			dst[i*nc+0] = c->r;
+			dst[i*nc+1] = c->g;
+			dst[i*nc+2] = c->b;
+			if(nc==4) dst[i*nc+3] = c->a;
+		}
+	}
+
+	iw_free(rctx->ctx,img->pixels);
+	img->pixels = newpixels;
+	img->bpr = newbpr;
+	img->imgtype = (nc==4) ? IW_IMGTYPE_RGBA : IW_IMGTYPE_RGB;
+	rctx->bytes_per_pixel = nc;
+	for(k=0;k<rctx->image_height;k++) {
+		rctx->row_pointers[k] = NULL;
+	}
+	return 1;
+}
+
 static int iwgif_read_image(struct iwgifrcontext *rctx)
 {
 	int retval=0;
 	struct lzwdeccontext d;
 	size_t subblocksize;
+	const iw_byte *subblock;
 	int has_local_ct;
 	int local_ct_size;
+	size_t idxbuf_rows;
 
 	unsigned int root_codesize;
 
@@ -675,6 +833,16 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 
 	if(!iwgif_make_row_pointers(rctx)) goto done;
 
+	// Make the index buffer big enough for some number of rows, plus the
+	// longest possible LZW string.
+	idxbuf_rows = IWGIF_IDXBUF_SIZE/(size_t)rctx->image_width;
+	if(idxbuf_rows<1) idxbuf_rows=1;
+	if(idxbuf_rows>(size_t)rctx->image_height) idxbuf_rows=(size_t)rctx->image_height;
+	rctx->idxbuf_alloc = idxbuf_rows*(size_t)rctx->image_width + 4096;
+	rctx->idxbuf = (iw_byte*)iw_malloc(rctx->ctx,rctx->idxbuf_alloc);
+	if(!rctx->idxbuf) goto done;
+	rctx->idxbuf_start = 0;
+
 	lzw_init(&d,root_codesize);
 	lzw_clear(&d);
 
@@ -684,9 +852,11 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 		subblocksize = (size_t)rctx->rbuf[0];
 		if(subblocksize==0) break;
 
-		// Read next subblock
-		if(!iwgif_read(rctx,rctx->rbuf,subblocksize)) goto done;
-		if(!lzw_process_bytes(rctx,&d,rctx->rbuf,subblocksize)) goto done;
+		// Decode the next subblock, straight from the read buffer.
+		subblock = iw_bufreader_peek(&rctx->br,subblocksize);
+		if(!subblock) goto done;
+		if(!lzw_process_bytes(rctx,&d,subblock,subblocksize)) goto done;
+		if(!iw_bufreader_skip(&rctx->br,subblocksize)) goto done;
 
 		if(d.eoi_flag) break;
 
@@ -695,6 +865,12 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 		if(rctx->pixels_set >= rctx->total_npixels) break;
 	}
 
+	iwgif_flush_idxbuf(rctx,1);
+
+	if(rctx->bytes_per_pixel==1 && rctx->pixels_set < rctx->total_npixels) {
+		if(!iwgif_convert_to_rgb(rctx)) goto done;
+	}
+
 	retval=1;
 
 done:
@@ -781,6 +957,7 @@ IW_IMPL(int) iw_read_gif_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	rctx->ctx = ctx;
 	rctx->iodescr = iodescr;
 	rctx->img = &img;
+	if(!iw_bufreader_init(ctx,&rctx->br,iodescr)) goto done;
 
 	// Assume GIF images are sRGB.
 	iw_make_srgb_csdescr_2(&rctx->csdescr);
@@ -794,6 +971,11 @@ IW_IMPL(int) iw_read_gif_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 		goto done;
 
 	iw_set_input_image(ctx, &img);
+	if(img.imgtype==IW_IMGTYPE_PALETTE) {
+		struct iw_palette pal;
+		iwgif_make_palette(rctx,&pal);
+		iw_set_input_palette(ctx,&pal);
+	}
 
 	iw_set_input_colorspace(ctx,&rctx->csdescr);
 
@@ -809,6 +991,8 @@ done:
 
 	if(rctx) {
 		if(rctx->row_pointers) iw_free(ctx,rctx->row_pointers);
+		if(rctx->idxbuf) iw_free(ctx,rctx->idxbuf);
+		iw_bufreader_done(&rctx->br);
 		iw_free(ctx,rctx);
 	}
 
@@ -26,6 +26,12 @@ typedef double iw_tmpsample;
 #define IW_DEFAULT_MAX_MALLOC 2000000000
 #endif
 
+#define IW_MAX_THREADS 64
+
+// The maximum size, in bytes, of the buffer of input rows used when doing
+// the vertical resize a row at a time, or processing a channel in one pass.
+#define IW_MAX_ROW_WINDOW_SIZE 100000000
+
 #define IW_BKGD_STRATEGY_EARLY 1 // Apply background before resizing
 #define IW_BKGD_STRATEGY_LATE  2 // Apply background after resizing
 
@@ -34,21 +40,43 @@ typedef double iw_tmpsample;
 
 struct iw_rr_ctx; // "resize rows" state; see imagew-resize.c.
 
+struct iw_context;
+
+// Reads raw samples from the input image, starting at physical coordinates
+// (rx,ry), and moving by (drx,dry) each time. See imagew-main.c.
+typedef void (*iw_getrawsamplesfn_type)(struct iw_context *ctx, int rx, int ry,
+	int drx, int dry, int count, int channel, unsigned int *dst);
+
 // "Raw" settings from the application.
 struct iw_resize_settings {
 	int family;
+	int auto_family; // Set if .family was IW_RESIZETYPE_AUTO before we chose one.
 	int edge_policy;
 	int use_offset;
 	int disable_rrctx_cache;
 	double param1; // 'B' in Mitchell-Netravali cubics. "lobes" in Lanczos, etc.
 	double param2; // 'C' in Mitchell-Netravali cubics.
 	double blur_factor;
+	// The part of the input pixels that the input image occupies, if not all
+	// of them. in_true_size=0 means all.
+	double in_true_size;
+	double in_true_start;
 	double out_true_size; // Size onto which to map the input image.
 	double translate; // Amount to move the image, before applying any channel offsets.
 	double channel_offset[3]; // Indexed by IW_CHANNELTYPE_[Red..Blue]
 	struct iw_rr_ctx *rrctx;
 };
 
+// Records what a color correction table was made for, so that it can be
+// reused for the next image. See iw_reset_context().
+struct iw_corr_table_info {
+	int bit_depth;
+	struct iw_csdescr cs;
+};
+
+// The number of resize contexts to keep for reuse.
+#define IW_RRCTX_CACHE_SIZE 8
+
 struct iw_channelinfo_in {
 	int channeltype;
 	int disable_fast_get_sample;
@@ -187,6 +215,18 @@ struct iw_context {
 
 	struct iw_image img1;
 	struct iw_csdescr img1cs;
+	// Set if the input image was decoded at a reduced size that doesn't
+	// evenly divide the original size.
+	int img1_true_valid;
+	double img1_true_width, img1_true_height;
+	// Set if img1 contains only part of the full image (see
+	// iw_set_input_region()).
+	int img1_region_valid;
+	int img1_region_x, img1_region_y;
+	int img1_full_width, img1_full_height;
+	// The palette, if img1 is of type IW_IMGTYPE_PALETTE. Always has 256
+	// entries.
+	struct iw_palette *img1_palette;
 	int img1_imgtype_logical;
 
 	int img1_numchannels_physical;
@@ -205,6 +245,7 @@ struct iw_context {
 	int intermed_canvas_width, intermed_canvas_height;
 
 	struct iw_image img2;
+	size_t img2_pixels_size; // Allocated size of img2.pixels
 	struct iw_csdescr img2cs;
 	struct iw_channelinfo_out img2_ci[IW_CI_COUNT];
 	int img2_numchannels;
@@ -217,6 +258,11 @@ struct iw_context {
 	// Indexed by IW_DIMENSION_*.
 	struct iw_resize_settings resize_settings[2];
 
+	// Resize contexts that we're done with, most recently used first. They
+	// are kept until the context is destroyed, so that they can be reused by
+	// later channels, and by later images (see iw_reset_context()).
+	struct iw_rr_ctx *rrctx_cache[IW_RRCTX_CACHE_SIZE];
+
 	int to_grayscale;
 
 	int apply_bkgd; // 1 = We will be applying a background color.
@@ -243,6 +289,10 @@ struct iw_context {
 
 	int support_reduced_input_bitdepths;
 
+	// Used to read integer samples from the input image, a row or column at
+	// a time. Depends on the input bit depth.
+	iw_getrawsamplesfn_type get_raw_samples_fn;
+
 	int disable_output_lookup_tables;
 	int reduced_output_maxcolor_flag;  // Are there any reduced output maxcolorcodes?
 
@@ -282,14 +332,33 @@ struct iw_context {
 
 	// Color correction tables, to improve performance.
 	double *input_color_corr_table;
+	struct iw_corr_table_info input_color_corr_table_info;
 	// This is not for converting linear to the output colorspace; it's the
 	// same as input_color_corr_table except that it might have a different
 	// number of entries, and might be for a different colorspace.
 	double *output_rev_color_corr_table;
+	int output_rev_color_corr_table_nentries;
+	struct iw_corr_table_info output_rev_color_corr_table_info;
 
 	double *nearest_color_table;
+	int nearest_color_table_nentries;
+	struct iw_corr_table_info nearest_color_table_info;
+
+	// Indexes that make it fast to search the above tables.
+	// See iw_make_lookup_index().
+	int lookup_index_nbuckets;
+	int *output_rev_index;
+	int *nearest_color_index;
 
 	struct iw_zlib_module *zlib_module;
+
+	int max_threads; // IW_VAL_MAX_THREADS
+	int no_simd; // IW_VAL_NO_SIMD
+	int resize_order_req; // IW_VAL_RESIZE_ORDER
+	int resize_order; // IW_RESIZE_ORDER_[V_FIRST|H_FIRST]: The order we're using.
+	int no_streaming; // IW_VAL_NO_STREAMING
+	int decode_width_hint; // IW_VAL_DECODE_WIDTH_HINT
+	int decode_height_hint; // IW_VAL_DECODE_HEIGHT_HINT
 };
 
 // Defined imagew-util.c
@@ -301,12 +370,18 @@ int iwpvt_util_randomize(struct iw_prng *prng); // Returns the random seed that
 void* iwpvt_default_malloc(void *userdata, unsigned int flags, size_t n);
 void iwpvt_default_free(void *userdata, void *mem);
 char* iwpvt_strdup_dbl(struct iw_context *ctx, double n);
+void iwpvt_clamp_crop(int full_w, int full_h, int *px, int *py, int *pw, int *ph);
 
 // Defined in imagew-resize.c
 struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
   struct iw_resize_settings *rs, int channeltype, int num_in_pix, int num_out_pix);
+int iwpvt_resize_rows_is_reusable(struct iw_rr_ctx *rrctx, struct iw_context *ctx,
+  struct iw_resize_settings *rs, int channeltype, int num_in_pix, int num_out_pix);
 void iwpvt_resize_rows_done(struct iw_rr_ctx *rrctx);
 void iwpvt_resize_row_main(struct iw_rr_ctx *rrctx, iw_tmpsample *in_pix, iw_tmpsample *out_pix);
+int iwpvt_resize_max_contribs(struct iw_rr_ctx *rrctx);
+int iwpvt_resize_get_contribs(struct iw_rr_ctx *rrctx, int out_pix,
+	int *src_pix, double *weight);
 
 // Defined in imagew-opt.c
-void iwpvt_optimize_image(struct iw_context *ctx);
+int iwpvt_optimize_image(struct iw_context *ctx);
@@ -22,6 +22,14 @@
 #error "Wrong JSAMPLE size"
 #endif
 
+// libjpeg-turbo 1.5 and later can decode just part of each row, and can skip
+// rows without fully decoding them.
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER>=1005000
+#define IWJPEG_CROP_SUPPORTED 1
+#else
+#define IWJPEG_CROP_SUPPORTED 0
+#endif
+
 struct my_error_mgr {
 	struct jpeg_error_mgr pub;
 	jmp_buf setjmp_buffer;
@@ -287,9 +295,59 @@ static void handle_exif_density(struct iwjpegrcontext *rctx, struct iw_image *im
 	}
 }
 
+static const unsigned int exif_orient_to_transform[9] =
+   { 0,0, 1,3,2,4,5,7,6 };
+
+// Choose the scale (1/1, 1/2, 1/4, or 1/8) at which to decode the image,
+// based on the caller's size hints. Returns the denominator.
+// The reduced image must still be at least twice the size of the hint, so
+// that most of the reduction is done by IW's resampling filter, not by
+// libjpeg's.
+static unsigned int iwjpeg_choose_scale_denom(struct iw_context *ctx,
+	struct iwjpegrcontext *rctx, struct jpeg_decompress_struct *cinfo)
+{
+	unsigned int d;
+	unsigned int t = 0;
+	unsigned int w, h;
+	int hint_w, hint_h;
+
+	if(rctx->exif_orientation>=2 && rctx->exif_orientation<=8)
+		t = exif_orient_to_transform[rctx->exif_orientation];
+
+	// The hints are for the image after it is reoriented.
+	if(t&0x4) {
+		hint_w = iw_get_value(ctx,IW_VAL_DECODE_HEIGHT_HINT);
+		hint_h = iw_get_value(ctx,IW_VAL_DECODE_WIDTH_HINT);
+	}
+	else {
+		hint_w = iw_get_value(ctx,IW_VAL_DECODE_WIDTH_HINT);
+		hint_h = iw_get_value(ctx,IW_VAL_DECODE_HEIGHT_HINT);
+	}
+	if(hint_w<=0 && hint_h<=0) return 1;
+
+	w = cinfo->image_width;
+	h = cinfo->image_height;
+
+	for(d=8; d>=2; d/=2) {
+		if(hint_w>0 && (double)w/d < 2.0*hint_w) continue;
+		if(hint_h>0 && (double)h/d < 2.0*hint_h) continue;
+		return d;
+	}
+	return 1;
+}
+
 static void my_init_source_fn(j_decompress_ptr cinfo)
 {
 	struct iwjpegrcontext *rctx = (struct iwjpegrcontext*)cinfo->src;
+	struct iw_iodescr *iodescr = rctx->iodescr;
+
+	if(iodescr->mem) {
+		// The whole file is in memory, so let libjpeg read it from there.
+		rctx->pub.next_input_byte = &iodescr->mem[iodescr->mem_pos];
+		rctx->pub.bytes_in_buffer = iodescr->mem_size - iodescr->mem_pos;
+		iodescr->mem_pos = iodescr->mem_size;
+		return;
+	}
 	rctx->pub.next_input_byte = rctx->buffer;
 	rctx->pub.bytes_in_buffer = 0;
 }
@@ -366,26 +424,41 @@ static void my_term_source_fn(j_decompress_ptr cinfo)
 {
 }
 
-static void convert_cmyk_to_rbg(struct iw_context *ctx, const JSAMPLE *src,
+// Each of the R, G, B samples depends only on the corresponding C, M, or Y
+// sample, and on K. So we can convert with a 256x256 table, indexed by
+// (K<<8)|C, etc.
+static JSAMPLE *make_cmyk_table(struct iw_context *ctx)
+{
+	JSAMPLE *tbl;
+	int s, k_s;
+	double c, k, r;
+
+	tbl = (JSAMPLE*)iw_malloc(ctx,256*256);
+	if(!tbl) return NULL;
+
+	for(k_s=0;k_s<256;k_s++) {
+		k = 1.0 - ((double)k_s)/255.0;
+		for(s=0;s<256;s++) {
+			c = 1.0 - ((double)s)/255.0;
+			r = 1.0 - c*(1.0-k) - k;
+			if(r<0.0) r=0.0; if(r>1.0) r=1.0;
+			tbl[(k_s<<8)|s] = (JSAMPLE)(0.5+255.0*r);
+		}
+	}
+	return tbl;
+}
+
+static void convert_cmyk_to_rbg(const JSAMPLE *tbl, const JSAMPLE *src,
 	JSAMPLE *dst, int npixels)
 {
 	int i;
-	double c, m, y, k, r, g, b;
+	const JSAMPLE *t;
 
 	for(i=0;i<npixels;i++) {
-		c = 1.0 - ((double)src[4*i+0])/255.0;
-		m = 1.0 - ((double)src[4*i+1])/255.0;
-		y = 1.0 - ((double)src[4*i+2])/255.0;
-		k = 1.0 - ((double)src[4*i+3])/255.0;
-		r = 1.0 - c*(1.0-k) - k;
-		g = 1.0 - m*(1.0-k) - k;
-		b = 1.0 - y*(1.0-k) - k;
-		if(r<0.0) r=0.0; if(r>1.0) r=1.0;
-		if(g<0.0) g=0.0; if(g>1.0) g=1.0;
-		if(b<0.0) b=0.0; if(b>1.0) b=1.0;
-		dst[3*i+0] = (JSAMPLE)(0.5+255.0*r);
-		dst[3*i+1] = (JSAMPLE)(0.5+255.0*g);
-		dst[3*i+2] = (JSAMPLE)(0.5+255.0*b);
+		t = &tbl[((unsigned int)src[4*i+3])<<8];
+		dst[3*i+0] = t[src[4*i+0]];
+		dst[3*i+1] = t[src[4*i+1]];
+		dst[3*i+2] = t[src[4*i+2]];
 	}
 }
 
@@ -397,12 +470,24 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 	int cinfo_valid=0;
 	int colorspace;
 	JDIMENSION rownum;
-	JSAMPLE *jsamprow;
+	JDIMENSION nrows;
+	JDIMENSION first_row, end_row;
+#if IWJPEG_CROP_SUPPORTED
+	JDIMENSION crop_x, crop_w;
+	int margin;
+#endif
+	int rgn_x, rgn_y, rgn_w, rgn_h;
+	int use_region = 0;
+	JDIMENSION batch_rows = 1;
+	JDIMENSION i;
+	JSAMPARRAY rowptrs = NULL;
 	int numchannels=0;
 	struct iw_image img;
 	struct iwjpegrcontext rctx;
-	JSAMPLE *tmprow = NULL;
+	JSAMPLE *tmprows = NULL;
+	JSAMPLE *cmyk_tbl = NULL;
 	int cmyk_flag = 0;
+	unsigned int scale_denom;
 	int ret;
 
 	iw_zeromem(&img,sizeof(struct iw_image));
@@ -463,6 +548,14 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 
 	iwjpeg_read_saved_markers(&rctx,&cinfo);
 
+	// If the caller only needs a much smaller image, let libjpeg reduce it
+	// while decoding. This is far faster than decoding the full image.
+	scale_denom = iwjpeg_choose_scale_denom(ctx,&rctx,&cinfo);
+	if(scale_denom>1) {
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = scale_denom;
+	}
+
 	jpeg_start_decompress(&cinfo);
 
 	colorspace=cinfo.out_color_space;
@@ -489,12 +582,45 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 		goto done;
 	}
 
-	img.width = cinfo.output_width;
-	img.height = cinfo.output_height;
-	if(!iw_check_image_dimensions(ctx,img.width,img.height)) {
+	if(!iw_check_image_dimensions(ctx,cinfo.output_width,cinfo.output_height)) {
 		goto done;
 	}
 
+	// If only part of the image is needed, decode only the rows it covers,
+	// and (if libjpeg supports it) only the columns it covers. This isn't
+	// attempted if the image is to be reduced or reoriented, since the crop
+	// is relative to the final image.
+	rgn_x = 0;
+	rgn_y = 0;
+	rgn_w = (int)cinfo.output_width;
+	rgn_h = (int)cinfo.output_height;
+	if(scale_denom==1 &&
+		!(rctx.exif_orientation>=2 && rctx.exif_orientation<=8) &&
+		iw_get_input_region(ctx,rgn_w,rgn_h,&rgn_x,&rgn_y,&rgn_w,&rgn_h))
+	{
+		use_region = 1;
+#if IWJPEG_CROP_SUPPORTED
+		// Upsampled color samples near the edges of a cropped row can differ
+		// from those in the full row, so widen the region by a few pixels.
+		// libjpeg may widen it further, to align it with the image's blocks.
+		margin = cinfo.max_h_samp_factor;
+		crop_x = (JDIMENSION)(rgn_x>margin ? rgn_x-margin : 0);
+		crop_w = (JDIMENSION)(rgn_x+rgn_w+margin) - crop_x;
+		if(crop_x+crop_w > cinfo.output_width) crop_w = cinfo.output_width - crop_x;
+		jpeg_crop_scanline(&cinfo,&crop_x,&crop_w);
+		rgn_x = (int)crop_x;
+		rgn_w = (int)crop_w;
+#else
+		rgn_x = 0;
+		rgn_w = (int)cinfo.output_width;
+#endif
+	}
+	first_row = (JDIMENSION)rgn_y;
+	end_row = (JDIMENSION)(rgn_y+rgn_h);
+
+	img.width = rgn_w;
+	img.height = rgn_h;
+
 	img.bit_depth = 8;
 	img.bpr = iw_calc_bytesperrow(img.width,img.bit_depth*numchannels);
 
@@ -504,39 +630,105 @@ IW_IMPL(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 	}
 
 	if(cmyk_flag) {
-		tmprow = iw_malloc(ctx,4*img.width);
-		if(!tmprow) goto done;
+		// Read batches of rows into tmprows, then convert them and copy
+		// to img.pixels.
+		batch_rows = (JDIMENSION)cinfo.rec_outbuf_height;
+		if(batch_rows<1) batch_rows=1;
+		tmprows = iw_malloc_large(ctx,4*img.width,batch_rows);
+		if(!tmprows) goto done;
+		cmyk_tbl = make_cmyk_table(ctx);
+		if(!cmyk_tbl) goto done;
+		rowptrs = (JSAMPARRAY)iw_malloc(ctx,batch_rows*sizeof(JSAMPROW));
+		if(!rowptrs) goto done;
+		for(i=0;i<batch_rows;i++) {
+			rowptrs[i] = &tmprows[(size_t)i*4*img.width];
+		}
+	}
+	else {
+		// Read directly into img.pixels, as many rows at a time as libjpeg
+		// wants to give us.
+		rowptrs = (JSAMPARRAY)iw_malloc_large(ctx,img.height,sizeof(JSAMPROW));
+		if(!rowptrs) goto done;
+		for(i=0;i<(JDIMENSION)img.height;i++) {
+			rowptrs[i] = &img.pixels[img.bpr * i];
+		}
+	}
+
+	if(first_row>0) {
+#if IWJPEG_CROP_SUPPORTED
+		if(jpeg_skip_scanlines(&cinfo,first_row)!=first_row) {
+			iw_set_error(ctx,"Error reading JPEG file");
+			goto done;
+		}
+#else
+		// Decode the unneeded rows into the first row of the image, which
+		// will be overwritten later.
+		while(cinfo.output_scanline < first_row) {
+			rownum=cinfo.output_scanline;
+			jpeg_read_scanlines(&cinfo, rowptrs, 1);
+			if(cinfo.output_scanline<=rownum) {
+				iw_set_error(ctx,"Error reading JPEG file");
+				goto done;
+			}
+		}
+#endif
 	}
 
-	while(cinfo.output_scanline < cinfo.output_height) {
-		rownum=cinfo.output_scanline;
-		jsamprow = &img.pixels[img.bpr * rownum];
+	while(cinfo.output_scanline < end_row) {
+		rownum=cinfo.output_scanline-first_row;
 		if(cmyk_flag) {
-			// read into tmprow, then convert and copy to img.pixels
-			jpeg_read_scanlines(&cinfo, &tmprow, 1);
-			convert_cmyk_to_rbg(ctx,tmprow,jsamprow,img.width);
+			nrows = end_row-cinfo.output_scanline;
+			if(nrows>batch_rows) nrows=batch_rows;
+			nrows = jpeg_read_scanlines(&cinfo, rowptrs, nrows);
+			for(i=0;i<nrows;i++) {
+				convert_cmyk_to_rbg(cmyk_tbl,rowptrs[i],
+					&img.pixels[img.bpr * (rownum+i)],img.width);
+			}
 		}
 		else {
-			// read directly into img.pixels
-			jpeg_read_scanlines(&cinfo, &jsamprow, 1);
+			jpeg_read_scanlines(&cinfo, &rowptrs[rownum],
+				end_row-cinfo.output_scanline);
 		}
-		if(cinfo.output_scanline<=rownum) {
+		if(cinfo.output_scanline-first_row<=rownum) {
 			iw_set_error(ctx,"Error reading JPEG file");
 			goto done;
 		}
 	}
-	jpeg_finish_decompress(&cinfo);
+	if(cinfo.output_scanline < cinfo.output_height) {
+		// We don't need the rest of the image.
+		jpeg_abort_decompress(&cinfo);
+	}
+	else {
+		jpeg_finish_decompress(&cinfo);
+	}
 
 	handle_exif_density(&rctx, &img);
 
+	if(scale_denom>1 && img.density_code!=IW_DENSITY_UNKNOWN) {
+		img.density_x /= (double)scale_denom;
+		img.density_y /= (double)scale_denom;
+	}
+
 	iw_set_input_image(ctx, &img);
 	// The contents of img no longer belong to us.
 	img.pixels = NULL;
 
-	if(rctx.exif_orientation>=2 && rctx.exif_orientation<=8) {
-		static const unsigned int exif_orient_to_transform[9] =
-		   { 0,0, 1,3,2,4,5,7,6 };
+	if(use_region) {
+		iw_set_input_region(ctx,rgn_x,rgn_y,(int)cinfo.image_width,
+			(int)cinfo.image_height);
+	}
+
+	if(scale_denom>1 && ((cinfo.image_width%scale_denom) ||
+		(cinfo.image_height%scale_denom)))
+	{
+		// libjpeg rounded the size up, so the last pixel in a row or column
+		// is only partly part of the image.
+		iw_set_input_true_size(ctx,
+			((double)cinfo.image_width)/scale_denom,
+			((double)cinfo.image_height)/scale_denom);
+	}
 
+	if(rctx.exif_orientation>=2 && rctx.exif_orientation<=8) {
 		// An Exif marker indicated an unusual image orientation.
 
 		if(rctx.is_jfif) {
@@ -554,12 +746,17 @@ done:
 	iw_free(ctx, img.pixels);
 	if(cinfo_valid) jpeg_destroy_decompress(&cinfo);
 	if(rctx.buffer) iw_free(ctx,rctx.buffer);
-	if(tmprow) iw_free(ctx,tmprow);
+	if(tmprows) iw_free(ctx,tmprows);
+	if(cmyk_tbl) iw_free(ctx,cmyk_tbl);
+	if(rowptrs) iw_free(ctx,rowptrs);
 	return retval;
 }
 
 ////////////////////////////////////
 
+// The number of rows to give libjpeg per call to jpeg_write_scanlines().
+#define IWJPEG_WRITE_STRIP_ROWS 16
+
 struct iwjpegwcontext {
 	struct jpeg_destination_mgr pub; // This field must be first.
 	struct iw_context *ctx;
@@ -640,9 +837,10 @@ IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iode
 	int jpeg_cmpts;
 	int compress_created = 0;
 	int compress_started = 0;
-	JSAMPROW *row_pointers = NULL;
+	JSAMPROW row_pointers[IWJPEG_WRITE_STRIP_ROWS];
 	int is_grayscale;
 	int j;
+	int nrows;
 	struct iw_image img;
 	int jpeg_quality;
 	int samp_factor_h, samp_factor_v;
@@ -819,17 +1017,21 @@ IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iode
 		jpeg_simple_progression(&cinfo);
 	}
 
-	row_pointers = (JSAMPROW*)iw_malloc(ctx, img.height * sizeof(JSAMPROW));
-	if(!row_pointers) goto done;
-
-	for(j=0;j<img.height;j++) {
-		row_pointers[j] = &img.pixels[j*img.bpr];
-	}
-
 	jpeg_start_compress(&cinfo, TRUE);
 	compress_started=1;
 
-	jpeg_write_scanlines(&cinfo, row_pointers, img.height);
+	// Hand the rows to libjpeg a strip at a time.
+	while(cinfo.next_scanline < cinfo.image_height) {
+		nrows = (int)(cinfo.image_height - cinfo.next_scanline);
+		if(nrows>IWJPEG_WRITE_STRIP_ROWS) nrows=IWJPEG_WRITE_STRIP_ROWS;
+		for(j=0;j<nrows;j++) {
+			row_pointers[j] = &img.pixels[(size_t)(cinfo.next_scanline+j)*img.bpr];
+		}
+		if(jpeg_write_scanlines(&cinfo, row_pointers, (JDIMENSION)nrows) < 1) {
+			iw_set_error(ctx,"Error writing JPEG file");
+			goto done;
+		}
+	}
 
 	retval=1;
 
@@ -840,8 +1042,6 @@ done:
 	if(compress_created)
 		jpeg_destroy_compress(&cinfo);
 
-	if(row_pointers) iw_free(ctx,row_pointers);
-
 	if(wctx.buffer) iw_free(ctx,wctx.buffer);
 
 	return retval;
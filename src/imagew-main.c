@@ -233,7 +233,34 @@ static IW_INLINE void translate_coords(struct iw_context *ctx,
 	}
 }
 
-// Returns a value from 0 to 2^(ctx->img1.bit_depth)-1.
+// Returns the palette index of the pixel at physical position (rx,ry).
+static IW_INLINE unsigned int get_raw_palette_index(struct iw_context *ctx,
+	int rx, int ry)
+{
+	switch(ctx->img1.bit_depth) {
+	case 8: return get_raw_sample_8(ctx,rx,ry,0);
+	case 1: return get_raw_sample_1(ctx,rx,ry);
+	case 4: return get_raw_sample_4(ctx,rx,ry);
+	case 2: return get_raw_sample_2(ctx,rx,ry);
+	}
+	return 0;
+}
+
+// Returns sample 'channel' (0=red, 1=green, 2=blue, 3=alpha) of a
+// palette color.
+static IW_INLINE unsigned int get_palette_sample(const struct iw_rgba8color *c,
+	int channel)
+{
+	switch(channel) {
+	case 0: return c->r;
+	case 1: return c->g;
+	case 2: return c->b;
+	}
+	return c->a;
+}
+
+// Returns a value from 0 to 2^(ctx->img1.bit_depth)-1, or, for palette
+// images, from 0 to 255.
 // x and y are logical coordinates.
 static unsigned int get_raw_sample_int(struct iw_context *ctx,
 	   int x, int y, int channel)
@@ -242,6 +269,11 @@ static unsigned int get_raw_sample_int(struct iw_context *ctx,
 
 	translate_coords(ctx,x,y,&rx,&ry);
 
+	if(ctx->img1_palette) {
+		return get_palette_sample(&ctx->img1_palette->entry[get_raw_palette_index(ctx,rx,ry)],
+			channel);
+	}
+
 	switch(ctx->img1.bit_depth) {
 	case 8: return get_raw_sample_8(ctx,rx,ry,channel);
 	case 1: return get_raw_sample_1(ctx,rx,ry);
@@ -252,6 +284,104 @@ static unsigned int get_raw_sample_int(struct iw_context *ctx,
 	return 0;
 }
 
+// The get_raw_samples_* functions read 'count' samples of the given input
+// channel into dst, starting at physical position (rx,ry), and moving by
+// (drx,dry) each time. One of them is selected by iw_prepare_processing(),
+// based on the bit depth.
+
+static void get_raw_samples_8(struct iw_context *ctx, int rx, int ry,
+	int drx, int dry, int count, int channel, unsigned int *dst)
+{
+	int i;
+	iw_int64 pos, step;
+	const iw_byte *pixels = ctx->img1.pixels;
+
+	pos = (iw_int64)ry*ctx->img1.bpr + (iw_int64)ctx->img1_numchannels_physical*rx + channel;
+	step = (iw_int64)dry*ctx->img1.bpr + (iw_int64)ctx->img1_numchannels_physical*drx;
+	for(i=0;i<count;i++) {
+		dst[i] = pixels[pos];
+		pos += step;
+	}
+}
+
+static void get_raw_samples_16(struct iw_context *ctx, int rx, int ry,
+	int drx, int dry, int count, int channel, unsigned int *dst)
+{
+	int i;
+	iw_int64 pos, step;
+	const iw_byte *pixels = ctx->img1.pixels;
+
+	pos = (iw_int64)ry*ctx->img1.bpr + ((iw_int64)ctx->img1_numchannels_physical*rx + channel)*2;
+	step = (iw_int64)dry*ctx->img1.bpr + (iw_int64)ctx->img1_numchannels_physical*drx*2;
+	for(i=0;i<count;i++) {
+		dst[i] = (((unsigned int)pixels[pos])<<8) | pixels[pos+1];
+		pos += step;
+	}
+}
+
+static void get_raw_samples_4(struct iw_context *ctx, int rx, int ry,
+	int drx, int dry, int count, int channel, unsigned int *dst)
+{
+	int i;
+	for(i=0;i<count;i++) {
+		dst[i] = get_raw_sample_4(ctx,rx,ry);
+		rx += drx;
+		ry += dry;
+	}
+}
+
+static void get_raw_samples_2(struct iw_context *ctx, int rx, int ry,
+	int drx, int dry, int count, int channel, unsigned int *dst)
+{
+	int i;
+	for(i=0;i<count;i++) {
+		dst[i] = get_raw_sample_2(ctx,rx,ry);
+		rx += drx;
+		ry += dry;
+	}
+}
+
+static void get_raw_samples_1(struct iw_context *ctx, int rx, int ry,
+	int drx, int dry, int count, int channel, unsigned int *dst)
+{
+	int i;
+	for(i=0;i<count;i++) {
+		dst[i] = get_raw_sample_1(ctx,rx,ry);
+		rx += drx;
+		ry += dry;
+	}
+}
+
+static iw_getrawsamplesfn_type iw_choose_get_raw_samples_fn(int bit_depth)
+{
+	switch(bit_depth) {
+	case 8: return get_raw_samples_8;
+	case 16: return get_raw_samples_16;
+	case 4: return get_raw_samples_4;
+	case 2: return get_raw_samples_2;
+	case 1: return get_raw_samples_1;
+	}
+	return NULL;
+}
+
+// Like get_raw_sample_int(), but reads 'count' samples starting at logical
+// position (x,y), going right (or down, if by_col is set).
+static void get_raw_samples_int(struct iw_context *ctx,
+	int x, int y, int by_col, int count, int channel, unsigned int *dst)
+{
+	int rx,ry; // physical coordinates
+	int rx2,ry2; // physical coordinates of the next sample
+
+	// Orientation, and the number of channels, just determine the distance
+	// between one sample and the next.
+	translate_coords(ctx,x,y,&rx,&ry);
+	if(by_col)
+		translate_coords(ctx,x,y+1,&rx2,&ry2);
+	else
+		translate_coords(ctx,x+1,y,&rx2,&ry2);
+	(*ctx->get_raw_samples_fn)(ctx,rx,ry,rx2-rx,ry2-ry,count,channel,dst);
+}
+
 // Channel is the input channel number.
 // x and y are logical coordinates.
 static iw_tmpsample get_raw_sample(struct iw_context *ctx,
@@ -259,6 +389,12 @@ static iw_tmpsample get_raw_sample(struct iw_context *ctx,
 {
 	unsigned int v;
 
+	if(ctx->img1_palette) {
+		// For RGB palettes, the (virtual) alpha samples are all 255.
+		v = get_raw_sample_int(ctx,x,y,channel);
+		return ((double)v) / ctx->img1_ci[channel].maxcolorcode_dbl;
+	}
+
 	if(channel>=ctx->img1_numchannels_physical) {
 		// This is a virtual alpha channel. Return "opaque".
 		return 1.0;
@@ -326,6 +462,29 @@ static iw_tmpsample cvt_int_sample_to_linear(struct iw_context *ctx,
 	return x_to_linear_sample(s,csdescr);
 }
 
+// Like cvt_int_sample_to_linear(), for 'count' samples.
+static void cvt_int_samples_to_linear(struct iw_context *ctx,
+	const unsigned int *v, iw_tmpsample *dst, int count, const struct iw_csdescr *csdescr)
+{
+	int i;
+
+	if(csdescr->cstype==IW_CSTYPE_LINEAR) {
+		for(i=0;i<count;i++) {
+			dst[i] = ((double)v[i]) / ctx->input_maxcolorcode;
+		}
+	}
+	else if(ctx->input_color_corr_table) {
+		for(i=0;i<count;i++) {
+			dst[i] = ctx->input_color_corr_table[v[i]];
+		}
+	}
+	else {
+		for(i=0;i<count;i++) {
+			dst[i] = x_to_linear_sample(((double)v[i]) / ctx->input_maxcolorcode,csdescr);
+		}
+	}
+}
+
 // Based on color depth of the output image.
 static iw_tmpsample cvt_int_sample_to_linear_output(struct iw_context *ctx,
 	unsigned int v, const struct iw_csdescr *csdescr, double overall_maxcolorcode)
@@ -631,34 +790,59 @@ static void put_sample_convert_from_linear_flt(struct iw_context *ctx, iw_tmpsam
 	put_raw_sample_flt32(ctx,(double)samp_lin,x,y,channel);
 }
 
-static double get_final_sample_using_nc_tbl(struct iw_context *ctx, iw_tmpsample samp_lin)
+// Returns the number of entries in tbl (which must be sorted) that are <= v,
+// where v is from 0.0 to 1.0. 'idx' is the table made by iw_make_lookup_index().
+static IW_INLINE int iw_count_le_using_index(const double *tbl, int nentries,
+	const int *idx, int idx_nbuckets, double v)
 {
-	unsigned int x;
-	unsigned int d;
+	int x;
+	int bucket;
 
-	// For numbers 0 through 254, find the smallest one for which the
-	// corresponding table value is larger than samp_lin.
+	// Out-of-range (or NaN) values shouldn't get here, but be safe.
+	if(!(v>0.0)) bucket = 0;
+	else if(v>=1.0) bucket = idx_nbuckets;
+	else bucket = (int)(v*idx_nbuckets);
 
-	// Do a binary search.
+	// Start with the count for the lowest number in v's bucket, then correct
+	// it. Usually there is at most one table entry in a bucket.
+	x = idx[bucket];
+	while(x<nentries && tbl[x]<=v) x++;
+	return x;
+}
 
-	x = 127;
-	d = 64;
+static double get_final_sample_using_nc_tbl(struct iw_context *ctx, iw_tmpsample samp_lin)
+{
+	// For numbers 0 through nentries-1, find the smallest one for which the
+	// corresponding table value is larger than samp_lin. If there is none,
+	// the answer is nentries. That's the same as the number of table values
+	// that are <= samp_lin.
+	return (double)iw_count_le_using_index(ctx->nearest_color_table,
+		ctx->nearest_color_table_nentries,
+		ctx->nearest_color_index, ctx->lookup_index_nbuckets, samp_lin);
+}
 
-	while(1) {
-		if(x>254 || ctx->nearest_color_table[x] > samp_lin)
-			x -= d;
-		else
-			x += d;
+// A faster version of get_nearest_valid_colors(), for when we're not
+// posterizing, and the output_rev_color_corr_table exists.
+static int get_nearest_valid_colors_using_tbl(struct iw_context *ctx, iw_tmpsample samp_lin,
+		double *s_lin_floor_1, double *s_lin_ceil_1,
+		double *s_cvt_floor_full, double *s_cvt_ceil_full)
+{
+	int floor_int;
+	const double *tbl = ctx->output_rev_color_corr_table;
 
-		if(d==1) {
-			if(x>254 || ctx->nearest_color_table[x] > samp_lin)
-				return (double)(x);
-			else
-				return (double)(x+1);
-		}
+	// tbl[0] is 0.0, so the count is at least 1.
+	floor_int = iw_count_le_using_index(tbl, ctx->output_rev_color_corr_table_nentries,
+		ctx->output_rev_index, ctx->lookup_index_nbuckets, samp_lin) - 1;
 
-		d = d/2;
+	*s_cvt_floor_full = (double)floor_int;
+	if(tbl[floor_int]==samp_lin || floor_int>=ctx->output_rev_color_corr_table_nentries-1) {
+		*s_cvt_ceil_full = *s_cvt_floor_full;
+		return 1;
 	}
+	*s_cvt_ceil_full = (double)(floor_int+1);
+	*s_lin_floor_1 = tbl[floor_int];
+	*s_lin_ceil_1 = tbl[floor_int+1];
+	return 0;
 }
 
 // channel is the output channel
@@ -677,18 +861,14 @@ static void put_sample_convert_from_linear(struct iw_context *ctx, iw_tmpsample
 	// The sample type is UINT, so out-of-range samples can't be represented.
 	// TODO: I think that out-of-range samples could still have a meaningful
 	// effect if we are dithering. More investigation is needed here.
-	if(samp_lin<0.0) samp_lin=0.0;
+	// (The first test also catches NaN.)
+	if(!(samp_lin>=0.0)) samp_lin=0.0;
 	if(samp_lin>1.0) samp_lin=1.0;
 
-	// TODO: This is getting messy. The conditions under which we use lookup
-	// tables are too complicated, and we still don't use them as often as we
-	// should. For example, if we are not dithering, we can use a table optimized
-	// for telling us the single nearest color. But if we are dithering, then we
-	// instead need to know both the next-highest and next-lowest colors, which
-	// would require a different table. The same table could be used for both,
-	// but not quite as efficiently. Currently, we don't use use a lookup table
-	// when dithering, except that we may still use one to do some of the
-	// intermediate computations. Etc.
+	// If we are not dithering, we can use a table optimized for telling us the
+	// single nearest color. But if we are dithering, then we instead need to
+	// know both the next-highest and next-lowest colors, for which we use
+	// output_rev_color_corr_table (if we can).
 	if(ctx->img2_ci[channel].use_nearest_color_table) {
 		s_full = get_final_sample_using_nc_tbl(ctx,samp_lin);
 		goto okay;
@@ -701,13 +881,22 @@ static void put_sample_convert_from_linear(struct iw_context *ctx, iw_tmpsample
 		// If the prior error makes the ideal brightness out of the available range,
 		// just throw away any extra.
 		if(samp_lin>1.0) samp_lin=1.0;
-		else if(samp_lin<0.0) samp_lin=0.0;
+		else if(!(samp_lin>=0.0)) samp_lin=0.0;
 	}
 
-	is_exact = get_nearest_valid_colors(ctx,samp_lin,csdescr,
-		&s_lin_floor_1, &s_lin_ceil_1,
-		&s_cvt_floor_full, &s_cvt_ceil_full,
-		ctx->img2_ci[channel].maxcolorcode_dbl, ctx->img2_ci[channel].color_count);
+	if(ctx->output_rev_index && csdescr->cstype!=IW_CSTYPE_LINEAR &&
+		ctx->img2_ci[channel].color_count==0)
+	{
+		is_exact = get_nearest_valid_colors_using_tbl(ctx,samp_lin,
+			&s_lin_floor_1, &s_lin_ceil_1,
+			&s_cvt_floor_full, &s_cvt_ceil_full);
+	}
+	else {
+		is_exact = get_nearest_valid_colors(ctx,samp_lin,csdescr,
+			&s_lin_floor_1, &s_lin_ceil_1,
+			&s_cvt_floor_full, &s_cvt_ceil_full,
+			ctx->img2_ci[channel].maxcolorcode_dbl, ctx->img2_ci[channel].color_count);
+	}
 
 	if(is_exact) {
 		s_full = s_cvt_floor_full;
@@ -823,141 +1012,712 @@ static int iw_bkgd_has_transparency(struct iw_context *ctx)
 	return 0;
 }
 
-// 'channel' is an intermediate channel number.
-static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
-	const struct iw_csdescr *in_csdescr)
+// State for processing one channel, shared by all the threads that are
+// working on it. The columns (or rows) are divided into num_bands
+// contiguous bands, and each band has its own sample buffers.
+struct iw_channel_job {
+	struct iw_context *ctx;
+	int channel; // Intermediate channel number
+	const struct iw_csdescr *in_csdescr;
+	const struct iw_csdescr *out_csdescr;
+	struct iw_rr_ctx *rrctx;
+	struct iw_rr_ctx *rrctx_h; // Used by the one-pass method to resize rows
+	int num_lines; // Number of columns (or rows) to process
+	int num_bands;
+	int num_in_pix;
+	int num_out_pix;
+	int in_pix_size; // Number of samples in each band's in_pix buffer
+	int out_pix_size; // Number of samples in each band's out_pix buffer
+	iw_tmpsample *in_pix_buf; // num_bands*in_pix_size samples
+	iw_tmpsample *out_pix_buf; // num_bands*out_pix_size samples
+
+	// Used by get_samples_for_resize(). The most samples it will be asked to
+	// read at once.
+	int raw_pix_size;
+	unsigned int *raw_pix_buf; // num_bands*raw_pix_size raw samples
+
+	// For palette images: each palette entry, already converted as
+	// get_sample_for_resize() would convert it. 256 entries.
+	iw_tmpsample *pal_tbl;
+
+	// Used when calculating rows as weighted sums of other rows (see
+	// iwpvt_resize_get_contribs()).
+	int max_contribs;
+	int *contrib_src_buf; // num_bands*max_contribs
+	double *contrib_w_buf; // num_bands*max_contribs
+
+	// Used by iw_process_col_band_by_rows() and iw_process_row_band_one_pass().
+	// Each band has a "window" of num_window_rows input rows (possibly
+	// already resized horizontally), each window_row_size samples wide.
+	int num_window_rows;
+	int window_row_size;
+	iw_tmpsample *window_buf; // num_bands*num_window_rows*window_row_size samples
+	int *window_row_buf; // num_bands*num_window_rows row numbers (-1 = unused)
+
+	// The remaining fields are only used by the final phase.
+	struct iw_channelinfo_out *out_ci;
+	struct iw_channelinfo_out default_ci_out;
+	int output_channel;
+	int is_alpha_channel;
+	int bkgd_has_transparency;
+	int using_errdiffdither;
+};
+
+// Decide how many bands to divide the work into.
+static int iw_calc_num_bands(struct iw_context *ctx, int num_lines)
 {
-	int i,j;
-	int retval=0;
+	int n;
+	n = ctx->max_threads;
+	if(n>num_lines) n=num_lines;
+	if(n<1) n=1;
+	return n;
+}
+
+static void iw_make_palette_table(struct iw_context *ctx, struct iw_channel_job *job);
+
+// Allocate the per-band buffers.
+static int iw_channel_job_alloc(struct iw_context *ctx, struct iw_channel_job *job)
+{
+	int i;
+
+	if(job->in_pix_size>0) {
+		job->in_pix_buf = (iw_tmpsample*)iw_malloc_large(ctx, (size_t)job->num_bands*job->in_pix_size,
+			sizeof(iw_tmpsample));
+		if(!job->in_pix_buf) return 0;
+	}
+	if(job->out_pix_size>0) {
+		job->out_pix_buf = (iw_tmpsample*)iw_malloc_large(ctx, (size_t)job->num_bands*job->out_pix_size,
+			sizeof(iw_tmpsample));
+		if(!job->out_pix_buf) return 0;
+	}
+	if(job->raw_pix_size>0) {
+		job->raw_pix_buf = (unsigned int*)iw_malloc_large(ctx, (size_t)job->num_bands*job->raw_pix_size,
+			sizeof(unsigned int));
+		if(!job->raw_pix_buf) return 0;
+
+		if(ctx->img1_palette && job->in_csdescr) {
+			job->pal_tbl = (iw_tmpsample*)iw_malloc(ctx, 256*sizeof(iw_tmpsample));
+			if(!job->pal_tbl) return 0;
+			iw_make_palette_table(ctx,job);
+		}
+	}
+	if(job->max_contribs>0) {
+		job->contrib_src_buf = (int*)iw_malloc(ctx, (size_t)job->num_bands*job->max_contribs*sizeof(int));
+		if(!job->contrib_src_buf) return 0;
+		job->contrib_w_buf = (double*)iw_malloc(ctx, (size_t)job->num_bands*job->max_contribs*sizeof(double));
+		if(!job->contrib_w_buf) return 0;
+	}
+	if(job->num_window_rows>0) {
+		job->window_buf = (iw_tmpsample*)iw_malloc_large(ctx,
+			(size_t)job->num_bands*job->num_window_rows, job->window_row_size*sizeof(iw_tmpsample));
+		if(!job->window_buf) return 0;
+		job->window_row_buf = (int*)iw_malloc(ctx, (size_t)job->num_bands*job->num_window_rows*sizeof(int));
+		if(!job->window_row_buf) return 0;
+		for(i=0;i<job->num_bands*job->num_window_rows;i++) {
+			job->window_row_buf[i] = -1;
+		}
+	}
+	return 1;
+}
+
+static void iw_channel_job_free(struct iw_context *ctx, struct iw_channel_job *job)
+{
+	if(job->in_pix_buf) iw_free(ctx,job->in_pix_buf);
+	if(job->out_pix_buf) iw_free(ctx,job->out_pix_buf);
+	if(job->raw_pix_buf) iw_free(ctx,job->raw_pix_buf);
+	if(job->pal_tbl) iw_free(ctx,job->pal_tbl);
+	if(job->contrib_src_buf) iw_free(ctx,job->contrib_src_buf);
+	if(job->contrib_w_buf) iw_free(ctx,job->contrib_w_buf);
+	if(job->window_buf) iw_free(ctx,job->window_buf);
+	if(job->window_row_buf) iw_free(ctx,job->window_row_buf);
+}
+
+// Returns a pointer to the start of row j of the intermediate image for
+// this job's channel.
+static IW_INLINE iw_float32 *get_intermediate_row(struct iw_context *ctx,
+	const struct iw_channel_job *job, int j)
+{
+	if(ctx->intermed_ci[job->channel].channeltype==IW_CHANNELTYPE_ALPHA)
+		return &ctx->intermediate_alpha32[((size_t)j)*ctx->intermed_canvas_width];
+	return &ctx->intermediate32[((size_t)j)*ctx->intermed_canvas_width];
+}
+
+// Read input sample (i,j), and convert it to the form used for resizing: a
+// linear colorspace, with associated alpha, and possibly with the background
+// already applied.
+static IW_INLINE iw_tmpsample get_sample_for_resize(struct iw_context *ctx,
+	struct iw_channel_job *job, const struct iw_channelinfo_intermed *int_ci,
+	int i, int j)
+{
+	iw_tmpsample s;
 	iw_tmpsample tmp_alpha;
-	iw_tmpsample *inpix_tofree = NULL;
-	iw_tmpsample *outpix_tofree = NULL;
-	int is_alpha_channel;
-	struct iw_resize_settings *rs = NULL;
-	struct iw_channelinfo_intermed *int_ci;
 
-	iw_tmpsample *in_pix;
-	iw_tmpsample *out_pix;
-	int num_in_pix;
-	int num_out_pix;
+	s = get_sample_cvt_to_linear(ctx,i,j,job->channel,job->in_csdescr);
 
-	int_ci = &ctx->intermed_ci[channel];
-	is_alpha_channel = (int_ci->channeltype==IW_CHANNELTYPE_ALPHA);
+	if(int_ci->need_unassoc_alpha_processing) { // We need opacity information also
+		tmp_alpha = get_raw_sample(ctx,i,j,ctx->img1_alpha_channel_index);
 
-	num_in_pix = ctx->input_h;
-	inpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_in_pix * sizeof(iw_tmpsample));
-	if(!inpix_tofree) goto done;
-	in_pix = inpix_tofree;
+		// Multiply color amount by opacity
+		s *= tmp_alpha;
+	}
+	else if(ctx->apply_bkgd && ctx->apply_bkgd_strategy==IW_BKGD_STRATEGY_EARLY) {
+		// We're doing "Early" background color application.
+		// All intermediate channels will need the background color
+		// applied to them.
+		tmp_alpha = get_raw_sample(ctx,i,j,ctx->img1_alpha_channel_index);
+		s = (tmp_alpha)*(s) + (1.0-tmp_alpha)*(int_ci->bkgd_color_lin);
+	}
+	return s;
+}
+
+// Convert each palette entry as get_sample_for_resize() would convert a pixel
+// of that color.
+static void iw_make_palette_table(struct iw_context *ctx, struct iw_channel_job *job)
+{
+	const struct iw_channelinfo_intermed *int_ci;
+	const struct iw_rgba8color *c;
+	iw_tmpsample s;
+	iw_tmpsample r,g,b;
+	iw_tmpsample tmp_alpha;
+	int ch;
+	int k;
 
-	num_out_pix = ctx->intermed_canvas_height;
-	outpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_out_pix * sizeof(iw_tmpsample));
-	if(!outpix_tofree) goto done;
-	out_pix = outpix_tofree;
+	int_ci = &ctx->intermed_ci[job->channel];
+	ch = int_ci->corresponding_input_channel;
 
-	rs=&ctx->resize_settings[IW_DIMENSION_V];
+	for(k=0;k<256;k++) {
+		c = &ctx->img1_palette->entry[k];
 
-	// If the resize context for this dimension already exists, we should be
-	// able to reuse it. Otherwise, create a new one.
-	if(!rs->rrctx) {
-		// TODO: The use of the word "rows" here is misleading, because we are
-		// actually resizing columns.
-		rs->rrctx = iwpvt_resize_rows_init(ctx,rs,int_ci->channeltype,
-			num_in_pix, num_out_pix);
-		if(!rs->rrctx) goto done;
+		if(int_ci->cvt_to_grayscale) {
+			r = cvt_int_sample_to_linear(ctx,c->r,job->in_csdescr);
+			g = cvt_int_sample_to_linear(ctx,c->g,job->in_csdescr);
+			b = cvt_int_sample_to_linear(ctx,c->b,job->in_csdescr);
+			s = iw_color_to_grayscale(ctx,r,g,b);
+		}
+		else {
+			s = cvt_int_sample_to_linear(ctx,get_palette_sample(c,ch),job->in_csdescr);
+		}
+
+		tmp_alpha = ((double)c->a)/255.0;
+		if(int_ci->need_unassoc_alpha_processing) {
+			s *= tmp_alpha;
+		}
+		else if(ctx->apply_bkgd && ctx->apply_bkgd_strategy==IW_BKGD_STRATEGY_EARLY) {
+			s = (tmp_alpha)*(s) + (1.0-tmp_alpha)*(int_ci->bkgd_color_lin);
+		}
+		job->pal_tbl[k] = s;
 	}
+}
 
-	for(i=0;i<ctx->input_w;i++) {
+// Read 'count' samples, starting at (x,y) and going right (or down, if by_col
+// is set), and convert them as get_sample_for_resize() does.
+// 'band' selects the raw sample buffer to use.
+static void get_samples_for_resize(struct iw_context *ctx,
+	struct iw_channel_job *job, const struct iw_channelinfo_intermed *int_ci,
+	int band, int x, int y, int by_col, int count, iw_tmpsample *dst)
+{
+	int i;
+	int ch;
+	int alpha_ch;
+	int need_alpha;
+	double alpha_maxcolorcode = 1.0;
+	unsigned int *raw_pix;
+	iw_tmpsample tmp_alpha;
 
-		// Read a column of pixels into ctx->in_pix
-		for(j=0;j<ctx->input_h;j++) {
+	ch = int_ci->corresponding_input_channel;
 
-			in_pix[j] = get_sample_cvt_to_linear(ctx,i,j,channel,in_csdescr);
+	if(job->pal_tbl) {
+		// Read the palette indices, and look up their converted values.
+		raw_pix = &job->raw_pix_buf[(size_t)band*job->raw_pix_size];
+		get_raw_samples_int(ctx,x,y,by_col,count,0,raw_pix);
+		for(i=0;i<count;i++) {
+			dst[i] = job->pal_tbl[raw_pix[i]];
+		}
+		return;
+	}
 
-			if(int_ci->need_unassoc_alpha_processing) { // We need opacity information also
-				tmp_alpha = get_raw_sample(ctx,i,j,ctx->img1_alpha_channel_index);
+	if(!job->raw_pix_buf || ctx->img1_ci[ch].disable_fast_get_sample ||
+		int_ci->cvt_to_grayscale)
+	{
+		// The slow way...
+		for(i=0;i<count;i++) {
+			if(by_col)
+				dst[i] = get_sample_for_resize(ctx,job,int_ci,x,y+i);
+			else
+				dst[i] = get_sample_for_resize(ctx,job,int_ci,x+i,y);
+		}
+		return;
+	}
 
-				// Multiply color amount by opacity
-				in_pix[j] *= tmp_alpha;
-			}
-			else if(ctx->apply_bkgd && ctx->apply_bkgd_strategy==IW_BKGD_STRATEGY_EARLY) {
-				// We're doing "Early" background color application.
-				// All intermediate channels will need the background color
-				// applied to them.
-				tmp_alpha = get_raw_sample(ctx,i,j,ctx->img1_alpha_channel_index);
-				in_pix[j] = (tmp_alpha)*(in_pix[j]) +
-					(1.0-tmp_alpha)*(int_ci->bkgd_color_lin);
-			}
+	raw_pix = &job->raw_pix_buf[(size_t)band*job->raw_pix_size];
+	get_raw_samples_int(ctx,x,y,by_col,count,ch,raw_pix);
+	cvt_int_samples_to_linear(ctx,raw_pix,dst,count,job->in_csdescr);
+
+	need_alpha = int_ci->need_unassoc_alpha_processing ||
+		(ctx->apply_bkgd && ctx->apply_bkgd_strategy==IW_BKGD_STRATEGY_EARLY);
+	if(!need_alpha) return;
+
+	alpha_ch = ctx->img1_alpha_channel_index;
+	if(alpha_ch<ctx->img1_numchannels_physical) {
+		get_raw_samples_int(ctx,x,y,by_col,count,alpha_ch,raw_pix);
+		alpha_maxcolorcode = ctx->img1_ci[alpha_ch].maxcolorcode_dbl;
+	}
+
+	for(i=0;i<count;i++) {
+		if(alpha_ch<ctx->img1_numchannels_physical)
+			tmp_alpha = ((double)raw_pix[i]) / alpha_maxcolorcode;
+		else
+			tmp_alpha = 1.0; // A virtual alpha channel
+
+		if(int_ci->need_unassoc_alpha_processing) {
+			dst[i] *= tmp_alpha;
+		}
+		else {
+			dst[i] = (tmp_alpha)*(dst[i]) + (1.0-tmp_alpha)*(int_ci->bkgd_color_lin);
 		}
+	}
+}
+
+// This is an iw_threadfn_type function. 'band' is the item number.
+// Process all the columns in one band.
+static void iw_process_col_band(struct iw_context *ctx, void *userdata, int band)
+{
+	struct iw_channel_job *job = (struct iw_channel_job*)userdata;
+	int i,j;
+	int i_start, i_end;
+	struct iw_channelinfo_intermed *int_ci;
+	iw_tmpsample *in_pix;
+	iw_tmpsample *out_pix;
+
+	int_ci = &ctx->intermed_ci[job->channel];
+	in_pix = &job->in_pix_buf[(size_t)band*job->in_pix_size];
+	out_pix = &job->out_pix_buf[(size_t)band*job->out_pix_size];
+	i_start = (int)(((iw_int64)job->num_lines*band)/job->num_bands);
+	i_end = (int)(((iw_int64)job->num_lines*(band+1))/job->num_bands);
+
+	for(i=i_start;i<i_end;i++) {
+
+		// Read a column of pixels into in_pix
+		get_samples_for_resize(ctx,job,int_ci,band,i,0,1,ctx->input_h,in_pix);
 
 		// Now we have a row in the right format.
 		// Resize it and store it in the right place in the intermediate array.
 
-		iwpvt_resize_row_main(rs->rrctx,in_pix,out_pix);
+		iwpvt_resize_row_main(job->rrctx,in_pix,out_pix);
 
 		if(ctx->intclamp)
-			clamp_output_samples(ctx,out_pix,num_out_pix);
+			clamp_output_samples(ctx,out_pix,job->num_out_pix);
+
+		// The intermediate pixels are in out_pix. Copy them to the intermediate array.
+		for(j=0;j<job->num_out_pix;j++) {
+			get_intermediate_row(ctx,job,j)[i] = (iw_float32)out_pix[j];
+		}
+	}
+}
 
-		// The intermediate pixels are in ctx->out_pix. Copy them to the intermediate array.
-		for(j=0;j<ctx->intermed_canvas_height;j++) {
-			if(is_alpha_channel) {
-				ctx->intermediate_alpha32[((size_t)j)*ctx->intermed_canvas_width + i] = (iw_float32)out_pix[j];
+// This is an iw_threadfn_type function. 'band' is the item number.
+// Does the same thing as iw_process_col_band(), but instead of resizing one
+// column at a time, it calculates each intermediate row as a weighted sum of
+// input rows. The input rows that are needed are converted once, and kept in
+// a small "window" buffer, so that we read the input image sequentially.
+static void iw_process_col_band_by_rows(struct iw_context *ctx, void *userdata, int band)
+{
+	struct iw_channel_job *job = (struct iw_channel_job*)userdata;
+	int i,j,k;
+	int i_start, i_end;
+	int band_width;
+	int ncontribs;
+	int slot;
+	struct iw_channelinfo_intermed *int_ci;
+	iw_tmpsample *window;
+	int *window_row;
+	int *contrib_src;
+	double *contrib_w;
+	iw_tmpsample *out_pix;
+	iw_tmpsample *slot_row;
+	const iw_tmpsample *row;
+	double w;
+	iw_float32 *dst;
+
+	int_ci = &ctx->intermed_ci[job->channel];
+	i_start = (int)(((iw_int64)job->num_lines*band)/job->num_bands);
+	i_end = (int)(((iw_int64)job->num_lines*(band+1))/job->num_bands);
+	band_width = i_end-i_start;
+
+	window = &job->window_buf[(size_t)band*job->num_window_rows*job->window_row_size];
+	window_row = &job->window_row_buf[band*job->num_window_rows];
+	contrib_src = &job->contrib_src_buf[band*job->max_contribs];
+	contrib_w = &job->contrib_w_buf[band*job->max_contribs];
+	out_pix = &job->out_pix_buf[(size_t)band*job->out_pix_size];
+
+	for(j=0;j<job->num_out_pix;j++) {
+		ncontribs = iwpvt_resize_get_contribs(job->rrctx,j,contrib_src,contrib_w);
+
+		// Make sure all the input rows we need are in the window.
+		// The rows needed for one intermediate row are never more than
+		// num_window_rows apart, so they can't collide.
+		for(k=0;k<ncontribs;k++) {
+			if(contrib_src[k]<0) continue;
+			slot = contrib_src[k] % job->num_window_rows;
+			if(window_row[slot]==contrib_src[k]) continue;
+			slot_row = &window[(size_t)slot*job->window_row_size];
+			get_samples_for_resize(ctx,job,int_ci,band,i_start,contrib_src[k],0,band_width,slot_row);
+			window_row[slot] = contrib_src[k];
+		}
+
+		for(i=0;i<band_width;i++) {
+			out_pix[i] = 0.0;
+		}
+		for(k=0;k<ncontribs;k++) {
+			w = contrib_w[k];
+			if(contrib_src[k]<0) {
+				// A virtual pixel; w is the amount to add.
+				for(i=0;i<band_width;i++) {
+					out_pix[i] += w;
+				}
+				continue;
 			}
-			else {
-				ctx->intermediate32[((size_t)j)*ctx->intermed_canvas_width + i] = (iw_float32)out_pix[j];
+			row = &window[(size_t)(contrib_src[k] % job->num_window_rows)*job->window_row_size];
+			for(i=0;i<band_width;i++) {
+				out_pix[i] += row[i] * w;
 			}
 		}
+
+		if(ctx->intclamp)
+			clamp_output_samples(ctx,out_pix,band_width);
+
+		dst = &get_intermediate_row(ctx,job,j)[i_start];
+		for(i=0;i<band_width;i++) {
+			dst[i] = (iw_float32)out_pix[i];
+		}
 	}
+}
+
+// 'channel' is an intermediate channel number.
+// Resize the image vertically, making the intermediate image.
+static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
+	const struct iw_csdescr *in_csdescr, struct iw_rr_ctx *rrctx)
+{
+	int retval=0;
+	int max_contribs;
+	int num_window_rows;
+	struct iw_channel_job job;
+
+	iw_zeromem(&job,sizeof(struct iw_channel_job));
+
+	job.ctx = ctx;
+	job.channel = channel;
+	job.in_csdescr = in_csdescr;
+	job.num_lines = ctx->input_w;
+	job.num_bands = iw_calc_num_bands(ctx,job.num_lines);
+	job.num_in_pix = ctx->input_h;
+	job.num_out_pix = ctx->intermed_canvas_height;
+	job.rrctx = rrctx;
+
+	// Reading the input image a column at a time is slow, so we prefer to
+	// work on rows. But that needs a buffer big enough for all the input rows
+	// that contribute to an intermediate row, which, for a large reduction
+	// factor, could be huge.
+	max_contribs = iwpvt_resize_max_contribs(job.rrctx);
+	if(max_contribs<1) max_contribs=1;
+	num_window_rows = max_contribs;
+	if(num_window_rows>job.num_in_pix) num_window_rows=job.num_in_pix;
+	if(((size_t)num_window_rows)*job.num_lines*sizeof(iw_tmpsample) <= IW_MAX_ROW_WINDOW_SIZE) {
+		job.max_contribs = max_contribs;
+		job.num_window_rows = num_window_rows;
+		job.window_row_size = (job.num_lines+job.num_bands-1)/job.num_bands;
+		job.out_pix_size = job.window_row_size;
+		job.raw_pix_size = job.window_row_size;
+	}
+	else {
+		job.in_pix_size = job.num_in_pix;
+		job.out_pix_size = job.num_out_pix;
+		job.raw_pix_size = job.num_in_pix;
+	}
+
+	if(!iw_channel_job_alloc(ctx,&job)) goto done;
+
+	if(job.num_window_rows>0)
+		iw_run_threaded(ctx,job.num_bands,iw_process_col_band_by_rows,(void*)&job);
+	else
+		iw_run_threaded(ctx,job.num_bands,iw_process_col_band,(void*)&job);
 
 	retval=1;
 
 done:
-	if(rs && rs->disable_rrctx_cache && rs->rrctx) {
-		// In some cases, the channels may need different resize contexts.
-		// Delete the current context, so that it doesn't get reused.
-		iwpvt_resize_rows_done(rs->rrctx);
-		rs->rrctx = NULL;
-	}
-	if(inpix_tofree) iw_free(ctx,inpix_tofree);
-	if(outpix_tofree) iw_free(ctx,outpix_tofree);
+	iw_channel_job_free(ctx,&job);
 	return retval;
 }
 
-static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int intermed_channel,
-	const struct iw_csdescr *out_csdescr)
+// This is an iw_threadfn_type function. 'band' is the item number.
+// Resize all the input rows in one band horizontally, and store them in
+// the intermediate image.
+static void iw_process_row_band_to_intermediate(struct iw_context *ctx, void *userdata, int band)
 {
+	struct iw_channel_job *job = (struct iw_channel_job*)userdata;
 	int i,j;
+	int j_start, j_end;
+	struct iw_channelinfo_intermed *int_ci;
+	iw_tmpsample *in_pix;
+	iw_tmpsample *out_pix;
+	iw_float32 *dst;
+
+	int_ci = &ctx->intermed_ci[job->channel];
+	in_pix = &job->in_pix_buf[(size_t)band*job->in_pix_size];
+	out_pix = &job->out_pix_buf[(size_t)band*job->out_pix_size];
+	j_start = (int)(((iw_int64)job->num_lines*band)/job->num_bands);
+	j_end = (int)(((iw_int64)job->num_lines*(band+1))/job->num_bands);
+
+	for(j=j_start;j<j_end;j++) {
+		get_samples_for_resize(ctx,job,int_ci,band,0,j,0,job->num_in_pix,in_pix);
+
+		iwpvt_resize_row_main(job->rrctx,in_pix,out_pix);
+
+		if(ctx->intclamp)
+			clamp_output_samples(ctx,out_pix,job->num_out_pix);
+
+		dst = get_intermediate_row(ctx,job,j);
+		for(i=0;i<job->num_out_pix;i++) {
+			dst[i] = (iw_float32)out_pix[i];
+		}
+	}
+}
+
+// 'channel' is an intermediate channel number.
+// Resize the image horizontally, making the intermediate image. Used if
+// we're resizing horizontally first.
+static int iw_process_rows_to_intermediate(struct iw_context *ctx, int channel,
+	const struct iw_csdescr *in_csdescr, struct iw_rr_ctx *rrctx)
+{
+	int retval=0;
+	struct iw_channel_job job;
+
+	iw_zeromem(&job,sizeof(struct iw_channel_job));
+
+	job.ctx = ctx;
+	job.channel = channel;
+	job.in_csdescr = in_csdescr;
+	job.num_lines = ctx->input_h;
+	job.num_bands = iw_calc_num_bands(ctx,job.num_lines);
+	job.num_in_pix = ctx->input_w;
+	job.num_out_pix = ctx->intermed_canvas_width;
+	job.in_pix_size = job.num_in_pix;
+	job.out_pix_size = job.num_out_pix;
+	job.raw_pix_size = job.num_in_pix;
+	job.rrctx = rrctx;
+	if(!iw_channel_job_alloc(ctx,&job)) goto done;
+
+	iw_run_threaded(ctx,job.num_bands,iw_process_row_band_to_intermediate,(void*)&job);
+
+	retval=1;
+
+done:
+	iw_channel_job_free(ctx,&job);
+	return retval;
+}
+
+// Convert the fully-resized samples in out_pix (row j of the final image),
+// and put them in the final image.
+static void iw_process_final_row(struct iw_context *ctx, struct iw_channel_job *job,
+	int j, iw_tmpsample *out_pix)
+{
+	int i;
 	int z;
 	int k;
-	int retval=0;
 	iw_tmpsample tmpsamp;
 	iw_tmpsample alphasamp = 0.0;
-	iw_tmpsample *inpix_tofree = NULL; // Used if we need a separate temp buffer for input samples
-	iw_tmpsample *outpix_tofree = NULL; // Used if we need a separate temp buffer for output samples
-	// Do any of the output channels use error-diffusion dithering?
-	int using_errdiffdither = 0;
-	int output_channel;
-	int is_alpha_channel;
-	int bkgd_has_transparency;
 	double tmpbkgdalpha=0.0;
 	int alt_bkgd = 0; // Nonzero if we should use bkgd2 for this sample
-	struct iw_resize_settings *rs = NULL;
-	int ditherfamily, dithersubtype;
 	struct iw_channelinfo_intermed *int_ci;
 	struct iw_channelinfo_out *out_ci;
+	int num_out_pix = ctx->img2.width;
 
-	iw_tmpsample *in_pix = NULL;
-	iw_tmpsample *out_pix = NULL;
-	int num_in_pix;
-	int num_out_pix;
-	struct iw_channelinfo_out default_ci_out;
+	int_ci = &ctx->intermed_ci[job->channel];
+	out_ci = job->out_ci;
+
+	if(ctx->intclamp)
+		clamp_output_samples(ctx,out_pix,num_out_pix);
+
+	// If necessary, copy the resized samples to the final_alpha image
+	if(job->is_alpha_channel && ctx->final_alpha32) {
+		for(i=0;i<num_out_pix;i++) {
+			ctx->final_alpha32[((size_t)j)*ctx->img2.width+i] = (iw_float32)out_pix[i];
+		}
+	}
+
+	// Now convert the out_pix and put them in the final image.
+
+	if(job->output_channel == -1) {
+		// No corresponding output channel.
+		// (Presumably because this is an alpha channel that's being
+		// removed because we're applying a background.)
+		return;
+	}
+
+	for(z=0;z<ctx->img2.width;z++) {
+		// For decent Floyd-Steinberg dithering, we need to process alternate
+		// rows in reverse order.
+		if(job->using_errdiffdither && (j%2))
+			i=ctx->img2.width-1-z;
+		else
+			i=z;
+
+		tmpsamp = out_pix[i];
 
-	num_in_pix = ctx->intermed_canvas_width;
-	num_out_pix = ctx->img2.width;
+		if(ctx->bkgd_checkerboard) {
+			alt_bkgd = (((ctx->bkgd_check_origin[IW_DIMENSION_H]+i)/ctx->bkgd_check_size)%2) !=
+				(((ctx->bkgd_check_origin[IW_DIMENSION_V]+j)/ctx->bkgd_check_size)%2);
+		}
+
+		if(job->bkgd_has_transparency) {
+			tmpbkgdalpha = alt_bkgd ? ctx->bkgd2alpha : ctx->bkgd1alpha;
+		}
+
+		if(int_ci->need_unassoc_alpha_processing) {
+			// Convert color samples back to unassociated alpha.
+			alphasamp = ctx->final_alpha32[((size_t)j)*ctx->img2.width + i];
+
+			if(alphasamp!=0.0) {
+				tmpsamp /= alphasamp;
+			}
+
+			if(ctx->apply_bkgd && ctx->apply_bkgd_strategy==IW_BKGD_STRATEGY_LATE) {
+				// Apply a background color (or checkerboard pattern).
+				double bkcolor;
+				bkcolor = alt_bkgd ? out_ci->bkgd2_color_lin : out_ci->bkgd1_color_lin;
+
+				if(job->bkgd_has_transparency) {
+					tmpsamp = tmpsamp*alphasamp + bkcolor*tmpbkgdalpha*(1.0-alphasamp);
+				}
+				else {
+					tmpsamp = tmpsamp*alphasamp + bkcolor*(1.0-alphasamp);
+				}
+			}
+		}
+		else if(job->is_alpha_channel && job->bkgd_has_transparency) {
+			// Composite the alpha of the foreground over the alpha of the background.
+			tmpsamp = tmpsamp + tmpbkgdalpha*(1.0-tmpsamp);
+		}
+
+		if(ctx->img2.sampletype==IW_SAMPLETYPE_FLOATINGPOINT)
+			put_sample_convert_from_linear_flt(ctx,tmpsamp,i,j,job->output_channel,job->out_csdescr);
+		else
+			put_sample_convert_from_linear(ctx,tmpsamp,i,j,job->output_channel,job->out_csdescr);
+
+	}
+
+	if(job->using_errdiffdither) {
+		// Move "next row" error data to "this row", and clear the "next row".
+		// TODO: Obviously, it would be more efficient to just swap pointers
+		// to the rows.
+		for(i=0;i<ctx->img2.width;i++) {
+			// Move data in all rows but the first row up one row.
+			for(k=0;k<IW_DITHER_MAXROWS-1;k++) {
+				ctx->dither_errors[k][i] = ctx->dither_errors[k+1][i];
+			}
+			// Clear the last row.
+			ctx->dither_errors[IW_DITHER_MAXROWS-1][i] = 0.0;
+		}
+	}
+}
+
+// This is an iw_threadfn_type function. 'band' is the item number.
+// Process all the rows in one band, by resizing rows of the intermediate
+// image horizontally.
+static void iw_process_row_band(struct iw_context *ctx, void *userdata, int band)
+{
+	struct iw_channel_job *job = (struct iw_channel_job*)userdata;
+	int i,j;
+	int j_start, j_end;
+	iw_tmpsample *in_pix;
+	iw_tmpsample *out_pix;
+	const iw_float32 *src;
+
+	in_pix = &job->in_pix_buf[(size_t)band*job->in_pix_size];
+	out_pix = &job->out_pix_buf[(size_t)band*job->out_pix_size];
+	j_start = (int)(((iw_int64)job->num_lines*band)/job->num_bands);
+	j_end = (int)(((iw_int64)job->num_lines*(band+1))/job->num_bands);
+
+	for(j=j_start;j<j_end;j++) {
+		// Copy the input pixels to a temp buffer.
+		src = get_intermediate_row(ctx,job,j);
+		for(i=0;i<job->num_in_pix;i++) {
+			in_pix[i] = src[i];
+		}
+
+		// Resize in_pix to out_pix.
+		iwpvt_resize_row_main(job->rrctx,in_pix,out_pix);
+
+		iw_process_final_row(ctx,job,j,out_pix);
+	}
+}
+
+// This is an iw_threadfn_type function. 'band' is the item number.
+// Process all the rows in one band, by calculating each one as a weighted
+// sum of rows of the intermediate image (which has already been resized
+// horizontally).
+static void iw_process_row_band_by_contribs(struct iw_context *ctx, void *userdata, int band)
+{
+	struct iw_channel_job *job = (struct iw_channel_job*)userdata;
+	int i,j,k;
+	int j_start, j_end;
+	int ncontribs;
+	int *contrib_src;
+	double *contrib_w;
+	iw_tmpsample *out_pix;
+	const iw_float32 *src;
+	double w;
+
+	contrib_src = &job->contrib_src_buf[band*job->max_contribs];
+	contrib_w = &job->contrib_w_buf[band*job->max_contribs];
+	out_pix = &job->out_pix_buf[(size_t)band*job->out_pix_size];
+	j_start = (int)(((iw_int64)job->num_lines*band)/job->num_bands);
+	j_end = (int)(((iw_int64)job->num_lines*(band+1))/job->num_bands);
+
+	for(j=j_start;j<j_end;j++) {
+		ncontribs = iwpvt_resize_get_contribs(job->rrctx,j,contrib_src,contrib_w);
+
+		for(i=0;i<ctx->img2.width;i++) {
+			out_pix[i] = 0.0;
+		}
+		for(k=0;k<ncontribs;k++) {
+			w = contrib_w[k];
+			if(contrib_src[k]<0) {
+				// A virtual pixel; w is the amount to add.
+				for(i=0;i<ctx->img2.width;i++) {
+					out_pix[i] += w;
+				}
+				continue;
+			}
+			src = get_intermediate_row(ctx,job,contrib_src[k]);
+			for(i=0;i<ctx->img2.width;i++) {
+				out_pix[i] += ((iw_tmpsample)src[i]) * w;
+			}
+		}
+
+		iw_process_final_row(ctx,job,j,out_pix);
+	}
+}
+
+// Set up the fields of 'job' that are used by the final phase, and prepare
+// for dithering. job->num_lines must already be set.
+static void iw_init_final_job(struct iw_context *ctx, struct iw_channel_job *job,
+	int intermed_channel, const struct iw_csdescr *out_csdescr)
+{
+	int i;
+	int k;
+	int ditherfamily, dithersubtype;
+	struct iw_channelinfo_intermed *int_ci;
+	struct iw_channelinfo_out *out_ci;
+
+	job->ctx = ctx;
+	job->channel = intermed_channel;
+	job->out_csdescr = out_csdescr;
 
 	int_ci = &ctx->intermed_ci[intermed_channel];
-	output_channel = int_ci->corresponding_output_channel;
-	if(output_channel>=0) {
-		out_ci = &ctx->img2_ci[output_channel];
+	job->output_channel = int_ci->corresponding_output_channel;
+	if(job->output_channel>=0) {
+		out_ci = &ctx->img2_ci[job->output_channel];
 	}
 	else {
 		// If there is no output channelinfo struct, create a temporary one to
@@ -965,220 +1725,658 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 		// TODO: This is admittedly ugly, but we use these settings for a few
 		// things even when there is no corresponding output channel, and I
 		// don't remember exactly why.
-		iw_zeromem(&default_ci_out, sizeof(struct iw_channelinfo_out));
-		default_ci_out.channeltype = IW_CHANNELTYPE_NONALPHA;
-		out_ci = &default_ci_out;
+		iw_zeromem(&job->default_ci_out, sizeof(struct iw_channelinfo_out));
+		job->default_ci_out.channeltype = IW_CHANNELTYPE_NONALPHA;
+		out_ci = &job->default_ci_out;
+	}
+	job->out_ci = out_ci;
+
+	job->is_alpha_channel = (int_ci->channeltype==IW_CHANNELTYPE_ALPHA);
+	job->bkgd_has_transparency = iw_bkgd_has_transparency(ctx);
+
+	// Decide if the 'nearest color table' optimization can be used
+	if(ctx->nearest_color_table && !job->is_alpha_channel &&
+	   out_ci->ditherfamily==IW_DITHERFAMILY_NONE &&
+	   out_ci->color_count==0)
+	{
+		out_ci->use_nearest_color_table = 1;
+	}
+	else {
+		out_ci->use_nearest_color_table = 0;
+	}
+
+	// Seed the PRNG, if necessary.
+	ditherfamily = out_ci->ditherfamily;
+	dithersubtype = out_ci->dithersubtype;
+	if(ditherfamily==IW_DITHERFAMILY_RANDOM) {
+		// Decide what random seed to use. The alpha channel always has its own
+		// seed. If using "r" (not "r2") dithering, every channel has its own seed.
+		if(dithersubtype==IW_DITHERSUBTYPE_SAMEPATTERN && out_ci->channeltype!=IW_CHANNELTYPE_ALPHA)
+		{
+			iwpvt_prng_set_random_seed(ctx->prng,ctx->random_seed);
+		}
+		else {
+			iwpvt_prng_set_random_seed(ctx->prng,ctx->random_seed+out_ci->channeltype);
+		}
+	}
+
+	// Initialize Floyd-Steinberg dithering.
+	if(job->output_channel>=0 && out_ci->ditherfamily==IW_DITHERFAMILY_ERRDIFF) {
+		job->using_errdiffdither = 1;
+		for(i=0;i<ctx->img2.width;i++) {
+			for(k=0;k<IW_DITHER_MAXROWS;k++) {
+				ctx->dither_errors[k][i] = 0.0;
+			}
+		}
+	}
+
+	// Error-diffusion and random dithering depend on the rows being processed
+	// in order, so they can't be multithreaded.
+	if(job->using_errdiffdither || ditherfamily==IW_DITHERFAMILY_RANDOM) {
+		job->num_bands = 1;
+	}
+	else {
+		job->num_bands = iw_calc_num_bands(ctx,job->num_lines);
+	}
+}
+
+// Resize the intermediate image in the remaining dimension, and write the
+// final image.
+static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int intermed_channel,
+	const struct iw_csdescr *out_csdescr, struct iw_rr_ctx *rrctx)
+{
+	int retval=0;
+	struct iw_channel_job job;
+
+	iw_zeromem(&job,sizeof(struct iw_channel_job));
+	job.num_lines = ctx->img2.height;
+	iw_init_final_job(ctx,&job,intermed_channel,out_csdescr);
+	job.rrctx = rrctx;
+
+	job.out_pix_size = ctx->img2.width;
+	if(ctx->resize_order==IW_RESIZE_ORDER_H_FIRST) {
+		// The remaining dimension is vertical.
+		job.num_in_pix = ctx->intermed_canvas_height;
+		job.num_out_pix = ctx->img2.height;
+		job.max_contribs = iwpvt_resize_max_contribs(job.rrctx);
+		if(job.max_contribs<1) job.max_contribs=1;
+	}
+	else {
+		job.num_in_pix = ctx->intermed_canvas_width;
+		job.num_out_pix = ctx->img2.width;
+		job.in_pix_size = job.num_in_pix;
+	}
+	if(!iw_channel_job_alloc(ctx,&job)) goto done;
+
+	if(ctx->resize_order==IW_RESIZE_ORDER_H_FIRST)
+		iw_run_threaded(ctx,job.num_bands,iw_process_row_band_by_contribs,(void*)&job);
+	else
+		iw_run_threaded(ctx,job.num_bands,iw_process_row_band,(void*)&job);
+
+	retval=1;
+
+done:
+	iw_channel_job_free(ctx,&job);
+
+	return retval;
+}
+
+// Calculate row j of the final image, for the channel in 'job', without
+// using an intermediate image. 'band' selects the buffers to use.
+// The row is calculated as a weighted sum of input rows, which are kept in a
+// small "window" buffer. If we're resizing vertically first, the window holds
+// converted input rows, and the sum is then resized horizontally. Otherwise,
+// the input rows are resized horizontally as they are added to the window.
+// The results are the same as if we had used an intermediate image.
+static void iw_process_row_one_pass(struct iw_context *ctx, struct iw_channel_job *job,
+	int band, int j)
+{
+	int i,k;
+	int ncontribs;
+	int slot;
+	int h_first;
+	struct iw_channelinfo_intermed *int_ci;
+	iw_tmpsample *window;
+	int *window_row;
+	int *contrib_src;
+	double *contrib_w;
+	iw_tmpsample *in_pix;
+	iw_tmpsample *out_pix;
+	iw_tmpsample *sum_pix;
+	iw_tmpsample *slot_row;
+	const iw_tmpsample *row;
+	double w;
+
+	int_ci = &ctx->intermed_ci[job->channel];
+	h_first = (ctx->resize_order==IW_RESIZE_ORDER_H_FIRST);
+
+	window = &job->window_buf[(size_t)band*job->num_window_rows*job->window_row_size];
+	window_row = &job->window_row_buf[band*job->num_window_rows];
+	contrib_src = &job->contrib_src_buf[band*job->max_contribs];
+	contrib_w = &job->contrib_w_buf[band*job->max_contribs];
+	in_pix = &job->in_pix_buf[(size_t)band*job->in_pix_size];
+	out_pix = &job->out_pix_buf[(size_t)band*job->out_pix_size];
+	sum_pix = h_first ? out_pix : in_pix;
+
+	ncontribs = iwpvt_resize_get_contribs(job->rrctx,j,contrib_src,contrib_w);
+
+	// Make sure all the input rows we need are in the window.
+	for(k=0;k<ncontribs;k++) {
+		if(contrib_src[k]<0) continue;
+		slot = contrib_src[k] % job->num_window_rows;
+		if(window_row[slot]==contrib_src[k]) continue;
+		slot_row = &window[(size_t)slot*job->window_row_size];
+		if(h_first) {
+			get_samples_for_resize(ctx,job,int_ci,band,0,contrib_src[k],0,ctx->input_w,in_pix);
+			iwpvt_resize_row_main(job->rrctx_h,in_pix,out_pix);
+			if(ctx->intclamp)
+				clamp_output_samples(ctx,out_pix,ctx->img2.width);
+			// Use the same precision that the intermediate image would have.
+			for(i=0;i<ctx->img2.width;i++) {
+				slot_row[i] = (iw_float32)out_pix[i];
+			}
+		}
+		else {
+			get_samples_for_resize(ctx,job,int_ci,band,0,contrib_src[k],0,ctx->input_w,slot_row);
+		}
+		window_row[slot] = contrib_src[k];
 	}
 
-	is_alpha_channel = (int_ci->channeltype==IW_CHANNELTYPE_ALPHA);
-	bkgd_has_transparency = iw_bkgd_has_transparency(ctx);
+	for(i=0;i<job->window_row_size;i++) {
+		sum_pix[i] = 0.0;
+	}
+	for(k=0;k<ncontribs;k++) {
+		w = contrib_w[k];
+		if(contrib_src[k]<0) {
+			// A virtual pixel; w is the amount to add.
+			for(i=0;i<job->window_row_size;i++) {
+				sum_pix[i] += w;
+			}
+			continue;
+		}
+		row = &window[(size_t)(contrib_src[k] % job->num_window_rows)*job->window_row_size];
+		for(i=0;i<job->window_row_size;i++) {
+			sum_pix[i] += row[i] * w;
+		}
+	}
+
+	if(!h_first) {
+		// sum_pix is now row j of the intermediate image.
+		if(ctx->intclamp)
+			clamp_output_samples(ctx,sum_pix,ctx->input_w);
+		for(i=0;i<ctx->input_w;i++) {
+			sum_pix[i] = (iw_float32)sum_pix[i];
+		}
+		iwpvt_resize_row_main(job->rrctx_h,in_pix,out_pix);
+	}
+
+	iw_process_final_row(ctx,job,j,out_pix);
+}
+
+// This is an iw_threadfn_type function. 'band' is the item number.
+// Process all the rows in one band, without using an intermediate image.
+static void iw_process_row_band_one_pass(struct iw_context *ctx, void *userdata, int band)
+{
+	struct iw_channel_job *job = (struct iw_channel_job*)userdata;
+	int j;
+	int j_start, j_end;
+
+	j_start = (int)(((iw_int64)job->num_lines*band)/job->num_bands);
+	j_end = (int)(((iw_int64)job->num_lines*(band+1))/job->num_bands);
+
+	for(j=j_start;j<j_end;j++) {
+		iw_process_row_one_pass(ctx,job,band,j);
+	}
+}
+
+// Returns the number of input rows that the one-pass method needs to keep
+// in each band's window, or 0 if the windows for num_channels channels would
+// be too large.
+static int iw_calc_one_pass_window_rows(struct iw_context *ctx, struct iw_rr_ctx *rrctx_v,
+	int num_channels)
+{
+	int num_window_rows;
+	int row_size;
+	int num_bands;
+
+	if(ctx->no_streaming) return 0;
+
+	num_window_rows = iwpvt_resize_max_contribs(rrctx_v);
+	if(num_window_rows<1) num_window_rows=1;
+	if(num_window_rows>ctx->input_h) num_window_rows=ctx->input_h;
+
+	if(ctx->resize_order==IW_RESIZE_ORDER_H_FIRST)
+		row_size = ctx->img2.width;
+	else
+		row_size = ctx->input_w;
+
+	// This is the most bands we might use.
+	num_bands = iw_calc_num_bands(ctx,ctx->img2.height);
+
+	if(((size_t)num_channels)*num_bands*num_window_rows*row_size*sizeof(iw_tmpsample) >
+		IW_MAX_ROW_WINDOW_SIZE)
+	{
+		return 0;
+	}
+	return num_window_rows;
+}
+
+// Set up a job for the one-pass method. Does not allocate the buffers.
+static void iw_init_one_pass_job(struct iw_context *ctx, struct iw_channel_job *job,
+  int intermed_channel,
+  const struct iw_csdescr *in_csdescr, const struct iw_csdescr *out_csdescr,
+  struct iw_rr_ctx *rrctx_h, struct iw_rr_ctx *rrctx_v, int num_window_rows)
+{
+	job->num_lines = ctx->img2.height;
+	iw_init_final_job(ctx,job,intermed_channel,out_csdescr);
+	job->in_csdescr = in_csdescr;
+	job->rrctx = rrctx_v;
+	job->rrctx_h = rrctx_h;
+
+	job->max_contribs = iwpvt_resize_max_contribs(rrctx_v);
+	if(job->max_contribs<1) job->max_contribs=1;
+	job->num_window_rows = num_window_rows;
+	if(ctx->resize_order==IW_RESIZE_ORDER_H_FIRST)
+		job->window_row_size = ctx->img2.width;
+	else
+		job->window_row_size = ctx->input_w;
+	job->in_pix_size = ctx->input_w;
+	job->out_pix_size = ctx->img2.width;
+	job->raw_pix_size = ctx->input_w;
+}
+
+// Process a channel, from the input image to the final image, without using
+// an intermediate image.
+static int iw_process_channel_one_pass(struct iw_context *ctx, int intermed_channel,
+  const struct iw_csdescr *in_csdescr, const struct iw_csdescr *out_csdescr,
+  struct iw_rr_ctx *rrctx_h, struct iw_rr_ctx *rrctx_v, int num_window_rows)
+{
+	int retval=0;
+	struct iw_channel_job job;
+
+	iw_zeromem(&job,sizeof(struct iw_channel_job));
+	iw_init_one_pass_job(ctx,&job,intermed_channel,in_csdescr,out_csdescr,
+		rrctx_h,rrctx_v,num_window_rows);
+	if(!iw_channel_job_alloc(ctx,&job)) goto done;
+
+	iw_run_threaded(ctx,job.num_bands,iw_process_row_band_one_pass,(void*)&job);
+
+	retval=1;
+
+done:
+	iw_channel_job_free(ctx,&job);
+	return retval;
+}
+
+// Create a resize context, or take a suitable one from ctx->rrctx_cache.
+static struct iw_rr_ctx *iw_new_rrctx(struct iw_context *ctx, struct iw_resize_settings *rs,
+	int channeltype, int num_in_pix, int num_out_pix)
+{
+	struct iw_rr_ctx *rrctx;
+	int i;
+
+	for(i=0;i<IW_RRCTX_CACHE_SIZE;i++) {
+		rrctx = ctx->rrctx_cache[i];
+		if(iwpvt_resize_rows_is_reusable(rrctx,ctx,rs,channeltype,num_in_pix,num_out_pix)) {
+			ctx->rrctx_cache[i] = NULL;
+			return rrctx;
+		}
+	}
+
+	// TODO: The use of the word "rows" here is misleading, because we
+	// might be resizing columns.
+	return iwpvt_resize_rows_init(ctx,rs,channeltype,num_in_pix,num_out_pix);
+}
+
+// Put a resize context that we're done with into ctx->rrctx_cache. If the
+// cache is full, the least recently used context is deleted.
+static void iw_done_with_rrctx(struct iw_context *ctx, struct iw_rr_ctx *rrctx)
+{
+	int i;
+
+	if(!rrctx) return;
+	if(ctx->rrctx_cache[IW_RRCTX_CACHE_SIZE-1]) {
+		iwpvt_resize_rows_done(ctx->rrctx_cache[IW_RRCTX_CACHE_SIZE-1]);
+	}
+	for(i=IW_RRCTX_CACHE_SIZE-1;i>0;i--) {
+		ctx->rrctx_cache[i] = ctx->rrctx_cache[i-1];
+	}
+	ctx->rrctx_cache[0] = rrctx;
+}
+
+// Returns the resize context to use for the given dimension. If it already
+// exists, we should be able to reuse it. Otherwise, create a new one.
+static struct iw_rr_ctx *iw_get_rrctx(struct iw_context *ctx, int dimension, int channeltype)
+{
+	struct iw_resize_settings *rs;
+
+	rs=&ctx->resize_settings[dimension];
+	if(!rs->rrctx) {
+		if(dimension==IW_DIMENSION_H)
+			rs->rrctx = iw_new_rrctx(ctx,rs,channeltype,ctx->input_w,ctx->img2.width);
+		else
+			rs->rrctx = iw_new_rrctx(ctx,rs,channeltype,ctx->input_h,ctx->img2.height);
+	}
+	return rs->rrctx;
+}
+
+static void iw_release_rrctx(struct iw_context *ctx, int dimension)
+{
+	struct iw_resize_settings *rs;
+
+	rs=&ctx->resize_settings[dimension];
+	if(rs->disable_rrctx_cache && rs->rrctx) {
+		// In some cases, the channels may need different resize contexts.
+		// Stop using the current context. (It may still be reused, if
+		// another channel needs one with the same settings.)
+		iw_done_with_rrctx(ctx,rs->rrctx);
+		rs->rrctx = NULL;
+	}
+}
 
-	inpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_in_pix * sizeof(iw_tmpsample));
-	in_pix = inpix_tofree;
+// Allocate the intermediate image for this type of channel, if it hasn't
+// been allocated yet.
+static int iw_alloc_intermediate(struct iw_context *ctx, int channeltype)
+{
+	iw_float32 **pimage;
 
-	// We need an output buffer.
-	outpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_out_pix * sizeof(iw_tmpsample));
-	if(!outpix_tofree) goto done;
-	out_pix = outpix_tofree;
+	if(channeltype==IW_CHANNELTYPE_ALPHA)
+		pimage = &ctx->intermediate_alpha32;
+	else
+		pimage = &ctx->intermediate32;
+	if(*pimage) return 1;
 
-	// Decide if the 'nearest color table' optimization can be used
-	if(ctx->nearest_color_table && !is_alpha_channel &&
-	   out_ci->ditherfamily==IW_DITHERFAMILY_NONE &&
-	   out_ci->color_count==0)
-	{
-		out_ci->use_nearest_color_table = 1;
-	}
-	else {
-		out_ci->use_nearest_color_table = 0;
-	}
+	*pimage = (iw_float32*)iw_malloc_large(ctx, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
+	if(!*pimage) return 0;
+	return 1;
+}
 
-	// Seed the PRNG, if necessary.
-	ditherfamily = out_ci->ditherfamily;
-	dithersubtype = out_ci->dithersubtype;
-	if(ditherfamily==IW_DITHERFAMILY_RANDOM) {
-		// Decide what random seed to use. The alpha channel always has its own
-		// seed. If using "r" (not "r2") dithering, every channel has its own seed.
-		if(dithersubtype==IW_DITHERSUBTYPE_SAMEPATTERN && out_ci->channeltype!=IW_CHANNELTYPE_ALPHA)
+static int iw_process_one_channel(struct iw_context *ctx, int intermed_channel,
+  const struct iw_csdescr *in_csdescr, const struct iw_csdescr *out_csdescr)
+{
+	int retval=0;
+	int ret;
+	int channeltype;
+	int num_window_rows;
+	struct iw_rr_ctx *rrctx_h;
+	struct iw_rr_ctx *rrctx_v;
+
+	channeltype = ctx->intermed_ci[intermed_channel].channeltype;
+	rrctx_h = iw_get_rrctx(ctx,IW_DIMENSION_H,channeltype);
+	if(!rrctx_h) goto done;
+	rrctx_v = iw_get_rrctx(ctx,IW_DIMENSION_V,channeltype);
+	if(!rrctx_v) goto done;
+
+	// If we can, process the channel in one pass. Otherwise, we need a full
+	// size intermediate image.
+	num_window_rows = iw_calc_one_pass_window_rows(ctx,rrctx_v,1);
+	if(num_window_rows>0) {
+		if(!iw_process_channel_one_pass(ctx,intermed_channel,in_csdescr,out_csdescr,
+			rrctx_h,rrctx_v,num_window_rows))
 		{
-			iwpvt_prng_set_random_seed(ctx->prng,ctx->random_seed);
-		}
-		else {
-			iwpvt_prng_set_random_seed(ctx->prng,ctx->random_seed+out_ci->channeltype);
+			goto done;
 		}
+		retval=1;
+		goto done;
 	}
 
-	// Initialize Floyd-Steinberg dithering.
-	if(output_channel>=0 && out_ci->ditherfamily==IW_DITHERFAMILY_ERRDIFF) {
-		using_errdiffdither = 1;
-		for(i=0;i<ctx->img2.width;i++) {
-			for(k=0;k<IW_DITHER_MAXROWS;k++) {
-				ctx->dither_errors[k][i] = 0.0;
-			}
-		}
-	}
+	if(!iw_alloc_intermediate(ctx,channeltype)) goto done;
 
-	rs=&ctx->resize_settings[IW_DIMENSION_H];
+	if(ctx->resize_order==IW_RESIZE_ORDER_H_FIRST)
+		ret = iw_process_rows_to_intermediate(ctx,intermed_channel,in_csdescr,rrctx_h);
+	else
+		ret = iw_process_cols_to_intermediate(ctx,intermed_channel,in_csdescr,rrctx_v);
+	if(!ret) goto done;
 
-	// If the resize context for this dimension already exists, we should be
-	// able to reuse it. Otherwise, create a new one.
-	if(!rs->rrctx) {
-		rs->rrctx = iwpvt_resize_rows_init(ctx,rs,int_ci->channeltype,
-			num_in_pix, num_out_pix);
-		if(!rs->rrctx) goto done;
+	if(!iw_process_rows_intermediate_to_final(ctx,intermed_channel,out_csdescr,
+		(ctx->resize_order==IW_RESIZE_ORDER_H_FIRST) ? rrctx_v : rrctx_h))
+	{
+		goto done;
 	}
 
-	for(j=0;j<ctx->intermed_canvas_height;j++) {
+	retval=1;
 
-		// As needed, either copy the input pixels to a temp buffer (inpix, which
-		// ctx->in_pix already points to), or point ctx->in_pix directly to the
-		// intermediate data.
-		if(is_alpha_channel) {
-			for(i=0;i<num_in_pix;i++) {
-				inpix_tofree[i] = ctx->intermediate_alpha32[((size_t)j)*ctx->intermed_canvas_width+i];
-			}
-		}
-		else {
-			for(i=0;i<num_in_pix;i++) {
-				inpix_tofree[i] = ctx->intermediate32[((size_t)j)*ctx->intermed_canvas_width+i];
-			}
-		}
+done:
+	iw_release_rrctx(ctx,IW_DIMENSION_H);
+	iw_release_rrctx(ctx,IW_DIMENSION_V);
+	return retval;
+}
 
-		// Resize ctx->in_pix to ctx->out_pix.
-		iwpvt_resize_row_main(rs->rrctx,in_pix,out_pix);
+// State for processing all the channels together.
+struct iw_multichannel_job {
+	int num_channels;
+	int num_lines;
+	int num_bands;
+	// In the order they should be processed; the alpha channel must be first.
+	struct iw_channel_job chan[IW_CI_COUNT];
+};
 
-		if(ctx->intclamp)
-			clamp_output_samples(ctx,out_pix,num_out_pix);
+// This is an iw_threadfn_type function. 'band' is the item number.
+// Process all the rows in one band, for all channels, without using an
+// intermediate image.
+static void iw_process_row_band_all_channels(struct iw_context *ctx, void *userdata, int band)
+{
+	struct iw_multichannel_job *mjob = (struct iw_multichannel_job*)userdata;
+	int j;
+	int c;
+	int j_start, j_end;
 
-		// If necessary, copy the resized samples to the final_alpha image
-		if(is_alpha_channel && outpix_tofree && ctx->final_alpha32) {
-			for(i=0;i<num_out_pix;i++) {
-				ctx->final_alpha32[((size_t)j)*ctx->img2.width+i] = (iw_float32)outpix_tofree[i];
-			}
+	j_start = (int)(((iw_int64)mjob->num_lines*band)/mjob->num_bands);
+	j_end = (int)(((iw_int64)mjob->num_lines*(band+1))/mjob->num_bands);
+
+	for(j=j_start;j<j_end;j++) {
+		// The color channels of row j need row j of final_alpha32, so the
+		// alpha channel is done first.
+		for(c=0;c<mjob->num_channels;c++) {
+			iw_process_row_one_pass(ctx,&mjob->chan[c],band,j);
 		}
+	}
+}
 
-		// Now convert the out_pix and put them in the final image.
+// Returns the number of window rows to use if we can process all the channels
+// together, a row at a time, or 0 if we can't.
+static int iw_can_process_channels_together(struct iw_context *ctx)
+{
+	int channel;
+	int output_channel;
+	int ditherfamily;
+	struct iw_rr_ctx *rrctx_v;
 
-		if(output_channel == -1) {
-			// No corresponding output channel.
-			// (Presumably because this is an alpha channel that's being
-			// removed because we're applying a background.)
-			goto here;
-		}
+	if(ctx->intermed_numchannels<2) return 0;
 
-		for(z=0;z<ctx->img2.width;z++) {
-			// For decent Floyd-Steinberg dithering, we need to process alternate
-			// rows in reverse order.
-			if(using_errdiffdither && (j%2))
-				i=ctx->img2.width-1-z;
-			else
-				i=z;
+	// All channels must be able to use the same resize contexts.
+	if(ctx->resize_settings[IW_DIMENSION_H].disable_rrctx_cache ||
+		ctx->resize_settings[IW_DIMENSION_V].disable_rrctx_cache)
+	{
+		return 0;
+	}
 
-			tmpsamp = out_pix[i];
+	// Error-diffusion and random dithering keep state that is shared by
+	// all channels, and assume the channels are done one at a time.
+	for(channel=0;channel<ctx->intermed_numchannels;channel++) {
+		output_channel = ctx->intermed_ci[channel].corresponding_output_channel;
+		if(output_channel<0) continue;
+		ditherfamily = ctx->img2_ci[output_channel].ditherfamily;
+		if(ditherfamily==IW_DITHERFAMILY_ERRDIFF || ditherfamily==IW_DITHERFAMILY_RANDOM)
+			return 0;
+	}
 
-			if(ctx->bkgd_checkerboard) {
-				alt_bkgd = (((ctx->bkgd_check_origin[IW_DIMENSION_H]+i)/ctx->bkgd_check_size)%2) !=
-					(((ctx->bkgd_check_origin[IW_DIMENSION_V]+j)/ctx->bkgd_check_size)%2);
-			}
+	if(!iw_get_rrctx(ctx,IW_DIMENSION_H,ctx->intermed_ci[0].channeltype)) return 0;
+	rrctx_v = iw_get_rrctx(ctx,IW_DIMENSION_V,ctx->intermed_ci[0].channeltype);
+	if(!rrctx_v) return 0;
 
-			if(bkgd_has_transparency) {
-				tmpbkgdalpha = alt_bkgd ? ctx->bkgd2alpha : ctx->bkgd1alpha;
-			}
+	return iw_calc_one_pass_window_rows(ctx,rrctx_v,ctx->intermed_numchannels);
+}
 
-			if(int_ci->need_unassoc_alpha_processing) {
-				// Convert color samples back to unassociated alpha.
-				alphasamp = ctx->final_alpha32[((size_t)j)*ctx->img2.width + i];
+// Process all the channels together, from the input image to the final
+// image, so that each input row is read, and each output row is written, while
+// it is still in the cache.
+static int iw_process_channels_together(struct iw_context *ctx,
+	const struct iw_csdescr *csdescr_linear, int num_window_rows)
+{
+	int retval=0;
+	int c;
+	int channel;
+	const struct iw_csdescr *in_csdescr;
+	const struct iw_csdescr *out_csdescr;
+	struct iw_rr_ctx *rrctx_h;
+	struct iw_rr_ctx *rrctx_v;
+	struct iw_multichannel_job *mjob = NULL;
 
-				if(alphasamp!=0.0) {
-					tmpsamp /= alphasamp;
-				}
+	rrctx_h = ctx->resize_settings[IW_DIMENSION_H].rrctx;
+	rrctx_v = ctx->resize_settings[IW_DIMENSION_V].rrctx;
 
-				if(ctx->apply_bkgd && ctx->apply_bkgd_strategy==IW_BKGD_STRATEGY_LATE) {
-					// Apply a background color (or checkerboard pattern).
-					double bkcolor;
-					bkcolor = alt_bkgd ? out_ci->bkgd2_color_lin : out_ci->bkgd1_color_lin;
-
-					if(bkgd_has_transparency) {
-						tmpsamp = tmpsamp*alphasamp + bkcolor*tmpbkgdalpha*(1.0-alphasamp);
-					}
-					else {
-						tmpsamp = tmpsamp*alphasamp + bkcolor*(1.0-alphasamp);
-					}
-				}
-			}
-			else if(is_alpha_channel && bkgd_has_transparency) {
-				// Composite the alpha of the foreground over the alpha of the background.
-				tmpsamp = tmpsamp + tmpbkgdalpha*(1.0-tmpsamp);
-			}
+	mjob = (struct iw_multichannel_job*)iw_mallocz(ctx, sizeof(struct iw_multichannel_job));
+	if(!mjob) goto done;
+	mjob->num_lines = ctx->img2.height;
+	mjob->num_bands = iw_calc_num_bands(ctx,mjob->num_lines);
 
-			if(ctx->img2.sampletype==IW_SAMPLETYPE_FLOATINGPOINT)
-				put_sample_convert_from_linear_flt(ctx,tmpsamp,i,j,output_channel,out_csdescr);
-			else
-				put_sample_convert_from_linear(ctx,tmpsamp,i,j,output_channel,out_csdescr);
+	// Put the alpha channel first.
+	if(IW_IMGTYPE_HAS_ALPHA(ctx->intermed_imgtype)) {
+		iw_init_one_pass_job(ctx,&mjob->chan[mjob->num_channels],ctx->intermed_alpha_channel_index,
+			csdescr_linear,csdescr_linear,rrctx_h,rrctx_v,num_window_rows);
+		mjob->num_channels++;
+	}
 
+	for(channel=0;channel<ctx->intermed_numchannels;channel++) {
+		if(ctx->intermed_ci[channel].channeltype==IW_CHANNELTYPE_ALPHA) continue;
+		if(ctx->no_gamma) {
+			in_csdescr = csdescr_linear;
+			out_csdescr = csdescr_linear;
 		}
-
-		if(using_errdiffdither) {
-			// Move "next row" error data to "this row", and clear the "next row".
-			// TODO: Obviously, it would be more efficient to just swap pointers
-			// to the rows.
-			for(i=0;i<ctx->img2.width;i++) {
-				// Move data in all rows but the first row up one row.
-				for(k=0;k<IW_DITHER_MAXROWS-1;k++) {
-					ctx->dither_errors[k][i] = ctx->dither_errors[k+1][i];
-				}
-				// Clear the last row.
-				ctx->dither_errors[IW_DITHER_MAXROWS-1][i] = 0.0;
-			}
+		else {
+			in_csdescr = &ctx->img1cs;
+			out_csdescr = &ctx->img2cs;
 		}
+		iw_init_one_pass_job(ctx,&mjob->chan[mjob->num_channels],channel,
+			in_csdescr,out_csdescr,rrctx_h,rrctx_v,num_window_rows);
+		mjob->num_channels++;
+	}
 
-here:
-		;
+	for(c=0;c<mjob->num_channels;c++) {
+		mjob->chan[c].num_bands = mjob->num_bands;
+		if(!iw_channel_job_alloc(ctx,&mjob->chan[c])) goto done;
 	}
 
+	iw_run_threaded(ctx,mjob->num_bands,iw_process_row_band_all_channels,(void*)mjob);
+
 	retval=1;
 
 done:
-	if(rs && rs->disable_rrctx_cache && rs->rrctx) {
-		// In some cases, the channels may need different resize contexts.
-		// Delete the current context, so that it doesn't get reused.
-		iwpvt_resize_rows_done(rs->rrctx);
-		rs->rrctx = NULL;
+	if(mjob) {
+		for(c=0;c<mjob->num_channels;c++) {
+			iw_channel_job_free(ctx,&mjob->chan[c]);
+		}
+		iw_free(ctx,mjob);
 	}
-	if(inpix_tofree) iw_free(ctx,inpix_tofree);
-	if(outpix_tofree) iw_free(ctx,outpix_tofree);
-
 	return retval;
 }
 
-static int iw_process_one_channel(struct iw_context *ctx, int intermed_channel,
-  const struct iw_csdescr *in_csdescr, const struct iw_csdescr *out_csdescr)
+// Estimate the relative cost of resizing one dimension, per line.
+// As a side effect, this may create the resize context for that dimension.
+static double iw_estimate_resize_cost(struct iw_context *ctx, int dimension,
+	int num_in_pix, int num_out_pix)
 {
-	if(!iw_process_cols_to_intermediate(ctx,intermed_channel,in_csdescr)) {
-		return 0;
+	struct iw_resize_settings *rs;
+	struct iw_rr_ctx *rrctx;
+	int ncontribs;
+
+	rs = &ctx->resize_settings[dimension];
+	rrctx = iw_new_rrctx(ctx,rs,ctx->intermed_ci[0].channeltype,
+		num_in_pix,num_out_pix);
+	if(!rrctx) return 0.0;
+	ncontribs = iwpvt_resize_max_contribs(rrctx);
+
+	if(rs->disable_rrctx_cache || rs->rrctx) {
+		iw_done_with_rrctx(ctx,rrctx);
+	}
+	else {
+		// Keep it, so it doesn't have to be created again.
+		rs->rrctx = rrctx;
 	}
 
-	if(!iw_process_rows_intermediate_to_final(ctx,intermed_channel,out_csdescr)) {
-		return 0;
+	// Even a null resize costs something.
+	return (double)num_out_pix * (double)(ncontribs>0 ? ncontribs : 1);
+}
+
+// Decide whether to resize the vertical or horizontal dimension first.
+static void iw_decide_resize_order(struct iw_context *ctx)
+{
+	double cost_h, cost_v;
+	double cost_v_first, cost_h_first;
+
+	if(ctx->resize_order_req==IW_RESIZE_ORDER_V_FIRST ||
+		ctx->resize_order_req==IW_RESIZE_ORDER_H_FIRST)
+	{
+		ctx->resize_order = ctx->resize_order_req;
+		return;
 	}
 
-	return 1;
+	// The cost of resizing a dimension is roughly proportional to the number
+	// of output samples times the number of input samples that contribute to
+	// each one. The first pass has to do this for every input line, and the
+	// second pass only for every output line.
+	cost_h = iw_estimate_resize_cost(ctx,IW_DIMENSION_H,ctx->input_w,ctx->img2.width);
+	cost_v = iw_estimate_resize_cost(ctx,IW_DIMENSION_V,ctx->input_h,ctx->img2.height);
+	cost_v_first = cost_v*ctx->input_w + cost_h*ctx->img2.height;
+	cost_h_first = cost_h*ctx->input_h + cost_v*ctx->img2.width;
+
+	if(cost_h_first < cost_v_first)
+		ctx->resize_order = IW_RESIZE_ORDER_H_FIRST;
+	else
+		ctx->resize_order = IW_RESIZE_ORDER_V_FIRST;
+}
+
+static void iw_free_corr_table(struct iw_context *ctx, double **ptable)
+{
+	if(*ptable) {
+		iw_free(ctx,*ptable);
+		*ptable = NULL;
+	}
+}
+
+// If *ptable is a table that was made (according to 'info') for the given
+// image type and colorspace, return 1. Otherwise, free it and return 0.
+// This lets a context that was reset by iw_reset_context() keep its tables,
+// if the next image is similar.
+static int iw_reuse_corr_table(struct iw_context *ctx, double **ptable,
+	const struct iw_corr_table_info *info,
+	const struct iw_image *img, const struct iw_csdescr *csdescr)
+{
+	if(!*ptable) return 0;
+	if(img->sampletype!=IW_SAMPLETYPE_FLOATINGPOINT &&
+		info->bit_depth==img->bit_depth &&
+		info->cs.cstype==csdescr->cstype &&
+		info->cs.gamma==csdescr->gamma)
+	{
+		return 1;
+	}
+	iw_free_corr_table(ctx,ptable);
+	return 0;
 }
 
 // Potentially make a lookup table for color correction.
 static void iw_make_x_to_linear_table(struct iw_context *ctx, double **ptable,
+	struct iw_corr_table_info *info,
 	const struct iw_image *img, const struct iw_csdescr *csdescr)
 {
 	int ncolors;
 	int i;
 	double *tbl;
 
+	if(iw_reuse_corr_table(ctx,ptable,info,img,csdescr)) return;
+
 	if(csdescr->cstype==IW_CSTYPE_LINEAR) return;
+	if(img->sampletype==IW_SAMPLETYPE_FLOATINGPOINT) return;
+	if(img->bit_depth>16) return;
 
 	ncolors = (1 << img->bit_depth);
-	if(ncolors>256) return;
 
-	// Don't make a table if the image is really small.
+	// Don't make a table if the image is really small. For 16-bit images,
+	// the table is big, so don't make it unless there are more pixels than
+	// table entries.
 	if( ((size_t)img->width)*img->height <= 512 ) return;
+	if( ((size_t)img->width)*img->height <= (size_t)ncolors ) return;
 
 	tbl = iw_malloc(ctx,ncolors*sizeof(double));
 	if(!tbl) return;
@@ -1188,9 +2386,34 @@ static void iw_make_x_to_linear_table(struct iw_context *ctx, double **ptable,
 	}
 
 	*ptable = tbl;
+	info->bit_depth = img->bit_depth;
+	info->cs = *csdescr; // struct copy
+}
+
+// Make an index for a sorted table of nentries numbers from 0.0 to 1.0. For
+// each of the nbuckets+1 "buckets", it stores the number of table entries that
+// are <= the lowest number in the bucket. See iw_count_le_using_index().
+static int *iw_make_lookup_index(struct iw_context *ctx, const double *tbl, int nentries,
+	int nbuckets)
+{
+	int *idx;
+	int k;
+	int x;
+
+	idx = (int*)iw_malloc(ctx,(nbuckets+1)*sizeof(int));
+	if(!idx) return NULL;
+
+	x = 0;
+	for(k=0;k<=nbuckets;k++) {
+		// nbuckets is a power of 2, so this division is exact.
+		while(x<nentries && tbl[x] <= ((double)k)/nbuckets) x++;
+		idx[k] = x;
+	}
+	return idx;
 }
 
 static void iw_make_nearest_color_table(struct iw_context *ctx, double **ptable,
+	struct iw_corr_table_info *info,
 	const struct iw_image *img, const struct iw_csdescr *csdescr)
 {
 	int ncolors;
@@ -1200,17 +2423,23 @@ static void iw_make_nearest_color_table(struct iw_context *ctx, double **ptable,
 	double prev;
 	double curr;
 
-	if(ctx->no_gamma) return;
+	if(ctx->no_gamma) {
+		iw_free_corr_table(ctx,ptable);
+		return;
+	}
+	if(iw_reuse_corr_table(ctx,ptable,info,img,csdescr)) return;
+
 	if(csdescr->cstype==IW_CSTYPE_LINEAR) return;
 	if(img->sampletype==IW_SAMPLETYPE_FLOATINGPOINT) return;
 	if(img->bit_depth != ctx->img2.bit_depth) return;
+	if(img->bit_depth>16) return;
 
 	ncolors = (1 << img->bit_depth);
-	if(ncolors>256) return;
 	nentries = ncolors-1;
 
 	// Don't make a table if the image is really small.
 	if( ((size_t)img->width)*img->height <= 512 ) return;
+	if( ((size_t)img->width)*img->height <= (size_t)ncolors ) return;
 
 	tbl = iw_malloc(ctx,nentries*sizeof(double));
 	if(!tbl) return;
@@ -1229,6 +2458,9 @@ static void iw_make_nearest_color_table(struct iw_context *ctx, double **ptable,
 	}
 
 	*ptable = tbl;
+	ctx->nearest_color_table_nentries = nentries;
+	info->bit_depth = img->bit_depth;
+	info->cs = *csdescr; // struct copy
 }
 
 // Label is returned in linear colorspace.
@@ -1367,27 +2599,41 @@ static int iw_process_internal(struct iw_context *ctx)
 	int retval=0;
 	int i,k;
 	int ret;
+	int num_window_rows;
 	// A linear color-correction descriptor to use with alpha channels.
 	struct iw_csdescr csdescr_linear;
 
 	ctx->intermediate32=NULL;
 	ctx->intermediate_alpha32=NULL;
 	ctx->final_alpha32=NULL;
-	ctx->intermed_canvas_width = ctx->input_w;
-	ctx->intermed_canvas_height = ctx->img2.height;
+
+	iw_decide_resize_order(ctx);
+	if(ctx->resize_order==IW_RESIZE_ORDER_H_FIRST) {
+		ctx->intermed_canvas_width = ctx->img2.width;
+		ctx->intermed_canvas_height = ctx->input_h;
+	}
+	else {
+		ctx->intermed_canvas_width = ctx->input_w;
+		ctx->intermed_canvas_height = ctx->img2.height;
+	}
 
 	iw_make_linear_csdescr(&csdescr_linear);
 
 	ctx->img2.bpr = iw_calc_bytesperrow(ctx->img2.width,ctx->img2.bit_depth*ctx->img2_numchannels);
 
-	ctx->img2.pixels = iw_malloc_large(ctx, ctx->img2.bpr, ctx->img2.height);
-	if(!ctx->img2.pixels) {
-		goto done;
+	if(ctx->img2.pixels && ctx->img2.bpr>0 &&
+		ctx->img2_pixels_size/ctx->img2.bpr >= (size_t)ctx->img2.height)
+	{
+		// Reuse the buffer from the previous image. See iw_reset_context().
 	}
-
-	ctx->intermediate32 = (iw_float32*)iw_malloc_large(ctx, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
-	if(!ctx->intermediate32) {
-		goto done;
+	else {
+		if(ctx->img2.pixels) iw_free(ctx,ctx->img2.pixels);
+		ctx->img2_pixels_size = 0;
+		ctx->img2.pixels = iw_malloc_large(ctx, ctx->img2.bpr, ctx->img2.height);
+		if(!ctx->img2.pixels) {
+			goto done;
+		}
+		ctx->img2_pixels_size = ctx->img2.bpr * ctx->img2.height;
 	}
 
 	if(ctx->uses_errdiffdither) {
@@ -1398,35 +2644,67 @@ static int iw_process_internal(struct iw_context *ctx)
 	}
 
 	if(!ctx->disable_output_lookup_tables) {
-		iw_make_x_to_linear_table(ctx,&ctx->output_rev_color_corr_table,&ctx->img2,&ctx->img2cs);
-
-		iw_make_nearest_color_table(ctx,&ctx->nearest_color_table,&ctx->img2,&ctx->img2cs);
+		iw_make_x_to_linear_table(ctx,&ctx->output_rev_color_corr_table,
+			&ctx->output_rev_color_corr_table_info,&ctx->img2,&ctx->img2cs);
+
+		iw_make_nearest_color_table(ctx,&ctx->nearest_color_table,
+			&ctx->nearest_color_table_info,&ctx->img2,&ctx->img2cs);
+
+		// Make the indexes that let us search the tables quickly.
+		if(ctx->output_rev_color_corr_table || ctx->nearest_color_table) {
+			ctx->lookup_index_nbuckets = 4<<ctx->img2.bit_depth;
+			if(ctx->lookup_index_nbuckets>65536) ctx->lookup_index_nbuckets=65536;
+		}
+		if(ctx->output_rev_color_corr_table) {
+			ctx->output_rev_color_corr_table_nentries = 1<<ctx->img2.bit_depth;
+			ctx->output_rev_index = iw_make_lookup_index(ctx,ctx->output_rev_color_corr_table,
+				ctx->output_rev_color_corr_table_nentries,ctx->lookup_index_nbuckets);
+		}
+		if(ctx->nearest_color_table) {
+			ctx->nearest_color_index = iw_make_lookup_index(ctx,ctx->nearest_color_table,
+				ctx->nearest_color_table_nentries,ctx->lookup_index_nbuckets);
+			if(!ctx->nearest_color_index) {
+				iw_free(ctx,ctx->nearest_color_table);
+				ctx->nearest_color_table = NULL;
+			}
+		}
+	}
+	else {
+		iw_free_corr_table(ctx,&ctx->output_rev_color_corr_table);
+		iw_free_corr_table(ctx,&ctx->nearest_color_table);
 	}
 
-	// If an alpha channel is present, we have to process it first.
+	// If an alpha channel is present, the color channels will need the
+	// resized alpha samples.
 	if(IW_IMGTYPE_HAS_ALPHA(ctx->intermed_imgtype)) {
-		ctx->intermediate_alpha32 = (iw_float32*)iw_malloc_large(ctx, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
-		if(!ctx->intermediate_alpha32) {
-			goto done;
-		}
 		ctx->final_alpha32 = (iw_float32*)iw_malloc_large(ctx, ctx->img2.width * ctx->img2.height, sizeof(iw_float32));
 		if(!ctx->final_alpha32) {
 			goto done;
 		}
+	}
 
-		if(!iw_process_one_channel(ctx,ctx->intermed_alpha_channel_index,&csdescr_linear,&csdescr_linear)) goto done;
+	num_window_rows = iw_can_process_channels_together(ctx);
+	if(num_window_rows>0) {
+		// Process all the channels at the same time.
+		if(!iw_process_channels_together(ctx,&csdescr_linear,num_window_rows)) goto done;
 	}
+	else {
+		// If an alpha channel is present, we have to process it first.
+		if(IW_IMGTYPE_HAS_ALPHA(ctx->intermed_imgtype)) {
+			if(!iw_process_one_channel(ctx,ctx->intermed_alpha_channel_index,&csdescr_linear,&csdescr_linear)) goto done;
+		}
 
-	// Process the non-alpha channels.
+		// Process the non-alpha channels.
 
-	for(channel=0;channel<ctx->intermed_numchannels;channel++) {
-		if(ctx->intermed_ci[channel].channeltype!=IW_CHANNELTYPE_ALPHA) {
-			if(ctx->no_gamma)
-				ret=iw_process_one_channel(ctx,channel,&csdescr_linear,&csdescr_linear);
-			else
-				ret=iw_process_one_channel(ctx,channel,&ctx->img1cs,&ctx->img2cs);
+		for(channel=0;channel<ctx->intermed_numchannels;channel++) {
+			if(ctx->intermed_ci[channel].channeltype!=IW_CHANNELTYPE_ALPHA) {
+				if(ctx->no_gamma)
+					ret=iw_process_one_channel(ctx,channel,&csdescr_linear,&csdescr_linear);
+				else
+					ret=iw_process_one_channel(ctx,channel,&ctx->img1cs,&ctx->img2cs);
 
-			if(!ret) goto done;
+				if(!ret) goto done;
+			}
 		}
 	}
 
@@ -1446,16 +2724,164 @@ done:
 		if(ctx->dither_errors[k]) { iw_free(ctx,ctx->dither_errors[k]); ctx->dither_errors[k]=NULL; }
 	}
 	// The 'resize contexts' are usually kept around so that they can be reused.
-	// Now that we're done with everything, free them.
+	// Now that we're done with this image, move them to the cache, in case the
+	// context is reset and used for another image.
 	for(i=0;i<2;i++) { // horizontal, vertical
 		if(ctx->resize_settings[i].rrctx) {
-			iwpvt_resize_rows_done(ctx->resize_settings[i].rrctx);
+			iw_done_with_rrctx(ctx,ctx->resize_settings[i].rrctx);
 			ctx->resize_settings[i].rrctx = NULL;
 		}
 	}
 	return retval;
 }
 
+// Returns nonzero if, for a palette image, every output pixel would be an
+// unmodified copy of some input pixel, provided the resize contexts only pick
+// single pixels (see iw_make_palette_direct_map()).
+static int iw_palette_direct_ok(struct iw_context *ctx)
+{
+	int i;
+
+	if(!ctx->img1_palette) return 0;
+	if(ctx->img2.sampletype!=IW_SAMPLETYPE_UINT || ctx->img2.bit_depth!=8) return 0;
+	if(ctx->img2.imgtype!=ctx->img1_imgtype_logical) return 0;
+	if(ctx->intermed_imgtype!=ctx->img1_imgtype_logical) return 0;
+	if(ctx->apply_bkgd || ctx->req.negate_target || ctx->to_grayscale) return 0;
+	if(ctx->reduced_output_maxcolor_flag) return 0;
+	for(i=0;i<2;i++) {
+		if(ctx->resize_settings[i].use_offset) return 0;
+	}
+	for(i=0;i<ctx->img2_numchannels;i++) {
+		if(ctx->img2_ci[i].ditherfamily!=IW_DITHERFAMILY_NONE) return 0;
+		if(ctx->img2_ci[i].color_count!=0) return 0;
+	}
+	// An 8-bit sample converted to linear and back is unchanged, if the
+	// colorspaces are the same.
+	if(!ctx->no_gamma) {
+		if(ctx->img1cs.cstype!=ctx->img2cs.cstype) return 0;
+		if(ctx->img1cs.cstype==IW_CSTYPE_GAMMA && ctx->img1cs.gamma!=ctx->img2cs.gamma) return 0;
+	}
+	return 1;
+}
+
+// For each of the num_out_pix output pixels, find the one input pixel it is
+// copied from. Returns 0 if any output pixel is not simply a copy.
+static int iw_make_palette_direct_map(struct iw_context *ctx, struct iw_rr_ctx *rrctx,
+	int num_in_pix, int num_out_pix, int *map)
+{
+	int i;
+	int n;
+	int max_contribs;
+	int *src_pix = NULL;
+	double *weight = NULL;
+	int retval = 0;
+
+	max_contribs = iwpvt_resize_max_contribs(rrctx);
+	if(max_contribs<1) max_contribs=1;
+	src_pix = (int*)iw_malloc(ctx, max_contribs*sizeof(int));
+	if(!src_pix) goto done;
+	weight = (double*)iw_malloc(ctx, max_contribs*sizeof(double));
+	if(!weight) goto done;
+
+	for(i=0;i<num_out_pix;i++) {
+		n = iwpvt_resize_get_contribs(rrctx,i,src_pix,weight);
+		if(n!=1 || weight[0]!=1.0) goto done;
+		if(src_pix[0]<0 || src_pix[0]>=num_in_pix) goto done;
+		map[i] = src_pix[0];
+	}
+	retval = 1;
+
+done:
+	if(src_pix) iw_free(ctx,src_pix);
+	if(weight) iw_free(ctx,weight);
+	return retval;
+}
+
+// If the output image can be made just by copying palette indices from the
+// input image (e.g. no resizing, or "nearest neighbor" resizing), do that,
+// and set *phandled. The output image is then also a palette image, with
+// the same palette as the input image; see iwpvt_optimize_image().
+// Returns 0 on failure.
+static int iw_process_palette_direct(struct iw_context *ctx, int *phandled)
+{
+	int *srcx = NULL;
+	int *srcy = NULL;
+	struct iw_rr_ctx *rrctx_h, *rrctx_v;
+	int i,j;
+	int rx,ry;
+	iw_byte *dstrow;
+	int retval = 0;
+
+	*phandled = 0;
+	if(!iw_palette_direct_ok(ctx)) return 1;
+
+	rrctx_h = iw_get_rrctx(ctx,IW_DIMENSION_H,ctx->intermed_ci[0].channeltype);
+	rrctx_v = iw_get_rrctx(ctx,IW_DIMENSION_V,ctx->intermed_ci[0].channeltype);
+	if(!rrctx_h || !rrctx_v) return 0;
+
+	srcx = (int*)iw_malloc(ctx, ctx->img2.width*sizeof(int));
+	if(!srcx) goto done;
+	srcy = (int*)iw_malloc(ctx, ctx->img2.height*sizeof(int));
+	if(!srcy) goto done;
+
+	if(!iw_make_palette_direct_map(ctx,rrctx_h,ctx->input_w,ctx->img2.width,srcx) ||
+		!iw_make_palette_direct_map(ctx,rrctx_v,ctx->input_h,ctx->img2.height,srcy))
+	{
+		// Not a simple copy. The caller will do it the normal way.
+		retval = 1;
+		goto done;
+	}
+
+	ctx->img2.imgtype = IW_IMGTYPE_PALETTE;
+	ctx->img2.bpr = iw_calc_bytesperrow(ctx->img2.width,8);
+
+	if(ctx->img2.pixels && ctx->img2.bpr>0 &&
+		ctx->img2_pixels_size/ctx->img2.bpr >= (size_t)ctx->img2.height)
+	{
+		// Reuse the buffer from the previous image. See iw_reset_context().
+	}
+	else {
+		if(ctx->img2.pixels) iw_free(ctx,ctx->img2.pixels);
+		ctx->img2_pixels_size = 0;
+		ctx->img2.pixels = iw_malloc_large(ctx, ctx->img2.bpr, ctx->img2.height);
+		if(!ctx->img2.pixels) {
+			goto done;
+		}
+		ctx->img2_pixels_size = ctx->img2.bpr * ctx->img2.height;
+	}
+
+	for(j=0;j<ctx->img2.height;j++) {
+		dstrow = &ctx->img2.pixels[j*ctx->img2.bpr];
+		for(i=0;i<ctx->img2.width;i++) {
+			translate_coords(ctx,srcx[i],srcy[j],&rx,&ry);
+			dstrow[i] = (iw_byte)get_raw_palette_index(ctx,rx,ry);
+		}
+	}
+
+	// Don't let iw_process_bkgd_label() use a table left over from a
+	// previous image.
+	iw_reuse_corr_table(ctx,&ctx->output_rev_color_corr_table,
+		&ctx->output_rev_color_corr_table_info,&ctx->img2,&ctx->img2cs);
+	iw_process_bkgd_label(ctx);
+
+	*phandled = 1;
+	retval = 1;
+
+done:
+	if(srcx) iw_free(ctx,srcx);
+	if(srcy) iw_free(ctx,srcy);
+	if(*phandled || !retval) {
+		// Same as at the end of iw_process_internal().
+		for(i=0;i<2;i++) {
+			if(ctx->resize_settings[i].rrctx) {
+				iw_done_with_rrctx(ctx,ctx->resize_settings[i].rrctx);
+				ctx->resize_settings[i].rrctx = NULL;
+			}
+		}
+	}
+	return retval;
+}
+
 static int iw_get_channeltype(int imgtype, int channel)
 {
 	switch(imgtype) {
@@ -1825,6 +3251,7 @@ static void iw_set_auto_resizetype(struct iw_context *ctx, int size1, int size2,
 	// (We can't do that if using a translation or channel offset.)
 	if(size2==size1 && !ctx->resize_settings[dimension].use_offset &&
 		!ctx->req.out_true_valid &&
+		ctx->resize_settings[dimension].in_true_size==0.0 &&
 		ctx->resize_settings[dimension].translate==0.0)
 	{
 		iw_set_resize_alg(ctx, dimension, IW_RESIZETYPE_NULL, 1.0, 0.0, 0.0);
@@ -1835,24 +3262,69 @@ static void iw_set_auto_resizetype(struct iw_context *ctx, int size1, int size2,
 	iw_set_resize_alg(ctx, dimension, IW_RESIZETYPE_CUBIC, 1.0, 0.0, 0.5);
 }
 
+// If the input image doesn't occupy all of its last row or column of pixels
+// (see iw_set_input_true_size()), record the part of the cropped region
+// that it does occupy.
+static void iw_set_input_true_range(struct iw_resize_settings *rs, int start, int count,
+	int num_pix, double true_size, int reversed)
+{
+	double lo, hi;
+
+	if(reversed) {
+		lo = (double)num_pix - true_size;
+		hi = (double)num_pix;
+	}
+	else {
+		lo = 0.0;
+		hi = true_size;
+	}
+	if(lo<(double)start) lo = (double)start;
+	if(hi>(double)(start+count)) hi = (double)(start+count);
+	if(hi<=lo) return;
+
+	rs->in_true_size = hi-lo;
+	rs->in_true_start = lo-(double)start;
+}
+
+// Returns nonzero if any palette entry is not fully opaque.
+static int iw_palette_has_transparency(const struct iw_palette *pal)
+{
+	int i;
+	for(i=0;i<pal->num_entries;i++) {
+		if(pal->entry[i].a<255) return 1;
+	}
+	return 0;
+}
+
 static void init_channel_info(struct iw_context *ctx)
 {
 	int i;
+	int num_real_channels;
 
 	ctx->img1_imgtype_logical = ctx->img1.imgtype;
+	if(ctx->img1.imgtype==IW_IMGTYPE_PALETTE && ctx->img1_palette) {
+		// Palette images are processed as RGB or RGBA. The samples are read
+		// from the palette.
+		ctx->img1_imgtype_logical = iw_palette_has_transparency(ctx->img1_palette) ?
+			IW_IMGTYPE_RGBA : IW_IMGTYPE_RGB;
+	}
 
 	if(ctx->resize_settings[IW_DIMENSION_H].edge_policy==IW_EDGE_POLICY_TRANSPARENT ||
 		ctx->resize_settings[IW_DIMENSION_V].edge_policy==IW_EDGE_POLICY_TRANSPARENT)
 	{
 		// Add a virtual alpha channel
-		if(ctx->img1.imgtype==IW_IMGTYPE_GRAY) {
+		if(ctx->img1_imgtype_logical==IW_IMGTYPE_GRAY) {
 			ctx->img1_imgtype_logical = IW_IMGTYPE_GRAYA;
 		}
-		else if(ctx->img1.imgtype==IW_IMGTYPE_RGB)
+		else if(ctx->img1_imgtype_logical==IW_IMGTYPE_RGB)
 			ctx->img1_imgtype_logical = IW_IMGTYPE_RGBA;
 	}
 
 	ctx->img1_numchannels_physical = iw_imgtype_num_channels(ctx->img1.imgtype);
+	num_real_channels = ctx->img1_numchannels_physical;
+	if(ctx->img1.imgtype==IW_IMGTYPE_PALETTE && ctx->img1_palette) {
+		num_real_channels = iw_palette_has_transparency(ctx->img1_palette) ? 4 : 3;
+	}
 	ctx->img1_numchannels_logical = iw_imgtype_num_channels(ctx->img1_imgtype_logical);
 	ctx->img1_alpha_channel_index = iw_imgtype_alpha_channel_index(ctx->img1_imgtype_logical);
 
@@ -1866,7 +3338,7 @@ static void init_channel_info(struct iw_context *ctx)
 		ctx->intermed_ci[i].channeltype = ctx->img1_ci[i].channeltype;
 		ctx->intermed_ci[i].corresponding_input_channel = i;
 		ctx->img2_ci[i].channeltype = ctx->img1_ci[i].channeltype;
-		if(i>=ctx->img1_numchannels_physical) {
+		if(i>=num_real_channels) {
 			// This is a virtual channel, which is handled by get_raw_sample().
 			// But some optimizations cause that function to be bypassed, so we
 			// have to disable those optimizations.
@@ -1936,22 +3408,53 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 		prepare_grayscale(ctx);
 	}
 
+	if(ctx->img1.imgtype!=IW_IMGTYPE_PALETTE && ctx->img1_palette) {
+		// A palette was set, but the image doesn't use it.
+		iw_free(ctx,ctx->img1_palette);
+		ctx->img1_palette = NULL;
+	}
+	if(ctx->img1.imgtype==IW_IMGTYPE_PALETTE) {
+		if(!ctx->img1_palette) {
+			iw_set_error(ctx,"Internal: Palette not set");
+			return 0;
+		}
+		if(ctx->img1.sampletype!=IW_SAMPLETYPE_UINT ||
+			(ctx->img1.bit_depth!=1 && ctx->img1.bit_depth!=2 &&
+			ctx->img1.bit_depth!=4 && ctx->img1.bit_depth!=8))
+		{
+			iw_set_error(ctx,"Internal: Unsupported palette image bit depth");
+			return 0;
+		}
+	}
+
 	init_channel_info(ctx);
 
 	ctx->img2.width = w;
 	ctx->img2.height = h;
 
 	// Figure out the region of the source image to read from.
-	if(ctx->input_start_x<0) ctx->input_start_x=0;
-	if(ctx->input_start_y<0) ctx->input_start_y=0;
-	if(ctx->input_start_x>ctx->img1.width-1) ctx->input_start_x=ctx->img1.width-1;
-	if(ctx->input_start_y>ctx->img1.height-1) ctx->input_start_x=ctx->img1.height-1;
-	if(ctx->input_w<0) ctx->input_w = ctx->img1.width - ctx->input_start_x;
-	if(ctx->input_h<0) ctx->input_h = ctx->img1.height - ctx->input_start_y;
-	if(ctx->input_w<1) ctx->input_w = 1;
-	if(ctx->input_h<1) ctx->input_h = 1;
-	if(ctx->input_w>(ctx->img1.width-ctx->input_start_x)) ctx->input_w=ctx->img1.width-ctx->input_start_x;
-	if(ctx->input_h>(ctx->img1.height-ctx->input_start_y)) ctx->input_h=ctx->img1.height-ctx->input_start_y;
+	if(ctx->img1_region_valid) {
+		// The crop refers to the full image, of which img1 is only a part.
+		iwpvt_clamp_crop(ctx->img1_full_width,ctx->img1_full_height,
+			&ctx->input_start_x,&ctx->input_start_y,&ctx->input_w,&ctx->input_h);
+		ctx->input_start_x -= ctx->img1_region_x;
+		ctx->input_start_y -= ctx->img1_region_y;
+	}
+	iwpvt_clamp_crop(ctx->img1.width,ctx->img1.height,
+		&ctx->input_start_x,&ctx->input_start_y,&ctx->input_w,&ctx->input_h);
+
+	ctx->resize_settings[IW_DIMENSION_H].in_true_size = 0.0;
+	ctx->resize_settings[IW_DIMENSION_H].in_true_start = 0.0;
+	ctx->resize_settings[IW_DIMENSION_V].in_true_size = 0.0;
+	ctx->resize_settings[IW_DIMENSION_V].in_true_start = 0.0;
+	if(ctx->img1_true_valid) {
+		iw_set_input_true_range(&ctx->resize_settings[IW_DIMENSION_H],
+			ctx->input_start_x,ctx->input_w,ctx->img1.width,
+			ctx->img1_true_width,ctx->img1.orient_transform&0x1);
+		iw_set_input_true_range(&ctx->resize_settings[IW_DIMENSION_V],
+			ctx->input_start_y,ctx->input_h,ctx->img1.height,
+			ctx->img1_true_height,ctx->img1.orient_transform&0x2);
+	}
 
 	// Decide on the output colorspace.
 	if(ctx->req.output_cs_valid) {
@@ -1977,10 +3480,19 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 
 	// Make sure maxcolorcodes are set.
 	if(ctx->img1.sampletype!=IW_SAMPLETYPE_FLOATINGPOINT) {
-		ctx->input_maxcolorcode_int = (1 << ctx->img1.bit_depth)-1;
+		if(ctx->img1_palette) {
+			// The samples are read from the palette, and are always 8-bit.
+			ctx->input_maxcolorcode_int = 255;
+		}
+		else {
+			ctx->input_maxcolorcode_int = (1 << ctx->img1.bit_depth)-1;
+		}
 		ctx->input_maxcolorcode = (double)ctx->input_maxcolorcode_int;
 
 		for(i=0;i<IW_CI_COUNT;i++) {
+			if(ctx->img1_palette) {
+				ctx->img1_ci[i].maxcolorcode_int = 255;
+			}
 			if(ctx->img1_ci[i].maxcolorcode_int<=0) {
 				ctx->img1_ci[i].maxcolorcode_int = ctx->input_maxcolorcode_int;
 			}
@@ -2001,6 +3513,14 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 			ctx->img1_ci[i].disable_fast_get_sample=1;
 		}
 	}
+	else {
+		ctx->get_raw_samples_fn = iw_choose_get_raw_samples_fn(ctx->img1.bit_depth);
+		if(!ctx->get_raw_samples_fn) {
+			for(i=0;i<ctx->img1_numchannels_physical;i++) {
+				ctx->img1_ci[i].disable_fast_get_sample=1;
+			}
+		}
+	}
 
 	// Set the .use_offset flags, based on whether the caller set any
 	// .channel_offset[]s.
@@ -2198,8 +3718,17 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 		}
 	}
 
-	if(!ctx->support_reduced_input_bitdepths && ctx->img1.sampletype==IW_SAMPLETYPE_UINT) {
-		iw_make_x_to_linear_table(ctx,&ctx->input_color_corr_table,&ctx->img1,&ctx->img1cs);
+	if(!ctx->support_reduced_input_bitdepths && ctx->img1.sampletype==IW_SAMPLETYPE_UINT &&
+		!ctx->img1_palette)
+	{
+		// (For palette images, iw_make_palette_table() does the conversion
+		// for each palette entry instead.)
+		iw_make_x_to_linear_table(ctx,&ctx->input_color_corr_table,
+			&ctx->input_color_corr_table_info,&ctx->img1,&ctx->img1cs);
+	}
+	else {
+		// Don't use a table left over from a previous image.
+		iw_free_corr_table(ctx,&ctx->input_color_corr_table);
 	}
 
 	if(ctx->img1_bkgd_label_set) {
@@ -2223,9 +3752,11 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 	}
 
 	if(ctx->resize_settings[IW_DIMENSION_H].family==IW_RESIZETYPE_AUTO) {
+		ctx->resize_settings[IW_DIMENSION_H].auto_family = 1;
 		iw_set_auto_resizetype(ctx,ctx->input_w,ctx->img2.width,IW_DIMENSION_H);
 	}
 	if(ctx->resize_settings[IW_DIMENSION_V].family==IW_RESIZETYPE_AUTO) {
+		ctx->resize_settings[IW_DIMENSION_V].auto_family = 1;
 		iw_set_auto_resizetype(ctx,ctx->input_h,ctx->img2.height,IW_DIMENSION_V);
 	}
 
@@ -2246,6 +3777,7 @@ static int iw_prepare_processing(struct iw_context *ctx, int w, int h)
 IW_IMPL(int) iw_process_image(struct iw_context *ctx)
 {
 	int ret;
+	int handled;
 	int retval = 0;
 
 	if(ctx->use_count>0) {
@@ -2257,10 +3789,16 @@ IW_IMPL(int) iw_process_image(struct iw_context *ctx)
 	ret = iw_prepare_processing(ctx,ctx->canvas_width,ctx->canvas_height);
 	if(!ret) goto done;
 
-	ret = iw_process_internal(ctx);
+	ret = iw_process_palette_direct(ctx,&handled);
 	if(!ret) goto done;
 
-	iwpvt_optimize_image(ctx);
+	if(!handled) {
+		ret = iw_process_internal(ctx);
+		if(!ret) goto done;
+	}
+
+	ret = iwpvt_optimize_image(ctx);
+	if(!ret) goto done;
 
 	retval = 1;
 done:
@@ -17,6 +17,7 @@
 struct iwmiffrcontext {
 	int host_endian;
 	struct iw_iodescr *iodescr;
+	struct iw_bufreader br;
 	struct iw_context *ctx;
 	struct iw_image *img;
 	int read_error_flag;
@@ -40,15 +41,14 @@ struct iwmiffrcontext {
 	struct iw_zlib_context *zctx;
 };
 
+// When compressing using multiple threads, the approximate amount of
+// uncompressed data to process per thread, per batch.
+#define IWMIFF_BATCH_SIZE_PER_THREAD 524288
+
 static int iwmiff_read(struct iwmiffrcontext *rctx,
 		iw_byte *buf, size_t buflen)
 {
-	int ret;
-	size_t bytesread = 0;
-
-	ret = (*rctx->iodescr->read_fn)(rctx->ctx,rctx->iodescr,
-		buf,buflen,&bytesread);
-	if(!ret || bytesread!=buflen) {
+	if(!iw_bufreader_read(&rctx->br,buf,buflen)) {
 		rctx->read_error_flag=1;
 		return 0;
 	}
@@ -57,19 +57,13 @@ static int iwmiff_read(struct iwmiffrcontext *rctx,
 
 static iw_byte iwmiff_read_byte(struct iwmiffrcontext *rctx)
 {
-	iw_byte buf[1];
-	int ret;
-	size_t bytesread = 0;
-
-	// TODO: buffering
+	iw_byte b;
 
-	ret = (*rctx->iodescr->read_fn)(rctx->ctx,rctx->iodescr,
-		buf,1,&bytesread);
-	if(!ret || bytesread!=1) {
+	if(!iw_bufreader_read_byte(&rctx->br,&b)) {
 		rctx->read_error_flag=1;
 		return '\0';
 	}
-	return buf[0];
+	return b;
 }
 
 static unsigned int iwmiff_read_uint32(struct iwmiffrcontext *rctx)
@@ -85,6 +79,7 @@ static int iwmiff_read_zip_compressed_row(struct iwmiffrcontext *rctx,
 	iw_byte *buf, size_t buflen)
 {
 	size_t cmprsize;
+	const iw_byte *cdata;
 	int retval=0;
 	int ret;
 
@@ -106,6 +101,16 @@ static int iwmiff_read_zip_compressed_row(struct iwmiffrcontext *rctx,
 		goto done;
 	}
 
+	// If possible, decompress the row straight from the read buffer.
+	cdata = iw_bufreader_peek(&rctx->br,cmprsize);
+	if(cdata) {
+		ret = rctx->zmod->inflate_item(rctx->zctx,(iw_byte*)cdata,cmprsize,buf,buflen);
+		if(!ret) goto done;
+		if(!iw_bufreader_skip(&rctx->br,cmprsize)) goto done;
+		retval = 1;
+		goto done;
+	}
+
 	// If necessary, allocate a buffer to read the row into.
 	if(rctx->cbuf_alloc < cmprsize) {
 		if(rctx->cbuf) {
@@ -116,6 +121,7 @@ static int iwmiff_read_zip_compressed_row(struct iwmiffrcontext *rctx,
 	if(!rctx->cbuf) {
 		rctx->cbuf = iw_malloc(rctx->ctx, cmprsize+1024);
 		if(!rctx->cbuf) goto done;
+		rctx->cbuf_alloc = cmprsize+1024;
 	}
 
 	// Read a row of compressed data from the file
@@ -548,6 +554,9 @@ IW_IMPL(int) iw_read_miff_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 
 	img.sampletype = IW_SAMPLETYPE_FLOATINGPOINT;
 
+	if(!iw_bufreader_init(ctx,&rctx.br,iodescr))
+		goto done;
+
 	if(!iwmiff_read_header(&rctx))
 		goto done;
 
@@ -587,6 +596,7 @@ IW_IMPL(int) iw_read_miff_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 	retval = 1;
 
 done:
+	iw_bufreader_done(&rctx.br);
 	if(!retval) {
 		iw_set_error(ctx,"Failed to read MIFF file");
 		iw_free(ctx, img.pixels);
@@ -785,6 +795,71 @@ static int iwmiff_compress_and_write_row(struct iwmiffwcontext *wctx,
 	return 0;
 }
 
+// Convert and compress a batch of rows at a time, using multiple threads.
+// The result is a single zlib stream with a sync flush after each row, the
+// same as iwmiff_write_zip_compressed_row() would produce (though not
+// necessarily byte-for-byte identical).
+static int iwmiff_write_zip_parallel(struct iwmiffwcontext *wctx,
+	int num_channels, size_t dstbpr, int max_threads)
+{
+	struct iw_image *img = wctx->img;
+	iw_byte *batchbuf = NULL;
+	size_t *csize = NULL;
+	iw_byte *zbuf = NULL;
+	size_t zlen;
+	size_t pos;
+	int rows_per_batch;
+	int first_row;
+	int nrows;
+	int j;
+	int retval=0;
+
+	rows_per_batch = (int)(((size_t)max_threads*IWMIFF_BATCH_SIZE_PER_THREAD)/dstbpr);
+	if(rows_per_batch<1) rows_per_batch=1;
+	if(rows_per_batch>img->height) rows_per_batch=img->height;
+
+	batchbuf = iw_malloc_large(wctx->ctx,rows_per_batch,dstbpr);
+	if(!batchbuf) goto done;
+	csize = iw_malloc(wctx->ctx,rows_per_batch*sizeof(size_t));
+	if(!csize) goto done;
+
+	wctx->zctx = wctx->zmod->deflate_init(wctx->ctx);
+	if(!wctx->zctx) goto done;
+
+	for(first_row=0;first_row<img->height;first_row+=nrows) {
+		nrows = img->height - first_row;
+		if(nrows>rows_per_batch) nrows=rows_per_batch;
+
+		for(j=0;j<nrows;j++) {
+			iwmiffw_convert_row32(wctx,&img->pixels[(first_row+j)*img->bpr],
+				&batchbuf[j*dstbpr],img->width*num_channels);
+		}
+
+		if(!wctx->zmod->deflate_items(wctx->zctx,batchbuf,nrows*dstbpr,dstbpr,0,
+			&zbuf,&zlen,csize))
+		{
+			goto done;
+		}
+
+		// Write each row's 'count', followed by its compressed data.
+		pos = 0;
+		for(j=0;j<nrows;j++) {
+			iwmiff_write_uint32(wctx,(unsigned int)csize[j]);
+			iwmiff_write(wctx,&zbuf[pos],csize[j]);
+			pos += csize[j];
+		}
+		iw_free(wctx->ctx,zbuf);
+		zbuf = NULL;
+	}
+
+	retval = 1;
+done:
+	iw_free(wctx->ctx,batchbuf);
+	iw_free(wctx->ctx,csize);
+	iw_free(wctx->ctx,zbuf);
+	return retval;
+}
+
 static int iwmiff_write_main(struct iwmiffwcontext *wctx)
 {
 	struct iw_image *img;
@@ -795,6 +870,7 @@ static int iwmiff_write_main(struct iwmiffwcontext *wctx)
 	int bytes_per_sample;
 	int num_channels;
 	int cmpr_req;
+	int max_threads;
 	int retval=0;
 
 	img = wctx->img;
@@ -847,6 +923,15 @@ static int iwmiff_write_main(struct iwmiffwcontext *wctx)
 
 	iwmiff_write_header(wctx);
 
+	max_threads = iw_get_value(wctx->ctx,IW_VAL_MAX_THREADS);
+	if(wctx->compression==IW_COMPRESSION_ZIP && max_threads>1 &&
+		wctx->zmod->deflate_items && img->height>1)
+	{
+		if(!iwmiff_write_zip_parallel(wctx,num_channels,dstbpr,max_threads)) goto done;
+		retval = 1;
+		goto done;
+	}
+
 	dstrow = iw_mallocz(wctx->ctx,dstbpr);
 	if(!dstrow) goto done;
 
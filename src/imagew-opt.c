@@ -15,378 +15,361 @@
 
 #include "imagew-internals.h"
 
-static void iw_opt_scanpixels_rgb8(struct iw_opt_ctx *optctx)
+// Must be a power of 2, and much larger than the max number of palette colors.
+#define IWOPT_CLRHASH_SIZE   1024
+#define IWOPT_CLRHASH_BITS   10
+#define IWOPT_CLRBITMAP_BITS 12
+
+// A hash table (using open addressing) that maps colors to palette indices.
+struct iwopt_color_hash {
+	iw_uint32 key[IWOPT_CLRHASH_SIZE]; // Colors packed by iwopt_pack_color()
+	short idx[IWOPT_CLRHASH_SIZE]; // -1 = unused slot
+	// One bit for each value of a second hash function. If a color's bit is
+	// not set, the color is definitely not in the table, and we don't have
+	// to probe for it.
+	iw_byte bitmap[(1<<IWOPT_CLRBITMAP_BITS)/8];
+};
+
+// Information about img2, gathered by iwopt_scan_image().
+struct iwopt_scan_ctx {
+	int nc; // Number of channels in img2
+	int alpha_ch; // The alpha channel index, or -1 if there is no alpha channel
+	int is_rgb;
+	int is16;
+
+	// Set if img2 is a palette image (see iw_process_palette_direct()). Its
+	// nominal type, with nc channels, is optctx->imgtype, and pal_pixels
+	// holds the palette entries in that format.
+	int is_palette_img;
+	iw_byte pal_pixels[256*4];
+
+	int collecting_palette; // Set if we are still collecting palette colors.
+	int palette_ok; // Set if all the colors were collected into optctx->palette.
+	struct iwopt_color_hash clrhash; // Indexes the colors in optctx->palette.
+	int have_prev_color;
+	iw_uint32 prev_color; // The last color looked up in clrhash
+	int prev_color_idx; // ... and its palette index
+
+	// For the binary transparency optimization: Which of the possible key
+	// colors are used by nontransparent pixels. See iwopt_try_binary_trns().
+	// The "8" tables assume the image will be reduced to 8 bits/sample.
+	iw_byte clr_used_rgb8[256];   // Red samples of colors with G=B=192
+	iw_byte clr_used_gray8[256];  // Gray samples
+	iw_byte clr_used_rgb16[256];  // Low byte of red, if all other bytes are 192
+	iw_byte clr_used_gray16[256]; // Low byte of gray, if the high byte is 192
+};
+
+static iw_uint32 iwopt_pack_color(const struct iw_rgba8color *c)
 {
-	int i,j;
-	iw_byte r,g,b;
-	const iw_byte *ptr;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*3];
-			r=ptr[0]; g=ptr[1]; b=ptr[2];
-
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
+	return (((iw_uint32)c->r)<<24) | (((iw_uint32)c->g)<<16) |
+		(((iw_uint32)c->b)<<8) | (iw_uint32)c->a;
+}
 
-			if(optctx->has_color) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
-		}
+static void iwopt_clrhash_clear(struct iwopt_color_hash *h)
+{
+	int i;
+	for(i=0;i<IWOPT_CLRHASH_SIZE;i++) {
+		h->idx[i] = -1;
 	}
-done:
-	;
+	iw_zeromem(h->bitmap,sizeof(h->bitmap));
 }
 
-static void iw_opt_scanpixels_ga8(struct iw_opt_ctx *optctx)
+// Returns the palette index of the color, or -1 if not found.
+// If not found, *pslot is set to the slot where it can be added.
+static int iwopt_clrhash_find(const struct iwopt_color_hash *h, iw_uint32 key, int *pslot)
 {
-	int i,j;
-	iw_byte a;
-	const iw_byte *ptr;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*2];
-			a=ptr[1];
-
-			// Check transparency
-			if(a<255) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
-				}
-			}
-
-			if(optctx->has_partial_transparency) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
+	iw_uint32 hv;
+	unsigned int bit;
+	int slot;
+
+	hv = key*0x9e3779b1U;
+	slot = (int)(hv>>(32-IWOPT_CLRHASH_BITS));
+	bit = (hv>>8) & ((1<<IWOPT_CLRBITMAP_BITS)-1);
+
+	if(!(h->bitmap[bit/8] & (1<<(bit%8)))) {
+		// Definitely not present. Find an unused slot.
+		while(h->idx[slot]>=0) {
+			slot = (slot+1)&(IWOPT_CLRHASH_SIZE-1);
 		}
+		*pslot = slot;
+		return -1;
 	}
-done:
-	;
+
+	while(h->idx[slot]>=0) {
+		if(h->key[slot]==key) return h->idx[slot];
+		slot = (slot+1)&(IWOPT_CLRHASH_SIZE-1);
+	}
+	*pslot = slot;
+	return -1;
 }
 
-static void iw_opt_scanpixels_rgba8(struct iw_opt_ctx *optctx)
+// 'slot' must have been returned by iwopt_clrhash_find().
+static void iwopt_clrhash_add(struct iwopt_color_hash *h, iw_uint32 key, int slot, int idx)
 {
-	int i,j;
-	iw_byte r,g,b,a;
-	const iw_byte *ptr;
+	unsigned int bit;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*4];
-			r=ptr[0]; g=ptr[1]; b=ptr[2]; a=ptr[3];
-
-			// Check transparency
-			if(a<255) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
-				}
-			}
+	bit = ((key*0x9e3779b1U)>>8) & ((1<<IWOPT_CLRBITMAP_BITS)-1);
+	h->bitmap[bit/8] |= (iw_byte)(1<<(bit%8));
+	h->key[slot] = key;
+	h->idx[slot] = (short)idx;
+}
 
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
+// Rebuild the hash table from the palette, after the palette has changed.
+static void iwopt_clrhash_index_palette(struct iwopt_scan_ctx *scan, const struct iw_palette *pal)
+{
+	int i;
+	int slot;
+	iw_uint32 key;
 
-			if(optctx->has_partial_transparency && optctx->has_color) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
+	iwopt_clrhash_clear(&scan->clrhash);
+	scan->have_prev_color = 0;
+	for(i=0;i<pal->num_entries;i++) {
+		key = iwopt_pack_color(&pal->entry[i]);
+		if(iwopt_clrhash_find(&scan->clrhash,key,&slot)<0) {
+			iwopt_clrhash_add(&scan->clrhash,key,slot,i);
 		}
 	}
-done:
-	;
 }
 
-static void iw_opt_scanpixels_g16(struct iw_opt_ctx *optctx)
+// Read a pixel from img2, as an 8-bit color. For 16-bit images, only the
+// most significant byte of each sample is used.
+static void iwopt_get_rgba8(const struct iwopt_scan_ctx *scan, const iw_byte *p,
+	struct iw_rgba8color *c)
 {
-	int i,j;
-	const iw_byte *ptr;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)];
-
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1])
-			{
-				optctx->has_16bit_precision=1;
-			}
+	int bps = scan->is16 ? 2 : 1;
 
-			if(optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
-		}
+	if(scan->is_rgb) {
+		c->r = p[0];
+		c->g = p[bps];
+		c->b = p[2*bps];
 	}
-done:
-	;
+	else {
+		c->r = c->g = c->b = p[0];
+	}
+	c->a = (scan->alpha_ch>=0) ? p[scan->alpha_ch*bps] : 255;
+	if(c->a==0) { c->r = c->g = c->b = 0; } // all invisible colors are the same
 }
 
-static void iw_opt_scanpixels_ga16(struct iw_opt_ctx *optctx)
+// Make all fully transparent pixels in this row "black". This makes the other
+// optimization routines simpler, makes the output image more deterministic,
+// and can make the image look better in viewers that ignore the alpha channel.
+static void iwopt_make_transparent_pixels_black(const struct iwopt_scan_ctx *scan,
+	iw_byte *row, int npixels)
 {
-	int i,j;
-	unsigned int a;
-	const iw_byte *ptr;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*2];
-
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1] || ptr[2]!=ptr[3])
-			{
-				optctx->has_16bit_precision=1;
-			}
-
-			a=(((unsigned int)ptr[2])<<8) | ptr[3];
+	int i,k;
+	int bps;
+	iw_byte *p;
 
-			// Check transparency
-			if(a<65535) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
-				}
-			}
+	if(scan->alpha_ch<0) return;
+	bps = scan->is16 ? 2 : 1;
 
-			if(optctx->has_partial_transparency && optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
+	for(i=0;i<npixels;i++) {
+		p = &row[i*scan->nc*bps];
+		if(p[scan->alpha_ch*bps]==0 && (bps==1 || p[scan->alpha_ch*bps+1]==0)) {
+			for(k=0;k<scan->alpha_ch*bps;k++) {
+				p[k]=0;
 			}
 		}
 	}
-done:
-	;
 }
 
-static void iw_opt_scanpixels_rgb16(struct iw_opt_ctx *optctx)
+// Scan 'npixels' pixels (usually one row of img2), updating the flags in
+// optctx, and the information in 'scan'.
+static void iwopt_scan_row(struct iw_opt_ctx *optctx, struct iwopt_scan_ctx *scan,
+	const iw_byte *row, int npixels)
 {
-	int i,j;
-	unsigned int r,g,b;
-	const iw_byte *ptr;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*3];
-
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1] || ptr[2]!=ptr[3] || ptr[4]!=ptr[5])
-			{
-				optctx->has_16bit_precision=1;
-			}
+	int i,k;
+	int bps;
+	const iw_byte *p;
+	unsigned int v[4];
+	unsigned int r,g,b,a;
+	unsigned int maxval;
+	struct iw_rgba8color c;
+	iw_uint32 key;
+	int e;
+	int slot;
 
-			r=(((unsigned int)ptr[0])<<8) | ptr[1];
-			g=(((unsigned int)ptr[2])<<8) | ptr[3];
-			b=(((unsigned int)ptr[4])<<8) | ptr[5];
+	bps = scan->is16 ? 2 : 1;
+	maxval = scan->is16 ? 65535 : 255;
 
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
+	for(i=0;i<npixels;i++) {
+		p = &row[i*scan->nc*bps];
 
-			if(optctx->has_color && optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
+		if(scan->is16) {
+			for(k=0;k<scan->nc;k++) {
+				v[k] = (((unsigned int)p[k*2])<<8) | p[k*2+1];
+				// Check if 16-bit output is necessary
+				if(p[k*2]!=p[k*2+1])
+					optctx->has_16bit_precision=1;
+			}
+		}
+		else {
+			for(k=0;k<scan->nc;k++) {
+				v[k] = p[k];
 			}
 		}
-	}
-done:
-	;
-}
-
-static void iw_opt_scanpixels_rgba16(struct iw_opt_ctx *optctx)
-{
-	int i,j;
-	unsigned int r,g,b,a;
-	const iw_byte *ptr;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*4];
+		if(scan->is_rgb) {
+			r=v[0]; g=v[1]; b=v[2];
+		}
+		else {
+			r=g=b=v[0];
+		}
+		a = (scan->alpha_ch>=0) ? v[scan->alpha_ch] : maxval;
 
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1] || ptr[2]!=ptr[3] || ptr[4]!=ptr[5] || ptr[6]!=ptr[7])
-			{
-				optctx->has_16bit_precision=1;
+		// Check transparency
+		if(a<maxval) {
+			optctx->has_transparency=1;
+			if(a>0) {
+				optctx->has_partial_transparency=1;
 			}
+		}
 
-			r=(((unsigned int)ptr[0])<<8) | ptr[1];
-			g=(((unsigned int)ptr[2])<<8) | ptr[3];
-			b=(((unsigned int)ptr[4])<<8) | ptr[5];
-			a=(((unsigned int)ptr[6])<<8) | ptr[7];
-
-			// Check transparency
-			if(a<65535) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
+		// Check grayscale
+		if(r!=g || r!=b)
+			optctx->has_color=1;
+
+		if(scan->collecting_palette) {
+			iwopt_get_rgba8(scan,p,&c);
+			key = iwopt_pack_color(&c);
+			// Neighboring pixels are often the same color.
+			if(!scan->have_prev_color || key!=scan->prev_color) {
+				e = iwopt_clrhash_find(&scan->clrhash,key,&slot);
+				if(e<0) {
+					// not in palette
+					if(optctx->palette->num_entries<256) {
+						e = optctx->palette->num_entries;
+						optctx->palette->entry[e] = c; // struct copy
+						optctx->palette->num_entries++;
+						iwopt_clrhash_add(&scan->clrhash,key,slot,e);
+					}
+					else {
+						// Image has more than 256 colors.
+						scan->collecting_palette = 0;
+						scan->palette_ok = 0;
+					}
 				}
+				scan->have_prev_color = 1;
+				scan->prev_color = key;
+				scan->prev_color_idx = e;
 			}
+		}
 
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
-
-			if(optctx->has_partial_transparency && optctx->has_color && optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
+		if(scan->alpha_ch>=0 && !optctx->has_partial_transparency) {
+			// Keep track of which key colors are used by nontransparent pixels.
+			if((a>>(scan->is16?8:0)) != 0) {
+				if(scan->is_rgb && p[bps]==192 && p[2*bps]==192)
+					scan->clr_used_rgb8[p[0]] = 1;
+				scan->clr_used_gray8[p[0]] = 1;
+			}
+			if(scan->is16 && a!=0 && p[0]==192) {
+				if(scan->is_rgb && g==192*257 && b==192*257)
+					scan->clr_used_rgb16[p[1]] = 1;
+				scan->clr_used_gray16[p[1]] = 1;
 			}
 		}
 	}
-done:
-	;
 }
 
-static void iw_opt_16_to_8(struct iw_context *ctx, struct iw_opt_ctx *optctx, int spp)
+// Returns nonzero if scanning more pixels could not tell us anything useful.
+static int iwopt_scan_is_done(struct iw_opt_ctx *optctx, struct iwopt_scan_ctx *scan)
 {
-	iw_byte *newpixels;
-	size_t newbpr;
-	int i,j,k;
-
-	if(!ctx->opt_16_to_8) return;
-
-	newbpr = iw_calc_bytesperrow(optctx->width,8*spp);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<spp*optctx->width;i++) {
-			// i is a sample number, not a pixel number.
-			newpixels[j*newbpr + i] = optctx->pixelsptr[j*optctx->bpr + i*2];
-		}
+	if(scan->collecting_palette && scan->is16 && optctx->has_16bit_precision) {
+		// Palettes aren't supported with bitdepth>8.
+		scan->collecting_palette = 0;
+		scan->palette_ok = 0;
 	}
 
-	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
-
-	// Attach our new image
-	optctx->tmp_pixels = newpixels;
-	optctx->pixelsptr = optctx->tmp_pixels;
-	optctx->bpr = newbpr;
-	optctx->bit_depth = 8;
-
-	// If there's a background color label, also reduce its precision.
-	if(optctx->has_bkgdlabel) {
-		for(k=0;k<4;k++) {
-			optctx->bkgdlabel[k] >>= 8;
-		}
-	}
+	if(scan->collecting_palette) return 0;
+	if(scan->alpha_ch>=0 && !optctx->has_partial_transparency) return 0;
+	if(scan->is_rgb && !optctx->has_color) return 0;
+	if(scan->is16 && !optctx->has_16bit_precision) return 0;
+	return 1;
 }
 
-// Create a new (8-bit) image by copying up to 3 channels from the old image.
-static void iw_opt_copychannels_8(struct iw_context *ctx, struct iw_opt_ctx *optctx,
-			int new_imgtype, int c0, int c1, int c2)
+// For palette images: Expand the palette to the image's nominal format, and
+// scan just the colors that are used.
+static void iwopt_scan_palette_image(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iwopt_scan_ctx *scan)
 {
-	iw_byte *newpixels;
-	int oldnc, newnc; // num_channels
-	size_t newbpr;
-	int i,j;
-
-	oldnc = iw_imgtype_num_channels(optctx->imgtype);
-	newnc = iw_imgtype_num_channels(new_imgtype);
+	iw_byte used[256];
+	iw_byte used_pixels[256*4];
+	int num_used = 0;
+	int i,j,k;
+	const struct iw_rgba8color *c;
+	const iw_byte *row;
+	iw_byte *p;
 
-	newbpr = iw_calc_bytesperrow(optctx->width,8*newnc);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
+	for(i=0;i<256;i++) {
+		c = &ctx->img1_palette->entry[i];
+		p = &scan->pal_pixels[i*scan->nc];
+		if(scan->is_rgb) {
+			p[0] = c->r; p[1] = c->g; p[2] = c->b;
+		}
+		else {
+			p[0] = c->r;
+		}
+		if(scan->alpha_ch>=0) p[scan->alpha_ch] = c->a;
+	}
+	iwopt_make_transparent_pixels_black(scan,scan->pal_pixels,256);
 
+	iw_zeromem(used,256);
 	for(j=0;j<optctx->height;j++) {
+		row = &ctx->img2.pixels[j*ctx->img2.bpr];
 		for(i=0;i<optctx->width;i++) {
-			newpixels[j*newbpr + i*newnc +0] = optctx->pixelsptr[j*optctx->bpr + i*oldnc +c0];
-			if(newnc>1)
-				newpixels[j*newbpr + i*newnc +1] = optctx->pixelsptr[j*optctx->bpr + i*oldnc +c1];
-			if(newnc>2)
-				newpixels[j*newbpr + i*newnc +2] = optctx->pixelsptr[j*optctx->bpr + i*oldnc +c2];
+			used[row[i]] = 1;
 		}
 	}
 
-	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
-
-	// Attach our new image
-	optctx->tmp_pixels = newpixels;
-	optctx->pixelsptr = optctx->tmp_pixels;
-	optctx->bpr = newbpr;
-	optctx->imgtype = new_imgtype;
-
+	for(i=0;i<256;i++) {
+		if(!used[i]) continue;
+		for(k=0;k<scan->nc;k++) {
+			used_pixels[num_used*scan->nc+k] = scan->pal_pixels[i*scan->nc+k];
+		}
+		num_used++;
+	}
+	iwopt_scan_row(optctx,scan,used_pixels,num_used);
 }
 
-// Create a new (16-bit) image by copying up to 3 channels from the old image.
-static void iw_opt_copychannels_16(struct iw_context *ctx, struct iw_opt_ctx *optctx,
-			int new_imgtype, int c0, int c1, int c2)
+// Returns a pointer to pixel (x,y) of img2, in its nominal format.
+static IW_INLINE const iw_byte *iwopt_get_src_pixel(struct iw_context *ctx,
+	const struct iwopt_scan_ctx *scan, int x, int y)
 {
-	iw_byte *newpixels;
-	int oldnc, newnc; // num_channels
-	size_t newbpr;
-	int i,j;
+	if(scan->is_palette_img) {
+		return &scan->pal_pixels[ctx->img2.pixels[y*ctx->img2.bpr + x]*scan->nc];
+	}
+	return &ctx->img2.pixels[y*ctx->img2.bpr + x*scan->nc*(scan->is16?2:1)];
+}
 
-	oldnc = iw_imgtype_num_channels(optctx->imgtype);
-	newnc = iw_imgtype_num_channels(new_imgtype);
+// Make one pass over img2, to make transparent pixels black, and to collect
+// all the information that the optimization routines need: the has_*
+// flags, up to 256 palette colors, and the key colors that are in use.
+static void iwopt_scan_image(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iwopt_scan_ctx *scan)
+{
+	int j;
+	int scanning = 1;
+	iw_byte *row;
 
-	newbpr = iw_calc_bytesperrow(optctx->width,16*newnc);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
+	if(scan->is_palette_img) {
+		iwopt_scan_palette_image(ctx,optctx,scan);
+		return;
+	}
 
 	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			newpixels[j*newbpr + (i*newnc+0)*2+0] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c0)*2+0];
-			newpixels[j*newbpr + (i*newnc+0)*2+1] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c0)*2+1];
-			if(newnc>1) {
-				newpixels[j*newbpr + (i*newnc+1)*2+0] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c1)*2+0];
-				newpixels[j*newbpr + (i*newnc+1)*2+1] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c1)*2+1];
-			}
-			if(newnc>2) {
-				newpixels[j*newbpr + (i*newnc+2)*2+0] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c2)*2+0];
-				newpixels[j*newbpr + (i*newnc+2)*2+1] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c2)*2+1];
+		row = &ctx->img2.pixels[j*ctx->img2.bpr];
+		iwopt_make_transparent_pixels_black(scan,row,optctx->width);
+		if(scanning) {
+			iwopt_scan_row(optctx,scan,row,optctx->width);
+			if(iwopt_scan_is_done(optctx,scan)) {
+				// No further optimizations possible, but any remaining
+				// transparent pixels still need to be made black.
+				scanning = 0;
 			}
 		}
 	}
-
-	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
-
-	// Attach our new image
-	optctx->tmp_pixels = newpixels;
-	optctx->pixelsptr = optctx->tmp_pixels;
-	optctx->bpr = newbpr;
-	optctx->imgtype = new_imgtype;
 }
 
-// Returns 0 if no scanning was done.
-static int iw_opt_scanpixels(struct iw_context *ctx, struct iw_opt_ctx *optctx)
-{
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16) {
-		iw_opt_scanpixels_rgba16(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8) {
-		iw_opt_scanpixels_rgba8(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==16) {
-		iw_opt_scanpixels_rgb16(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==8) {
-		iw_opt_scanpixels_rgb8(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16) {
-		iw_opt_scanpixels_ga16(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==8) {
-		iw_opt_scanpixels_ga8(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_GRAY && optctx->bit_depth==16) {
-		iw_opt_scanpixels_g16(optctx);
-	}
-	else {
-		return 0;
-	}
-
-	return 1;
-}
-
-////////////////////
-
 // Returns 0 if nothing found.
 static int iwopt_find_unused(const iw_byte *flags, int count, iw_byte *unused_clr)
 {
@@ -413,288 +396,135 @@ static int iwopt_find_unused(const iw_byte *flags, int count, iw_byte *unused_cl
 	return 0;
 }
 
-// Try to convert from RGBA to RGB+binary trns.
-// Assumes we already know there is transparency, but no partial transparency.
-static void iwopt_try_rgb8_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Create a new image from img2, having type optctx->imgtype and depth
+// optctx->bit_depth. The new image may have fewer channels, and may have
+// 8 bits/sample instead of 16.
+// If optctx->has_colorkey_trns is set, fully transparent pixels are changed
+// to the key color.
+// Returns 0 on failure.
+static int iwopt_repack(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	const struct iwopt_scan_ctx *scan)
 {
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
-	iw_byte clr_used[256];
-	iw_byte key_clr=0; // Red component of the key color
-	iw_byte *trns_mask = NULL;
-
-	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
-	if(!ctx->opt_binary_trns) return;
-
-	// Try to find a color that's not used in the image.
-	// Looking for all 2^24 possible colors is too much work.
-	// We will just look for 256 predefined colors: R={0-255},G=192,B=192
-	iw_zeromem(clr_used,256);
-
-	// Hard to decide how to do this. I don't want the optimization phase
-	// to modify img2.pixels, though that would be the easiest method.
-	// Another option would be to make a version of iw_opt_copychannels_8()
-	// that sets the transparent pixels to a certain value, but that would
-	// get messy.
-	// Instead, I'll make a transparency mask, then strip the alpha
-	// channel, then use the mask to patch up the new image.
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*4];
-			if(ptr[3]==0) {
-				// transparent pixel
-				trns_mask[j*optctx->width+i] = 0; // Remember which pixels are transparent.
-				continue;
-			}
-			else {
-				trns_mask[j*optctx->width+i] = 1;
-			}
-			if(ptr[1]!=192 || ptr[2]!=192) continue;
-			clr_used[(int)ptr[0]] = 1;
-		}
-	}
-
-	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
-	}
+	iw_byte *newpixels;
+	size_t newbpr;
+	int newnc;
+	int src_bps, dst_bps;
+	int src_ch[4]; // The img2 channel to use for each new channel
+	int i,j,k;
+	const iw_byte *src;
+	iw_byte *dst;
+	int transparent;
 
-	// Strip the alpha channel:
-	iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_RGB,0,1,2);
-	if(!optctx->tmp_pixels) goto done;
+	newnc = iw_imgtype_num_channels(optctx->imgtype);
+	src_bps = scan->is16 ? 2 : 1;
+	dst_bps = (optctx->bit_depth==16) ? 2 : 1;
 
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+i*3];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = key_clr;
-				ptr2[1] = 192;
-				ptr2[2] = 192;
-			}
-		}
+	for(k=0;k<newnc;k++) {
+		if(IW_IMGTYPE_HAS_ALPHA(optctx->imgtype) && k==newnc-1)
+			src_ch[k] = scan->alpha_ch;
+		else if(IW_IMGTYPE_IS_GRAY(optctx->imgtype))
+			src_ch[k] = 0;
+		else
+			src_ch[k] = k;
 	}
 
-	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192;
-
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
-}
-
-static void iwopt_try_rgb16_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
-{
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
-	iw_byte clr_used[256];
-	iw_byte key_clr=0; // low 8-bits of red component of the key color
-	iw_byte *trns_mask = NULL;
-
-	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
-	if(!ctx->opt_binary_trns) return;
-
-	iw_zeromem(clr_used,256);
-
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
+	newbpr = iw_calc_bytesperrow(optctx->width,optctx->bit_depth*newnc);
+	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
+	if(!newpixels) return 0;
 
 	for(j=0;j<optctx->height;j++) {
 		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*4];
-			if(ptr[6]==0 && ptr[7]==0) {
-				// Transparent pixel
-				trns_mask[j*optctx->width+i] = 0;
-				continue;
-			}
-			else {
-				// Nontransparent pixel
-				trns_mask[j*optctx->width+i] = 1;
+			src = iwopt_get_src_pixel(ctx,scan,i,j);
+			dst = &newpixels[j*newbpr + i*newnc*dst_bps];
+
+			if(optctx->has_colorkey_trns) {
+				// Transparent pixels have already been made black, so if the
+				// most significant byte of alpha is 0, the pixel is transparent.
+				transparent = (src[scan->alpha_ch*src_bps]==0);
+				if(transparent && dst_bps==2) {
+					transparent = (src[scan->alpha_ch*2+1]==0);
+				}
+				if(transparent) {
+					for(k=0;k<newnc;k++) {
+						if(dst_bps==2) {
+							dst[k*2  ] = (iw_byte)(optctx->colorkey[k]>>8);
+							dst[k*2+1] = (iw_byte)(optctx->colorkey[k]&0xff);
+						}
+						else {
+							dst[k] = (iw_byte)optctx->colorkey[k];
+						}
+					}
+					continue;
+				}
 			}
-			// For the colors we look for, all bytes are 192 except possibly the low-red byte.
-			if(ptr[0]!=192 || ptr[2]!=192 || ptr[3]!=192 || ptr[4]!=192 || ptr[5]!=192)
-				continue;
-			clr_used[(int)ptr[1]] = 1;
-		}
-	}
-
-	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
-	}
-
-	// Strip the alpha channel:
-	iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_RGB,0,1,2);
-	if(!optctx->tmp_pixels) goto done;
 
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+(i*2)*3];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = 192;
-				ptr2[1] = key_clr;
-				ptr2[2] = 192;
-				ptr2[3] = 192;
-				ptr2[4] = 192;
-				ptr2[5] = 192;
+			for(k=0;k<newnc;k++) {
+				if(dst_bps==2) {
+					dst[k*2  ] = src[src_ch[k]*2  ];
+					dst[k*2+1] = src[src_ch[k]*2+1];
+				}
+				else {
+					dst[k] = src[src_ch[k]*src_bps];
+				}
 			}
 		}
 	}
 
-	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = 192*256+key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192*256+192;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192*256+192;
+	// Remove previous image if it was allocated by the optimization code.
+	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
 
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+	// Attach our new image
+	optctx->tmp_pixels = newpixels;
+	optctx->pixelsptr = optctx->tmp_pixels;
+	optctx->bpr = newbpr;
+	return 1;
 }
 
-static void iwopt_try_gray8_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Try to convert from RGBA to RGB+binary trns, or from GA to G+binary trns.
+// Assumes we already know there is transparency, but no partial transparency.
+// We look for a key color that's not used in the image. Looking for all 2^24
+// possible colors is too much work. We just look for 256 predefined colors:
+// for RGB, R={0-255},G=192,B=192. For 16-bit images, only the low byte of the
+// red (or gray) sample varies, and all other bytes are 192.
+// This only decides what to do. The image is changed by iwopt_repack().
+static void iwopt_try_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	const struct iwopt_scan_ctx *scan)
 {
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
-	iw_byte clr_used[256];
+	const iw_byte *clr_used;
 	iw_byte key_clr=0;
-	iw_byte *trns_mask = NULL;
+	int is_rgb;
 
 	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
 	if(!ctx->opt_binary_trns) return;
 
-	iw_zeromem(clr_used,256);
-
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*2];
-			if(ptr[1]==0) {
-				// Transparent pixel
-				trns_mask[j*optctx->width+i] = 0;
-				continue;
-			}
-			else {
-				// Nontransparent pixel
-				trns_mask[j*optctx->width+i] = 1;
-			}
-			clr_used[(int)ptr[0]] = 1;
-		}
-	}
+	is_rgb = (optctx->imgtype==IW_IMGTYPE_RGBA);
+	if(optctx->bit_depth==16)
+		clr_used = is_rgb ? scan->clr_used_rgb16 : scan->clr_used_gray16;
+	else
+		clr_used = is_rgb ? scan->clr_used_rgb8 : scan->clr_used_gray8;
 
 	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
+		return;
 	}
 
-	// Strip the alpha channel:
-	iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAY,0,0,0);
-	if(!optctx->tmp_pixels) goto done;
-
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+i];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = key_clr;
-			}
-		}
-	}
+	// Strip the alpha channel.
+	optctx->imgtype = is_rgb ? IW_IMGTYPE_RGB : IW_IMGTYPE_GRAY;
 
 	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = key_clr;
-
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
-}
-
-static void iwopt_try_gray16_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
-{
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
-	iw_byte clr_used[256];
-	iw_byte key_clr=0; // low 8-bits of the key color
-	iw_byte *trns_mask = NULL;
-
-	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
-	if(!ctx->opt_binary_trns) return;
-
-	iw_zeromem(clr_used,256);
-
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*2];
-			if(ptr[2]==0 && ptr[3]==0) {
-				// Transparent pixel
-				trns_mask[j*optctx->width+i] = 0;
-				continue;
-			}
-			else {
-				// Nontransparent pixel
-				trns_mask[j*optctx->width+i] = 1;
-			}
-			// For the colors we look for, the high byte is always 192.
-			if(ptr[0]!=192)
-				continue;
-			clr_used[(int)ptr[1]] = 1;
-		}
-	}
-
-	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
+	if(optctx->bit_depth==16) {
+		optctx->colorkey[IW_CHANNELTYPE_RED] = 192*256+key_clr;
+		optctx->colorkey[IW_CHANNELTYPE_GREEN] = is_rgb ? 192*256+192 : 192*256+key_clr;
+		optctx->colorkey[IW_CHANNELTYPE_BLUE] = is_rgb ? 192*256+192 : 192*256+key_clr;
 	}
-
-	// Strip the alpha channel:
-	iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAY,0,0,0);
-	if(!optctx->tmp_pixels) goto done;
-
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+(i*2)];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = 192;
-				ptr2[1] = key_clr;
-			}
-		}
+	else {
+		optctx->colorkey[IW_CHANNELTYPE_RED] = key_clr;
+		optctx->colorkey[IW_CHANNELTYPE_GREEN] = is_rgb ? 192 : key_clr;
+		optctx->colorkey[IW_CHANNELTYPE_BLUE] = is_rgb ? 192 : key_clr;
 	}
-
-	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = 192*256+key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192*256+key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192*256+key_clr;
-
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
 }
 
 ////////////////////
 
-// returns palette entry, or -1 if not found
-static int iwopt_find_color(const struct iw_palette *pal, const struct iw_rgba8color *c)
-{
-	int i;
-	for(i=0;i<pal->num_entries;i++) {
-		if(pal->entry[i].r==c->r && pal->entry[i].g==c->g &&
-			pal->entry[i].b==c->b && pal->entry[i].a==c->a)
-		{
-			return i;
-		}
-	}
-	return -1;
-}
-
 // Returns palette index to use for the background color, or -1 if not found.
 static int iwopt_find_bkgd_color(const struct iw_palette *pal, const struct iw_rgba8color *c)
 {
@@ -715,137 +545,79 @@ static int iwopt_find_bkgd_color(const struct iw_palette *pal, const struct iw_r
 }
 
 // Writes to optctx->palette.
-// Returns 1 if a palette can be used.
-static int optctx_collect_palette_colors(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Make sure the palette has a color that can be used for the background
+// color label.
+// Returns 0 if there is no room for it.
+static int iwopt_add_bkgd_to_palette(struct iw_context *ctx, struct iw_opt_ctx *optctx)
 {
-	int x,y;
 	struct iw_rgba8color c;
-	const iw_byte *ptr;
-	int spp;
 	int e;
 
-	spp = iw_imgtype_num_channels(optctx->imgtype);
-
-	for(y=0;y<optctx->height;y++) {
-		for(x=0;x<optctx->width;x++) {
-			ptr = &optctx->pixelsptr[y*optctx->bpr + x*spp];
-
-			if(optctx->imgtype==IW_IMGTYPE_RGB) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = 255;
-			}
-			else if(optctx->imgtype==IW_IMGTYPE_RGBA) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = ptr[3];
-				// TODO: This check is probably no longer necessary.
-				if(c.a==0) { c.r = c.g = c.b = 0; } // all invisible colors are the same
-			}
-			else if(optctx->imgtype==IW_IMGTYPE_GRAYA) {
-				c.r = c.g = c.b = ptr[0];
-				c.a = ptr[1];
-				// TODO: This check is probably no longer necessary.
-				if(c.a==0) { c.r = c.g = c.b = 0; }
-			}
-			else { // optctx->imgtype==IW_IMGTYPE_GRAY(?)
-				c.r = c.g = c.b = ptr[0];
-				c.a = 255;
-			}
-
-			e = iwopt_find_color(optctx->palette,&c);
-			if(e<0) {
-				// not in palette
-				if(optctx->palette->num_entries<256) {
-					optctx->palette->entry[optctx->palette->num_entries] = c; // struct copy
-					optctx->palette->num_entries++;
-				}
-				else {
-					// Image has more than 256 colors.
-					return 0;
-				}
-			}
+	if(!optctx->has_bkgdlabel) return 1;
+
+	c.r = optctx->bkgdlabel[0];
+	c.g = optctx->bkgdlabel[1];
+	c.b = optctx->bkgdlabel[2];
+	c.a = 255;
+	e = iwopt_find_bkgd_color(optctx->palette,&c);
+	if(e<0) {
+		// Did not find a suiteable palette entry for the background color.
+		// Is there room to add one?
+		if(optctx->palette->num_entries<256) {
+			// Yes.
+			optctx->palette->entry[optctx->palette->num_entries] = c;
+			optctx->palette->num_entries++;
 		}
-	}
-
-	if(optctx->palette->num_entries<1) return 0; // Shouldn't happen.
-
-	if(optctx->has_bkgdlabel) {
-		c.r = optctx->bkgdlabel[0];
-		c.g = optctx->bkgdlabel[1];
-		c.b = optctx->bkgdlabel[2];
-		c.a = 255;
-		e = iwopt_find_bkgd_color(optctx->palette,&c);
-		if(e<0) {
-			// Did not find a suiteable palette entry for the background color.
-			// Is there room to add one?
-			if(optctx->palette->num_entries<256) {
-				// Yes.
-				optctx->palette->entry[optctx->palette->num_entries] = c;
-				optctx->palette->num_entries++;
-			}
-			else {
-				// No.
-				return 0;
-			}
+		else {
+			// No.
+			return 0;
 		}
 	}
-
 	return 1;
 }
 
-static void iwopt_convert_to_palette_image(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Create the palette image directly from img2.
+// Returns 0 on failure.
+static int iwopt_convert_to_palette_image(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iwopt_scan_ctx *scan)
 {
 	iw_byte *newpixels;
 	size_t newbpr;
 	int x,y;
 	struct iw_rgba8color c;
 	const iw_byte *ptr;
-	int spp;
 	int e;
-
-	spp = iw_imgtype_num_channels(optctx->imgtype);
+	int slot;
+	iw_uint32 key;
 
 	newbpr = optctx->width;
 	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
+	if(!newpixels) return 0;
+
+	// The palette may have been sorted or replaced since it was collected.
+	iwopt_clrhash_index_palette(scan,optctx->palette);
 
 	for(y=0;y<optctx->height;y++) {
 		for(x=0;x<optctx->width;x++) {
-			ptr = &optctx->pixelsptr[y*optctx->bpr + x*spp];
-
-			if(optctx->imgtype==IW_IMGTYPE_RGB) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = 255;
-			}
-			else if(optctx->imgtype==IW_IMGTYPE_RGBA) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = ptr[3];
-				if(c.a==0) { c.r = c.g = c.b = 0; }
-			}
-			else if(optctx->imgtype==IW_IMGTYPE_GRAYA) {
-				c.r = c.g = c.b = ptr[0];
-				c.a = ptr[1];
-				if(c.a==0) { c.r = c.g = c.b = 0; }
-			}
-			else { // optctx->imgtype==IW_IMGTYPE_GRAY(?)
-				c.r = c.g = c.b = ptr[0];
-				c.a = 255;
-			}
+			ptr = iwopt_get_src_pixel(ctx,scan,x,y);
+			iwopt_get_rgba8(scan,ptr,&c);
 
 			if(optctx->has_colorkey_trns && c.a==0) {
 				// We'll only get here if the image is really grayscale.
 				e = optctx->colorkey[IW_CHANNELTYPE_RED];
 			}
 			else {
-				e = iwopt_find_color(optctx->palette,&c);
-				if(e<0) e=0; // shouldn't happen
+				key = iwopt_pack_color(&c);
+				if(scan->have_prev_color && key==scan->prev_color) {
+					e = scan->prev_color_idx;
+				}
+				else {
+					e = iwopt_clrhash_find(&scan->clrhash,key,&slot);
+					if(e<0) e=0; // shouldn't happen
+					scan->have_prev_color = 1;
+					scan->prev_color = key;
+					scan->prev_color_idx = e;
+				}
 			}
 
 			newpixels[y*newbpr + x] = e;
@@ -861,6 +633,7 @@ static void iwopt_convert_to_palette_image(struct iw_context *ctx, struct iw_opt
 	optctx->bpr = newbpr;
 	optctx->bit_depth = 8;
 	optctx->imgtype = IW_IMGTYPE_PALETTE;
+	return 1;
 }
 
 static int iwopt_palsortfunc(const void* p1, const void* p2)
@@ -1008,36 +781,22 @@ static void iwopt_make_gray_palette(struct iw_context *ctx, struct iw_opt_ctx *o
 }
 
 // Optimize to palette, or 1-, 2-, or 4-bpp grayscale.
-static void iwopt_try_pal_lowgray_optimization(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Optimize to palette, or 1-, 2-, or 4-bpp grayscale.
+// optctx->palette contains the image's colors, collected by iwopt_scan_image().
+static void iwopt_try_pal_lowgray_optimization(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iwopt_scan_ctx *scan)
 {
-	int ret;
 	int binary_trns;
 	unsigned int trns_shade;
 
-	if(!(ctx->output_profile&IW_PROFILE_PAL1) &&
-	   !(ctx->output_profile&IW_PROFILE_PAL2) &&
-	   !(ctx->output_profile&IW_PROFILE_PAL4) &&
-	   !(ctx->output_profile&IW_PROFILE_PAL8) &&
-	   !(ctx->output_profile&IW_PROFILE_GRAY1) &&
-	   !(ctx->output_profile&IW_PROFILE_GRAY2) &&
-	   !(ctx->output_profile&IW_PROFILE_GRAY4) )
-	{
-		// Output format doesn't support anything that this optimization can provide.
-		return;
-	}
-
 	if(optctx->bit_depth!=8) {
 		// Palettes aren't supported with bitdepth>8.
-		return;
+		goto done;
 	}
 
-	optctx->palette = iw_malloc(ctx,sizeof(struct iw_palette));
-	if(!optctx->palette) return;
-
-	optctx->palette->num_entries=0;
+	if(optctx->palette->num_entries<1) goto done; // Shouldn't happen.
 
-	ret = optctx_collect_palette_colors(ctx,optctx);
-	if(!ret) {
+	if(!iwopt_add_bkgd_to_palette(ctx,optctx)) {
 		// Image can't be converted to a palette image.
 		goto done;
 	}
@@ -1098,7 +857,10 @@ static void iwopt_try_pal_lowgray_optimization(struct iw_context *ctx, struct iw
 			sizeof(struct iw_rgba8color),iwopt_palsortfunc);
 	}
 
-	iwopt_convert_to_palette_image(ctx,optctx);
+	if(!iwopt_convert_to_palette_image(ctx,optctx,scan)) {
+		optctx->has_colorkey_trns = 0;
+		optctx->palette_is_grayscale = 0;
+	}
 
 done:
 	if(optctx->imgtype!=IW_IMGTYPE_PALETTE) {
@@ -1109,64 +871,19 @@ done:
 
 ////////////////////
 
-static void make_transparent_pixels_black8(struct iw_context *ctx, struct iw_image *img, int nc)
-{
-	int i,j,k;
-	iw_byte *p;
-
-	for(j=0;j<img->height;j++) {
-		for(i=0;i<img->width;i++) {
-			p = &img->pixels[j*img->bpr + i*nc];
-			if(p[nc-1]==0) {
-				for(k=0;k<nc-1;k++) {
-					p[k]=0;
-				}
-			}
-		}
-	}
-}
-
-static void make_transparent_pixels_black16(struct iw_context *ctx, struct iw_image *img, int nc)
-{
-	int i,j,k;
-	iw_byte *p;
-
-	for(j=0;j<img->height;j++) {
-		for(i=0;i<img->width;i++) {
-			p = &img->pixels[j*img->bpr + i*nc*2];
-			if(p[(nc-1)*2]==0 && p[(nc-1)*2+1]==0) {
-				for(k=0;k<nc-1;k++) {
-					p[k*2  ]=0;
-					p[k*2+1]=0;
-				}
-			}
-		}
-	}
-}
-
-// Make all fully transparent pixels "black". This makes the other optimization
-// routines simpler, makes the output image more deterministic, and can make
-// the image look better in viewers that ignore the alpha channel.
-// Doing this in a separate pass is not the most efficient way to do it, but
-// it's easiest and safest.
-static void make_transparent_pixels_black(struct iw_context *ctx, struct iw_image *img)
-{
-	int nc;
-	if(!IW_IMGTYPE_HAS_ALPHA(img->imgtype)) return;
-
-	nc = iw_imgtype_num_channels(img->imgtype);
-
-	if(img->bit_depth>8)
-		make_transparent_pixels_black16(ctx,img,nc);
-	else
-		make_transparent_pixels_black8(ctx,img,nc);
-}
-
 // Strip alpha channel if there are no actual transparent pixels, etc.
-void iwpvt_optimize_image(struct iw_context *ctx)
+// The image is scanned once, by iwopt_scan_image(). Then we decide on the
+// final image type and bit depth, and make (at most) one new copy of the
+// image.
+// Returns 0 on failure, which can only happen if img2 is a palette image
+// (which must always be converted to some other format).
+int iwpvt_optimize_image(struct iw_context *ctx)
 {
 	struct iw_opt_ctx *optctx;
+	struct iwopt_scan_ctx *scan = NULL;
+	unsigned int orig_bkgdlabel[4];
 	int k;
+	int retval = 1;
 
 	optctx = &ctx->optctx;
 
@@ -1174,6 +891,10 @@ void iwpvt_optimize_image(struct iw_context *ctx)
 	optctx->width = ctx->img2.width;
 	optctx->height = ctx->img2.height;
 	optctx->imgtype = ctx->img2.imgtype;
+	if(ctx->img2.imgtype==IW_IMGTYPE_PALETTE) {
+		// The nominal type of the palette's colors
+		optctx->imgtype = ctx->img1_imgtype_logical;
+	}
 	optctx->bit_depth = ctx->img2.bit_depth;
 	optctx->bpr = ctx->img2.bpr;
 	optctx->pixelsptr = ctx->img2.pixels;
@@ -1190,14 +911,16 @@ void iwpvt_optimize_image(struct iw_context *ctx)
 	}
 
 	if(ctx->img2.sampletype!=IW_SAMPLETYPE_UINT) {
-		return;
+		return 1;
 	}
 
 	if(ctx->reduced_output_maxcolor_flag) {
-		return;
+		return 1;
 	}
 
-	make_transparent_pixels_black(ctx,&ctx->img2);
+	if(optctx->bit_depth!=8 && optctx->bit_depth!=16) {
+		return 1;
+	}
 
 	if(optctx->has_bkgdlabel) {
 		// The optimization routines are responsible for ensuring that the
@@ -1230,85 +953,102 @@ void iwpvt_optimize_image(struct iw_context *ctx)
 		}
 	}
 
-	if(!iw_opt_scanpixels(ctx,optctx)) {
-		goto noscan;
-	}
-
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,4);
-	}
+	scan = iw_mallocz(ctx,sizeof(struct iwopt_scan_ctx));
+	if(!scan) return (ctx->img2.imgtype==IW_IMGTYPE_PALETTE) ? 0 : 1;
 
-	if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,3);
-	}
+	scan->is_palette_img = (ctx->img2.imgtype==IW_IMGTYPE_PALETTE);
+	scan->nc = iw_imgtype_num_channels(optctx->imgtype);
+	scan->alpha_ch = IW_IMGTYPE_HAS_ALPHA(optctx->imgtype) ? scan->nc-1 : -1;
+	scan->is_rgb = IW_IMGTYPE_IS_GRAY(optctx->imgtype) ? 0 : 1;
+	scan->is16 = (optctx->bit_depth==16);
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,2);
-	}
-
-	if(optctx->imgtype==IW_IMGTYPE_GRAY && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,1);
+	if(((ctx->output_profile&IW_PROFILE_PAL1) ||
+	    (ctx->output_profile&IW_PROFILE_PAL2) ||
+	    (ctx->output_profile&IW_PROFILE_PAL4) ||
+	    (ctx->output_profile&IW_PROFILE_PAL8) ||
+	    (ctx->output_profile&IW_PROFILE_GRAY1) ||
+	    (ctx->output_profile&IW_PROFILE_GRAY2) ||
+	    (ctx->output_profile&IW_PROFILE_GRAY4)) &&
+	   (!scan->is16 || (ctx->opt_16_to_8 && !optctx->has_16bit_precision)))
+	{
+		// The output format supports something that the palette/low-gray
+		// optimization can provide, so collect the colors as we scan.
+		optctx->palette = iw_malloc(ctx,sizeof(struct iw_palette));
+		if(optctx->palette) {
+			optctx->palette->num_entries=0;
+			scan->collecting_palette = 1;
+			scan->palette_ok = 1;
+			iwopt_clrhash_clear(&scan->clrhash);
+		}
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_RGB,0,1,2); // RGBA -> RGB
-	}
+	iwopt_scan_image(ctx,optctx,scan);
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_RGB,0,1,2); // RGBA -> RGB (16)
+	for(k=0;k<4;k++) {
+		orig_bkgdlabel[k] = optctx->bkgdlabel[k];
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // GA -> G (16)
-	}
+	// Decide on the image type and bit depth.
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==8 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // GA -> G
-	}
+	if(optctx->bit_depth==16 && !optctx->has_16bit_precision && ctx->opt_16_to_8) {
+		optctx->bit_depth = 8;
 
-	if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==8 && !optctx->has_color &&
-	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
-	{
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // RGB -> G
+		// If there's a background color label, also reduce its precision.
+		if(optctx->has_bkgdlabel) {
+			for(k=0;k<4;k++) {
+				optctx->bkgdlabel[k] >>= 8;
+			}
+		}
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==16 && !optctx->has_color &&
-	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
-	{
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // RGB -> G (16)
+	if(IW_IMGTYPE_HAS_ALPHA(optctx->imgtype) && !optctx->has_transparency && ctx->opt_strip_alpha) {
+		// RGBA -> RGB, GA -> G
+		optctx->imgtype = (optctx->imgtype==IW_IMGTYPE_RGBA) ? IW_IMGTYPE_RGB : IW_IMGTYPE_GRAY;
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8 && !optctx->has_color &&
+	if(!IW_IMGTYPE_IS_GRAY(optctx->imgtype) && !optctx->has_color &&
 	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
 	{
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAYA,0,3, 0); // RGBA -> GA
+		// RGB -> G, RGBA -> GA
+		optctx->imgtype = (optctx->imgtype==IW_IMGTYPE_RGBA) ? IW_IMGTYPE_GRAYA : IW_IMGTYPE_GRAY;
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_color &&
-	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
-	{
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAYA,0,3, 0); // RGBA -> GA (16)
+	if(optctx->palette) {
+		if(scan->palette_ok) {
+			iwopt_try_pal_lowgray_optimization(ctx,optctx,scan);
+		}
+		else {
+			iw_free(ctx,optctx->palette);
+			optctx->palette = NULL;
+		}
 	}
-
-noscan:
-
-	iwopt_try_pal_lowgray_optimization(ctx,optctx);
+	if(optctx->imgtype==IW_IMGTYPE_PALETTE) goto done;
 
 	// Try to convert an alpha channel to binary transparency.
-
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8 && !optctx->has_partial_transparency) {
-		iwopt_try_rgb8_binary_trns(ctx,optctx);
+	if(IW_IMGTYPE_HAS_ALPHA(optctx->imgtype) && !optctx->has_partial_transparency) {
+		iwopt_try_binary_trns(ctx,optctx,scan);
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_partial_transparency) {
-		iwopt_try_rgb16_binary_trns(ctx,optctx);
+	if(optctx->imgtype==ctx->img2.imgtype && optctx->bit_depth==ctx->img2.bit_depth) {
+		// Nothing changed. Use img2 as-is.
+		goto done;
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==8 && !optctx->has_partial_transparency) {
-		iwopt_try_gray8_binary_trns(ctx,optctx);
+	if(!iwopt_repack(ctx,optctx,scan)) {
+		if(scan->is_palette_img) {
+			retval = 0;
+			goto done;
+		}
+		// Out of memory. Fall back to the unoptimized image.
+		optctx->imgtype = ctx->img2.imgtype;
+		optctx->bit_depth = ctx->img2.bit_depth;
+		optctx->has_colorkey_trns = 0;
+		for(k=0;k<4;k++) {
+			optctx->bkgdlabel[k] = orig_bkgdlabel[k];
+		}
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16 && !optctx->has_partial_transparency) {
-		iwopt_try_gray16_binary_trns(ctx,optctx);
-	}
+done:
+	iw_free(ctx,scan);
+	return retval;
 }
@@ -10,8 +10,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
@@ -26,6 +28,7 @@ struct iwpngrcontext {
 	int color_type;
 	int sbit_flag;
 	png_color_8 sbit;
+	struct iw_palette iwpal; // Used for palette images
 };
 
 struct errstruct {
@@ -231,6 +234,10 @@ static void iwpng_read_bkgd(struct iwpngrcontext *rctx)
 			((double)bg_colorp->gray)/maxcolor,
 			((double)bg_colorp->gray)/maxcolor);
 		break;
+	case PNG_COLOR_TYPE_PALETTE:
+		// libpng sets the RGB fields from the palette.
+		maxcolor = 255.0;
+		// Fall through
 	case PNG_COLOR_TYPE_RGB:
 	case PNG_COLOR_TYPE_RGB_ALPHA:
 		iw_set_input_bkgd_label(rctx->ctx,
@@ -241,6 +248,33 @@ static void iwpng_read_bkgd(struct iwpngrcontext *rctx)
 	}
 }
 
+// Read the PLTE and tRNS chunks into rctx->iwpal.
+static int iwpng_read_palette(struct iwpngrcontext *rctx)
+{
+	png_colorp plte = NULL;
+	int num_plte = 0;
+	png_bytep trns_alpha = NULL;
+	int num_trns = 0;
+	png_color_16p trns_color;
+	int i;
+
+	if(!png_get_PLTE(rctx->png_ptr, rctx->info_ptr, &plte, &num_plte)) return 0;
+	if(num_plte<1 || num_plte>256) return 0;
+	if(!png_get_tRNS(rctx->png_ptr, rctx->info_ptr, &trns_alpha, &num_trns, &trns_color)) {
+		num_trns = 0;
+	}
+	if(!trns_alpha) num_trns = 0;
+
+	rctx->iwpal.num_entries = num_plte;
+	for(i=0;i<num_plte;i++) {
+		rctx->iwpal.entry[i].r = plte[i].red;
+		rctx->iwpal.entry[i].g = plte[i].green;
+		rctx->iwpal.entry[i].b = plte[i].blue;
+		rctx->iwpal.entry[i].a = (i<num_trns) ? trns_alpha[i] : 255;
+	}
+	return 1;
+}
+
 static void iw_read_ancillary_data1(struct iwpngrcontext *rctx)
 {
 	iwpng_read_sbit(rctx);
@@ -258,6 +292,10 @@ IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	png_uint_32 width, height;
 	int interlace_type;
 	iw_byte **row_pointers = NULL;
+	iw_byte *rowbuf = NULL;
+	size_t full_bpr;
+	int rgn_x, rgn_y, rgn_w, rgn_h;
+	int use_region = 0;
 	int i;
 	jmp_buf jbuf;
 	struct errstruct errinfo;
@@ -322,8 +360,18 @@ IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	has_trns=png_get_valid(png_ptr,info_ptr,PNG_INFO_tRNS);
 	need_update_info=0;
 
-	if(rctx.color_type==PNG_COLOR_TYPE_PALETTE) {
-		// Expand all palette images to full RGB or RGBA.
+	if(rctx.color_type==PNG_COLOR_TYPE_PALETTE && !rctx.sbit_flag) {
+		// Keep palette images as palette images. The colors are read from
+		// the palette as needed, and for some operations the palette indices
+		// can be used directly.
+		if(!iwpng_read_palette(&rctx)) {
+			iw_set_error(ctx,"Invalid PNG palette");
+			goto done;
+		}
+	}
+	else if(rctx.color_type==PNG_COLOR_TYPE_PALETTE) {
+		// The sBIT chunk can't be applied to the palette, so expand to full
+		// RGB or RGBA.
 		png_set_palette_to_rgb(png_ptr);
 		need_update_info=1;
 	}
@@ -367,6 +415,11 @@ IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 		numchannels = 4;
 		is_supported=1;
 		break;
+	case PNG_COLOR_TYPE_PALETTE:
+		img.imgtype = IW_IMGTYPE_PALETTE;
+		numchannels = 1;
+		is_supported=1;
+		break;
 	}
 
 	if(!is_supported) {
@@ -382,26 +435,69 @@ IW_IMPL(int) iw_read_png_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 		png_set_shift(png_ptr, &rctx.sbit);
 	}
 
-	img.width = width;
-	img.height = height;
+	// If only part of the image is needed, and the image is not interlaced,
+	// store only that part, and stop reading after its last row.
+	if(interlace_type==PNG_INTERLACE_NONE &&
+		iw_get_input_region(ctx,(int)width,(int)height,&rgn_x,&rgn_y,&rgn_w,&rgn_h))
+	{
+		if(img.bit_depth<8) {
+			// Start on a byte boundary, so that the pixels can be copied
+			// without shifting.
+			rgn_w += rgn_x%8;
+			rgn_x -= rgn_x%8;
+		}
+		use_region = 1;
+	}
+	else {
+		rgn_x = 0;
+		rgn_y = 0;
+		rgn_w = (int)width;
+		rgn_h = (int)height;
+	}
+
+	img.width = rgn_w;
+	img.height = rgn_h;
 	img.bpr = iw_calc_bytesperrow(img.width,img.bit_depth*numchannels);
 
 	img.pixels = (iw_byte*)iw_malloc_large(ctx, img.bpr,img.height);
 	if(!img.pixels) {
 		goto done;
 	}
-	row_pointers = (iw_byte**)iw_malloc(ctx, img.height * sizeof(iw_byte*));
-	if(!row_pointers) goto done;
 
-	for(i=0;i<img.height;i++) {
-		row_pointers[i] = &img.pixels[img.bpr*i];
+	if(use_region) {
+		full_bpr = iw_calc_bytesperrow((int)width,img.bit_depth*numchannels);
+		rowbuf = (iw_byte*)iw_malloc(ctx, full_bpr);
+		if(!rowbuf) goto done;
+
+		for(i=0;i<rgn_y+rgn_h;i++) {
+			png_read_row(png_ptr, rowbuf, NULL);
+			if(i>=rgn_y) {
+				memcpy(&img.pixels[img.bpr*(i-rgn_y)],
+					&rowbuf[(size_t)rgn_x*img.bit_depth*numchannels/8], img.bpr);
+			}
+		}
+		// Don't bother to read the rest of the file.
 	}
+	else {
+		row_pointers = (iw_byte**)iw_malloc(ctx, img.height * sizeof(iw_byte*));
+		if(!row_pointers) goto done;
+
+		for(i=0;i<img.height;i++) {
+			row_pointers[i] = &img.pixels[img.bpr*i];
+		}
 
-	png_read_image(png_ptr, row_pointers);
+		png_read_image(png_ptr, row_pointers);
 
-	png_read_end(png_ptr, info_ptr);
+		png_read_end(png_ptr, info_ptr);
+	}
 
 	iw_set_input_image(ctx, &img);
+	if(use_region) {
+		iw_set_input_region(ctx,rgn_x,rgn_y,(int)width,(int)height);
+	}
+	if(img.imgtype==IW_IMGTYPE_PALETTE) {
+		iw_set_input_palette(ctx, &rctx.iwpal);
+	}
 
 	retval = 1;
 
@@ -414,6 +510,7 @@ done:
 		png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
 	}
 	if(row_pointers) iw_free(ctx,row_pointers);
+	if(rowbuf) iw_free(ctx,rowbuf);
 	return retval;
 }
 
@@ -428,6 +525,48 @@ struct iwpngwcontext {
 
 	int bkgd_pal_entry_valid;
 	int bkgd_pal_entry; // Write the background color to this palette entry.
+
+	// Used when we do the filtering and compression ourselves.
+	struct iw_zlib_module *zmod;
+	struct iw_zlib_context *zctx;
+	iw_byte *fbuf; // Filtered rows for the current batch
+	iw_byte *zbuf; // Compressed data for the current batch
+
+	size_t rowbytes; // Bytes per row, in PNG format (not counting filter type)
+	int bpp; // Bytes per pixel, rounded up to at least 1
+	int ftype; // An IWPNG_FILTER_* value
+	int strategy; // zlib compression strategy
+};
+
+// For the parallel compression path, the approximate amount of filtered
+// image data to process per thread, per batch.
+#define IWPNG_BATCH_SIZE_PER_THREAD 524288
+#define IWPNG_ZLIB_ITEM_SIZE        131072
+#define IWPNG_MAX_IDAT_SIZE         1048576
+
+// The five PNG filter types, plus a value meaning to choose a filter for
+// each row.
+#define IWPNG_FILTER_NONE     0
+#define IWPNG_FILTER_SUB      1
+#define IWPNG_FILTER_UP       2
+#define IWPNG_FILTER_AVG      3
+#define IWPNG_FILTER_PAETH    4
+#define IWPNG_FILTER_ADAPTIVE 5
+
+// For "png:optimize": the approximate amount of image data to use for the
+// trial compressions, and the default time limit in milliseconds.
+#define IWPNG_OPT_SAMPLE_SIZE   131072
+#define IWPNG_OPT_BAND_ROWS     16
+#define IWPNG_OPT_DEFAULT_TIME  250
+
+struct iwpng_filter_info {
+	const struct iw_image *img;
+	iw_byte *fbuf;
+	int first_row;
+	size_t rowbytes;
+	int bpp;
+	int bit_depth;
+	int ftype;
 };
 
 static void iwpng_set_phys(struct iwpngwcontext *wctx)
@@ -594,6 +733,350 @@ static int iw_intent_to_lpng_intent(int x)
 	return PNG_sRGB_INTENT_PERCEPTUAL;
 }
 
+static unsigned int iwpng_paeth(unsigned int a, unsigned int b, unsigned int c)
+{
+	int p, pa, pb, pc;
+
+	p = (int)a + (int)b - (int)c;
+	pa = abs(p-(int)a);
+	pb = abs(p-(int)b);
+	pc = abs(p-(int)c);
+	if(pa<=pb && pa<=pc) return a;
+	if(pb<=pc) return b;
+	return c;
+}
+
+// Returns the filtered value of byte i of row, for the given filter type.
+static iw_byte iwpng_filter_byte(int ftype, const iw_byte *row,
+	const iw_byte *prev, size_t i, int bpp)
+{
+	unsigned int a, b, c;
+
+	a = (i>=(size_t)bpp) ? row[i-bpp] : 0;
+	b = prev ? prev[i] : 0;
+	c = (prev && i>=(size_t)bpp) ? prev[i-bpp] : 0;
+
+	switch(ftype) {
+	case IWPNG_FILTER_SUB: return (iw_byte)(row[i]-a);
+	case IWPNG_FILTER_UP: return (iw_byte)(row[i]-b);
+	case IWPNG_FILTER_AVG: return (iw_byte)(row[i]-((a+b)/2));
+	case IWPNG_FILTER_PAETH: return (iw_byte)(row[i]-iwpng_paeth(a,b,c));
+	}
+	return row[i];
+}
+
+// Filter a row that is already in PNG format (src), writing the filter type
+// byte followed by the filtered bytes to dst. prev is the previous row, or
+// NULL for the first row.
+static void iwpng_filter_raw_row(int ftype, const iw_byte *src,
+	const iw_byte *prev, size_t rowbytes, int bpp, iw_byte *dst)
+{
+	size_t i;
+	int t;
+	size_t sum, best_sum;
+	unsigned int v;
+
+	if(ftype==IWPNG_FILTER_ADAPTIVE) {
+		// Same heuristic as libpng: choose the filter that minimizes the sum
+		// of the absolute values of the (signed) filtered bytes.
+		ftype = IWPNG_FILTER_NONE;
+		best_sum = 0;
+		for(t=IWPNG_FILTER_NONE;t<=IWPNG_FILTER_PAETH;t++) {
+			sum = 0;
+			for(i=0;i<rowbytes;i++) {
+				v = iwpng_filter_byte(t,src,prev,i,bpp);
+				sum += (v<128) ? v : 256-v;
+			}
+			if(t==IWPNG_FILTER_NONE || sum<best_sum) {
+				best_sum = sum;
+				ftype = t;
+			}
+		}
+	}
+
+	dst[0] = (iw_byte)ftype;
+	for(i=0;i<rowbytes;i++) {
+		dst[1+i] = iwpng_filter_byte(ftype,src,prev,i,bpp);
+	}
+}
+
+// Copy a row of img to dst, packing the samples if bit_depth is less than 8.
+static void iwpng_get_raw_row(const struct iw_image *img, int row,
+	int bit_depth, size_t rowbytes, iw_byte *dst)
+{
+	const iw_byte *src;
+	size_t i;
+	unsigned int v;
+	int ppb; // pixels per byte
+	int k;
+
+	src = &img->pixels[img->bpr*row];
+
+	if(bit_depth>=8) {
+		memcpy(dst,src,rowbytes);
+		return;
+	}
+
+	ppb = 8/bit_depth;
+	for(i=0;i<rowbytes;i++) {
+		v = 0;
+		for(k=0;k<ppb;k++) {
+			v <<= bit_depth;
+			if(i*ppb+k < (size_t)img->width)
+				v |= src[i*ppb+k];
+		}
+		dst[i] = (iw_byte)v;
+	}
+}
+
+// Filter (or pack) one row into fbuf. Runs in a worker thread.
+static void iwpng_filter_row(struct iw_context *ctx, void *userdata, int item)
+{
+	struct iwpng_filter_info *fi = (struct iwpng_filter_info*)userdata;
+	const struct iw_image *img = fi->img;
+	int row = fi->first_row + item;
+	const iw_byte *src;
+	const iw_byte *prev;
+	iw_byte *dst;
+
+	dst = &fi->fbuf[(fi->rowbytes+1)*item];
+
+	if(fi->bit_depth<8) {
+		// Packed rows are only written unfiltered by this path.
+		dst[0] = IWPNG_FILTER_NONE;
+		iwpng_get_raw_row(img,row,fi->bit_depth,fi->rowbytes,&dst[1]);
+		return;
+	}
+
+	src = &img->pixels[img->bpr*row];
+	prev = (row>0) ? &img->pixels[img->bpr*(row-1)] : NULL;
+	iwpng_filter_raw_row(fi->ftype,src,prev,fi->rowbytes,fi->bpp,dst);
+}
+
+// Compress buf using the given settings, and return the compressed size,
+// or 0 on failure.
+static size_t iwpng_trial_compress(const iw_byte *buf, size_t buflen,
+	int cmprlevel, int strategy, iw_byte *zbuf, size_t zbuf_len)
+{
+	z_stream strm;
+	size_t zlen = 0;
+	int ret;
+
+	iw_zeromem(&strm,sizeof(z_stream));
+	if(deflateInit2(&strm,cmprlevel,Z_DEFLATED,15,8,strategy)!=Z_OK) return 0;
+	strm.next_in = (Bytef*)buf;
+	strm.avail_in = (uInt)buflen;
+	strm.next_out = zbuf;
+	strm.avail_out = (uInt)zbuf_len;
+	ret = deflate(&strm,Z_FINISH);
+	if(ret==Z_STREAM_END) {
+		zlen = zbuf_len - strm.avail_out;
+	}
+	deflateEnd(&strm);
+	return zlen;
+}
+
+// "png:optimize" mode: Try some combinations of filter method and zlib
+// strategy on a sample of the image's rows, and set wctx->ftype and
+// wctx->strategy to the best one. The default settings are tried first, and
+// are only replaced by something that is at least 1% better, since the sample
+// may not be representative. The search stops early if it exceeds the time
+// limit set by "png:optimize-time".
+static void iwpng_optimize_settings(struct iwpngwcontext *wctx,
+	int lpng_bit_depth, int cmprlevel)
+{
+	static const int strategies[3] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+	struct iw_context *ctx = wctx->ctx;
+	const struct iw_image *img = wctx->img;
+	const char *optv;
+	double time_limit;
+	clock_t start_time;
+	int wanted_rows;
+	int band_rows;
+	int num_bands;
+	int band_start;
+	int nrows; // Number of sample rows
+	int i, j, k;
+	int t, s;
+	int ftype;
+	iw_byte *rawbuf = NULL; // Each band, preceded by the row before it
+	iw_byte *fbuf = NULL;
+	iw_byte *zbuf = NULL;
+	int *prev_valid = NULL;
+	size_t flen;
+	size_t zbuf_len;
+	size_t zlen, best_zlen;
+	size_t default_zlen = 0;
+	int best_ftype, best_strategy;
+
+	time_limit = IWPNG_OPT_DEFAULT_TIME;
+	optv = iw_get_option(ctx, "png:optimize-time");
+	if(optv) {
+		time_limit = iw_parse_number(optv);
+	}
+	start_time = clock();
+
+	// Choose some bands of rows, spread evenly across the image.
+	wanted_rows = (int)(IWPNG_OPT_SAMPLE_SIZE/(wctx->rowbytes+1));
+	if(wanted_rows<2) wanted_rows=2;
+	if(wanted_rows>=img->height) {
+		band_rows = img->height;
+		num_bands = 1;
+	}
+	else {
+		// Use at least 8 bands, even if that makes them short, so that the
+		// sample isn't just the top of the image.
+		band_rows = wanted_rows/8;
+		if(band_rows>IWPNG_OPT_BAND_ROWS) band_rows=IWPNG_OPT_BAND_ROWS;
+		if(band_rows<1) band_rows=1;
+		num_bands = wanted_rows/band_rows;
+	}
+	nrows = band_rows*num_bands;
+
+	rawbuf = iw_malloc_ex(ctx,IW_MALLOCFLAG_NOERRORS,(size_t)(nrows+num_bands)*wctx->rowbytes);
+	prev_valid = iw_malloc_ex(ctx,IW_MALLOCFLAG_NOERRORS,num_bands*sizeof(int));
+	flen = (size_t)nrows*(wctx->rowbytes+1);
+	fbuf = iw_malloc_ex(ctx,IW_MALLOCFLAG_NOERRORS,flen);
+	zbuf_len = flen + flen/8 + 1024;
+	zbuf = iw_malloc_ex(ctx,IW_MALLOCFLAG_NOERRORS,zbuf_len);
+	if(!rawbuf || !prev_valid || !fbuf || !zbuf) goto done;
+
+	for(i=0;i<num_bands;i++) {
+		band_start = (num_bands>1) ? (int)(((double)(img->height-band_rows)*i)/(num_bands-1)) : 0;
+		prev_valid[i] = (band_start>0);
+		for(j=(prev_valid[i]?-1:0);j<band_rows;j++) {
+			iwpng_get_raw_row(img,band_start+j,lpng_bit_depth,wctx->rowbytes,
+				&rawbuf[((size_t)i*(band_rows+1)+1+j)*wctx->rowbytes]);
+		}
+	}
+
+	best_zlen = 0;
+	best_ftype = wctx->ftype;
+	best_strategy = wctx->strategy;
+	for(k=0;k<=IWPNG_FILTER_ADAPTIVE;k++) {
+		// Try the default filter method first.
+		if(k==0) ftype = wctx->ftype;
+		else if(k-1<wctx->ftype) ftype = k-1;
+		else ftype = k;
+
+		for(i=0;i<num_bands;i++) {
+			for(j=0;j<band_rows;j++) {
+				t = i*(band_rows+1)+1+j;
+				iwpng_filter_raw_row(ftype,&rawbuf[(size_t)t*wctx->rowbytes],
+					(j>0 || prev_valid[i]) ? &rawbuf[(size_t)(t-1)*wctx->rowbytes] : NULL,
+					wctx->rowbytes,wctx->bpp,
+					&fbuf[((size_t)i*band_rows+j)*(wctx->rowbytes+1)]);
+			}
+		}
+
+		for(s=0;s<3;s++) {
+			if(best_zlen>0 && ((double)(clock()-start_time))*1000.0/CLOCKS_PER_SEC > time_limit) {
+				goto search_done;
+			}
+
+			zlen = iwpng_trial_compress(fbuf,flen,cmprlevel,strategies[s],zbuf,zbuf_len);
+			if(zlen==0) goto done;
+			if(best_zlen==0 || zlen<best_zlen) {
+				if(best_zlen==0) default_zlen = zlen;
+				best_zlen = zlen;
+				best_ftype = ftype;
+				best_strategy = strategies[s];
+			}
+		}
+	}
+
+search_done:
+	if(best_zlen < default_zlen - default_zlen/100) {
+		wctx->ftype = best_ftype;
+		wctx->strategy = best_strategy;
+	}
+
+done:
+	iw_free(ctx,rawbuf);
+	iw_free(ctx,prev_valid);
+	iw_free(ctx,fbuf);
+	iw_free(ctx,zbuf);
+}
+
+// Write the image data (IDAT chunks) using our own filtering and multi-block
+// deflate, so that both can use multiple threads. Also writes the IEND chunk.
+static int iwpng_write_image_parallel(struct iwpngwcontext *wctx,
+	int lpng_bit_depth)
+{
+	struct iw_context *ctx = wctx->ctx;
+	const struct iw_image *img = wctx->img;
+	struct iwpng_filter_info fi;
+	int max_threads;
+	int rows_per_batch;
+	int nrows;
+	size_t zlen;
+	size_t pos;
+	size_t n;
+	int retval = 0;
+
+	iw_zeromem(&fi,sizeof(struct iwpng_filter_info));
+	fi.img = img;
+	fi.bit_depth = lpng_bit_depth;
+	fi.rowbytes = wctx->rowbytes;
+	fi.bpp = wctx->bpp;
+	fi.ftype = wctx->ftype;
+
+	max_threads = iw_get_value(ctx,IW_VAL_MAX_THREADS);
+	if(max_threads<1) max_threads=1;
+	rows_per_batch = (int)(((size_t)max_threads*IWPNG_BATCH_SIZE_PER_THREAD)/(fi.rowbytes+1));
+	if(rows_per_batch<1) rows_per_batch=1;
+	if(rows_per_batch>img->height) rows_per_batch=img->height;
+
+	wctx->fbuf = iw_malloc_large(ctx,rows_per_batch,fi.rowbytes+1);
+	if(!wctx->fbuf) goto done;
+	fi.fbuf = wctx->fbuf;
+
+	wctx->zctx = wctx->zmod->deflate_init(ctx);
+	if(!wctx->zctx) goto done;
+
+	for(fi.first_row=0;fi.first_row<img->height;fi.first_row+=nrows) {
+		nrows = img->height - fi.first_row;
+		if(nrows>rows_per_batch) nrows=rows_per_batch;
+
+		iw_run_threaded(ctx,nrows,iwpng_filter_row,(void*)&fi);
+
+		if(!wctx->zmod->deflate_items(wctx->zctx,wctx->fbuf,(size_t)nrows*(fi.rowbytes+1),
+			IWPNG_ZLIB_ITEM_SIZE,(fi.first_row+nrows>=img->height)?IW_ZLIB_FINISH:0,
+			&wctx->zbuf,&zlen,NULL))
+		{
+			goto done;
+		}
+
+		for(pos=0;pos<zlen;pos+=n) {
+			n = zlen-pos;
+			if(n>IWPNG_MAX_IDAT_SIZE) n=IWPNG_MAX_IDAT_SIZE;
+			png_write_chunk(wctx->png_ptr,(png_bytep)"IDAT",&wctx->zbuf[pos],n);
+		}
+		iw_free(ctx,wctx->zbuf);
+		wctx->zbuf = NULL;
+	}
+
+	// libpng doesn't know we wrote the IDAT chunks, so png_write_end() would
+	// fail. There are no other chunks to write after the image data.
+	png_write_chunk(wctx->png_ptr,(png_bytep)"IEND",NULL,0);
+
+	retval = 1;
+done:
+	return retval;
+}
+
+static int iwpng_filter_to_lpng_filter(int ftype)
+{
+	switch(ftype) {
+	case IWPNG_FILTER_NONE:  return PNG_FILTER_NONE;
+	case IWPNG_FILTER_SUB:   return PNG_FILTER_SUB;
+	case IWPNG_FILTER_UP:    return PNG_FILTER_UP;
+	case IWPNG_FILTER_AVG:   return PNG_FILTER_AVG;
+	case IWPNG_FILTER_PAETH: return PNG_FILTER_PAETH;
+	}
+	return PNG_ALL_FILTERS;
+}
+
 static void my_png_write_fn(png_structp png_ptr, png_bytep data, png_size_t length)
 {
 	struct iwpngwcontext *wctx;
@@ -626,6 +1109,8 @@ IW_IMPL(int) iw_write_png_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 	int cmprlevel;
 	struct iwpngwcontext wctx;
 	const char *optv;
+	int use_parallel;
+	int num_channels;
 
 	iw_zeromem(&wctx,sizeof(struct iwpngwcontext));
 
@@ -749,8 +1234,59 @@ IW_IMPL(int) iw_write_png_file(struct iw_context *ctx, struct iw_iodescr *iodesc
 		png_set_shift(png_ptr,&sbit);
 	}
 
+	switch(lpng_color_type) {
+	case PNG_COLOR_TYPE_RGB_ALPHA: num_channels=4; break;
+	case PNG_COLOR_TYPE_RGB: num_channels=3; break;
+	case PNG_COLOR_TYPE_GRAY_ALPHA: num_channels=2; break;
+	default: num_channels=1;
+	}
+	wctx.rowbytes = ((size_t)img.width*num_channels*lpng_bit_depth+7)/8;
+	wctx.bpp = (num_channels*lpng_bit_depth+7)/8;
+
+	// Like libpng, by default, don't filter palette images or images with
+	// less than 8 bits per sample, and use the Z_FILTERED strategy for
+	// filtered images.
+	if(lpng_color_type!=PNG_COLOR_TYPE_PALETTE && lpng_bit_depth>=8) {
+		wctx.ftype = IWPNG_FILTER_ADAPTIVE;
+		wctx.strategy = Z_FILTERED;
+	}
+	else {
+		wctx.ftype = IWPNG_FILTER_NONE;
+		wctx.strategy = Z_DEFAULT_STRATEGY;
+	}
+
+	optv = iw_get_option(ctx, "png:optimize");
+	if(optv && (optv[0]=='\0' || iw_parse_int(optv))) {
+		iwpng_optimize_settings(&wctx, lpng_bit_depth, cmprlevel);
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, iwpng_filter_to_lpng_filter(wctx.ftype));
+		png_set_compression_strategy(png_ptr, wctx.strategy);
+	}
+
 	png_write_info(png_ptr, info_ptr);
 
+	// If we're allowed to use multiple threads, and the image is large enough
+	// for it to be worth it, do the filtering and compression ourselves.
+	// The zlib module always uses the default strategy, which is not much
+	// different from Z_FILTERED, but Z_RLE is.
+	use_parallel = 0;
+	wctx.zmod = iw_get_zlib_module(ctx);
+	if(wctx.zmod && wctx.zmod->deflate_items &&
+		iw_get_value(ctx,IW_VAL_MAX_THREADS)>1 &&
+		lpng_interlace_type==PNG_INTERLACE_NONE && !img.reduced_maxcolors &&
+		(size_t)img.bpr*img.height >= 2*IWPNG_ZLIB_ITEM_SIZE &&
+		wctx.strategy!=Z_RLE &&
+		(lpng_bit_depth>=8 || wctx.ftype==IWPNG_FILTER_NONE))
+	{
+		use_parallel = 1;
+	}
+
+	if(use_parallel) {
+		if(!iwpng_write_image_parallel(&wctx,lpng_bit_depth))
+			goto done;
+		retval = 1;
+		goto done;
+	}
+
 	row_pointers = (iw_byte**)iw_malloc(ctx, img.height * sizeof(iw_byte*));
 	if(!row_pointers) goto done;
 
@@ -776,6 +1312,9 @@ done:
 		png_destroy_write_struct(&png_ptr, &info_ptr);
 	}
 	if(row_pointers) iw_free(ctx,row_pointers);
+	if(wctx.zctx) wctx.zmod->deflate_end(wctx.zctx);
+	iw_free(ctx,wctx.fbuf);
+	iw_free(ctx,wctx.zbuf);
 	return retval;
 }
 
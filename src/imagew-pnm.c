@@ -13,43 +13,31 @@
 
 struct iwpnmrcontext {
 	struct iw_iodescr *iodescr;
+	struct iw_bufreader br;
 	struct iw_context *ctx;
 	struct iw_image *img;
 	int file_format_code;
 	int file_format;
 	int color_count;
 	int num_channels_pam;
+	int width, height; // The full image size
+	int rgn_x, rgn_y; // The position of the part of the image we read
 };
 
 static int iwpnm_read_byte(struct iwpnmrcontext *rctx, iw_byte *b)
 {
-	iw_byte buf[1];
-	int ret;
-	size_t bytesread = 0;
-
-	ret = (*rctx->iodescr->read_fn)(rctx->ctx,rctx->iodescr,
-		buf,1,&bytesread);
-	if(!ret || bytesread!=1) {
-		*b = 0;
-		return 0;
-	}
-
-	*b = buf[0];
-	return 1;
+	return iw_bufreader_read_byte(&rctx->br, b);
 }
 
 static int iwpnm_read(struct iwpnmrcontext *rctx,
 	iw_byte *buf, size_t buflen)
 {
-	int ret;
-	size_t bytesread = 0;
+	return iw_bufreader_read(&rctx->br, buf, buflen);
+}
 
-	ret = (*rctx->iodescr->read_fn)(rctx->ctx,rctx->iodescr,
-		buf,buflen,&bytesread);
-	if(!ret || bytesread!=buflen) {
-		return 0;
-	}
-	return 1;
+static int iwpnm_skip(struct iwpnmrcontext *rctx, size_t n)
+{
+	return iw_bufreader_skip(&rctx->br, n);
 }
 
 static int iwpnm_is_whitespace(iw_byte b)
@@ -109,8 +97,10 @@ static int iwpnm_read_next_token(struct iwpnmrcontext *rctx,
 static int iwpnm_read_pnm_bitmap(struct iwpnmrcontext *rctx)
 {
 	int i,j;
-	int pnm_bytesperpix;
+	int pnm_bytesperpix = 0;
 	int pnm_bpr;
+	int x, y, w, h;
+	size_t row_offset;
 	int retval = 0;
 
 	if(rctx->file_format_code==4) { // PBM
@@ -196,20 +186,50 @@ static int iwpnm_read_pnm_bitmap(struct iwpnmrcontext *rctx)
 		goto done;
 	}
 
-	rctx->img->bpr = pnm_bpr;
+	// If only part of the image is needed, read only the rows it covers,
+	// and store only the columns it covers.
+	rctx->width = rctx->img->width;
+	rctx->height = rctx->img->height;
+	rctx->rgn_x = 0;
+	rctx->rgn_y = 0;
+	if(iw_get_input_region(rctx->ctx,rctx->width,rctx->height,&x,&y,&w,&h)) {
+		if(rctx->file_format_code==4) {
+			// Start on a byte boundary, so that the pixels can be copied
+			// without shifting.
+			w += x%8;
+			x -= x%8;
+		}
+		rctx->rgn_x = x;
+		rctx->rgn_y = y;
+		rctx->img->width = w;
+		rctx->img->height = h;
+	}
+
+	if(rctx->file_format_code==4) {
+		rctx->img->bpr = (rctx->img->width+7)/8;
+		row_offset = (size_t)(rctx->rgn_x/8);
+	}
+	else {
+		rctx->img->bpr = pnm_bytesperpix * rctx->img->width;
+		row_offset = (size_t)pnm_bytesperpix * rctx->rgn_x;
+	}
 
 	rctx->img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx,rctx->img->bpr,rctx->img->height);
 	if(!rctx->img->pixels) goto done;
 
+	if(!iwpnm_skip(rctx, (size_t)pnm_bpr*rctx->rgn_y)) goto done;
+
 	for(j=0;j<rctx->img->height;j++) {
 		// Binary PNM files are identical or very similar to our internal format,
 		// so we can read them directly.
-		if(!iwpnm_read(rctx, &rctx->img->pixels[j*rctx->img->bpr], pnm_bpr)) {
+		if(!iwpnm_skip(rctx, row_offset)) goto done;
+		if(!iwpnm_read(rctx, &rctx->img->pixels[j*rctx->img->bpr], rctx->img->bpr)) {
 			goto done;
 		}
+		if(!iwpnm_skip(rctx, pnm_bpr - row_offset - rctx->img->bpr)) goto done;
 		if(rctx->file_format_code==4) {
 			// PBM images need to be inverted.
-			for(i=0;i<pnm_bpr;i++) {
+			for(i=0;i<(int)rctx->img->bpr;i++) {
 				rctx->img->pixels[j*rctx->img->bpr+i] = 255-rctx->img->pixels[j*rctx->img->bpr+i];
 			}
 		}
@@ -454,6 +474,7 @@ IW_IMPL(int) iw_read_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	rctx->ctx = ctx;
 	rctx->img = img;
 	rctx->iodescr = iodescr;
+	if(!iw_bufreader_init(ctx, &rctx->br, iodescr)) goto done;
 
 	if(!iwpnm_read_header(rctx)) {
 		iw_set_error(ctx, "Error parsing header");
@@ -466,6 +487,9 @@ IW_IMPL(int) iw_read_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr
 	if(!iwpnm_read_pnm_bitmap(rctx)) goto done;
 
 	iw_set_input_image(ctx, img);
+	if(img->width!=rctx->width || img->height!=rctx->height) {
+		iw_set_input_region(ctx,rctx->rgn_x,rctx->rgn_y,rctx->width,rctx->height);
+	}
 	// The contents of img no longer belong to us.
 	img->pixels = NULL;
 
@@ -476,7 +500,10 @@ done:
 		iw_free(ctx, img->pixels);
 		iw_free(ctx, img);
 	}
-	if(rctx) iw_free(ctx, rctx);
+	if(rctx) {
+		iw_bufreader_done(&rctx->br);
+		iw_free(ctx, rctx);
+	}
 	return retval;
 }
 
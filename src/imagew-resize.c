@@ -9,6 +9,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#if IW_SUPPORT_SIMD
+#include <immintrin.h>
+#endif
 
 #include "imagew-internals.h"
 
@@ -16,22 +19,19 @@
 #define M_PI 3.14159265358979323846
 #endif
 
-typedef void (*iw_resizerowfn_type)(struct iw_rr_ctx *rrctx);
+// in_pix is a single row of source samples to resample. out_pix is the
+// resulting resampled row.
+// These functions must not modify rrctx, so that multiple threads can use
+// the same rrctx at the same time.
+typedef void (*iw_resizerowfn_type)(struct iw_rr_ctx *rrctx,
+	const iw_tmpsample *in_pix, iw_tmpsample *out_pix);
 typedef double (*iw_filterfn_type)(struct iw_rr_ctx *rrctx, double x);
 
-struct iw_weight_struct {
-	int src_pix; // -1 means to use a virtual pixel
-	int dst_pix;
-	double weight;
-};
-
 struct iw_rr_ctx {
 	struct iw_context *ctx;
 
 	int num_in_pix;
 	int num_out_pix;
-	iw_tmpsample *in_pix; // A single row of source samples to resample.
-	iw_tmpsample *out_pix; // The resulting resampled row.
 
 	// int family; // Oddly, we don't need this field at all.
 	double radius; // (Does not take .blur_factor into account.)
@@ -40,11 +40,15 @@ struct iw_rr_ctx {
 	double mix_param;
 
 	double blur_factor;
+	double in_true_size;
+	double in_true_start;
 	double out_true_size;
 	double offset;
 	int edge_policy;
 	double edge_sample_value;
 
+	int no_simd;
+
 	iw_resizerowfn_type resizerow_fn;
 	iw_filterfn_type filter_fn;
 #define IW_FFF_STANDARD   0x01 // A filter that uses iw_create_weightlist_std()
@@ -53,9 +57,16 @@ struct iw_rr_ctx {
 #define IW_FFF_BOXFILTERHACK 0x08
 	unsigned int family_flags; // Misc. information about the filter family
 
-	struct iw_weight_struct *wl; // weightlist
-	int wl_used;
-	int wl_alloc;
+	// The weight table used by "standard" filters. Each output pixel uses
+	// exactly num_taps consecutive input pixels, starting at pw_start[i].
+	// Its weights are pw_weight[i*num_taps] through
+	// pw_weight[i*num_taps+num_taps-1], padded with zeros as needed.
+	// If the range of input pixels isn't entirely within the input row,
+	// pw_is_edge[i] is nonzero, and virtual pixels are needed.
+	int num_taps;
+	int *pw_start;
+	double *pw_weight;
+	iw_byte *pw_is_edge;
 };
 
 
@@ -184,46 +195,21 @@ static double iw_filter_mix(struct iw_rr_ctx *rrctx, double x)
 	return 0.0;
 }
 
-static void weightlist_ensure_alloc(struct iw_rr_ctx *rrctx, int n)
-{
-	size_t old_alloc;
-
-	if(rrctx->wl_alloc>=n) return;
-	old_alloc = rrctx->wl_alloc;
-	rrctx->wl_alloc = n+32;
-
-	// Note that rrctx->wl may be NULL, which iw_realloc() allows.
-	rrctx->wl = iw_realloc(rrctx->ctx,rrctx->wl,
-		sizeof(struct iw_weight_struct)*old_alloc,
-		sizeof(struct iw_weight_struct)*rrctx->wl_alloc);
-
-	if(!rrctx->wl) {
-		rrctx->wl_alloc = 0;
-		rrctx->wl_used = 0;
-	}
-}
-
 static void weightlist_free(struct iw_rr_ctx *rrctx)
 {
-	if(rrctx->wl) {
-		iw_free(rrctx->ctx,rrctx->wl);
-		rrctx->wl = NULL;
-		rrctx->wl_alloc = 0;
-		rrctx->wl_used = 0;
+	if(rrctx->pw_start) {
+		iw_free(rrctx->ctx,rrctx->pw_start);
+		rrctx->pw_start = NULL;
 	}
-}
-
-static void weightlist_add_weight(struct iw_rr_ctx *rrctx, int src_pix, int dst_pix, double v)
-{
-	if(v==0.0) return;
-	if(rrctx->wl_used>=rrctx->wl_alloc) {
-		weightlist_ensure_alloc(rrctx,rrctx->wl_used+1);
-		if(!rrctx->wl) return;
+	if(rrctx->pw_weight) {
+		iw_free(rrctx->ctx,rrctx->pw_weight);
+		rrctx->pw_weight = NULL;
+	}
+	if(rrctx->pw_is_edge) {
+		iw_free(rrctx->ctx,rrctx->pw_is_edge);
+		rrctx->pw_is_edge = NULL;
 	}
-	rrctx->wl[rrctx->wl_used].src_pix = src_pix;
-	rrctx->wl[rrctx->wl_used].dst_pix = dst_pix;
-	rrctx->wl[rrctx->wl_used].weight = v;
-	rrctx->wl_used++;
+	rrctx->num_taps = 0;
 }
 
 // If the filter is symmetric, return the absolute value of pos.
@@ -237,97 +223,113 @@ static double fixup_pos(struct iw_rr_ctx *rrctx, double pos)
 	return (pos<0) ? -pos : pos;
 }
 
+// Find the range of input pixels that may contribute to output pixel out_pix.
+static void calc_input_range(struct iw_rr_ctx *rrctx, int out_pix,
+	double reduction_factor, double *ppos_in_inpix, int *pfirst, int *plast)
+{
+	double out_pix_center;
+	double pos_in_inpix;
+
+	out_pix_center = (0.5+(double)out_pix-rrctx->offset)/rrctx->out_true_size;
+	pos_in_inpix = out_pix_center*rrctx->in_true_size + rrctx->in_true_start -0.5;
+
+	// There are up to radius*reduction_factor source pixels on each side
+	// of the target pixel that we need to look at.
+	*pfirst = (int)ceil(pos_in_inpix - rrctx->radius*reduction_factor -0.0001);
+	*plast = (int)floor(pos_in_inpix + rrctx->radius*reduction_factor +0.0001);
+
+	if(rrctx->edge_policy==IW_EDGE_POLICY_STANDARD) {
+		// The STANDARD method doesn't use virtual pixels, so we can
+		// ignore out-of-range source pixels.
+		if(*pfirst<0) *pfirst=0;
+		if(*plast>rrctx->num_in_pix-1) *plast=rrctx->num_in_pix-1;
+	}
+
+	*ppos_in_inpix = pos_in_inpix;
+}
+
 static void iw_create_weightlist_std(struct iw_context *ctx, struct iw_rr_ctx *rrctx)
 {
 	int out_pix;
 	double reduction_factor;
-	double out_pix_center;
 	double pos_in_inpix;
 	double pos;
 	int input_pixel;
 	int first_input_pixel;
 	int last_input_pixel;
-	int pix_to_read;
+	int start;
 	double v;
 	double v_sum;
-	int v_count;
-	int start_weight_idx;
-	int est_nweights;
-	int i;
+	double *w;
+	int k;
 
-	rrctx->wl_used = 0;
-
-	if(rrctx->out_true_size<(double)rrctx->num_in_pix) {
-		reduction_factor = ((double)rrctx->num_in_pix) / rrctx->out_true_size;
+	if(rrctx->out_true_size<rrctx->in_true_size) {
+		reduction_factor = rrctx->in_true_size / rrctx->out_true_size;
 	}
 	else {
 		reduction_factor = 1.0;
 	}
 	reduction_factor *= rrctx->blur_factor;
 
-	// Estimate the size of the weight list we'll need.
-	est_nweights = (int)(2.0*rrctx->radius*reduction_factor*rrctx->num_out_pix);
-	weightlist_ensure_alloc(rrctx,est_nweights);
-	if(!rrctx->wl) {
-		return;
+	// Find the number of taps we need: the largest number of input pixels
+	// used by any output pixel.
+	rrctx->num_taps = 1;
+	for(out_pix=0;out_pix<rrctx->num_out_pix;out_pix++) {
+		calc_input_range(rrctx,out_pix,reduction_factor,&pos_in_inpix,
+			&first_input_pixel,&last_input_pixel);
+		if(last_input_pixel-first_input_pixel+1 > rrctx->num_taps) {
+			rrctx->num_taps = last_input_pixel-first_input_pixel+1;
+		}
 	}
 
-	for(out_pix=0;out_pix<rrctx->num_out_pix;out_pix++) {
-		out_pix_center = (0.5+(double)out_pix-rrctx->offset)/rrctx->out_true_size;
-		pos_in_inpix = out_pix_center*(double)rrctx->num_in_pix -0.5;
+	rrctx->pw_start = iw_malloc_large(ctx, rrctx->num_out_pix, sizeof(int));
+	if(!rrctx->pw_start) goto done;
+	rrctx->pw_weight = iw_malloc_large(ctx, ((size_t)rrctx->num_out_pix)*rrctx->num_taps,
+		sizeof(double));
+	if(!rrctx->pw_weight) goto done;
+	rrctx->pw_is_edge = iw_mallocz(ctx, rrctx->num_out_pix);
+	if(!rrctx->pw_is_edge) goto done;
 
-		// There are up to radius*reduction_factor source pixels on each side
-		// of the target pixel that we need to look at.
+	for(out_pix=0;out_pix<rrctx->num_out_pix;out_pix++) {
+		calc_input_range(rrctx,out_pix,reduction_factor,&pos_in_inpix,
+			&first_input_pixel,&last_input_pixel);
 
-		first_input_pixel = (int)ceil(pos_in_inpix - rrctx->radius*reduction_factor -0.0001);
-		last_input_pixel = (int)floor(pos_in_inpix + rrctx->radius*reduction_factor +0.0001);
+		w = &rrctx->pw_weight[((size_t)out_pix)*rrctx->num_taps];
+		for(k=0;k<rrctx->num_taps;k++) {
+			w[k] = 0.0;
+		}
 
-		// Remember which item in the weightlist was the first one for this
-		// target sample.
-		start_weight_idx = rrctx->wl_used;
+		if(first_input_pixel<0 || last_input_pixel>rrctx->num_in_pix-1) {
+			// Some of the source pixels we need don't exist.
+			start = first_input_pixel;
+			rrctx->pw_is_edge[out_pix] = 1;
+		}
+		else if(first_input_pixel+rrctx->num_taps > rrctx->num_in_pix) {
+			// Move the start position back, so that we don't read past the end
+			// of the input row. The extra weights at the beginning will be zero.
+			start = rrctx->num_in_pix - rrctx->num_taps;
+			if(start<0) {
+				start = first_input_pixel;
+				rrctx->pw_is_edge[out_pix] = 1;
+			}
+		}
+		else {
+			start = first_input_pixel;
+		}
+		rrctx->pw_start[out_pix] = start;
 
 		v_sum=0.0;
-		v_count=0;
 		for(input_pixel=first_input_pixel;input_pixel<=last_input_pixel;input_pixel++) {
-			if(rrctx->edge_policy==IW_EDGE_POLICY_STANDARD) {
-				// The STANDARD method doesn't use virtual pixels, so we can
-				// ignore out-of-range source pixels.
-				if(input_pixel<0 || input_pixel>=rrctx->num_in_pix) {
-					continue;
-				}
-			}
-
 			pos = (((double)input_pixel)-pos_in_inpix)/reduction_factor;
 			v = (*rrctx->filter_fn)(rrctx, fixup_pos(rrctx,pos));
-			if(v==0.0) continue;
-
+			w[input_pixel-start] = v;
 			v_sum += v;
-			v_count++;
-
-			if(input_pixel<0 || input_pixel>rrctx->num_in_pix-1) {
-				// The source pixel we need doesn't exist.
-				if(rrctx->edge_policy==IW_EDGE_POLICY_TRANSPARENT) {
-					pix_to_read = -1; // Use a virtual pixel
-				}
-				else { // Assume IW_EDGE_POLICY_REPLICATE
-					if(input_pixel<0) pix_to_read=0;
-					else pix_to_read = rrctx->num_in_pix-1;
-				}
-			}
-			else {
-				pix_to_read = input_pixel;
-			}
-
-			weightlist_add_weight(rrctx,pix_to_read,out_pix,v);
 		}
 
-		if(v_count>0) {
-
+		for(k=0;k<rrctx->num_taps;k++) {
 			if(v_sum!=0.0) {
-				// Normalize the weights we just added to the list.
-				for(i=start_weight_idx;i<rrctx->wl_used;i++) {
-					rrctx->wl[i].weight /= v_sum;
-				}
+				// Normalize the weights.
+				w[k] /= v_sum;
 			}
 			else {
 				// Just in case we somehow have a nonzero number of weights
@@ -335,60 +337,199 @@ static void iw_create_weightlist_std(struct iw_context *ctx, struct iw_rr_ctx *r
 				// to normalize.
 				// This isn't really a meaningful thing to do, but at least
 				// it's predictable, and keeps us from dividing by zero.
-				for(i=start_weight_idx;i<rrctx->wl_used;i++) {
-					rrctx->wl[i].weight = 0.0;
-				}
+				w[k] = 0.0;
+			}
+		}
+	}
+	return;
+
+done:
+	weightlist_free(rrctx);
+}
+
+// Calculate an output sample for which some of the input pixels are outside
+// the input row.
+static iw_tmpsample resize_edge_sample(struct iw_rr_ctx *rrctx,
+	const iw_tmpsample *in_pix, int start, const double *w)
+{
+	int k;
+	int input_pixel;
+	double s;
+	double sum = 0.0;
+
+	for(k=0;k<rrctx->num_taps;k++) {
+		if(w[k]==0.0) continue;
+		input_pixel = start+k;
+
+		if(input_pixel<0 || input_pixel>rrctx->num_in_pix-1) {
+			if(rrctx->edge_policy==IW_EDGE_POLICY_TRANSPARENT) {
+				// Use a virtual pixel. The value to use was previously
+				// calculated and stored in ->edge_sample_value (it's almost
+				// always 0, i.e. "transparent black").
+				s = rrctx->edge_sample_value;
+			}
+			else { // Assume IW_EDGE_POLICY_REPLICATE
+				if(input_pixel<0) s = in_pix[0];
+				else s = in_pix[rrctx->num_in_pix-1];
 			}
 		}
+		else {
+			s = in_pix[input_pixel];
+		}
+
+		sum += s * w[k];
 	}
+	return sum;
 }
 
-static void iw_resize_row_std(struct iw_rr_ctx *rrctx)
+static void iw_resize_row_std(struct iw_rr_ctx *rrctx,
+	const iw_tmpsample *in_pix, iw_tmpsample *out_pix)
 {
 	int i;
-	struct iw_weight_struct *w;
+	int k;
+	int num_taps;
+	const double *w;
+	const iw_tmpsample *src;
+	double sum;
 
-	if(!rrctx->wl) return;
+	if(!rrctx->pw_weight) return;
+	num_taps = rrctx->num_taps;
 
 	for(i=0;i<rrctx->num_out_pix;i++) {
-		rrctx->out_pix[i] = 0.0;
+		w = &rrctx->pw_weight[((size_t)i)*num_taps];
+
+		if(rrctx->pw_is_edge[i]) {
+			out_pix[i] = resize_edge_sample(rrctx,in_pix,rrctx->pw_start[i],w);
+			continue;
+		}
+
+		src = &in_pix[rrctx->pw_start[i]];
+		sum = 0.0;
+		for(k=0;k<num_taps;k++) {
+			sum += src[k] * w[k];
+		}
+		out_pix[i] = sum;
 	}
+}
+
+#if IW_SUPPORT_SIMD
+
+// SIMD versions of iw_resize_row_std(). Each output sample is computed using
+// several partial sums, so the result may differ from that of the standard
+// version in the least significant bits.
+// We don't enable FMA instructions, because they'd make the rounding depend
+// on the compiler's whims.
 
-	for(i=0;i<rrctx->wl_used;i++) {
-		w = &rrctx->wl[i];
-		if(w->src_pix>=0) {
-			rrctx->out_pix[w->dst_pix] += rrctx->in_pix[w->src_pix] * w->weight;
+__attribute__((target("avx")))
+static void iw_resize_row_std_avx(struct iw_rr_ctx *rrctx,
+	const iw_tmpsample *in_pix, iw_tmpsample *out_pix)
+{
+	int i;
+	int k;
+	int num_taps;
+	const double *w;
+	const iw_tmpsample *src;
+	double sum;
+	__m256d acc;
+	__m128d acc2;
+
+	if(!rrctx->pw_weight) return;
+	num_taps = rrctx->num_taps;
+
+	for(i=0;i<rrctx->num_out_pix;i++) {
+		w = &rrctx->pw_weight[((size_t)i)*num_taps];
+
+		if(rrctx->pw_is_edge[i]) {
+			out_pix[i] = resize_edge_sample(rrctx,in_pix,rrctx->pw_start[i],w);
+			continue;
 		}
-		else {
-			// Use a virtual pixel. The only relevant virtual pixel type is
-			// TRANSPARENT (REPLICATE is handled elsewhere).
-			// The value to use was previously calculated and stored in
-			// ->edge_sample_value (it's almost always 0, i.e. "transparent
-			// black").
-			rrctx->out_pix[w->dst_pix] += rrctx->edge_sample_value * w->weight;
+
+		src = &in_pix[rrctx->pw_start[i]];
+		acc = _mm256_setzero_pd();
+		for(k=0;k+4<=num_taps;k+=4) {
+			acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(&src[k]),
+				_mm256_loadu_pd(&w[k])));
+		}
+		acc2 = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc,1));
+		acc2 = _mm_add_sd(acc2, _mm_unpackhi_pd(acc2,acc2));
+		sum = _mm_cvtsd_f64(acc2);
+		for(;k<num_taps;k++) {
+			sum += src[k] * w[k];
 		}
+		out_pix[i] = sum;
 	}
 }
 
+__attribute__((target("sse2")))
+static void iw_resize_row_std_sse2(struct iw_rr_ctx *rrctx,
+	const iw_tmpsample *in_pix, iw_tmpsample *out_pix)
+{
+	int i;
+	int k;
+	int num_taps;
+	const double *w;
+	const iw_tmpsample *src;
+	double sum;
+	__m128d acc;
+
+	if(!rrctx->pw_weight) return;
+	num_taps = rrctx->num_taps;
+
+	for(i=0;i<rrctx->num_out_pix;i++) {
+		w = &rrctx->pw_weight[((size_t)i)*num_taps];
+
+		if(rrctx->pw_is_edge[i]) {
+			out_pix[i] = resize_edge_sample(rrctx,in_pix,rrctx->pw_start[i],w);
+			continue;
+		}
+
+		src = &in_pix[rrctx->pw_start[i]];
+		acc = _mm_setzero_pd();
+		for(k=0;k+2<=num_taps;k+=2) {
+			acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(&src[k]), _mm_loadu_pd(&w[k])));
+		}
+		acc = _mm_add_sd(acc, _mm_unpackhi_pd(acc,acc));
+		sum = _mm_cvtsd_f64(acc);
+		if(k<num_taps) {
+			sum += src[k] * w[k];
+		}
+		out_pix[i] = sum;
+	}
+}
+
+// Returns the fastest version of iw_resize_row_std() that the CPU supports.
+static iw_resizerowfn_type iw_choose_resize_row_std_fn(struct iw_rr_ctx *rrctx)
+{
+	// With very few taps, the SIMD versions don't help.
+	if(rrctx->num_taps<4) return iw_resize_row_std;
+
+	if(__builtin_cpu_supports("avx")) return iw_resize_row_std_avx;
+	if(__builtin_cpu_supports("sse2")) return iw_resize_row_std_sse2;
+	return iw_resize_row_std;
+}
+
+#endif // IW_SUPPORT_SIMD
+
 // Although "nearest neighbor" can be implemented using the standard method
 // that uses a weightlist, we use a special algorithm for it. For one thing,
 // this ensures that it does literally use the nearest neighbor, and is not
 // affected by blur settings.
-static void iw_resize_row_nearest(struct iw_rr_ctx *rrctx)
+static void iw_resize_row_nearest(struct iw_rr_ctx *rrctx,
+	const iw_tmpsample *in_pix, iw_tmpsample *out_pix)
 {
-	int out_pix;
+	int i;
 	double out_pix_center;
 	int input_pixel;
 	int pix_to_read;
 
-	for(out_pix=0;out_pix<rrctx->num_out_pix;out_pix++) {
-		out_pix_center = (0.5+(double)out_pix-rrctx->offset)/(double)rrctx->num_out_pix;
-		input_pixel = (int)floor(out_pix_center*(double)rrctx->num_in_pix);
+	for(i=0;i<rrctx->num_out_pix;i++) {
+		out_pix_center = (0.5+(double)i-rrctx->offset)/(double)rrctx->num_out_pix;
+		input_pixel = (int)floor(out_pix_center*rrctx->in_true_size + rrctx->in_true_start);
 
 		if(input_pixel<0) pix_to_read=0;
 		else if(input_pixel>rrctx->num_in_pix-1) pix_to_read = rrctx->num_in_pix-1;
 		else pix_to_read = input_pixel;
-		rrctx->out_pix[out_pix] = rrctx->in_pix[pix_to_read];
+		out_pix[i] = in_pix[pix_to_read];
 	}
 }
 
@@ -396,28 +537,26 @@ static void iw_resize_row_nearest(struct iw_rr_ctx *rrctx)
 // If the target size is smaller than the source size, pixels will be cropped.
 // If it is larger, the extra pixels will be black or transparent.
 // Caution: Does not support translation or offsets.
-static void iw_resize_row_null(struct iw_rr_ctx *rrctx)
+static void iw_resize_row_null(struct iw_rr_ctx *rrctx,
+	const iw_tmpsample *in_pix, iw_tmpsample *out_pix)
 {
 	int i;
 	for(i=0;i<rrctx->num_out_pix;i++) {
 		if(i<rrctx->num_in_pix) {
-			rrctx->out_pix[i] =rrctx->in_pix[i];
+			out_pix[i] =in_pix[i];
 		}
 		else {
-			rrctx->out_pix[i] = 0.0;
+			out_pix[i] = 0.0;
 		}
 	}
 }
 
-struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
+// Copy/translate the settings for resizing one dimension into rrctx, but
+// don't create the weight list. Returns 0 if the resize algorithm is unknown.
+static int iw_rr_ctx_set_params(struct iw_context *ctx, struct iw_rr_ctx *rrctx,
   struct iw_resize_settings *rs, int channeltype,
 	  int num_in_pix, int num_out_pix)
 {
-	struct iw_rr_ctx *rrctx = NULL;
-
-	rrctx = iw_mallocz(ctx,sizeof(struct iw_rr_ctx));
-	if(!rrctx) goto done;
-
 	// rrctx stores the internal settings we'll use to resize (the current
 	// dimension of) the image.
 	// The settings will be copied/translated from the 'rs' struct, and other
@@ -429,6 +568,8 @@ struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
 
 	rrctx->num_in_pix = num_in_pix;
 	rrctx->num_out_pix = num_out_pix;
+	rrctx->in_true_size = (rs->in_true_size>0.0) ? rs->in_true_size : (double)num_in_pix;
+	rrctx->in_true_start = rs->in_true_start;
 	rrctx->out_true_size = rs->out_true_size;
 
 	// Gather filter-specific information.
@@ -448,7 +589,7 @@ struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
 		// whose exact shape depends on the scale factor.
 		// Precalculate a parameter (mix_param) that will be used by
 		// iw_filter_mix(). It's also used to compute the radius.
-		rrctx->mix_param = ((double)rrctx->num_out_pix)/rrctx->num_in_pix;
+		rrctx->mix_param = ((double)rrctx->num_out_pix)/rrctx->in_true_size;
 		if(rrctx->mix_param > 1.0) rrctx->mix_param = 1.0/rrctx->mix_param;
 		rrctx->radius = 0.5 + rrctx->mix_param;
 		break;
@@ -511,8 +652,7 @@ struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
 		break;
 	default:
 		rrctx->resizerow_fn = NULL;
-		iw_set_error(ctx,"Internal: Unknown resize algorithm");
-		goto done;
+		return 0;
 	}
 
 	if(rrctx->family_flags & IW_FFF_SINCBASED) {
@@ -545,9 +685,32 @@ struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
 	if(rs->use_offset && channeltype>=0 && channeltype<=2)
 		rrctx->offset += rs->channel_offset[channeltype];
 
+	rrctx->no_simd = ctx->no_simd;
+	return 1;
+}
+
+struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
+  struct iw_resize_settings *rs, int channeltype,
+	  int num_in_pix, int num_out_pix)
+{
+	struct iw_rr_ctx *rrctx = NULL;
+
+	rrctx = iw_mallocz(ctx,sizeof(struct iw_rr_ctx));
+	if(!rrctx) goto done;
+
+	if(!iw_rr_ctx_set_params(ctx,rrctx,rs,channeltype,num_in_pix,num_out_pix)) {
+		iw_set_error(ctx,"Internal: Unknown resize algorithm");
+		goto done;
+	}
+
 	if(rrctx->family_flags & IW_FFF_STANDARD) {
 		// This is a "standard" filter.
 		iw_create_weightlist_std(ctx,rrctx);
+#if IW_SUPPORT_SIMD
+		if(!rrctx->no_simd) {
+			rrctx->resizerow_fn = iw_choose_resize_row_std_fn(rrctx);
+		}
+#endif
 		goto done;
 	}
 
@@ -555,6 +718,115 @@ done:
 	return rrctx;
 }
 
+// Returns nonzero if rrctx, which was made by iwpvt_resize_rows_init(), is
+// exactly what iwpvt_resize_rows_init() would make for the given settings.
+// If so, it can be used instead of making a new one.
+int iwpvt_resize_rows_is_reusable(struct iw_rr_ctx *rrctx, struct iw_context *ctx,
+  struct iw_resize_settings *rs, int channeltype,
+	  int num_in_pix, int num_out_pix)
+{
+	struct iw_rr_ctx tmp;
+
+	if(!rrctx || rrctx->ctx!=ctx) return 0;
+	if((rrctx->family_flags & IW_FFF_STANDARD) && !rrctx->pw_weight) return 0;
+
+	iw_zeromem(&tmp,sizeof(struct iw_rr_ctx));
+	if(!iw_rr_ctx_set_params(ctx,&tmp,rs,channeltype,num_in_pix,num_out_pix)) return 0;
+
+	if(tmp.num_in_pix!=rrctx->num_in_pix) return 0;
+	if(tmp.num_out_pix!=rrctx->num_out_pix) return 0;
+	if(tmp.in_true_size!=rrctx->in_true_size) return 0;
+	if(tmp.in_true_start!=rrctx->in_true_start) return 0;
+	if(tmp.out_true_size!=rrctx->out_true_size) return 0;
+	if(tmp.filter_fn!=rrctx->filter_fn) return 0;
+	if(tmp.family_flags!=rrctx->family_flags) return 0;
+	if(tmp.radius!=rrctx->radius) return 0;
+	if(tmp.cubic_b!=rrctx->cubic_b) return 0;
+	if(tmp.cubic_c!=rrctx->cubic_c) return 0;
+	if(tmp.mix_param!=rrctx->mix_param) return 0;
+	if(tmp.blur_factor!=rrctx->blur_factor) return 0;
+	if(tmp.offset!=rrctx->offset) return 0;
+	if(tmp.edge_policy!=rrctx->edge_policy) return 0;
+	if(tmp.edge_sample_value!=rrctx->edge_sample_value) return 0;
+	if(tmp.no_simd!=rrctx->no_simd) return 0;
+	if(!(tmp.family_flags & IW_FFF_STANDARD)) {
+		// Null or nearest-neighbor.
+		if(tmp.resizerow_fn!=rrctx->resizerow_fn) return 0;
+	}
+	return 1;
+}
+
+// Returns the largest number of input samples that
+// iwpvt_resize_get_contribs() may report for any output sample.
+int iwpvt_resize_max_contribs(struct iw_rr_ctx *rrctx)
+{
+	if(!rrctx) return 0;
+	if(rrctx->family_flags & IW_FFF_STANDARD) {
+		return rrctx->num_taps;
+	}
+	return 1;
+}
+
+// Describes how to calculate output sample out_pix, as a weighted sum of
+// input samples, for callers that resample entire rows at a time.
+// Returns the number of contributing input samples. For each one, src_pix[k]
+// is the input pixel to use. If src_pix[k] is -1, weight[k] is instead
+// a constant to be added to the sum (it's for a virtual pixel).
+// The sum must be calculated in order, starting with k=0, to get the same
+// result as iwpvt_resize_row_main() with non-SIMD code.
+int iwpvt_resize_get_contribs(struct iw_rr_ctx *rrctx, int out_pix,
+	int *src_pix, double *weight)
+{
+	int k;
+	int n;
+	int input_pixel;
+	const double *w;
+	double out_pix_center;
+
+	if(rrctx->resizerow_fn==iw_resize_row_null) {
+		if(out_pix>=rrctx->num_in_pix) return 0;
+		src_pix[0] = out_pix;
+		weight[0] = 1.0;
+		return 1;
+	}
+
+	if(rrctx->resizerow_fn==iw_resize_row_nearest) {
+		out_pix_center = (0.5+(double)out_pix-rrctx->offset)/(double)rrctx->num_out_pix;
+		input_pixel = (int)floor(out_pix_center*rrctx->in_true_size + rrctx->in_true_start);
+		if(input_pixel<0) input_pixel=0;
+		else if(input_pixel>rrctx->num_in_pix-1) input_pixel = rrctx->num_in_pix-1;
+		src_pix[0] = input_pixel;
+		weight[0] = 1.0;
+		return 1;
+	}
+
+	if(!rrctx->pw_weight) return 0;
+	w = &rrctx->pw_weight[((size_t)out_pix)*rrctx->num_taps];
+
+	n = 0;
+	for(k=0;k<rrctx->num_taps;k++) {
+		if(w[k]==0.0) continue;
+		input_pixel = rrctx->pw_start[out_pix]+k;
+
+		if(input_pixel<0 || input_pixel>rrctx->num_in_pix-1) {
+			if(rrctx->edge_policy==IW_EDGE_POLICY_TRANSPARENT) {
+				src_pix[n] = -1;
+				weight[n] = rrctx->edge_sample_value * w[k];
+				n++;
+				continue;
+			}
+			// Assume IW_EDGE_POLICY_REPLICATE
+			if(input_pixel<0) input_pixel = 0;
+			else input_pixel = rrctx->num_in_pix-1;
+		}
+
+		src_pix[n] = input_pixel;
+		weight[n] = w[k];
+		n++;
+	}
+	return n;
+}
+
 void iwpvt_resize_rows_done(struct iw_rr_ctx *rrctx)
 {
 	if(!rrctx) return;
@@ -565,7 +837,5 @@ void iwpvt_resize_rows_done(struct iw_rr_ctx *rrctx)
 void iwpvt_resize_row_main(struct iw_rr_ctx *rrctx, iw_tmpsample *in_pix, iw_tmpsample *out_pix)
 {
 	if(!rrctx || !rrctx->resizerow_fn) return;
-	rrctx->in_pix = in_pix;
-	rrctx->out_pix = out_pix;
-	(*rrctx->resizerow_fn)(rrctx);
+	(*rrctx->resizerow_fn)(rrctx,in_pix,out_pix);
 }
@@ -6,12 +6,931 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
 
 #define IWTIFF_MAX_TAGS 20
 
+// The default uncompressed size of a strip, when the image is compressed.
+#define IWTIFF_DEFAULT_STRIP_SIZE 65536
+
+// Values of the Compression tag
+#define IWTIFF_CMPR_NONE     1
+#define IWTIFF_CMPR_DEFLATE  8
+#define IWTIFF_CMPR_PACKBITS 32773
+#define IWTIFF_CMPR_DEFLATE_OLD 32946 // Obsolete code for Deflate
+
+// Values of the PhotometricInterpretation tag
+#define IWTIFF_PHOTO_MINISWHITE  0
+#define IWTIFF_PHOTO_MINISBLACK  1
+#define IWTIFF_PHOTO_RGB         2
+#define IWTIFF_PHOTO_PALETTE     3
+
+#define IWTIFF_TAG256_IMAGEWIDTH 256
+#define IWTIFF_TAG257_IMAGELENGTH 257
+#define IWTIFF_TAG258_BITSPERSAMPLE 258
+#define IWTIFF_TAG259_COMPRESSION 259
+#define IWTIFF_TAG262_PHOTOMETRIC 262
+#define IWTIFF_TAG266_FILLORDER 266
+#define IWTIFF_TAG273_STRIPOFFSETS 273
+#define IWTIFF_TAG277_SAMPLESPERPIXEL 277
+#define IWTIFF_TAG278_ROWSPERSTRIP 278
+#define IWTIFF_TAG279_STRIPBYTECOUNTS 279
+#define IWTIFF_TAG282_XRESOLUTION 282
+#define IWTIFF_TAG283_YRESOLUTION 283
+#define IWTIFF_TAG284_PLANARCONFIG 284
+#define IWTIFF_TAG296_RESOLUTIONUNIT 296
+#define IWTIFF_TAG301_TRANSFERFUNCTION 301
+#define IWTIFF_TAG317_PREDICTOR 317
+#define IWTIFF_TAG320_COLORMAP 320
+#define IWTIFF_TAG322_TILEWIDTH 322
+#define IWTIFF_TAG323_TILELENGTH 323
+#define IWTIFF_TAG324_TILEOFFSETS 324
+#define IWTIFF_TAG325_TILEBYTECOUNTS 325
+#define IWTIFF_TAG338_EXTRASAMPLES 338
+#define IWTIFF_TAG339_SAMPLEFORMAT 339
+
+#define IWTIFF_UINT8    1 // "BYTE"
+#define IWTIFF_UINT16   3 // "SHORT"
+#define IWTIFF_UINT32   4 // "LONG"
+#define IWTIFF_RATIONAL 5
+
+// Amount of uncompressed image data that the reader decodes per thread, in
+// each batch of strips or tiles.
+#define IWTIFF_READ_BATCH_SIZE_PER_THREAD 524288
+
+// The location of a tag's values in the file.
+struct iwtiff_tag {
+	unsigned int type;
+	unsigned int count;
+	size_t pos;
+};
+
+struct iwtiffrcontext {
+	struct iw_context *ctx;
+	struct iw_iodescr *iodescr;
+	struct iw_image *img;
+
+	// The entire file
+	const iw_byte *data;
+	size_t data_len;
+	int is_le;
+
+	size_t ifd_pos;
+	int ifd_num_entries;
+
+	int width, height;
+	int bitspersample;
+	int samplesperpixel;
+	int compression; // An IWTIFF_CMPR_* value
+	int photometric;
+	int predictor;
+	int alpha_type; // The ExtraSamples value: 0=none, 1=associated, 2=unassociated
+	int num_channels; // The number of samples per pixel that we keep
+
+	int tiled;
+	int rows_per_strip;
+	int tile_width, tile_height;
+	int units_across;
+	int num_units;
+	size_t unit_bpr; // Bytes per row of a strip or tile
+	size_t unit_size; // Uncompressed size of a full strip or tile
+	unsigned int *unit_offsets;
+	unsigned int *unit_bytecounts;
+
+	// The part of the image to decode. This is the whole image, unless
+	// a crop has been set.
+	int rgn_x, rgn_y, rgn_w, rgn_h;
+
+	struct iw_palette pal;
+	struct iw_csdescr csdescr;
+
+	struct iw_zlib_module *zmod;
+	struct iw_zlib_context *zctx;
+};
+
+static unsigned int iwtiff_get_ui16(struct iwtiffrcontext *rctx, size_t pos)
+{
+	if(rctx->is_le) return iw_get_ui16le(&rctx->data[pos]);
+	return iw_get_ui16be(&rctx->data[pos]);
+}
+
+static unsigned int iwtiff_get_ui32(struct iwtiffrcontext *rctx, size_t pos)
+{
+	if(rctx->is_le) return iw_get_ui32le(&rctx->data[pos]);
+	return iw_get_ui32be(&rctx->data[pos]);
+}
+
+// Look up a tag in the IFD. Returns 0 if it is not present, or is not of a
+// type we can read.
+static int iwtiff_find_tag(struct iwtiffrcontext *rctx, unsigned int tagnum,
+	struct iwtiff_tag *tag)
+{
+	int i;
+	size_t epos;
+	size_t valsize;
+
+	for(i=0;i<rctx->ifd_num_entries;i++) {
+		epos = rctx->ifd_pos + 2 + 12*i;
+		if(iwtiff_get_ui16(rctx,epos)!=tagnum) continue;
+
+		tag->type = iwtiff_get_ui16(rctx,epos+2);
+		tag->count = iwtiff_get_ui32(rctx,epos+4);
+		switch(tag->type) {
+		case IWTIFF_UINT8: valsize = 1; break;
+		case IWTIFF_UINT16: valsize = 2; break;
+		case IWTIFF_UINT32: valsize = 4; break;
+		case IWTIFF_RATIONAL: valsize = 8; break;
+		default: return 0;
+		}
+		if(tag->count<1) return 0;
+		if(tag->count > (rctx->data_len/valsize)) return 0;
+
+		// Values that fit in 4 bytes are stored in the IFD entry itself.
+		if(valsize*tag->count <= 4) {
+			tag->pos = epos+8;
+		}
+		else {
+			tag->pos = iwtiff_get_ui32(rctx,epos+8);
+			if(tag->pos > rctx->data_len - valsize*tag->count) return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+// Returns the given value of an integer tag.
+static unsigned int iwtiff_tag_value(struct iwtiffrcontext *rctx,
+	const struct iwtiff_tag *tag, unsigned int i)
+{
+	switch(tag->type) {
+	case IWTIFF_UINT8: return rctx->data[tag->pos+i];
+	case IWTIFF_UINT16: return iwtiff_get_ui16(rctx,tag->pos+2*i);
+	case IWTIFF_UINT32: return iwtiff_get_ui32(rctx,tag->pos+4*i);
+	}
+	return 0;
+}
+
+// Returns the first value of an integer tag, or dflt if it is not present.
+static unsigned int iwtiff_get_tag_int(struct iwtiffrcontext *rctx,
+	unsigned int tagnum, unsigned int dflt)
+{
+	struct iwtiff_tag tag;
+
+	if(!iwtiff_find_tag(rctx,tagnum,&tag)) return dflt;
+	if(tag.type==IWTIFF_RATIONAL) return dflt;
+	return iwtiff_tag_value(rctx,&tag,0);
+}
+
+// Returns the value of a RATIONAL tag, or 0.0 if it is not present.
+static double iwtiff_get_tag_rational(struct iwtiffrcontext *rctx, unsigned int tagnum)
+{
+	struct iwtiff_tag tag;
+	unsigned int num, denom;
+
+	if(!iwtiff_find_tag(rctx,tagnum,&tag)) return 0.0;
+	if(tag.type!=IWTIFF_RATIONAL) return 0.0;
+	num = iwtiff_get_ui32(rctx,tag.pos);
+	denom = iwtiff_get_ui32(rctx,tag.pos+4);
+	if(denom==0) return 0.0;
+	return ((double)num)/denom;
+}
+
+// Read a tag containing one value per strip or tile.
+static int iwtiff_read_unit_array(struct iwtiffrcontext *rctx, unsigned int tagnum,
+	unsigned int **pvals)
+{
+	struct iwtiff_tag tag;
+	int i;
+
+	if(!iwtiff_find_tag(rctx,tagnum,&tag)) return 0;
+	if(tag.type==IWTIFF_RATIONAL) return 0;
+	if(tag.count < (unsigned int)rctx->num_units) return 0;
+
+	*pvals = iw_malloc(rctx->ctx,rctx->num_units*sizeof(unsigned int));
+	if(!*pvals) return 0;
+	for(i=0;i<rctx->num_units;i++) {
+		(*pvals)[i] = iwtiff_tag_value(rctx,&tag,i);
+	}
+	return 1;
+}
+
+static void iwtiff_read_density(struct iwtiffrcontext *rctx)
+{
+	struct iw_image *img = rctx->img;
+	double xres, yres;
+	unsigned int unit;
+
+	xres = iwtiff_get_tag_rational(rctx,IWTIFF_TAG282_XRESOLUTION);
+	yres = iwtiff_get_tag_rational(rctx,IWTIFF_TAG283_YRESOLUTION);
+	if(xres<=0.0 || yres<=0.0) return;
+
+	// 1==no units, 2=pixels/inch, 3=pixels/cm
+	unit = iwtiff_get_tag_int(rctx,IWTIFF_TAG296_RESOLUTIONUNIT,2);
+	if(unit==2) {
+		img->density_x = xres/0.0254;
+		img->density_y = yres/0.0254;
+		img->density_code = IW_DENSITY_UNITS_PER_METER;
+	}
+	else if(unit==3) {
+		img->density_x = xres*100.0;
+		img->density_y = yres*100.0;
+		img->density_code = IW_DENSITY_UNITS_PER_METER;
+	}
+	else if(unit==1) {
+		img->density_x = xres;
+		img->density_y = yres;
+		img->density_code = IW_DENSITY_UNITS_UNKNOWN;
+	}
+	if(!iw_is_valid_density(img->density_x,img->density_y,img->density_code)) {
+		img->density_code = IW_DENSITY_UNKNOWN;
+	}
+}
+
+// Returns nonzero if the first n entries of the TransferFunction table
+// are within 1 of what the given colorspace would produce.
+static int iwtiff_transferfunc_matches(struct iwtiffrcontext *rctx,
+	const struct iwtiff_tag *tag, unsigned int n, const struct iw_csdescr *cs)
+{
+	unsigned int i;
+	double linear;
+	int expected;
+	int v;
+
+	for(i=0;i<n;i++) {
+		linear = iw_convert_sample_to_linear(((double)i)/(n-1),cs);
+		expected = (int)(0.5+65535.0*linear);
+		v = (int)iwtiff_tag_value(rctx,tag,i);
+		if(v<expected-1 || v>expected+1) return 0;
+	}
+	return 1;
+}
+
+// A TransferFunction table can describe any colorspace, but we only support
+// the kinds that IW can write.
+static void iwtiff_read_transferfunction(struct iwtiffrcontext *rctx)
+{
+	struct iwtiff_tag tag;
+	struct iw_csdescr cs;
+	unsigned int n;
+	unsigned int mid;
+	double gamma;
+
+	if(rctx->bitspersample==1) return;
+	if(!iwtiff_find_tag(rctx,IWTIFF_TAG301_TRANSFERFUNCTION,&tag)) return;
+	if(tag.type!=IWTIFF_UINT16) return;
+	n = 1U<<rctx->bitspersample;
+	if(tag.count!=n && tag.count!=3*n) return;
+
+	iw_make_srgb_csdescr_2(&cs);
+	if(iwtiff_transferfunc_matches(rctx,&tag,n,&cs)) return;
+
+	iw_make_linear_csdescr(&cs);
+	if(iwtiff_transferfunc_matches(rctx,&tag,n,&cs)) {
+		rctx->csdescr = cs;
+		return;
+	}
+
+	// Estimate the gamma from the middle entry.
+	mid = n/2;
+	if(iwtiff_tag_value(rctx,&tag,mid)==0) return;
+	gamma = log(iwtiff_tag_value(rctx,&tag,mid)/65535.0) / log(((double)mid)/(n-1));
+	if(gamma<0.1 || gamma>10.0) return;
+	iw_make_gamma_csdescr(&rctx->csdescr,gamma);
+}
+
+static int iwtiff_read_palette(struct iwtiffrcontext *rctx)
+{
+	struct iwtiff_tag tag;
+	unsigned int n;
+	unsigned int i;
+
+	n = 1U<<rctx->bitspersample;
+	if(!iwtiff_find_tag(rctx,IWTIFF_TAG320_COLORMAP,&tag) ||
+		tag.type!=IWTIFF_UINT16 || tag.count<3*n)
+	{
+		iw_set_error(rctx->ctx,"TIFF: Missing or invalid color map");
+		return 0;
+	}
+
+	// All the red values go first, then green, blue. Samples are 16-bit.
+	rctx->pal.num_entries = n;
+	for(i=0;i<n;i++) {
+		rctx->pal.entry[i].r = (iw_byte)((iwtiff_tag_value(rctx,&tag,i)*255+32767)/65535);
+		rctx->pal.entry[i].g = (iw_byte)((iwtiff_tag_value(rctx,&tag,n+i)*255+32767)/65535);
+		rctx->pal.entry[i].b = (iw_byte)((iwtiff_tag_value(rctx,&tag,2*n+i)*255+32767)/65535);
+		rctx->pal.entry[i].a = 255;
+	}
+	return 1;
+}
+
+// Get the position and size, in pixels, of a strip or tile. Tiles at the
+// right and bottom edges extend past the edge of the image; the returned
+// size does not include that part.
+static void iwtiff_unit_rect(struct iwtiffrcontext *rctx, int unit,
+	int *px, int *py, int *pw, int *ph)
+{
+	if(rctx->tiled) {
+		*px = (unit%rctx->units_across)*rctx->tile_width;
+		*py = (unit/rctx->units_across)*rctx->tile_height;
+		*pw = rctx->width - *px;
+		if(*pw>rctx->tile_width) *pw = rctx->tile_width;
+		*ph = rctx->height - *py;
+		if(*ph>rctx->tile_height) *ph = rctx->tile_height;
+	}
+	else {
+		*px = 0;
+		*py = unit*rctx->rows_per_strip;
+		*pw = rctx->width;
+		*ph = rctx->height - *py;
+		if(*ph>rctx->rows_per_strip) *ph = rctx->rows_per_strip;
+	}
+}
+
+// Returns the uncompressed size of the given strip or tile.
+static size_t iwtiff_read_unit_raw_size(struct iwtiffrcontext *rctx, int unit)
+{
+	int x, y, w, h;
+
+	if(rctx->tiled) return rctx->unit_size;
+	iwtiff_unit_rect(rctx,unit,&x,&y,&w,&h);
+	return rctx->unit_bpr * h;
+}
+
+// Read the file header and IFD, and decide how to decode the image.
+static int iwtiff_read_ifd(struct iwtiffrcontext *rctx)
+{
+	struct iw_context *ctx = rctx->ctx;
+	struct iw_image *img = rctx->img;
+	struct iwtiff_tag tag;
+	unsigned int i;
+	int base_channels;
+	int units_down;
+	unsigned int n;
+
+	if(rctx->data_len<8) goto badfile;
+	if(rctx->data[0]=='I' && rctx->data[1]=='I') rctx->is_le = 1;
+	else if(rctx->data[0]=='M' && rctx->data[1]=='M') rctx->is_le = 0;
+	else goto badfile;
+	if(iwtiff_get_ui16(rctx,2)!=42) goto badfile;
+
+	// Only the first image in the file is read.
+	rctx->ifd_pos = iwtiff_get_ui32(rctx,4);
+	if(rctx->ifd_pos > rctx->data_len-2) goto badfile;
+	rctx->ifd_num_entries = (int)iwtiff_get_ui16(rctx,rctx->ifd_pos);
+	if((size_t)rctx->ifd_num_entries*12 > rctx->data_len-rctx->ifd_pos-2) goto badfile;
+
+	rctx->width = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG256_IMAGEWIDTH,0);
+	rctx->height = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG257_IMAGELENGTH,0);
+	if(!iw_check_image_dimensions(ctx,rctx->width,rctx->height)) return 0;
+
+	rctx->samplesperpixel = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG277_SAMPLESPERPIXEL,1);
+	if(rctx->samplesperpixel<1 || rctx->samplesperpixel>8) goto unsupported;
+
+	// All samples must have the same bit depth.
+	rctx->bitspersample = 1;
+	if(iwtiff_find_tag(rctx,IWTIFF_TAG258_BITSPERSAMPLE,&tag) && tag.type!=IWTIFF_RATIONAL) {
+		rctx->bitspersample = (int)iwtiff_tag_value(rctx,&tag,0);
+		for(i=1;i<tag.count && i<(unsigned int)rctx->samplesperpixel;i++) {
+			if((int)iwtiff_tag_value(rctx,&tag,i)!=rctx->bitspersample) goto unsupported;
+		}
+	}
+
+	rctx->compression = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG259_COMPRESSION,IWTIFF_CMPR_NONE);
+	if(rctx->compression==IWTIFF_CMPR_DEFLATE_OLD) rctx->compression = IWTIFF_CMPR_DEFLATE;
+	if(rctx->compression!=IWTIFF_CMPR_NONE && rctx->compression!=IWTIFF_CMPR_DEFLATE &&
+		rctx->compression!=IWTIFF_CMPR_PACKBITS)
+	{
+		iw_set_errorf(ctx,"TIFF: Unsupported compression type (%d)",rctx->compression);
+		return 0;
+	}
+	if(rctx->compression==IWTIFF_CMPR_DEFLATE) {
+		if(!rctx->zmod || !rctx->zmod->inflate_items) {
+			iw_set_error(ctx,"TIFF: Deflate compression is not supported");
+			return 0;
+		}
+	}
+
+	if(iwtiff_get_tag_int(rctx,IWTIFF_TAG284_PLANARCONFIG,1)!=1 && rctx->samplesperpixel>1)
+		goto unsupported;
+	if(iwtiff_get_tag_int(rctx,IWTIFF_TAG266_FILLORDER,1)!=1) goto unsupported;
+	if(iwtiff_get_tag_int(rctx,IWTIFF_TAG339_SAMPLEFORMAT,1)!=1) goto unsupported;
+
+	rctx->predictor = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG317_PREDICTOR,1);
+	if(rctx->predictor!=1) {
+		// Horizontal differencing
+		if(rctx->predictor!=2) goto unsupported;
+		if(rctx->bitspersample!=8 && rctx->bitspersample!=16) goto unsupported;
+	}
+
+	rctx->photometric = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG262_PHOTOMETRIC,IWTIFF_PHOTO_MINISBLACK);
+	switch(rctx->photometric) {
+	case IWTIFF_PHOTO_MINISWHITE:
+	case IWTIFF_PHOTO_MINISBLACK:
+		base_channels = 1;
+		break;
+	case IWTIFF_PHOTO_RGB:
+		base_channels = 3;
+		break;
+	case IWTIFF_PHOTO_PALETTE:
+		base_channels = 1;
+		break;
+	default:
+		iw_set_errorf(ctx,"TIFF: Unsupported color type (%d)",rctx->photometric);
+		return 0;
+	}
+	if(rctx->samplesperpixel<base_channels) goto badfile;
+
+	// The first extra sample may be an alpha channel. Any other extra
+	// samples are ignored.
+	if(rctx->samplesperpixel>base_channels && rctx->photometric!=IWTIFF_PHOTO_PALETTE) {
+		n = iwtiff_get_tag_int(rctx,IWTIFF_TAG338_EXTRASAMPLES,0);
+		if(n==1 || n==2) rctx->alpha_type = (int)n;
+	}
+	rctx->num_channels = base_channels + (rctx->alpha_type?1:0);
+
+	if(rctx->bitspersample<8) {
+		if(rctx->samplesperpixel!=1) goto unsupported;
+		if(rctx->bitspersample!=1 && rctx->bitspersample!=2 && rctx->bitspersample!=4)
+			goto unsupported;
+		if(rctx->photometric==IWTIFF_PHOTO_RGB) goto unsupported;
+	}
+	else if(rctx->bitspersample==16) {
+		if(rctx->photometric==IWTIFF_PHOTO_PALETTE) goto unsupported;
+	}
+	else if(rctx->bitspersample!=8) {
+		goto unsupported;
+	}
+
+	if(rctx->photometric==IWTIFF_PHOTO_PALETTE) {
+		if(!iwtiff_read_palette(rctx)) return 0;
+		img->imgtype = IW_IMGTYPE_PALETTE;
+	}
+	else if(base_channels==3) {
+		img->imgtype = rctx->alpha_type ? IW_IMGTYPE_RGBA : IW_IMGTYPE_RGB;
+	}
+	else {
+		img->imgtype = rctx->alpha_type ? IW_IMGTYPE_GRAYA : IW_IMGTYPE_GRAY;
+		img->native_grayscale = 1;
+	}
+	img->sampletype = IW_SAMPLETYPE_UINT;
+	img->bit_depth = rctx->bitspersample;
+
+	// Figure out the strips or tiles.
+	rctx->tiled = iwtiff_find_tag(rctx,IWTIFF_TAG324_TILEOFFSETS,&tag);
+	if(rctx->tiled) {
+		rctx->tile_width = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG322_TILEWIDTH,0);
+		rctx->tile_height = (int)iwtiff_get_tag_int(rctx,IWTIFF_TAG323_TILELENGTH,0);
+		if(rctx->tile_width<1 || rctx->tile_height<1) goto badfile;
+		if(rctx->tile_width>65536 || rctx->tile_height>65536) goto unsupported;
+		// Tile widths are supposed to be multiples of 16. Make sure that
+		// tiles don't share bytes of the decoded image.
+		if((rctx->tile_width*rctx->bitspersample)%8) goto badfile;
+
+		rctx->units_across = (rctx->width+rctx->tile_width-1)/rctx->tile_width;
+		units_down = (rctx->height+rctx->tile_height-1)/rctx->tile_height;
+		rctx->unit_bpr = iw_calc_bytesperrow(rctx->tile_width,
+			rctx->bitspersample*rctx->samplesperpixel);
+		rctx->unit_size = rctx->unit_bpr * rctx->tile_height;
+	}
+	else {
+		n = iwtiff_get_tag_int(rctx,IWTIFF_TAG278_ROWSPERSTRIP,0xffffffffU);
+		if(n<1 || n>(unsigned int)rctx->height) n = (unsigned int)rctx->height;
+		rctx->rows_per_strip = (int)n;
+
+		rctx->units_across = 1;
+		units_down = (rctx->height+rctx->rows_per_strip-1)/rctx->rows_per_strip;
+		rctx->unit_bpr = iw_calc_bytesperrow(rctx->width,
+			rctx->bitspersample*rctx->samplesperpixel);
+		rctx->unit_size = rctx->unit_bpr * rctx->rows_per_strip;
+	}
+	if(units_down > 0x7fffffff/rctx->units_across) goto unsupported;
+	rctx->num_units = rctx->units_across * units_down;
+
+	if(!iwtiff_read_unit_array(rctx,
+		rctx->tiled?IWTIFF_TAG324_TILEOFFSETS:IWTIFF_TAG273_STRIPOFFSETS,
+		&rctx->unit_offsets))
+	{
+		goto badfile;
+	}
+	if(!iwtiff_read_unit_array(rctx,
+		rctx->tiled?IWTIFF_TAG325_TILEBYTECOUNTS:IWTIFF_TAG279_STRIPBYTECOUNTS,
+		&rctx->unit_bytecounts))
+	{
+		// The byte counts can be inferred for uncompressed images.
+		if(rctx->compression!=IWTIFF_CMPR_NONE) goto badfile;
+	}
+
+	iwtiff_read_density(rctx);
+	iwtiff_read_transferfunction(rctx);
+	return 1;
+
+badfile:
+	iw_set_error(ctx,"Invalid or corrupt TIFF file");
+	return 0;
+unsupported:
+	iw_set_error(ctx,"TIFF: Unsupported image format");
+	return 0;
+}
+
+struct iwtiff_rbatch {
+	struct iwtiffrcontext *rctx;
+	const int *units; // The strips or tiles in this batch
+	iw_byte *rawbuf; // Uncompressed data for each unit, unit_size bytes apart
+	int *ok;
+};
+
+// Decompress PackBits data. Returns 0 if there wasn't enough data.
+static int iwtiff_unpackbits(const iw_byte *src, size_t srclen,
+	iw_byte *dst, size_t dstlen)
+{
+	size_t srcpos = 0;
+	size_t dstpos = 0;
+	size_t n;
+	int b;
+
+	while(dstpos<dstlen) {
+		if(srcpos>=srclen) return 0;
+		b = (int)src[srcpos++];
+		if(b<128) {
+			// Literal run of b+1 bytes
+			n = (size_t)b+1;
+			if(n>dstlen-dstpos) n = dstlen-dstpos;
+			if(n>srclen-srcpos) return 0;
+			memcpy(&dst[dstpos],&src[srcpos],n);
+			srcpos += (size_t)b+1;
+			dstpos += n;
+		}
+		else if(b>128) {
+			// Repeat the next byte 257-b times
+			if(srcpos>=srclen) return 0;
+			n = (size_t)(257-b);
+			if(n>dstlen-dstpos) n = dstlen-dstpos;
+			memset(&dst[dstpos],src[srcpos],n);
+			srcpos++;
+			dstpos += n;
+		}
+		// 128 is a no-op.
+	}
+	return 1;
+}
+
+// Undo horizontal differencing for one row of a strip or tile.
+static void iwtiff_undo_predictor(struct iwtiffrcontext *rctx, iw_byte *row)
+{
+	size_t i;
+	size_t spp = (size_t)rctx->samplesperpixel;
+	size_t nsamples;
+	unsigned int v;
+
+	if(rctx->bitspersample==8) {
+		for(i=spp;i<rctx->unit_bpr;i++) {
+			row[i] = (iw_byte)(row[i]+row[i-spp]);
+		}
+		return;
+	}
+
+	nsamples = rctx->unit_bpr/2;
+	for(i=spp;i<nsamples;i++) {
+		if(rctx->is_le) {
+			v = (iw_get_ui16le(&row[2*i]) + iw_get_ui16le(&row[2*(i-spp)])) & 0xffff;
+			iw_set_ui16le(&row[2*i],v);
+		}
+		else {
+			v = (iw_get_ui16be(&row[2*i]) + iw_get_ui16be(&row[2*(i-spp)])) & 0xffff;
+			iw_set_ui16be(&row[2*i],v);
+		}
+	}
+}
+
+// Convert n pixels of a TIFF row, starting at pixel sx, to IW format, and
+// store them in dstrow starting at pixel dx.
+static void iwtiff_read_row(struct iwtiffrcontext *rctx, const iw_byte *srcrow,
+	int sx, iw_byte *dstrow, int dx, int n)
+{
+	int bps = rctx->bitspersample;
+	int spp = rctx->samplesperpixel;
+	int nch = rctx->num_channels;
+	int invert = (rctx->photometric==IWTIFF_PHOTO_MINISWHITE);
+	int i, c;
+	unsigned int maxv;
+	unsigned int s[8];
+	unsigned int a;
+	size_t sbit, dbit;
+	unsigned int shift;
+	const iw_byte *sp;
+	iw_byte *dp;
+
+	maxv = (1U<<bps)-1;
+
+	if(bps<8) {
+		for(i=0;i<n;i++) {
+			sbit = (size_t)(sx+i)*bps;
+			s[0] = (srcrow[sbit/8] >> (8-bps-sbit%8)) & maxv;
+			if(invert) s[0] = maxv-s[0];
+			dbit = (size_t)(dx+i)*bps;
+			shift = (unsigned int)(8-bps-dbit%8);
+			dstrow[dbit/8] = (iw_byte)((dstrow[dbit/8] & ~(maxv<<shift)) | (s[0]<<shift));
+		}
+		return;
+	}
+
+	if(bps==8 && spp==nch && !invert && rctx->alpha_type!=1) {
+		memcpy(&dstrow[dx*nch],&srcrow[sx*spp],n*nch);
+		return;
+	}
+
+	for(i=0;i<n;i++) {
+		sp = &srcrow[(size_t)(sx+i)*spp*(bps/8)];
+		dp = &dstrow[(size_t)(dx+i)*nch*(bps/8)];
+
+		for(c=0;c<nch;c++) {
+			if(bps==8) s[c] = sp[c];
+			else if(rctx->is_le) s[c] = iw_get_ui16le(&sp[2*c]);
+			else s[c] = iw_get_ui16be(&sp[2*c]);
+		}
+
+		if(invert) {
+			s[0] = maxv-s[0];
+		}
+
+		if(rctx->alpha_type==1) {
+			// Convert from associated (premultiplied) alpha.
+			a = s[nch-1];
+			for(c=0;c<nch-1;c++) {
+				if(a==0) s[c] = 0;
+				else {
+					s[c] = (s[c]*maxv + a/2)/a;
+					if(s[c]>maxv) s[c]=maxv;
+				}
+			}
+		}
+
+		// Internally, 16-bit samples are stored in big-endian order.
+		for(c=0;c<nch;c++) {
+			if(bps==8) dp[c] = (iw_byte)s[c];
+			else iw_set_ui16be(&dp[2*c],s[c]);
+		}
+	}
+}
+
+// Decode one strip or tile of the batch, and store the part of it that is in
+// the region being decoded. Runs in a worker thread.
+static void iwtiff_decode_unit(struct iw_context *ctx, void *userdata, int item)
+{
+	struct iwtiff_rbatch *batch = (struct iwtiff_rbatch*)userdata;
+	struct iwtiffrcontext *rctx = batch->rctx;
+	struct iw_image *img = rctx->img;
+	int unit = batch->units[item];
+	const iw_byte *src;
+	const iw_byte *raw;
+	iw_byte *buf = NULL;
+	size_t rawsize;
+	int x0, y0, w, h;
+	int xs, xe, ys, ye;
+	int j;
+
+	src = &rctx->data[rctx->unit_offsets[unit]];
+	rawsize = iwtiff_read_unit_raw_size(rctx,unit);
+	if(batch->rawbuf) buf = &batch->rawbuf[item*rctx->unit_size];
+
+	if(rctx->compression==IWTIFF_CMPR_PACKBITS) {
+		if(!iwtiff_unpackbits(src,rctx->unit_bytecounts[unit],buf,rawsize)) return;
+	}
+	else if(rctx->compression==IWTIFF_CMPR_NONE && buf) {
+		memcpy(buf,src,rawsize);
+	}
+	// (Deflate data has already been decompressed to buf.)
+
+	if(buf) raw = buf;
+	else raw = src;
+
+	iwtiff_unit_rect(rctx,unit,&x0,&y0,&w,&h);
+	xs = (x0>rctx->rgn_x) ? x0 : rctx->rgn_x;
+	xe = (x0+w < rctx->rgn_x+rctx->rgn_w) ? x0+w : rctx->rgn_x+rctx->rgn_w;
+	ys = (y0>rctx->rgn_y) ? y0 : rctx->rgn_y;
+	ye = (y0+h < rctx->rgn_y+rctx->rgn_h) ? y0+h : rctx->rgn_y+rctx->rgn_h;
+
+	for(j=ys;j<ye;j++) {
+		if(rctx->predictor==2) {
+			iwtiff_undo_predictor(rctx,&buf[(j-y0)*rctx->unit_bpr]);
+		}
+		iwtiff_read_row(rctx,&raw[(j-y0)*rctx->unit_bpr],xs-x0,
+			&img->pixels[(size_t)(j-rctx->rgn_y)*img->bpr],xs-rctx->rgn_x,xe-xs);
+	}
+	batch->ok[item] = 1;
+}
+
+// Decode the strips or tiles that intersect the region, in batches, using
+// multiple threads.
+static int iwtiff_read_units(struct iwtiffrcontext *rctx)
+{
+	struct iw_context *ctx = rctx->ctx;
+	struct iwtiff_rbatch batch;
+	int *units = NULL;
+	iw_byte **zsrc = NULL;
+	size_t *zsrclen = NULL;
+	iw_byte **zdst = NULL;
+	size_t *zdstlen = NULL;
+	int num_units = 0;
+	int units_per_batch;
+	int max_threads;
+	int nunits;
+	int first;
+	int unit;
+	int i;
+	int x, y, w, h;
+	size_t avail;
+	int retval = 0;
+
+	iw_zeromem(&batch,sizeof(struct iwtiff_rbatch));
+	batch.rctx = rctx;
+
+	units = iw_malloc(ctx,rctx->num_units*sizeof(int));
+	if(!units) goto done;
+
+	for(unit=0;unit<rctx->num_units;unit++) {
+		iwtiff_unit_rect(rctx,unit,&x,&y,&w,&h);
+		if(x+w<=rctx->rgn_x || x>=rctx->rgn_x+rctx->rgn_w) continue;
+		if(y+h<=rctx->rgn_y || y>=rctx->rgn_y+rctx->rgn_h) continue;
+
+		// Make sure the data is in the file.
+		if(rctx->unit_offsets[unit] > rctx->data_len) goto badfile;
+		avail = rctx->data_len - rctx->unit_offsets[unit];
+		if(rctx->compression==IWTIFF_CMPR_NONE) {
+			if(avail < iwtiff_read_unit_raw_size(rctx,unit)) goto badfile;
+		}
+		else if(rctx->unit_bytecounts[unit] > avail) {
+			rctx->unit_bytecounts[unit] = (unsigned int)avail;
+		}
+		units[num_units++] = unit;
+	}
+
+	max_threads = iw_get_value(ctx,IW_VAL_MAX_THREADS);
+	if(max_threads<1) max_threads=1;
+	units_per_batch = (int)(((size_t)max_threads*IWTIFF_READ_BATCH_SIZE_PER_THREAD)/rctx->unit_size);
+	if(units_per_batch<max_threads) units_per_batch=max_threads;
+	if(units_per_batch>num_units) units_per_batch=num_units;
+	if(units_per_batch<1) units_per_batch=1;
+
+	// Uncompressed data can usually be read straight from the file.
+	if(rctx->compression!=IWTIFF_CMPR_NONE || rctx->predictor==2) {
+		batch.rawbuf = iw_malloc_large(ctx,units_per_batch,rctx->unit_size);
+		if(!batch.rawbuf) goto done;
+	}
+	batch.ok = iw_malloc(ctx,units_per_batch*sizeof(int));
+	if(!batch.ok) goto done;
+
+	if(rctx->compression==IWTIFF_CMPR_DEFLATE) {
+		rctx->zctx = rctx->zmod->inflate_init(ctx);
+		if(!rctx->zctx) goto done;
+		zsrc = iw_malloc(ctx,units_per_batch*sizeof(iw_byte*));
+		zsrclen = iw_malloc(ctx,units_per_batch*sizeof(size_t));
+		zdst = iw_malloc(ctx,units_per_batch*sizeof(iw_byte*));
+		zdstlen = iw_malloc(ctx,units_per_batch*sizeof(size_t));
+		if(!zsrc || !zsrclen || !zdst || !zdstlen) goto done;
+	}
+
+	for(first=0;first<num_units;first+=nunits) {
+		nunits = num_units - first;
+		if(nunits>units_per_batch) nunits=units_per_batch;
+		batch.units = &units[first];
+
+		if(rctx->compression==IWTIFF_CMPR_DEFLATE) {
+			for(i=0;i<nunits;i++) {
+				unit = units[first+i];
+				zsrc[i] = (iw_byte*)&rctx->data[rctx->unit_offsets[unit]];
+				zsrclen[i] = rctx->unit_bytecounts[unit];
+				zdst[i] = &batch.rawbuf[i*rctx->unit_size];
+				zdstlen[i] = iwtiff_read_unit_raw_size(rctx,unit);
+			}
+			if(!rctx->zmod->inflate_items(rctx->zctx,nunits,zsrc,zsrclen,zdst,zdstlen))
+				goto done;
+		}
+
+		iw_zeromem(batch.ok,nunits*sizeof(int));
+		iw_run_threaded(ctx,nunits,iwtiff_decode_unit,(void*)&batch);
+		for(i=0;i<nunits;i++) {
+			if(!batch.ok[i]) goto badfile;
+		}
+	}
+
+	retval = 1;
+	goto done;
+
+badfile:
+	iw_set_error(ctx,"Invalid or corrupt TIFF file");
+done:
+	iw_free(ctx,units);
+	iw_free(ctx,batch.rawbuf);
+	iw_free(ctx,batch.ok);
+	iw_free(ctx,zsrc);
+	iw_free(ctx,zsrclen);
+	iw_free(ctx,zdst);
+	iw_free(ctx,zdstlen);
+	return retval;
+}
+
+static int iwtiff_read_main(struct iwtiffrcontext *rctx)
+{
+	struct iw_context *ctx = rctx->ctx;
+	struct iw_image *img = rctx->img;
+	int x, y, w, h;
+
+	if(!iwtiff_read_ifd(rctx)) return 0;
+
+	rctx->rgn_x = 0;
+	rctx->rgn_y = 0;
+	rctx->rgn_w = rctx->width;
+	rctx->rgn_h = rctx->height;
+	if(iw_get_input_region(ctx,rctx->width,rctx->height,&x,&y,&w,&h)) {
+		if(rctx->bitspersample<8) {
+			// Start on a byte boundary, so that the pixels can be copied
+			// without shifting.
+			w += x%8;
+			x -= x%8;
+		}
+		rctx->rgn_x = x;
+		rctx->rgn_y = y;
+		rctx->rgn_w = w;
+		rctx->rgn_h = h;
+	}
+
+	img->width = rctx->rgn_w;
+	img->height = rctx->rgn_h;
+	img->bpr = iw_calc_bytesperrow(img->width,rctx->bitspersample*rctx->num_channels);
+	img->pixels = (iw_byte*)iw_malloc_large(ctx,img->bpr,img->height);
+	if(!img->pixels) return 0;
+
+	return iwtiff_read_units(rctx);
+}
+
+IW_IMPL(int) iw_read_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
+{
+	struct iwtiffrcontext *rctx = NULL;
+	struct iw_image img;
+	void *mem = NULL;
+	iw_int64 size = 0;
+	int retval = 0;
+
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	rctx = iw_mallocz(ctx,sizeof(struct iwtiffrcontext));
+	if(!rctx) goto done;
+
+	rctx->ctx = ctx;
+	rctx->iodescr = iodescr;
+	rctx->img = &img;
+	rctx->zmod = iw_get_zlib_module(ctx);
+
+	// Assume sRGB by default. This may be overridden later.
+	iw_make_srgb_csdescr_2(&rctx->csdescr);
+
+	// Strips and tiles can be anywhere in the file, so read the whole thing
+	// into memory (unless it's already there).
+	if(iodescr->mem) {
+		rctx->data = &iodescr->mem[iodescr->mem_pos];
+		rctx->data_len = iodescr->mem_size - iodescr->mem_pos;
+		iodescr->mem_pos = iodescr->mem_size;
+	}
+	else {
+		if(!iw_file_to_memory(ctx,iodescr,&mem,&size)) goto done;
+		rctx->data = (const iw_byte*)mem;
+		rctx->data_len = (size_t)size;
+	}
+
+	if(!iwtiff_read_main(rctx)) goto done;
+
+	iw_set_input_image(ctx, &img);
+	if(rctx->rgn_w!=rctx->width || rctx->rgn_h!=rctx->height) {
+		iw_set_input_region(ctx,rctx->rgn_x,rctx->rgn_y,rctx->width,rctx->height);
+	}
+	if(img.imgtype==IW_IMGTYPE_PALETTE) {
+		iw_set_input_palette(ctx,&rctx->pal);
+	}
+	iw_set_input_colorspace(ctx,&rctx->csdescr);
+
+	retval = 1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"TIFF read failed");
+		// If we didn't call iw_set_input_image, 'img' still belongs to us,
+		// so free its contents.
+		iw_free(ctx, img.pixels);
+	}
+	if(rctx) {
+		if(rctx->zctx) rctx->zmod->inflate_end(rctx->zctx);
+		iw_free(ctx,rctx->unit_offsets);
+		iw_free(ctx,rctx->unit_bytecounts);
+		iw_free(ctx,rctx);
+	}
+	if(mem) iw_free(ctx,mem);
+	return retval;
+}
+
 struct iwtiffwcontext {
 	int bitsperpixel;
 	int bitspersample;
@@ -26,10 +945,7 @@ struct iwtiffwcontext {
 	struct iw_image *img;
 	const struct iw_palette *pal;
 
-#define IWTIFF_PHOTO_MINISBLACK  1
-#define IWTIFF_PHOTO_RGB         2
-#define IWTIFF_PHOTO_PALETTE     3
-	int photometric;
+	int photometric; // An IWTIFF_PHOTO_* value
 
 	int write_density_in_cm;
 
@@ -46,7 +962,26 @@ struct iwtiffwcontext {
 	unsigned int transferfunc_offset;
 	unsigned int transferfunc_size;
 	unsigned int bitmap_offset;
-	size_t bitmap_size;
+
+	int compression; // An IWTIFF_CMPR_* value
+	int tiled;
+	int rows_per_strip;
+	int tile_width, tile_height;
+	int units_across; // Number of tiles per row of tiles (1 for strips)
+	int num_units; // Number of strips or tiles
+	size_t dstbpr; // Bytes per row of the whole image
+	size_t unit_bpr; // Bytes per row of a strip or tile
+	size_t unit_size; // Uncompressed size of a full strip or tile
+	unsigned int *unit_offsets;
+	unsigned int *unit_bytecounts;
+	iw_byte **unit_data; // Compressed data for each strip or tile
+	iw_byte **batch_bufs; // The buffers that unit_data points into
+	int num_batch_bufs;
+	unsigned int unit_offsets_offset; // Used if num_units>1
+	unsigned int unit_bytecounts_offset; // Used if num_units>1
+
+	struct iw_zlib_module *zmod;
+	struct iw_zlib_context *zctx;
 
 	unsigned short taglist[IWTIFF_MAX_TAGS];
 	int num_tags; // Number of tags in taglist that are used.
@@ -71,6 +1006,13 @@ static void iwtiff_write_ui16(struct iwtiffwcontext *wctx, unsigned int n)
 	iwtiff_write(wctx,buf,2);
 }
 
+static void iwtiff_write_ui32(struct iwtiffwcontext *wctx, unsigned int n)
+{
+	iw_byte buf[4];
+	iw_set_ui32le(buf,n);
+	iwtiff_write(wctx,buf,4);
+}
+
 static void iwtiff_convert_row1(const iw_byte *srcrow, iw_byte *dstrow, int width)
 {
 	int i;
@@ -195,11 +1137,11 @@ static void iwtiff_write_palette(struct iwtiffwcontext *wctx)
 	iw_byte *buf = NULL;
 	unsigned int v;
 
-	buf = iw_malloc(wctx->ctx,wctx->palette_size);
-	if(!buf) return;
-
 	if(wctx->palentries<1) return;
 
+	buf = iw_mallocz(wctx->ctx,wctx->palette_size);
+	if(!buf) return;
+
 	// Palette samples are always 16-bit in TIFF files.
 	// IW does not support generating palettes which contain colors that can't
 	// be represented at 8 bits, so not every image that could be written
@@ -224,26 +1166,6 @@ static void iwtiff_write_palette(struct iwtiffwcontext *wctx)
 	iw_free(wctx->ctx,buf);
 }
 
-#define IWTIFF_TAG256_IMAGEWIDTH 256
-#define IWTIFF_TAG257_IMAGELENGTH 257
-#define IWTIFF_TAG258_BITSPERSAMPLE 258
-#define IWTIFF_TAG259_COMPRESSION 259
-#define IWTIFF_TAG262_PHOTOMETRIC 262
-#define IWTIFF_TAG273_STRIPOFFSETS 273
-#define IWTIFF_TAG277_SAMPLESPERPIXEL 277
-#define IWTIFF_TAG278_ROWSPERSTRIP 278
-#define IWTIFF_TAG279_STRIPBYTECOUNTS 279
-#define IWTIFF_TAG282_XRESOLUTION 282
-#define IWTIFF_TAG283_YRESOLUTION 283
-#define IWTIFF_TAG296_RESOLUTIONUNIT 296
-#define IWTIFF_TAG301_TRANSFERFUNCTION 301
-#define IWTIFF_TAG320_COLORMAP 320
-#define IWTIFF_TAG338_EXTRASAMPLES 338
-
-#define IWTIFF_UINT16   3 // "SHORT"
-#define IWTIFF_UINT32   4 // "LONG"
-#define IWTIFF_RATIONAL 5
-
 static void write_tag_to_ifd(struct iwtiffwcontext *wctx,int tagnum,iw_byte *buf)
 {
 	iw_set_ui16le(&buf[0],tagnum);
@@ -273,7 +1195,7 @@ static void write_tag_to_ifd(struct iwtiffwcontext *wctx,int tagnum,iw_byte *buf
 		}
 		break;
 	case IWTIFF_TAG259_COMPRESSION:
-		iw_set_ui16le(&buf[8],1);
+		iw_set_ui16le(&buf[8],wctx->compression);
 		break;
 	case IWTIFF_TAG262_PHOTOMETRIC:
 		iw_set_ui16le(&buf[8],wctx->photometric);
@@ -296,19 +1218,37 @@ static void write_tag_to_ifd(struct iwtiffwcontext *wctx,int tagnum,iw_byte *buf
 		}
 		break;
 	case IWTIFF_TAG273_STRIPOFFSETS:
+	case IWTIFF_TAG324_TILEOFFSETS:
 		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
-		iw_set_ui32le(&buf[8],wctx->bitmap_offset);
+		iw_set_ui32le(&buf[4],wctx->num_units);
+		if(wctx->num_units>1)
+			iw_set_ui32le(&buf[8],wctx->unit_offsets_offset);
+		else
+			iw_set_ui32le(&buf[8],wctx->bitmap_offset);
 		break;
 	case IWTIFF_TAG277_SAMPLESPERPIXEL:
 		iw_set_ui16le(&buf[8],wctx->samplesperpixel);
 		break;
 	case IWTIFF_TAG278_ROWSPERSTRIP:
 		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
-		iw_set_ui32le(&buf[8],wctx->img->height);
+		iw_set_ui32le(&buf[8],wctx->rows_per_strip);
 		break;
 	case IWTIFF_TAG279_STRIPBYTECOUNTS:
+	case IWTIFF_TAG325_TILEBYTECOUNTS:
 		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
-		iw_set_ui32le(&buf[8],(unsigned int)wctx->bitmap_size);
+		iw_set_ui32le(&buf[4],wctx->num_units);
+		if(wctx->num_units>1)
+			iw_set_ui32le(&buf[8],wctx->unit_bytecounts_offset);
+		else
+			iw_set_ui32le(&buf[8],wctx->unit_bytecounts[0]);
+		break;
+	case IWTIFF_TAG322_TILEWIDTH:
+		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
+		iw_set_ui32le(&buf[8],wctx->tile_width);
+		break;
+	case IWTIFF_TAG323_TILELENGTH:
+		iw_set_ui16le(&buf[2],IWTIFF_UINT32);
+		iw_set_ui32le(&buf[8],wctx->tile_height);
 		break;
 	case IWTIFF_TAG320_COLORMAP:
 		iw_set_ui32le(&buf[4],3*wctx->palentries);
@@ -333,9 +1273,11 @@ static void append_tag(struct iwtiffwcontext *wctx, unsigned short tagnum)
 }
 
 // Writes the IFD, and meta data
-static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
+static int iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 {
 	unsigned int tmppos;
+	size_t datapos;
+	int retval = 0;
 	unsigned int ifd_size;
 	iw_byte *buf = NULL;
 	int i;
@@ -347,10 +1289,14 @@ static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 	append_tag(wctx,IWTIFF_TAG258_BITSPERSAMPLE);
 	append_tag(wctx,IWTIFF_TAG259_COMPRESSION);
 	append_tag(wctx,IWTIFF_TAG262_PHOTOMETRIC);
-	append_tag(wctx,IWTIFF_TAG273_STRIPOFFSETS);
+	if(!wctx->tiled) {
+		append_tag(wctx,IWTIFF_TAG273_STRIPOFFSETS);
+	}
 	append_tag(wctx,IWTIFF_TAG277_SAMPLESPERPIXEL);
-	append_tag(wctx,IWTIFF_TAG278_ROWSPERSTRIP);
-	append_tag(wctx,IWTIFF_TAG279_STRIPBYTECOUNTS);
+	if(!wctx->tiled) {
+		append_tag(wctx,IWTIFF_TAG278_ROWSPERSTRIP);
+		append_tag(wctx,IWTIFF_TAG279_STRIPBYTECOUNTS);
+	}
 
 	if(wctx->pixdens_size>0) {
 
@@ -374,6 +1320,12 @@ static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 	if(wctx->palette_size>0) {
 		append_tag(wctx,IWTIFF_TAG320_COLORMAP);
 	}
+	if(wctx->tiled) {
+		append_tag(wctx,IWTIFF_TAG322_TILEWIDTH);
+		append_tag(wctx,IWTIFF_TAG323_TILELENGTH);
+		append_tag(wctx,IWTIFF_TAG324_TILEOFFSETS);
+		append_tag(wctx,IWTIFF_TAG325_TILEBYTECOUNTS);
+	}
 	if(wctx->has_alpha_channel) {
 		append_tag(wctx,IWTIFF_TAG338_EXTRASAMPLES);
 	}
@@ -404,9 +1356,26 @@ static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 		tmppos += wctx->palette_size;
 	}
 
+	if(wctx->num_units>1) {
+		wctx->unit_offsets_offset = tmppos;
+		tmppos += 4*wctx->num_units;
+		wctx->unit_bytecounts_offset = tmppos;
+		tmppos += 4*wctx->num_units;
+	}
+
 	// Put the bitmap last
 	wctx->bitmap_offset = tmppos;
 
+	datapos = tmppos;
+	for(i=0;i<wctx->num_units;i++) {
+		wctx->unit_offsets[i] = (unsigned int)datapos;
+		datapos += wctx->unit_bytecounts[i];
+	}
+	if(datapos > 0xffffffffU) {
+		iw_set_error(wctx->ctx,"Image too large for TIFF format");
+		goto done;
+	}
+
 	buf = iw_mallocz(wctx->ctx,ifd_size);
 	if(!buf) goto done;
 
@@ -441,17 +1410,397 @@ static void iwtiff_write_ifd(struct iwtiffwcontext *wctx)
 	// Palette is always too large to be inlined.
 	iwtiff_write_palette(wctx);
 
+	if(wctx->num_units>1) {
+		for(i=0;i<wctx->num_units;i++) {
+			iwtiff_write_ui32(wctx,wctx->unit_offsets[i]);
+		}
+		for(i=0;i<wctx->num_units;i++) {
+			iwtiff_write_ui32(wctx,wctx->unit_bytecounts[i]);
+		}
+	}
+
+	retval = 1;
 done:
 	if(buf) iw_free(wctx->ctx,buf);
+	return retval;
+}
+
+// Convert width pixels starting at srcrow to TIFF format.
+static void iwtiff_convert_row(struct iwtiffwcontext *wctx,
+	const iw_byte *srcrow, iw_byte *dstrow, int width)
+{
+	if(wctx->bitspersample==16) {
+		switch(wctx->bitsperpixel) {
+		case 64: iwtiff_convert_row16bps(srcrow,dstrow,width,4); break; // RGBA16
+		case 48: iwtiff_convert_row16bps(srcrow,dstrow,width,3); break; // RGB16
+		case 32: iwtiff_convert_row16bps(srcrow,dstrow,width,2); break; // GA16
+		case 16: iwtiff_convert_row16bps(srcrow,dstrow,width,1); break; // G16
+		}
+	}
+	else {
+		switch(wctx->bitsperpixel) {
+		case 32: iwtiff_convert_row8bps(srcrow,dstrow,width,4); break; // RGBA8
+		case 24: iwtiff_convert_row8bps(srcrow,dstrow,width,3); break; // RGB8
+		case 16: iwtiff_convert_row8bps(srcrow,dstrow,width,2); break; // GA8
+		case 8: iwtiff_convert_row8bps(srcrow,dstrow,width,1); break; // G8 or palette8
+		case 4: iwtiff_convert_row4(srcrow,dstrow,width); break; // G4 or palette4
+		case 1: iwtiff_convert_row1(srcrow,dstrow,width); break; // G1
+		}
+	}
+}
+
+// Returns the uncompressed size of the given strip or tile.
+static size_t iwtiff_unit_raw_size(struct iwtiffwcontext *wctx, int unit)
+{
+	int nrows;
+
+	if(wctx->tiled) return wctx->unit_size;
+	// The last strip may have fewer rows.
+	nrows = wctx->img->height - unit*wctx->rows_per_strip;
+	if(nrows>wctx->rows_per_strip) nrows = wctx->rows_per_strip;
+	return wctx->unit_bpr * nrows;
+}
+
+// Write the uncompressed data for the given strip or tile to dst.
+// Tiles at the right and bottom edges are padded with zeroes.
+static void iwtiff_convert_unit(struct iwtiffwcontext *wctx, int unit, iw_byte *dst)
+{
+	const struct iw_image *img = wctx->img;
+	int x0, y0;
+	int w, h;
+	int j;
+	size_t src_bytespp;
+
+	if(wctx->tiled) {
+		x0 = (unit%wctx->units_across)*wctx->tile_width;
+		y0 = (unit/wctx->units_across)*wctx->tile_height;
+		w = img->width - x0;
+		if(w>wctx->tile_width) w = wctx->tile_width;
+		h = img->height - y0;
+		if(h>wctx->tile_height) h = wctx->tile_height;
+		if(w<wctx->tile_width || h<wctx->tile_height) {
+			iw_zeromem(dst,wctx->unit_size);
+		}
+	}
+	else {
+		x0 = 0;
+		y0 = unit*wctx->rows_per_strip;
+		w = img->width;
+		h = (int)(iwtiff_unit_raw_size(wctx,unit)/wctx->unit_bpr);
+	}
+
+	// Size of a pixel in the source image. Samples smaller than 8 bits are
+	// stored one per byte.
+	src_bytespp = (wctx->bitspersample==16) ? 2*wctx->samplesperpixel :
+		wctx->samplesperpixel;
+
+	for(j=0;j<h;j++) {
+		iwtiff_convert_row(wctx,&img->pixels[(size_t)(y0+j)*img->bpr + x0*src_bytespp],
+			&dst[j*wctx->unit_bpr],w);
+	}
+}
+
+// PackBits-compress n bytes from src to dst. dst must have room for at least
+// n + (n+127)/128 bytes. Returns the number of bytes written.
+static size_t iwtiff_packbits_row(const iw_byte *src, size_t n, iw_byte *dst)
+{
+	size_t i = 0;
+	size_t dstpos = 0;
+	size_t runlen;
+	size_t litstart;
+
+	while(i<n) {
+		runlen = 1;
+		while(i+runlen<n && runlen<128 && src[i+runlen]==src[i]) runlen++;
+
+		if(runlen>=3 || (runlen==2 && i+2>=n)) {
+			dst[dstpos++] = (iw_byte)(257-runlen); // = -(runlen-1)
+			dst[dstpos++] = src[i];
+			i += runlen;
+			continue;
+		}
+
+		// Literal run: continue until the next run of 3 or more identical
+		// bytes, or 128 bytes.
+		litstart = i;
+		while(i<n && i-litstart<128) {
+			if(i+2<n && src[i]==src[i+1] && src[i]==src[i+2]) break;
+			i++;
+		}
+		dst[dstpos++] = (iw_byte)(i-litstart-1);
+		memcpy(&dst[dstpos],&src[litstart],i-litstart);
+		dstpos += i-litstart;
+	}
+	return dstpos;
+}
+
+static size_t iwtiff_packbits_bound(size_t rowsize, size_t nrows)
+{
+	return (rowsize + (rowsize+127)/128) * nrows;
+}
+
+struct iwtiff_batch {
+	struct iwtiffwcontext *wctx;
+	int first_unit;
+	iw_byte *rawbuf; // Uncompressed data for each unit, unit_size bytes apart
+	iw_byte *cbuf; // For PackBits: compressed data for each unit
+	size_t cbuf_stride;
+	size_t *csize; // For PackBits: the compressed size of each unit
+};
+
+// Convert (and for PackBits, compress) one strip or tile of the batch. Runs
+// in a worker thread.
+static void iwtiff_process_unit(struct iw_context *ctx, void *userdata, int item)
+{
+	struct iwtiff_batch *batch = (struct iwtiff_batch*)userdata;
+	struct iwtiffwcontext *wctx = batch->wctx;
+	int unit = batch->first_unit + item;
+	iw_byte *raw;
+	iw_byte *dst;
+	size_t rawsize;
+	size_t pos;
+	size_t cpos;
+
+	raw = &batch->rawbuf[item*wctx->unit_size];
+	iwtiff_convert_unit(wctx,unit,raw);
+
+	if(wctx->compression!=IWTIFF_CMPR_PACKBITS) return;
+
+	// Each row is compressed separately.
+	rawsize = iwtiff_unit_raw_size(wctx,unit);
+	dst = &batch->cbuf[item*batch->cbuf_stride];
+	cpos = 0;
+	for(pos=0;pos<rawsize;pos+=wctx->unit_bpr) {
+		cpos += iwtiff_packbits_row(&raw[pos],wctx->unit_bpr,&dst[cpos]);
+	}
+	batch->csize[item] = cpos;
+}
+
+// Compress all the strips or tiles, in batches, using multiple threads.
+// The compressed data is kept in memory until the whole file is written.
+static int iwtiff_compress_units(struct iwtiffwcontext *wctx)
+{
+	struct iw_context *ctx = wctx->ctx;
+	struct iwtiff_batch batch;
+	int units_per_batch;
+	int nunits;
+	int max_threads;
+	int i;
+	iw_byte *zbuf;
+	size_t zlen;
+	size_t pos;
+	int retval = 0;
+
+	iw_zeromem(&batch,sizeof(struct iwtiff_batch));
+	batch.wctx = wctx;
+
+	max_threads = iw_get_value(ctx,IW_VAL_MAX_THREADS);
+	if(max_threads<1) max_threads=1;
+	units_per_batch = 4*max_threads;
+	if(units_per_batch>wctx->num_units) units_per_batch=wctx->num_units;
+
+	wctx->unit_data = iw_mallocz(ctx,wctx->num_units*sizeof(iw_byte*));
+	if(!wctx->unit_data) goto done;
+	wctx->batch_bufs = iw_mallocz(ctx,((wctx->num_units+units_per_batch-1)/units_per_batch)*sizeof(iw_byte*));
+	if(!wctx->batch_bufs) goto done;
+
+	batch.rawbuf = iw_malloc_large(ctx,units_per_batch,wctx->unit_size);
+	if(!batch.rawbuf) goto done;
+	batch.csize = iw_malloc(ctx,units_per_batch*sizeof(size_t));
+	if(!batch.csize) goto done;
+
+	if(wctx->compression==IWTIFF_CMPR_DEFLATE) {
+		wctx->zctx = wctx->zmod->deflate_init(ctx);
+		if(!wctx->zctx) goto done;
+	}
+	else {
+		batch.cbuf_stride = iwtiff_packbits_bound(wctx->unit_bpr,wctx->unit_size/wctx->unit_bpr);
+	}
+
+	for(batch.first_unit=0;batch.first_unit<wctx->num_units;batch.first_unit+=nunits) {
+		nunits = wctx->num_units - batch.first_unit;
+		if(nunits>units_per_batch) nunits=units_per_batch;
+
+		if(wctx->compression==IWTIFF_CMPR_PACKBITS) {
+			batch.cbuf = iw_malloc_large(ctx,nunits,batch.cbuf_stride);
+			if(!batch.cbuf) goto done;
+			wctx->batch_bufs[wctx->num_batch_bufs++] = batch.cbuf;
+		}
+
+		iw_run_threaded(ctx,nunits,iwtiff_process_unit,(void*)&batch);
+
+		if(wctx->compression==IWTIFF_CMPR_DEFLATE) {
+			// Only the last strip can be shorter than unit_size, so the data
+			// for this batch is contiguous.
+			if(!wctx->zmod->deflate_items(wctx->zctx,batch.rawbuf,
+				(nunits-1)*wctx->unit_size + iwtiff_unit_raw_size(wctx,batch.first_unit+nunits-1),
+				wctx->unit_size,IW_ZLIB_INDEPENDENT,&zbuf,&zlen,batch.csize))
+			{
+				goto done;
+			}
+			wctx->batch_bufs[wctx->num_batch_bufs++] = zbuf;
+			pos = 0;
+			for(i=0;i<nunits;i++) {
+				wctx->unit_data[batch.first_unit+i] = &zbuf[pos];
+				pos += batch.csize[i];
+			}
+		}
+		else {
+			for(i=0;i<nunits;i++) {
+				wctx->unit_data[batch.first_unit+i] = &batch.cbuf[i*batch.cbuf_stride];
+			}
+		}
+
+		for(i=0;i<nunits;i++) {
+			if(batch.csize[i] > 0xffffffffU) {
+				iw_set_error(ctx,"Image too large for TIFF format");
+				goto done;
+			}
+			wctx->unit_bytecounts[batch.first_unit+i] = (unsigned int)batch.csize[i];
+		}
+	}
+
+	retval = 1;
+done:
+	iw_free(ctx,batch.rawbuf);
+	iw_free(ctx,batch.csize);
+	return retval;
+}
+
+// Write the (uncompressed or already-compressed) image data.
+static int iwtiff_write_units(struct iwtiffwcontext *wctx)
+{
+	struct iw_image *img = wctx->img;
+	iw_byte *buf = NULL;
+	int i;
+	int j;
+	int retval = 0;
+
+	if(wctx->compression!=IWTIFF_CMPR_NONE) {
+		for(i=0;i<wctx->num_units;i++) {
+			iwtiff_write(wctx,wctx->unit_data[i],wctx->unit_bytecounts[i]);
+		}
+		retval = 1;
+		goto done;
+	}
+
+	if(wctx->tiled) {
+		buf = iw_malloc(wctx->ctx,wctx->unit_size);
+		if(!buf) goto done;
+		for(i=0;i<wctx->num_units;i++) {
+			iwtiff_convert_unit(wctx,i,buf);
+			iwtiff_write(wctx,buf,wctx->unit_size);
+		}
+		retval = 1;
+		goto done;
+	}
+
+	// Uncompressed strips are contiguous, so we can just write the rows
+	// in order.
+	buf = iw_mallocz(wctx->ctx,wctx->dstbpr);
+	if(!buf) goto done;
+	for(j=0;j<img->height;j++) {
+		iwtiff_convert_row(wctx,&img->pixels[(size_t)j*img->bpr],buf,img->width);
+		iwtiff_write(wctx,buf,wctx->dstbpr);
+	}
+	retval = 1;
+
+done:
+	if(buf) iw_free(wctx->ctx,buf);
+	return retval;
+}
+
+// Decide on the compression method, and how to divide the image into strips
+// or tiles.
+static int iwtiff_plan_layout(struct iwtiffwcontext *wctx)
+{
+	struct iw_image *img = wctx->img;
+	const char *optv;
+	double nums[2];
+	int max_size[2];
+	int n;
+	int i;
+	int units_down;
+
+	switch(iw_get_value(wctx->ctx,IW_VAL_COMPRESSION)) {
+	case IW_COMPRESSION_ZIP:
+		if(wctx->zmod && wctx->zmod->deflate_items)
+			wctx->compression = IWTIFF_CMPR_DEFLATE;
+		else
+			wctx->compression = IWTIFF_CMPR_NONE;
+		break;
+	case IW_COMPRESSION_RLE:
+		wctx->compression = IWTIFF_CMPR_PACKBITS;
+		break;
+	default:
+		wctx->compression = IWTIFF_CMPR_NONE;
+	}
+
+	optv = iw_get_option(wctx->ctx, "tiff:tilesize");
+	if(optv) {
+		nums[0] = nums[1] = 0.0;
+		n = iw_parse_number_list(optv,2,nums);
+		if(n<2) nums[1] = nums[0];
+		// Tile dimensions must be multiples of 16. There's no reason for a
+		// tile to be larger than the image.
+		max_size[0] = ((img->width+15)/16)*16;
+		max_size[1] = ((img->height+15)/16)*16;
+		for(i=0;i<2;i++) {
+			if(!(nums[i]>16.0)) nums[i] = 16.0;
+			if(nums[i]>(double)max_size[i]) nums[i] = (double)max_size[i];
+		}
+		wctx->tile_width = ((iw_round_to_int(nums[0])+15)/16)*16;
+		wctx->tile_height = ((iw_round_to_int(nums[1])+15)/16)*16;
+		wctx->tiled = 1;
+	}
+
+	if(wctx->tiled) {
+		wctx->units_across = (img->width+wctx->tile_width-1)/wctx->tile_width;
+		units_down = (img->height+wctx->tile_height-1)/wctx->tile_height;
+		wctx->unit_bpr = iwtiff_calc_bpr(wctx->bitsperpixel,wctx->tile_width);
+		wctx->unit_size = wctx->unit_bpr * wctx->tile_height;
+	}
+	else {
+		// By default, uncompressed images are written as a single strip.
+		wctx->rows_per_strip = img->height;
+		if(wctx->compression!=IWTIFF_CMPR_NONE) {
+			wctx->rows_per_strip = (int)(IWTIFF_DEFAULT_STRIP_SIZE/wctx->dstbpr);
+		}
+		optv = iw_get_option(wctx->ctx, "tiff:rowsperstrip");
+		if(optv) {
+			wctx->rows_per_strip = iw_parse_int(optv);
+		}
+		if(wctx->rows_per_strip<1) wctx->rows_per_strip=1;
+		if(wctx->rows_per_strip>img->height) wctx->rows_per_strip=img->height;
+
+		wctx->units_across = 1;
+		units_down = (img->height+wctx->rows_per_strip-1)/wctx->rows_per_strip;
+		wctx->unit_bpr = wctx->dstbpr;
+		wctx->unit_size = wctx->unit_bpr * wctx->rows_per_strip;
+	}
+
+	wctx->num_units = wctx->units_across * units_down;
+
+	wctx->unit_offsets = iw_mallocz(wctx->ctx,wctx->num_units*sizeof(unsigned int));
+	wctx->unit_bytecounts = iw_mallocz(wctx->ctx,wctx->num_units*sizeof(unsigned int));
+	if(!wctx->unit_offsets || !wctx->unit_bytecounts) return 0;
+
+	if(wctx->compression==IWTIFF_CMPR_NONE) {
+		for(i=0;i<wctx->num_units;i++) {
+			if(iwtiff_unit_raw_size(wctx,i) > 0xffffffffU) {
+				iw_set_error(wctx->ctx,"Image too large for TIFF format");
+				return 0;
+			}
+			wctx->unit_bytecounts[i] = (unsigned int)iwtiff_unit_raw_size(wctx,i);
+		}
+	}
+	return 1;
 }
 
 static int iwtiff_write_main(struct iwtiffwcontext *wctx)
 {
 	struct iw_image *img;
-	iw_byte *dstrow = NULL;
-	size_t dstbpr;
-	int j;
-	const iw_byte *srcrow;
+	int retval = 0;
 
 	img = wctx->img;
 
@@ -510,9 +1859,7 @@ static int iwtiff_write_main(struct iwtiffwcontext *wctx)
 	wctx->bitsperpixel = wctx->bitspersample * wctx->samplesperpixel;
 	wctx->bitspersample_size = 2*wctx->samplesperpixel;
 
-	dstbpr = iwtiff_calc_bpr(wctx->bitsperpixel,img->width);
-
-	wctx->bitmap_size = dstbpr * img->height;
+	wctx->dstbpr = iwtiff_calc_bpr(wctx->bitsperpixel,img->width);
 	wctx->palette_size = wctx->palentries*6;
 	wctx->pixdens_size = 16;
 
@@ -545,47 +1892,30 @@ static int iwtiff_write_main(struct iwtiffwcontext *wctx)
 
 	wctx->transferfunc_size = 2*wctx->transferfunc_numentries;
 
+	if(!iwtiff_plan_layout(wctx)) goto done;
+
+	if(wctx->compression!=IWTIFF_CMPR_NONE) {
+		if(!iwtiff_compress_units(wctx)) goto done;
+	}
+
 	// File header
 	iwtiff_write_file_header(wctx);
 
-	iwtiff_write_ifd(wctx);
+	if(!iwtiff_write_ifd(wctx)) goto done;
 
 	// Pixels
-	dstrow = iw_mallocz(wctx->ctx,dstbpr);
-	if(!dstrow) goto done;
-
-	for(j=0;j<img->height;j++) {
-		srcrow = &img->pixels[j*img->bpr];
-		if(wctx->bitspersample==16) {
-			switch(wctx->bitsperpixel) {
-			case 64: iwtiff_convert_row16bps(srcrow,dstrow,img->width,4); break; // RGBA16
-			case 48: iwtiff_convert_row16bps(srcrow,dstrow,img->width,3); break; // RGB16
-			case 32: iwtiff_convert_row16bps(srcrow,dstrow,img->width,2); break; // GA16
-			case 16: iwtiff_convert_row16bps(srcrow,dstrow,img->width,1); break; // G16
-			}
-		}
-		else {
-			switch(wctx->bitsperpixel) {
-			case 32: iwtiff_convert_row8bps(srcrow,dstrow,img->width,4); break; // RGBA8
-			case 24: iwtiff_convert_row8bps(srcrow,dstrow,img->width,3); break; // RGB8
-			case 16: iwtiff_convert_row8bps(srcrow,dstrow,img->width,2); break; // GA8
-			case 8: iwtiff_convert_row8bps(srcrow,dstrow,img->width,1); break; // G8 or palette8
-			case 4: iwtiff_convert_row4(srcrow,dstrow,img->width); break; // G4 or palette4
-			case 1: iwtiff_convert_row1(srcrow,dstrow,img->width); break; // G1
-			}
-		}
-		iwtiff_write(wctx,dstrow,dstbpr);
-	}
+	if(!iwtiff_write_units(wctx)) goto done;
 
+	retval = 1;
 done:
-	if(dstrow) iw_free(wctx->ctx,dstrow);
-	return 1;
+	return retval;
 }
 
 IW_IMPL(int) iw_write_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
 {
 	struct iwtiffwcontext *wctx = NULL;
 	int retval=0;
+	int i;
 	struct iw_image img1;
 
 	iw_zeromem(&img1,sizeof(struct iw_image));
@@ -609,11 +1939,25 @@ IW_IMPL(int) iw_write_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodes
 		if(!wctx->pal) goto done;
 	}
 
-	iwtiff_write_main(wctx);
+	wctx->zmod = iw_get_zlib_module(ctx);
+
+	if(!iwtiff_write_main(wctx)) goto done;
 
 	retval=1;
 
 done:
-	if(wctx) iw_free(ctx,wctx);
+	if(wctx) {
+		if(wctx->zctx) wctx->zmod->deflate_end(wctx->zctx);
+		if(wctx->batch_bufs) {
+			for(i=0;i<wctx->num_batch_bufs;i++) {
+				iw_free(ctx,wctx->batch_bufs[i]);
+			}
+			iw_free(ctx,wctx->batch_bufs);
+		}
+		iw_free(ctx,wctx->unit_data);
+		iw_free(ctx,wctx->unit_offsets);
+		iw_free(ctx,wctx->unit_bytecounts);
+		iw_free(ctx,wctx);
+	}
 	return retval;
 }
@@ -15,6 +15,13 @@
 #endif
 #include <stdarg.h>
 #include <time.h>
+#if IW_SUPPORT_THREADS == 1
+#ifdef IW_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
 
 #include "imagew-internals.h"
 #ifdef IW_WINDOWS
@@ -258,6 +265,7 @@ IW_IMPL(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodesc
 	if(!ret) return 0;
 
 	*pmem = iw_malloc(ctx,(size_t)*psize);
+	if(!*pmem) return 0;
 
 	ret = (*iodescr->read_fn)(ctx,iodescr,*pmem,(size_t)*psize,&bytesread);
 	if(!ret) return 0;
@@ -265,6 +273,203 @@ IW_IMPL(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodesc
 	return 1;
 }
 
+static int iw_mem_readfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	void *buf, size_t nbytes, size_t *pbytesread)
+{
+	size_t n;
+
+	n = iodescr->mem_size - iodescr->mem_pos;
+	if(n>nbytes) n=nbytes;
+	memcpy(buf,&iodescr->mem[iodescr->mem_pos],n);
+	iodescr->mem_pos += n;
+	*pbytesread = n;
+	return 1;
+}
+
+static int iw_mem_getfilesizefn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_int64 *pfilesize)
+{
+	*pfilesize = (iw_int64)iodescr->mem_size;
+	return 1;
+}
+
+static int iw_mem_seekfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_int64 offset, int whence)
+{
+	iw_int64 pos;
+
+	switch(whence) {
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = (iw_int64)iodescr->mem_pos + offset; break;
+	case SEEK_END: pos = (iw_int64)iodescr->mem_size + offset; break;
+	default: return 0;
+	}
+	if(pos<0) return 0;
+	if(pos>(iw_int64)iodescr->mem_size) pos = (iw_int64)iodescr->mem_size;
+	iodescr->mem_pos = (size_t)pos;
+	return 1;
+}
+
+static int iw_mem_tellfn(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_int64 *pfileptr)
+{
+	*pfileptr = (iw_int64)iodescr->mem_pos;
+	return 1;
+}
+
+IW_IMPL(void) iw_set_iodescr_mem(struct iw_iodescr *iodescr, const void *mem,
+  size_t memsize)
+{
+	iodescr->mem = (const iw_byte*)mem;
+	iodescr->mem_size = memsize;
+	iodescr->mem_pos = 0;
+	iodescr->read_fn = iw_mem_readfn;
+	iodescr->getfilesize_fn = iw_mem_getfilesizefn;
+	iodescr->seek_fn = iw_mem_seekfn;
+	iodescr->tell_fn = iw_mem_tellfn;
+}
+
+IW_IMPL(int) iw_bufreader_init(struct iw_context *ctx, struct iw_bufreader *br,
+  struct iw_iodescr *iodescr)
+{
+	iw_zeromem(br,sizeof(struct iw_bufreader));
+	br->ctx = ctx;
+	br->iodescr = iodescr;
+
+	if(iodescr->mem) {
+		br->data = &iodescr->mem[iodescr->mem_pos];
+		br->data_len = iodescr->mem_size - iodescr->mem_pos;
+		iodescr->mem_pos = iodescr->mem_size;
+		return 1;
+	}
+
+	br->buf = iw_malloc(ctx,IW_BUFREADER_SIZE);
+	if(!br->buf) return 0;
+	br->data = br->buf;
+	return 1;
+}
+
+IW_IMPL(void) iw_bufreader_done(struct iw_bufreader *br)
+{
+	if(br->buf) {
+		iw_free(br->ctx,br->buf);
+		br->buf = NULL;
+	}
+	br->data = NULL;
+	br->data_len = 0;
+	br->data_pos = 0;
+}
+
+// Try to make at least 'need' bytes (at most IW_BUFREADER_SIZE) available.
+// Returns the number of bytes available.
+static size_t iw_bufreader_fill(struct iw_bufreader *br, size_t need)
+{
+	size_t avail;
+	size_t amt;
+	size_t bytesread;
+	int ret;
+
+	avail = br->data_len - br->data_pos;
+	if(avail>=need || !br->buf || br->eof_flag) return avail;
+
+	// Move the unread bytes to the start of the buffer.
+	if(avail>0 && br->data_pos>0) {
+		memmove(br->buf,&br->buf[br->data_pos],avail);
+	}
+	br->data_pos = 0;
+	br->data_len = avail;
+
+	while(br->data_len < need) {
+		amt = IW_BUFREADER_SIZE - br->data_len;
+		bytesread = 0;
+		ret = (*br->iodescr->read_fn)(br->ctx,br->iodescr,&br->buf[br->data_len],
+			amt,&bytesread);
+		if(!ret || bytesread>amt) bytesread=0;
+		br->data_len += bytesread;
+		if(bytesread<amt) {
+			br->eof_flag = 1;
+			break;
+		}
+	}
+	return br->data_len;
+}
+
+IW_IMPL(int) iw_bufreader_read(struct iw_bufreader *br, void *buf, size_t n)
+{
+	size_t avail;
+	size_t bytesread;
+	int ret;
+	iw_byte *dst = (iw_byte*)buf;
+
+	avail = br->data_len - br->data_pos;
+	if(avail>=n) {
+		memcpy(dst,&br->data[br->data_pos],n);
+		br->data_pos += n;
+		return 1;
+	}
+
+	// Use up the buffered bytes.
+	memcpy(dst,&br->data[br->data_pos],avail);
+	br->data_pos = br->data_len;
+	dst += avail;
+	n -= avail;
+
+	if(!br->buf || br->eof_flag) return 0;
+
+	if(n>=IW_BUFREADER_SIZE) {
+		// A large read. Don't bother copying it through the buffer.
+		bytesread = 0;
+		ret = (*br->iodescr->read_fn)(br->ctx,br->iodescr,dst,n,&bytesread);
+		if(!ret || bytesread!=n) {
+			br->eof_flag = 1;
+			return 0;
+		}
+		return 1;
+	}
+
+	avail = iw_bufreader_fill(br,n);
+	if(avail<n) {
+		br->data_pos = br->data_len;
+		return 0;
+	}
+	memcpy(dst,&br->data[br->data_pos],n);
+	br->data_pos += n;
+	return 1;
+}
+
+IW_IMPL(int) iw_bufreader_read_byte(struct iw_bufreader *br, iw_byte *b)
+{
+	if(br->data_pos>=br->data_len) {
+		if(iw_bufreader_fill(br,1)<1) {
+			*b = 0;
+			return 0;
+		}
+	}
+	*b = br->data[br->data_pos++];
+	return 1;
+}
+
+IW_IMPL(const iw_byte*) iw_bufreader_peek(struct iw_bufreader *br, size_t n)
+{
+	if(br->buf && n>IW_BUFREADER_SIZE) return NULL;
+	if(iw_bufreader_fill(br,n)<n) return NULL;
+	return &br->data[br->data_pos];
+}
+
+IW_IMPL(int) iw_bufreader_skip(struct iw_bufreader *br, size_t n)
+{
+	size_t avail;
+
+	while(n>0) {
+		avail = iw_bufreader_fill(br,1);
+		if(avail<1) return 0;
+		if(avail>n) avail=n;
+		br->data_pos += avail;
+		n -= avail;
+	}
+	return 1;
+}
+
 struct iw_utf8cvt_struct {
 	char *dst;
 	int dstlen;
@@ -642,6 +847,7 @@ IW_IMPL(int) iw_is_input_fmt_supported(int fmt)
 	case IW_FORMAT_MIFF:
 	case IW_FORMAT_GIF:
 	case IW_FORMAT_BMP:
+	case IW_FORMAT_TIFF:
 	case IW_FORMAT_PNM:
 	case IW_FORMAT_PAM:
 		return 1;
@@ -767,3 +973,135 @@ IW_IMPL(int) iw_parse_int(const char *s)
 	iw_parse_number_internal(s, &result, &charsread);
 	return iw_round_to_int(result);
 }
+
+////////////////////////////////////////////
+// A simple thread pool. The calling thread does some of the work, and
+// each thread takes the next unclaimed item number until none are left.
+
+#if IW_SUPPORT_THREADS == 1
+
+struct iw_threadpool {
+	struct iw_context *ctx;
+	iw_threadfn_type fn;
+	void *userdata;
+	int num_items;
+	int next_item;
+#ifdef IW_WINDOWS
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+};
+
+static int threadpool_claim_item(struct iw_threadpool *tp)
+{
+	int item;
+#ifdef IW_WINDOWS
+	EnterCriticalSection(&tp->lock);
+#else
+	pthread_mutex_lock(&tp->lock);
+#endif
+	item = tp->next_item;
+	if(item < tp->num_items) tp->next_item++;
+#ifdef IW_WINDOWS
+	LeaveCriticalSection(&tp->lock);
+#else
+	pthread_mutex_unlock(&tp->lock);
+#endif
+	return item;
+}
+
+static void threadpool_do_work(struct iw_threadpool *tp)
+{
+	int item;
+
+	while(1) {
+		item = threadpool_claim_item(tp);
+		if(item >= tp->num_items) break;
+		(*tp->fn)(tp->ctx,tp->userdata,item);
+	}
+}
+
+#ifdef IW_WINDOWS
+static DWORD WINAPI threadpool_thread_main(LPVOID p)
+{
+	threadpool_do_work((struct iw_threadpool*)p);
+	return 0;
+}
+#else
+static void *threadpool_thread_main(void *p)
+{
+	threadpool_do_work((struct iw_threadpool*)p);
+	return NULL;
+}
+#endif
+
+#endif // IW_SUPPORT_THREADS
+
+IW_IMPL(int) iw_run_threaded(struct iw_context *ctx, int num_items,
+	iw_threadfn_type fn, void *userdata)
+{
+	int num_threads;
+	int i;
+#if IW_SUPPORT_THREADS == 1
+	struct iw_threadpool tp;
+	int num_started = 0;
+#ifdef IW_WINDOWS
+	HANDLE threads[IW_MAX_THREADS];
+#else
+	pthread_t threads[IW_MAX_THREADS];
+#endif
+#endif
+
+	num_threads = ctx->max_threads;
+	if(num_threads>num_items) num_threads=num_items;
+
+#if IW_SUPPORT_THREADS == 1
+	if(num_threads>1) {
+		tp.ctx = ctx;
+		tp.fn = fn;
+		tp.userdata = userdata;
+		tp.num_items = num_items;
+		tp.next_item = 0;
+#ifdef IW_WINDOWS
+		InitializeCriticalSection(&tp.lock);
+#else
+		pthread_mutex_init(&tp.lock,NULL);
+#endif
+
+		// If a thread can't be created, we just make do with fewer threads.
+		for(i=0;i<num_threads-1;i++) {
+#ifdef IW_WINDOWS
+			threads[num_started] = CreateThread(NULL,0,threadpool_thread_main,&tp,0,NULL);
+			if(!threads[num_started]) break;
+#else
+			if(pthread_create(&threads[num_started],NULL,threadpool_thread_main,&tp)) break;
+#endif
+			num_started++;
+		}
+
+		threadpool_do_work(&tp);
+
+		for(i=0;i<num_started;i++) {
+#ifdef IW_WINDOWS
+			WaitForSingleObject(threads[i],INFINITE);
+			CloseHandle(threads[i]);
+#else
+			pthread_join(threads[i],NULL);
+#endif
+		}
+
+#ifdef IW_WINDOWS
+		DeleteCriticalSection(&tp.lock);
+#else
+		pthread_mutex_destroy(&tp.lock);
+#endif
+		return num_started+1;
+	}
+#endif
+
+	for(i=0;i<num_items;i++) {
+		(*fn)(ctx,userdata,i);
+	}
+	return 1;
+}
@@ -360,14 +360,45 @@ done:
 
 #endif
 
+#if IW_WEBPDECMETHOD == 3 || IW_WEBPDECMETHOD == 4
+
+// Get the whole WebP file as a memory block. If the file is already in memory
+// (see iw_set_iodescr_mem()), it is used directly. Otherwise it is read into
+// memory, and *pmem_to_free is set to the memory that must be freed.
+static int iwwebp_get_file_data(struct iwwebprcontext *rctx,
+	const uint8_t **pdata, size_t *psize, void **pmem_to_free)
+{
+	struct iw_iodescr *iodescr = rctx->iodescr;
+	void *mem = NULL;
+	iw_int64 size = 0;
+	int ret;
+
+	if(iodescr->mem) {
+		*pdata = &iodescr->mem[iodescr->mem_pos];
+		*psize = iodescr->mem_size - iodescr->mem_pos;
+		iodescr->mem_pos = iodescr->mem_size;
+		return 1;
+	}
+
+	ret = iw_file_to_memory(rctx->ctx, iodescr, &mem, &size);
+	*pmem_to_free = mem;
+	if(!ret) return 0;
+	*pdata = (const uint8_t*)mem;
+	*psize = (size_t)size;
+	return 1;
+}
+
+#endif
+
 #if IW_WEBPDECMETHOD == 3 // WebPDecodeRGBA()
 
 static int iwwebp_read_main(struct iwwebprcontext *rctx)
 {
 	struct iw_image *img;
 	int retval=0;
-	void *webpimage=NULL;
-	iw_int64 webpimage_size=0;
+	const uint8_t *webpimage=NULL;
+	size_t webpimage_size=0;
+	void *webpimage_mem=NULL;
 	uint8_t* uncmpr_webp_pixels = NULL;
 	int width, height;
 	size_t npixels;
@@ -376,7 +407,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	img = rctx->img;
 
 	// Read the whole WebP file into a memory block.
-	if(!iw_file_to_memory(rctx->ctx, rctx->iodescr, &webpimage, &webpimage_size)) {
+	if(!iwwebp_get_file_data(rctx, &webpimage, &webpimage_size, &webpimage_mem)) {
 		goto done;
 	}
 
@@ -418,7 +449,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	retval=1;
 
 done:
-	if(webpimage) iw_free(rctx->ctx,webpimage);
+	if(webpimage_mem) iw_free(rctx->ctx,webpimage_mem);
 
 	// !!! Portability warning: This is dangerous, because this memory was
 	// allocated by libwebp. There's no way to be sure that our free() function
@@ -436,8 +467,9 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 {
 	struct iw_image *img;
 	int retval=0;
-	void *webpimage=NULL;
-	iw_int64 webpimage_size=0;
+	const uint8_t *webpimage=NULL;
+	size_t webpimage_size=0;
+	void *webpimage_mem=NULL;
 	int width, height;
 	size_t npixels;
 	int bytes_per_pixel;
@@ -453,7 +485,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	needfree_decbuffer = 1;
 
 	// Read the whole WebP file into a memory block.
-	if(!iw_file_to_memory(rctx->ctx, rctx->iodescr, &webpimage, &webpimage_size)) {
+	if(!iwwebp_get_file_data(rctx, &webpimage, &webpimage_size, &webpimage_mem)) {
 		if(rctx->iodescr->getfilesize_fn==NULL) {
 			// Assume this was the problem.
 			iw_set_errorf(rctx->ctx,"Failed to read WebP file: Seekable stream required");
@@ -517,7 +549,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	retval=1;
 
 done:
-	if(webpimage) iw_free(rctx->ctx,webpimage);
+	if(webpimage_mem) iw_free(rctx->ctx,webpimage_mem);
 
 	if(needfree_decbuffer) {
 		 WebPFreeDecBuffer(&cfg.output);
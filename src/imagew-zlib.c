@@ -14,9 +14,56 @@
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
 
+// Amount of input data that is compressed by one thread at a time, by
+// iw_zlib_deflate_items().
+#define IW_ZLIB_BLOCK_SIZE  131072
+#define IW_ZLIB_WINDOW_SIZE 32768
+// Maximum number of streams that iw_zlib_inflate_items() decompresses at once.
+#define IW_ZLIB_MAX_INFLATE_STREAMS 64
+
 struct iw_zlib_context {
 	struct iw_context *ctx;
 	z_stream strm;
+
+	// Fields used by iw_zlib_deflate_items():
+	int cmprlevel;
+	int header_written;
+	uLong adler;
+	size_t dictlen;
+	iw_byte *dict; // The last (up to) 32K of uncompressed data
+};
+
+struct iw_zlib_block {
+	z_stream strm;
+	int strm_initialized;
+	int ok;
+	const iw_byte *src;
+	size_t srclen;
+	size_t first_item;
+	size_t num_items;
+	iw_byte *dst;
+	size_t dst_alloc;
+	size_t dst_used;
+	uLong adler;
+};
+
+struct iw_zlib_inflate_batch {
+	z_stream *strms;
+	int *ok;
+	int first_item;
+	iw_byte **src;
+	const size_t *srclen;
+	iw_byte **dst;
+	const size_t *dstlen;
+};
+
+struct iw_zlib_batch {
+	struct iw_zlib_block *blocks;
+	size_t item_size;
+	size_t num_items;
+	int finish;
+	int independent;
+	size_t *item_csize; // Compressed size of each item, not counting the header
 };
 
 static voidpf my_zlib_malloc(voidpf opaque, uInt items, uInt size)
@@ -25,6 +72,13 @@ static voidpf my_zlib_malloc(voidpf opaque, uInt items, uInt size)
 	return iw_malloc(zctx->ctx,((size_t)items)*size);
 }
 
+// For streams that are used in worker threads, which must not report errors.
+static voidpf my_zlib_malloc_noerrors(voidpf opaque, uInt items, uInt size)
+{
+	struct iw_zlib_context *zctx = (struct iw_zlib_context*)opaque;
+	return iw_malloc_ex(zctx->ctx,IW_MALLOCFLAG_NOERRORS,((size_t)items)*size);
+}
+
 static void my_zlib_free(voidpf opaque, voidpf address)
 {
 	struct iw_zlib_context *zctx = (struct iw_zlib_context*)opaque;
@@ -118,6 +172,9 @@ static struct iw_zlib_context* iw_zlib_deflate_init(struct iw_context *ctx)
 		return NULL;
 	}
 
+	zctx->cmprlevel = cmprlevel;
+	zctx->adler = adler32(0L,NULL,0);
+
 	return zctx;
 }
 
@@ -125,6 +182,7 @@ static void iw_zlib_deflate_end(struct iw_zlib_context *zctx)
 {
 	if(!zctx) return;
 	deflateEnd(&zctx->strm);
+	iw_free(zctx->ctx,zctx->dict);
 	iw_free(zctx->ctx,zctx);
 }
 
@@ -159,6 +217,334 @@ done:
 	return retval;
 }
 
+// Compress one block of a batch. Runs in a worker thread, so it must not
+// allocate memory or report errors.
+static void iw_zlib_deflate_block(struct iw_context *ctx, void *userdata, int item)
+{
+	struct iw_zlib_batch *batch = (struct iw_zlib_batch*)userdata;
+	struct iw_zlib_block *blk = &batch->blocks[item];
+	size_t i;
+	size_t pos = 0;
+	size_t len;
+	size_t prev_avail_out;
+	int flush;
+	int ret;
+
+	if(!batch->independent) {
+		blk->adler = adler32(adler32(0L,NULL,0),blk->src,(uInt)blk->srclen);
+	}
+
+	blk->strm.next_out = blk->dst;
+	blk->strm.avail_out = (uInt)blk->dst_alloc;
+
+	for(i=0;i<blk->num_items;i++) {
+		len = blk->srclen - pos;
+		if(len>batch->item_size) len = batch->item_size;
+
+		flush = Z_SYNC_FLUSH;
+		if(batch->independent ||
+			(batch->finish && blk->first_item+i==batch->num_items-1))
+		{
+			flush = Z_FINISH;
+		}
+
+		blk->strm.next_in = (Bytef*)&blk->src[pos];
+		blk->strm.avail_in = (uInt)len;
+		prev_avail_out = blk->strm.avail_out;
+
+		ret = deflate(&blk->strm,flush);
+		if(flush==Z_FINISH) {
+			if(ret!=Z_STREAM_END) return;
+		}
+		else {
+			// If the output buffer was filled, the flush may be incomplete.
+			if(ret!=Z_OK || blk->strm.avail_out==0) return;
+		}
+		if(blk->strm.avail_in!=0) return;
+
+		if(batch->item_csize) {
+			batch->item_csize[blk->first_item+i] = prev_avail_out - blk->strm.avail_out;
+		}
+		pos += len;
+	}
+
+	blk->dst_used = blk->dst_alloc - blk->strm.avail_out;
+	blk->ok = 1;
+}
+
+// Remember the last 32K of uncompressed data, for use as the preset
+// dictionary of the next batch.
+static int iw_zlib_save_dict(struct iw_zlib_context *zctx,
+	const iw_byte *src, size_t srclen)
+{
+	size_t keep;
+
+	if(!zctx->dict) {
+		zctx->dict = iw_malloc(zctx->ctx,IW_ZLIB_WINDOW_SIZE);
+		if(!zctx->dict) return 0;
+	}
+
+	if(srclen>=IW_ZLIB_WINDOW_SIZE) {
+		memcpy(zctx->dict,&src[srclen-IW_ZLIB_WINDOW_SIZE],IW_ZLIB_WINDOW_SIZE);
+		zctx->dictlen = IW_ZLIB_WINDOW_SIZE;
+		return 1;
+	}
+
+	keep = zctx->dictlen;
+	if(keep > IW_ZLIB_WINDOW_SIZE-srclen) keep = IW_ZLIB_WINDOW_SIZE-srclen;
+	memmove(zctx->dict,&zctx->dict[zctx->dictlen-keep],keep);
+	memcpy(&zctx->dict[keep],src,srclen);
+	zctx->dictlen = keep+srclen;
+	return 1;
+}
+
+// Multi-block (pigz-style) compression. Each block is compressed by an
+// independent raw deflate stream, primed with the 32K of data that precedes
+// it, and ended with a sync flush so that the blocks can simply be
+// concatenated. The zlib header and Adler-32 trailer are added here.
+// In IW_ZLIB_INDEPENDENT mode, each block is a complete zlib stream.
+static int iw_zlib_deflate_items(struct iw_zlib_context *zctx,
+	const iw_byte *src, size_t srclen, size_t item_size, unsigned int flags,
+	iw_byte **pdst, size_t *pdstlen, size_t *item_csize)
+{
+	struct iw_context *ctx = zctx->ctx;
+	struct iw_zlib_batch batch;
+	struct iw_zlib_block *blk;
+	size_t items_per_block;
+	size_t num_blocks = 0;
+	size_t b;
+	size_t start;
+	size_t dictlen;
+	size_t total;
+	size_t pos;
+	unsigned int hdr_flevel;
+	iw_byte *dst = NULL;
+	int finish;
+	int ret;
+	int retval = 0;
+
+	*pdst = NULL;
+	*pdstlen = 0;
+	iw_zeromem(&batch,sizeof(struct iw_zlib_batch));
+
+	if(item_size<1) goto done;
+	batch.independent = (flags&IW_ZLIB_INDEPENDENT)?1:0;
+	// Independent streams are always finished, and don't affect zctx.
+	finish = (flags&IW_ZLIB_FINISH) && !batch.independent;
+	batch.item_size = item_size;
+	batch.finish = finish;
+	batch.item_csize = item_csize;
+	batch.num_items = (srclen+item_size-1)/item_size;
+	// An empty stream still needs its final block.
+	if(batch.num_items==0 && finish) batch.num_items = 1;
+
+	items_per_block = IW_ZLIB_BLOCK_SIZE/item_size;
+	if(items_per_block<1 || batch.independent) items_per_block=1;
+	num_blocks = (batch.num_items+items_per_block-1)/items_per_block;
+
+	if(num_blocks>0) {
+		batch.blocks = iw_mallocz(ctx,num_blocks*sizeof(struct iw_zlib_block));
+		if(!batch.blocks) goto done;
+	}
+
+	// Memory allocation happens here, in the main thread.
+	for(b=0;b<num_blocks;b++) {
+		blk = &batch.blocks[b];
+		blk->first_item = b*items_per_block;
+		blk->num_items = items_per_block;
+		if(blk->first_item+blk->num_items > batch.num_items)
+			blk->num_items = batch.num_items - blk->first_item;
+		start = blk->first_item*item_size;
+		blk->src = &src[start];
+		blk->srclen = blk->num_items*item_size;
+		if(start+blk->srclen > srclen) blk->srclen = srclen-start;
+
+		blk->strm.opaque = (voidpf)zctx;
+		blk->strm.zalloc = my_zlib_malloc;
+		blk->strm.zfree = my_zlib_free;
+		ret = deflateInit2(&blk->strm,zctx->cmprlevel,Z_DEFLATED,
+			batch.independent?15:-15,8,Z_DEFAULT_STRATEGY);
+		if(ret!=Z_OK) goto done;
+		blk->strm_initialized = 1;
+
+		if(batch.independent) {
+			;
+		}
+		else if(b==0) {
+			if(zctx->dictlen>0) {
+				ret = deflateSetDictionary(&blk->strm,zctx->dict,(uInt)zctx->dictlen);
+				if(ret!=Z_OK) goto done;
+			}
+		}
+		else {
+			dictlen = start;
+			if(dictlen>IW_ZLIB_WINDOW_SIZE) dictlen=IW_ZLIB_WINDOW_SIZE;
+			ret = deflateSetDictionary(&blk->strm,&src[start-dictlen],(uInt)dictlen);
+			if(ret!=Z_OK) goto done;
+		}
+
+		// Leave room for the overhead of the flush at the end of each item.
+		blk->dst_alloc = deflateBound(&blk->strm,(uLong)blk->srclen) + 16*blk->num_items + 64;
+		blk->dst = iw_malloc(ctx,blk->dst_alloc);
+		if(!blk->dst) goto done;
+	}
+
+	iw_run_threaded(ctx,(int)num_blocks,iw_zlib_deflate_block,(void*)&batch);
+
+	total = 0;
+	for(b=0;b<num_blocks;b++) {
+		if(!batch.blocks[b].ok) goto done;
+		total += batch.blocks[b].dst_used;
+	}
+	if(!zctx->header_written && !batch.independent) total += 2;
+	if(finish) total += 4;
+
+	dst = iw_malloc(ctx,total?total:1);
+	if(!dst) goto done;
+	pos = 0;
+
+	if(!zctx->header_written && !batch.independent) {
+		if(zctx->cmprlevel>=0 && zctx->cmprlevel<2) hdr_flevel = 0;
+		else if(zctx->cmprlevel>=2 && zctx->cmprlevel<6) hdr_flevel = 1;
+		else if(zctx->cmprlevel>=7) hdr_flevel = 3;
+		else hdr_flevel = 2;
+		dst[0] = 0x78;
+		dst[1] = (iw_byte)(hdr_flevel<<6);
+		dst[1] += (iw_byte)(31 - ((((unsigned int)dst[0])<<8) + dst[1])%31);
+		pos = 2;
+		if(item_csize && batch.num_items>0) item_csize[0] += 2;
+		zctx->header_written = 1;
+	}
+
+	for(b=0;b<num_blocks;b++) {
+		blk = &batch.blocks[b];
+		memcpy(&dst[pos],blk->dst,blk->dst_used);
+		pos += blk->dst_used;
+		if(!batch.independent)
+			zctx->adler = adler32_combine(zctx->adler,blk->adler,(z_off_t)blk->srclen);
+	}
+
+	if(finish) {
+		dst[pos++] = (iw_byte)(zctx->adler>>24);
+		dst[pos++] = (iw_byte)(zctx->adler>>16);
+		dst[pos++] = (iw_byte)(zctx->adler>>8);
+		dst[pos++] = (iw_byte)(zctx->adler);
+		if(item_csize && batch.num_items>0) item_csize[batch.num_items-1] += 4;
+	}
+	else if(!batch.independent) {
+		if(!iw_zlib_save_dict(zctx,src,srclen)) goto done;
+	}
+
+	*pdst = dst;
+	*pdstlen = total;
+	dst = NULL;
+	retval = 1;
+done:
+	if(batch.blocks) {
+		for(b=0;b<num_blocks;b++) {
+			if(batch.blocks[b].strm_initialized)
+				deflateEnd(&batch.blocks[b].strm);
+			iw_free(ctx,batch.blocks[b].dst);
+		}
+		iw_free(ctx,batch.blocks);
+	}
+	iw_free(ctx,dst);
+	if(!retval) {
+		iw_set_error(ctx,"zlib compression failed");
+	}
+	return retval;
+}
+
+// Decompress one item of an inflate batch. Runs in a worker thread.
+static void iw_zlib_inflate_stream(struct iw_context *ctx, void *userdata, int item)
+{
+	struct iw_zlib_inflate_batch *batch = (struct iw_zlib_inflate_batch*)userdata;
+	z_stream *strm = &batch->strms[item];
+	int n = batch->first_item + item;
+	int ret;
+
+	strm->next_in = batch->src[n];
+	strm->avail_in = (uInt)batch->srclen[n];
+	strm->next_out = batch->dst[n];
+	strm->avail_out = (uInt)batch->dstlen[n];
+
+	ret = inflate(strm,Z_FINISH);
+	// It's okay if the stream contains more data than we need.
+	if(ret!=Z_STREAM_END && ret!=Z_BUF_ERROR && ret!=Z_OK) return;
+	if(strm->avail_out!=0) return;
+	batch->ok[item] = 1;
+}
+
+static int iw_zlib_inflate_items(struct iw_zlib_context *zctx,
+	int num_items, iw_byte **src, const size_t *srclen,
+	iw_byte **dst, const size_t *dstlen)
+{
+	struct iw_context *ctx = zctx->ctx;
+	struct iw_zlib_inflate_batch batch;
+	int num_strms;
+	int num_initialized = 0;
+	int n;
+	int i;
+	int retval = 0;
+
+	iw_zeromem(&batch,sizeof(struct iw_zlib_inflate_batch));
+	batch.src = src;
+	batch.srclen = srclen;
+	batch.dst = dst;
+	batch.dstlen = dstlen;
+
+	num_strms = num_items;
+	if(num_strms>IW_ZLIB_MAX_INFLATE_STREAMS) num_strms=IW_ZLIB_MAX_INFLATE_STREAMS;
+	if(num_strms<1) return 1;
+
+	batch.strms = iw_mallocz(ctx,num_strms*sizeof(z_stream));
+	if(!batch.strms) goto done;
+	batch.ok = iw_mallocz(ctx,num_strms*sizeof(int));
+	if(!batch.ok) goto done;
+
+	for(i=0;i<num_strms;i++) {
+		batch.strms[i].opaque = (voidpf)zctx;
+		batch.strms[i].zalloc = my_zlib_malloc_noerrors;
+		batch.strms[i].zfree = my_zlib_free;
+		if(inflateInit(&batch.strms[i])!=Z_OK) goto done;
+		num_initialized++;
+	}
+
+	for(batch.first_item=0;batch.first_item<num_items;batch.first_item+=n) {
+		n = num_items - batch.first_item;
+		if(n>num_strms) n=num_strms;
+
+		if(batch.first_item>0) {
+			for(i=0;i<n;i++) {
+				inflateReset(&batch.strms[i]);
+				batch.ok[i] = 0;
+			}
+		}
+
+		iw_run_threaded(ctx,n,iw_zlib_inflate_stream,(void*)&batch);
+
+		for(i=0;i<n;i++) {
+			if(!batch.ok[i]) {
+				if(batch.strms[i].msg)
+					iw_set_errorf(ctx,"zlib reports decompression error: %s",batch.strms[i].msg);
+				goto done;
+			}
+		}
+	}
+
+	retval = 1;
+done:
+	for(i=0;i<num_initialized;i++) {
+		inflateEnd(&batch.strms[i]);
+	}
+	iw_free(ctx,batch.strms);
+	iw_free(ctx,batch.ok);
+	if(!retval) {
+		iw_set_error(ctx,"zlib decompression failed");
+	}
+	return retval;
+}
+
 IW_IMPL(char*) iw_get_zlib_version_string(char *s, int s_len)
 {
 	const char *zv;
@@ -175,7 +561,9 @@ IW_IMPL(void) iw_enable_zlib(struct iw_context *ctx)
 		iw_zlib_inflate_item,
 		iw_zlib_deflate_init,
 		iw_zlib_deflate_end,
-		iw_zlib_deflate_item
+		iw_zlib_deflate_item,
+		iw_zlib_deflate_items,
+		iw_zlib_inflate_items
 	};
 
 	iw_set_zlib_module(ctx,&zlib_module);
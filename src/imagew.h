@@ -37,7 +37,7 @@ extern "C" {
 
 // The version of the IW header files.
 // Use iw_get_version_int() to get the version at runtime.
-#define IW_VERSION_INT           0x010302
+#define IW_VERSION_INT           0x010400
 
 
 //// Codes for use with iw_get_value/iw_set_value.
@@ -148,6 +148,41 @@ extern "C" {
 // Make a negative image (in target colorspace).
 #define IW_VAL_NEGATE_TARGET     53
 
+// The maximum number of threads to use when processing the image.
+// The default is 1 (don't use multiple threads). Ignored if IW was built
+// without thread support.
+#define IW_VAL_MAX_THREADS       54
+
+// Don't use SIMD-optimized (vectorized) code paths, even if the CPU supports
+// them. The results of the optimized code may differ very slightly, due to
+// floating point rounding.
+#define IW_VAL_NO_SIMD           55
+
+// The order in which to resize the two dimensions (IW_RESIZE_ORDER_*).
+// The default is IW_RESIZE_ORDER_AUTO, which picks the order that is
+// estimated to be faster. The results may differ very slightly, depending on
+// the order.
+#define IW_VAL_RESIZE_ORDER      56
+
+// (Read-only) The order in which the image was actually resized. Valid after
+// the image has been processed.
+#define IW_VAL_RESIZE_ORDER_USED 57
+
+// Always use a full-size intermediate image, instead of processing each
+// channel in one pass when possible. This uses much more memory, and does not
+// change the result. Mainly useful for testing.
+#define IW_VAL_NO_STREAMING      58
+
+// The approximate size, in pixels, of the image that the caller intends to
+// make from the input image. If set before reading the file, a decoder that
+// can cheaply decode at a reduced size (currently only JPEG) may do so, as
+// long as the result is still comfortably larger than this size. The reduced
+// image is then resized as usual. The default of 0 means no hint.
+// These should be set in the image's logical orientation (after any Exif
+// orientation is applied).
+#define IW_VAL_DECODE_WIDTH_HINT  59
+#define IW_VAL_DECODE_HEIGHT_HINT 60
+
 // File formats.
 #define IW_FORMAT_UNKNOWN  0
 #define IW_FORMAT_PNG      1
@@ -224,7 +259,7 @@ extern "C" {
 #define IW_IMGTYPE_GRAYA   0x0101
 #define IW_IMGTYPE_RGB     0x0010
 #define IW_IMGTYPE_RGBA    0x0110
-#define IW_IMGTYPE_PALETTE 0x1000  // Used only during optimization / output.
+#define IW_IMGTYPE_PALETTE 0x1000  // Each pixel is an index into an iw_palette.
 
 #define IW_IMGTYPE_IS_GRAY(x)   (((x)&0x001)?1:0)
 #define IW_IMGTYPE_HAS_ALPHA(x) (((x)&0x100)?1:0)
@@ -314,6 +349,10 @@ extern "C" {
 #define IW_EDGE_POLICY_STANDARD   2  // Use available samples if any are within radius; otherwise replicate.
 #define IW_EDGE_POLICY_TRANSPARENT 3
 
+#define IW_RESIZE_ORDER_AUTO     0
+#define IW_RESIZE_ORDER_V_FIRST  1 // Resize vertically, then horizontally.
+#define IW_RESIZE_ORDER_H_FIRST  2 // Resize horizontally, then vertically.
+
 // Reorientation codes, for use with iw_reorient_image().
 // Note that these do not represent an orientation; they represent a *change*
 // in orientation.
@@ -462,6 +501,13 @@ struct iw_iodescr {
 
 	// Return the current file position.
 	iw_tellfn_type tell_fn;
+
+	// Set by iw_set_iodescr_mem(), if the entire file is in memory. Modules
+	// may then read it directly, instead of calling read_fn. mem_pos is the
+	// current file position.
+	const iw_byte *mem;
+	size_t mem_size;
+	size_t mem_pos;
 };
 
 // Allocate n bytes of memory. Return NULL on failure.
@@ -498,6 +544,17 @@ IW_EXPORT(struct iw_context*) iw_create_context(struct iw_init_params *params);
 
 IW_EXPORT(void) iw_destroy_context(struct iw_context *ctx);
 
+// Prepare a context that has processed an image to process another one, with
+// the same settings. This is faster than creating a new context, because
+// some things, such as resampling weights and color correction tables, can
+// be reused if the new image is similar.
+// The input image, the output image, and the error state are cleared. Any
+// pointers returned by iw_get_output_image() become invalid.
+// Settings that depend on the input image, such as the input crop, the
+// canvas size, the output image size, and the output density, are cleared,
+// and must be set again if needed. The random number generator is not reset.
+IW_EXPORT(void) iw_reset_context(struct iw_context *ctx);
+
 IW_EXPORT(int) iw_process_image(struct iw_context *ctx);
 
 // Rotate and/or mirror the image. 'x' is an IW_REORIENT_ code.
@@ -549,8 +606,34 @@ IW_EXPORT(void) iw_set_output_canvas_size(struct iw_context *ctx, int w, int h);
 IW_EXPORT(void) iw_set_output_image_size(struct iw_context *ctx, double w, double h);
 
 // Crop before resizing.
+// If this is called before the image is read, decoders that support it will
+// only decode the part of the image that is needed.
 IW_EXPORT(void) iw_set_input_crop(struct iw_context *ctx, int x, int y, int w, int h);
 
+// For use by image decoders. If only part of an image of size full_w x full_h
+// will be used, because of a crop set by iw_set_input_crop(), returns nonzero
+// and sets (*px,*py,*pw,*ph) to that region. Otherwise, returns 0.
+IW_EXPORT(int) iw_get_input_region(struct iw_context *ctx, int full_w, int full_h,
+	int *px, int *py, int *pw, int *ph);
+
+// For use by image decoders. Tells IW that the input image contains only the
+// region at (x,y) of an image of size full_w x full_h, typically the region
+// returned by iw_get_input_region(). Crop coordinates continue to refer to
+// the full image. Must be called after iw_set_input_image().
+IW_EXPORT(void) iw_set_input_region(struct iw_context *ctx, int x, int y,
+	int full_w, int full_h);
+
+// For use by image decoders that decode an image at a reduced size. The
+// size of the input image, in its own pixels, if it is not a whole number.
+// The fractional part of the last pixel in each dimension is assumed to be
+// at the right or bottom edge, as decoded. Must be called after
+// iw_set_input_image(), and before iw_reorient_image().
+IW_EXPORT(void) iw_set_input_true_size(struct iw_context *ctx, double w, double h);
+
+// Returns the size set by iw_set_input_true_size(), or, if not set, the
+// size of the input image.
+IW_EXPORT(void) iw_get_input_true_size(struct iw_context *ctx, double *pw, double *ph);
+
 // Inform IW about the features of your intended output file format.
 // n is a bitwise combination of IW_PROFILE_* values.
 // iw_get_profile_by_fmt() can be used to get value for n.
@@ -636,6 +719,13 @@ IW_EXPORT(void) iw_set_allow_opt(struct iw_context *ctx, int opt, int n);
 // A copy is made of the img structure itself.
 IW_EXPORT(void) iw_set_input_image(struct iw_context *ctx, const struct iw_image *img);
 
+// For input images of type IW_IMGTYPE_PALETTE, which may have a bit depth of
+// 1, 2, 4, or 8. A copy is made of the palette. Any entries past
+// pal->num_entries are taken to be opaque black. The image is processed as
+// RGBA if any entry is not fully opaque; otherwise as RGB.
+// Must be called after iw_set_input_image().
+IW_EXPORT(void) iw_set_input_palette(struct iw_context *ctx, const struct iw_palette *pal);
+
 // Caller supplies an (uninitialized) iw_image structure, which the
 // function fills in.
 IW_EXPORT(void) iw_get_output_image(struct iw_context *ctx, struct iw_image *img);
@@ -711,6 +801,7 @@ IW_EXPORT(int) iw_write_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iod
 IW_EXPORT(char*) iw_get_libjpeg_version_string(char *s, int s_len);
 IW_EXPORT(int) iw_read_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
+IW_EXPORT(int) iw_read_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_read_miff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_miff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
@@ -777,6 +868,45 @@ IW_EXPORT(int) iw_is_valid_density(double density_x, double density_y, int densi
 IW_EXPORT(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iodescr,
   void **pmem, iw_int64 *psize);
 
+// Make iodescr read from a memory block containing the entire file (e.g. a
+// memory-mapped file). This sets read_fn, getfilesize_fn, seek_fn, and
+// tell_fn. The memory must remain valid until IW is done reading the file.
+IW_EXPORT(void) iw_set_iodescr_mem(struct iw_iodescr *iodescr, const void *mem,
+  size_t memsize);
+
+// A buffered reader, for modules that read a file a few bytes at a time.
+// It reads IW_BUFREADER_SIZE bytes at a time from the iodescr, or, if the file
+// is in memory (see iw_set_iodescr_mem()), reads from memory directly.
+// The fields are private.
+#define IW_BUFREADER_SIZE 65536
+struct iw_bufreader {
+	struct iw_context *ctx;
+	struct iw_iodescr *iodescr;
+	const iw_byte *data; // The bytes that are available to read
+	size_t data_len;
+	size_t data_pos;
+	iw_byte *buf; // Our buffer, or NULL if the file is in memory
+	int eof_flag;
+};
+
+// Start reading from iodescr's current position. Once this is used, the
+// file position is undefined, so all reading must be done with the
+// iw_bufreader_* functions. Returns 0 on failure.
+IW_EXPORT(int) iw_bufreader_init(struct iw_context *ctx, struct iw_bufreader *br,
+  struct iw_iodescr *iodescr);
+// Free the resources used by br. Safe to call if iw_bufreader_init() was not
+// called, provided br was zeroed.
+IW_EXPORT(void) iw_bufreader_done(struct iw_bufreader *br);
+// Read exactly n bytes. Returns 0 if the file ends first.
+IW_EXPORT(int) iw_bufreader_read(struct iw_bufreader *br, void *buf, size_t n);
+IW_EXPORT(int) iw_bufreader_read_byte(struct iw_bufreader *br, iw_byte *b);
+// Returns a pointer to the next n bytes, without consuming them, or NULL if
+// there are fewer than n bytes left. If the file isn't in memory, n can be
+// at most IW_BUFREADER_SIZE. The pointer is valid until br is next used.
+IW_EXPORT(const iw_byte*) iw_bufreader_peek(struct iw_bufreader *br, size_t n);
+// Returns 0 if the file ends first.
+IW_EXPORT(int) iw_bufreader_skip(struct iw_bufreader *br, size_t n);
+
 // Various memory allocation functions.
 // In general, they allocate a block of memory of size n.
 // On failure, they generate an error (unless the IW_MALLOCFLAG_NOERRORS flag
@@ -836,6 +966,34 @@ typedef void (*iw_zlib_deflate_end_type)(struct iw_zlib_context *zctx);
 typedef int (*iw_zlib_deflate_item_type)(struct iw_zlib_context *zctx,
 	iw_byte *src, size_t srclen, iw_byte *dst, size_t dstlen, size_t *pdstused);
 
+// Compresses a batch of "items" (srclen bytes, split every item_size bytes;
+// the last item may be shorter), continuing the stream in zctx. Each item
+// ends with a sync flush, as with deflate_item. If the IW_ZLIB_FINISH flag is
+// set, the stream is terminated after the last item. The work is split into
+// blocks that are compressed in parallel.
+// If the IW_ZLIB_INDEPENDENT flag is set, each item is instead compressed as
+// a separate, complete zlib stream, and zctx is only used for its settings.
+// Each item is then one block, so the caller should limit the number of items
+// per call.
+// On success, *pdst is set to a buffer allocated with iw_malloc, which the
+// caller must free. If item_csize is not NULL, it receives the compressed
+// size of each item.
+// Do not mix calls to deflate_item and deflate_items on the same zctx.
+#define IW_ZLIB_FINISH      0x1
+#define IW_ZLIB_INDEPENDENT 0x2
+typedef int (*iw_zlib_deflate_items_type)(struct iw_zlib_context *zctx,
+	const iw_byte *src, size_t srclen, size_t item_size, unsigned int flags,
+	iw_byte **pdst, size_t *pdstlen, size_t *item_csize);
+
+// Decompresses num_items separate, complete zlib streams, in parallel. Item i
+// is read from src[i] (srclen[i] bytes), and must decompress to at least
+// dstlen[i] bytes, of which the first dstlen[i] are written to dst[i].
+// zctx is not modified. Returns 1 if every item was decompressed
+// successfully.
+typedef int (*iw_zlib_inflate_items_type)(struct iw_zlib_context *zctx,
+	int num_items, iw_byte **src, const size_t *srclen,
+	iw_byte **dst, const size_t *dstlen);
+
 struct iw_zlib_module {
 	iw_zlib_inflate_init_type inflate_init;
 	iw_zlib_inflate_end_type inflate_end;
@@ -843,8 +1001,19 @@ struct iw_zlib_module {
 	iw_zlib_deflate_init_type deflate_init;
 	iw_zlib_deflate_end_type deflate_end;
 	iw_zlib_deflate_item_type deflate_item;
+	iw_zlib_deflate_items_type deflate_items;
+	iw_zlib_inflate_items_type inflate_items;
 };
 
+// Calls fn once for each item number from 0 to num_items-1, using up to
+// IW_VAL_MAX_THREADS threads. Items may be processed in any order, and at the
+// same time. fn should not call functions that could report an error, and any
+// memory allocation functions it uses must be thread-safe.
+// Returns the number of threads used.
+typedef void (*iw_threadfn_type)(struct iw_context *ctx, void *userdata, int item);
+IW_EXPORT(int) iw_run_threaded(struct iw_context *ctx, int num_items,
+	iw_threadfn_type fn, void *userdata);
+
 IW_EXPORT(void) iw_set_zlib_module(struct iw_context *ctx, struct iw_zlib_module *z);
 IW_EXPORT(struct iw_zlib_module*) iw_get_zlib_module(struct iw_context *ctx);
 
@@ -0,0 +1,218 @@
+// resettest.c
+// Part of ImageWorsener's regression tests.
+//
+// Processes a series of images with one context, calling iw_reset_context()
+// between them, and checks that each output image is the same as that made
+// by a new context. Some of the images change the bit depth or colorspace
+// from the previous one, so cached tables must not be reused for them.
+//
+// Usage: resettest <srcimg-dir>
+
+#include "imagew-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IW_INCLUDE_UTIL_FUNCTIONS // Needed for iw_set_iodescr_mem(), etc.
+#include "imagew.h"
+
+struct test_case {
+	const char *fn;
+	int w, h;
+	int depth;
+	int dither; // Use ordered dithering
+	int ncolors; // 0 = no color reduction
+	int filter; // IW_RESIZETYPE_*
+	double gamma_in; // 0 = default
+	double gamma_out; // 0 = sRGB; -1 = linear
+};
+
+static const struct test_case cases[] = {
+	{ "rgb8.png", 23, 19, 8, 0, 0, IW_RESIZETYPE_AUTO, 0.0, 0.0 },
+	// Same input and size, 16-bit output
+	{ "rgb16.png", 23, 19, 16, 0, 0, IW_RESIZETYPE_AUTO, 0.0, 0.0 },
+	// Linear output colorspace
+	{ "rgb8.png", 23, 19, 8, 0, 0, IW_RESIZETYPE_AUTO, 0.0, -1.0 },
+	// Back to the first case, which may reuse the tables again
+	{ "rgb8.png", 23, 19, 8, 0, 0, IW_RESIZETYPE_AUTO, 0.0, 0.0 },
+	{ "rgb8.png", 23, 19, 8, 0, 0, IW_RESIZETYPE_MIX, 0.0, 0.0 },
+	{ "g8.png", 31, 7, 4, 1, 0, IW_RESIZETYPE_AUTO, 1.8, 2.2 },
+	{ "g8.png", 31, 7, 8, 1, 5, IW_RESIZETYPE_AUTO, 1.8, 2.2 },
+	{ "g8.png", 31, 7, 8, 1, 5, IW_RESIZETYPE_AUTO, 0.0, 0.0 },
+	{ "rgb8a.png", 40, 30, 8, 0, 0, IW_RESIZETYPE_AUTO, 0.0, 0.0 },
+	{ "rgb16.png", 40, 30, 16, 0, 0, IW_RESIZETYPE_AUTO, 0.0, -1.0 },
+	{ "p8t.png", 40, 30, 8, 0, 0, IW_RESIZETYPE_NEAREST, 0.0, 0.0 },
+	{ "p8t.png", 40, 30, 8, 0, 0, IW_RESIZETYPE_AUTO, 0.0, 0.0 },
+	{ "rgb8.png", 23, 19, 8, 0, 0, IW_RESIZETYPE_AUTO, 0.0, 0.0 },
+	{ NULL, 0, 0, 0, 0, 0, 0, 0.0, 0.0 }
+};
+
+static void my_warning_fn(struct iw_context *ctx, const char *msg)
+{
+}
+
+static iw_byte *read_file(const char *fn, size_t *psize)
+{
+	FILE *fp;
+	iw_byte *buf = NULL;
+	long n;
+
+	fp = fopen(fn,"rb");
+	if(!fp) return NULL;
+	if(fseek(fp,0,SEEK_END)!=0) goto done;
+	n = ftell(fp);
+	if(n<=0) goto done;
+	rewind(fp);
+	buf = malloc((size_t)n);
+	if(!buf) goto done;
+	if(fread(buf,1,(size_t)n,fp)!=(size_t)n) {
+		free(buf);
+		buf = NULL;
+		goto done;
+	}
+	*psize = (size_t)n;
+done:
+	fclose(fp);
+	return buf;
+}
+
+// Read and process one image. Returns 0 on failure.
+static int process_case(struct iw_context *ctx, const char *dir,
+	const struct test_case *tc)
+{
+	char fn[1000];
+	iw_byte *filedata;
+	size_t filesize = 0;
+	struct iw_iodescr readdescr;
+	struct iw_csdescr cs;
+	int ret = 0;
+
+	snprintf(fn,sizeof(fn),"%s/%s",dir,tc->fn);
+	filedata = read_file(fn,&filesize);
+	if(!filedata) {
+		fprintf(stderr,"resettest: Can't read %s\n",fn);
+		return 0;
+	}
+
+	iw_zeromem(&readdescr,sizeof(struct iw_iodescr));
+	iw_set_iodescr_mem(&readdescr,filedata,filesize);
+	if(!iw_read_file_by_fmt(ctx,&readdescr,IW_FORMAT_PNG)) goto done;
+
+	iw_set_output_profile(ctx,iw_get_profile_by_fmt(IW_FORMAT_PNG));
+	iw_set_output_depth(ctx,tc->depth);
+	iw_set_output_canvas_size(ctx,tc->w,tc->h);
+	iw_set_resize_alg(ctx,IW_DIMENSION_H,tc->filter,1.0,0.0,0.0);
+	iw_set_resize_alg(ctx,IW_DIMENSION_V,tc->filter,1.0,0.0,0.0);
+
+	if(tc->gamma_in>0.0) {
+		iw_make_gamma_csdescr(&cs,tc->gamma_in);
+	}
+	else {
+		iw_make_srgb_csdescr_2(&cs);
+	}
+	iw_set_input_colorspace(ctx,&cs);
+
+	if(tc->gamma_out>0.0) {
+		iw_make_gamma_csdescr(&cs,tc->gamma_out);
+	}
+	else if(tc->gamma_out<0.0) {
+		iw_make_linear_csdescr(&cs);
+	}
+	else {
+		iw_make_srgb_csdescr_2(&cs);
+	}
+	iw_set_output_colorspace(ctx,&cs);
+
+	iw_set_dither_type(ctx,IW_CHANNELTYPE_ALL,
+		tc->dither?IW_DITHERFAMILY_ORDERED:IW_DITHERFAMILY_NONE,
+		tc->dither?IW_DITHERSUBTYPE_DEFAULT:0);
+	iw_set_color_count(ctx,IW_CHANNELTYPE_ALL,tc->ncolors);
+
+	if(!iw_process_image(ctx)) goto done;
+	ret = 1;
+done:
+	if(!ret) {
+		char errmsg[200];
+		fprintf(stderr,"resettest: %s: %s\n",tc->fn,
+			iw_get_errormsg(ctx,errmsg,sizeof(errmsg)));
+	}
+	free(filedata);
+	return ret;
+}
+
+static int images_are_equal(struct iw_context *ctx1, struct iw_context *ctx2)
+{
+	struct iw_image img1, img2;
+	const struct iw_palette *pal1, *pal2;
+	size_t rowsize;
+	int j;
+
+	iw_get_output_image(ctx1,&img1);
+	iw_get_output_image(ctx2,&img2);
+
+	if(img1.width!=img2.width || img1.height!=img2.height ||
+		img1.imgtype!=img2.imgtype || img1.bit_depth!=img2.bit_depth ||
+		img1.sampletype!=img2.sampletype)
+	{
+		return 0;
+	}
+
+	rowsize = (size_t)iw_calc_bytesperrow(img1.width,
+		img1.bit_depth*iw_imgtype_num_channels(img1.imgtype));
+	for(j=0;j<img1.height;j++) {
+		if(memcmp(&img1.pixels[j*img1.bpr],&img2.pixels[j*img2.bpr],rowsize))
+			return 0;
+	}
+
+	pal1 = iw_get_output_palette(ctx1);
+	pal2 = iw_get_output_palette(ctx2);
+	if(!pal1 || !pal2) return (!pal1 && !pal2);
+	if(pal1->num_entries!=pal2->num_entries) return 0;
+	return !memcmp(pal1->entry,pal2->entry,
+		pal1->num_entries*sizeof(struct iw_rgba8color));
+}
+
+int main(int argc, char **argv)
+{
+	struct iw_context *ctx = NULL;
+	struct iw_context *ctx2 = NULL;
+	const char *dir;
+	int i;
+	int failures = 0;
+
+	dir = (argc>=2) ? argv[1] : "srcimg";
+
+	ctx = iw_create_context(NULL);
+	if(!ctx) return 1;
+	iw_set_warning_fn(ctx,my_warning_fn);
+
+	for(i=0;cases[i].fn;i++) {
+		if(i>0) iw_reset_context(ctx);
+		if(!process_case(ctx,dir,&cases[i])) {
+			failures++;
+			continue;
+		}
+
+		ctx2 = iw_create_context(NULL);
+		if(!ctx2) return 1;
+		iw_set_warning_fn(ctx2,my_warning_fn);
+		if(!process_case(ctx2,dir,&cases[i])) {
+			failures++;
+		}
+		else if(!images_are_equal(ctx,ctx2)) {
+			fprintf(stderr,"resettest: Image %d (%s) differs from that made by "
+				"a new context\n",i,cases[i].fn);
+			failures++;
+		}
+		iw_destroy_context(ctx2);
+		ctx2 = NULL;
+	}
+
+	iw_destroy_context(ctx);
+	if(failures) {
+		fprintf(stderr,"resettest: %d failure(s)\n",failures);
+		return 1;
+	}
+	return 0;
+}